@@ -266,6 +266,47 @@ class bisMatrix(bisBaseObject):
         self.filename=fname;
 
 
+# --------------------------------------
+# bisSparseMatrix
+# CSR matrix (see cpp/bisSparseMatrix.h), e.g. the output of
+# computeImageDistanceMatrixWASM with csr=True. Kept as the serialized
+# bytes and passed back to the library as is.
+# --------------------------------------
+class bisSparseMatrix(bisBaseObject):
+
+    def __init__(self):
+        super().__init__();
+        self.header=[ 0,0,0,0 ];
+
+    def getRawSize(self):
+        return len(self.data_array);
+
+    def serializeWasm(self):
+        return self.data_array.tobytes();
+
+    def deserializeWasm(self,wasm_pointer,offset=0):
+        top=struct.unpack('iiii',bytes(wasm_pointer[offset:offset+16]));
+        if top[0]!=biswasm.getSparseMatrixMagicCode():
+            raise ValueError('Not a serialized sparse matrix '+str(top));
+        numbytes=top[3];
+        if numbytes==-64:
+            sizeoffset=offset+16+top[2]-8;
+            numbytes=struct.unpack('q',bytes(wasm_pointer[sizeoffset:sizeoffset+8]))[0];
+        total=16+top[2]+numbytes;
+        self.data_array=np.frombuffer(bytes(wasm_pointer[offset:offset+total]),dtype=np.uint8).copy();
+        self.header=list(struct.unpack('iiii',bytes(wasm_pointer[offset+16:offset+32])));
+        return 1;
+
+    def getNumRows(self):
+        return self.header[0];
+
+    def getNumNonZero(self):
+        return self.header[2];
+
+    def getNumComponents(self):
+        return self.header[3];
+
+
 # --------------------------------------
 # bisImage
 # --------------------------------------
@@ -284,7 +325,7 @@ class bisImage(bisBaseObject):
         s=imagedata.shape;
         l=len(s);
 
-        if l<2 or l>=5:
+        if l<2 or l>5:
             raise ValueError('Can only use 2D to 5D matrices in bisImage'+str(s));
         self.data_array=imagedata;
         self.affine=imagematrix;
@@ -90,6 +90,38 @@ def set_force_large_memory(val=3):
     else:
        Module().set_large_memory_mode(0);
 
+# -----------------------------------------------------
+# set_pool_memory
+# Recycles large buffers between calls (useful for long running sessions)
+def set_pool_memory(val=True,limitmb=0):
+
+    Module().set_pool_memory_mode.argtypes=[ ctypes.c_int, ctypes.c_int];
+    if (val):
+        Module().set_pool_memory_mode(1,int(limitmb));
+    else:
+        Module().set_pool_memory_mode(0,int(limitmb));
+
+# -----------------------------------------------------
+# release_pool_memory
+# Frees all buffers kept by the pool (see set_pool_memory)
+def release_pool_memory():
+
+    Module().release_pool_memory();
+
+# -----------------------------------------------------
+# set_num_threads
+# Sets the size of the global thread pool (0 = all cores), returns the new size
+def set_num_threads(n=0):
+
+    Module().set_num_threads.argtypes=[ ctypes.c_int];
+    Module().set_num_threads.restype=ctypes.c_int;
+    return Module().set_num_threads(int(n));
+
+def get_num_threads():
+
+    Module().get_num_threads.restype=ctypes.c_int;
+    return Module().get_num_threads();
+
 # --------------------------------------------
 # Magic Codes
 # --------------------------------------------
@@ -115,6 +147,9 @@ def getCollectionMagicCode():
 def getSurfaceMagicCode():
     return Module().getSurfaceMagicCode();
 
+def getSparseMatrixMagicCode():
+    return Module().getSparseMatrixMagicCode();
+
 
 def getNameFromMagicCode(magic_code):
 
@@ -139,6 +174,9 @@ def getNameFromMagicCode(magic_code):
     if magic_code==getSurfaceMagicCode():
         return 'bisSurface';
 
+    if magic_code==getSparseMatrixMagicCode():
+        return 'bisSparseMatrix';
+
 
 # --------------------------------------------
 # Type Mapping
@@ -197,6 +235,29 @@ def get_dtype(n):
 def release_pointer(ptr):
     Module().jsdel_array(ptr);
 
+# --------------------------------------------
+# In place operations
+# The input is copied to library memory so that the library can return it as the output
+# --------------------------------------------
+def is_inplace(paramobj):
+    try:
+        return paramobj.get('inplace',False) in [ True, 1, 'true', 'True' ];
+    except AttributeError:
+        return False;
+
+def copy_to_library_memory(data):
+    n=len(data);
+    Module().allocate_js_array.argtypes=[ ctypes.c_int ];
+    Module().allocate_js_array.restype=ctypes.c_void_p;
+    ptr=Module().allocate_js_array(n);
+    ctypes.memmove(ptr,data,n);
+    return ptr;
+
+def release_inplace_input(ptr,wasm_output):
+    # If the output is the input it was already released by wrapper_deserialize_and_delete
+    if ctypes.cast(wasm_output,ctypes.c_void_p).value!=ptr:
+        release_pointer(ctypes.c_void_p(ptr));
+
 # --------------------------------------------
 # Core Serialize/Deserialize
 # --------------------------------------------
@@ -299,16 +360,25 @@ def deserialize_simpledataobject(wasm_pointer,offset=0,debug=0):
     spa=[];
     mode=1;
     numbytes=header[3];
+    large_header=False;
+
+    # 64-bit data size stored in the last 8 bytes of the object header
+    if (header[3]==-64):
+        large_header=True;
+        sizeoffset=offset+16+header[2]-8;
+        numbytes=struct.unpack('q',bytes(wasm_pointer[sizeoffset:sizeoffset+8]))[0];
     
     if (debug>0):
         print('header=',header);
 
     if (header[0]==Module().getVectorMagicCode()):
         dims=[ header[3] ];
+        if (large_header):
+            dims=[ numbytes//np.dtype(get_dtype(header[1])).itemsize ];
     elif (header[0]==Module().getMatrixMagicCode()):
         dims=struct.unpack('ii',bytes(wasm_pointer[offset+16:offset+24]));
         mode=2;
-        if (header[3]<0):
+        if (header[3]<0 and large_header==False):
             numbytes=dims[0]*dims[1]*(-header[3]);
     elif (header[0]==Module().getImageMagicCode()):
         in_dims=struct.unpack('iiiii',bytes(wasm_pointer[offset+16:offset+36]));
@@ -326,7 +396,7 @@ def deserialize_simpledataobject(wasm_pointer,offset=0,debug=0):
                 spa.append(in_spa[index]);
             index=index+1;
 
-        if (header[3]<0):
+        if (header[3]<0 and large_header==False):
             numbytes=-header[3];
             index=0;
             while (index<len(dims)):
@@ -378,7 +448,7 @@ def deserialize_simpledataobject(wasm_pointer,offset=0,debug=0):
         'data' : s
     }
 
-def wrapper_serialize(obj):
+def wrapper_serialize(obj,library_memory=False):
 
     if type(obj) is np.ndarray:
         shp=obj.shape;
@@ -387,7 +457,10 @@ def wrapper_serialize(obj):
         if l1<1 or l1>5:
             raise ValueError('Bad numpy array shape  '+str(shp)+' for direct serialization ...');
 
-        return serialize_simpledataobject(obj);
+        out=serialize_simpledataobject(obj);
+        if library_memory:
+            return copy_to_library_memory(out);
+        return out;
 
     out=0;
     try:
@@ -395,7 +468,8 @@ def wrapper_serialize(obj):
     except Error:
         raise ValueError('we can only serialize numpy arrays or bis.bisBaseObject derived classes');
 
-    
+    if library_memory:
+        return copy_to_library_memory(out);
     return out;
 
     
@@ -413,6 +487,11 @@ def deserialize_object(ptr,datatype='',offset=0,first_input=0):
         return output.getString();
         
     if  datatype == 'Matrix':
+        # CSR output (csr=True) of the distance matrix functions
+        if struct.unpack('i',bytes(ptr[offset:offset+4]))[0]==getSparseMatrixMagicCode():
+            output=bis.bisSparseMatrix();
+            output.deserializeWasm(ptr,offset);
+            return output;
         output=bis.bisMatrix();
         output.deserializeWasm(ptr,offset);
         return output.get_data();
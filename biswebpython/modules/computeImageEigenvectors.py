@@ -98,6 +98,25 @@ class computeImageEigenvectors(bis_basemodule.baseModule):
                     "highbound": 10000,
                     "varname": "maxiter"
                 },
+                {
+                    "name": "Single Precision",
+                    "description": "if true store the matrix weights as float (products are still accumulated in double)",
+                    "priority": 1000,
+                    "advanced": True,
+                    "gui": "check",
+                    "varname": "singleprecision",
+                    "type": 'boolean',
+                    "default": False,
+                },
+                {
+                    "name": "NumThreads",
+                    "description": "The number of threads to use for the matrix products",
+                    "type": "int",
+                    "default": 4,
+                    "lowbound": 1,
+                    "highbound": 10,
+                    "varname": "numthreads"
+                },
                 {
                     "name": "Patchsize",
                     "description": "If no mask is specified, this is used to create it",
@@ -130,6 +149,8 @@ class computeImageEigenvectors(bis_basemodule.baseModule):
             'sigma' : vals['sigma'],
             'maxiter' : vals['maxiter'],
             'scale' : vals['scale'],
+            'singleprecision' : self.parseBoolean(vals['singleprecision']),
+            'numthreads' : vals['numthreads'],
         };
         print('Paramobj=',paramobj);
         if (self.inputs['mask'] is None):
@@ -87,6 +87,15 @@ class imageDistanceMatrix(bis_basemodule.baseModule):
                     "highbound": 0.2,
                     "varname": "sparsity"
                 },
+                {
+                    "name": "KNN",
+                    "description": "Nearest neighbor search (if useradius=false): 0=compare all pairs, 1=exact k-NN graph, 2=approximate k-NN graph (NN-descent)",
+                    "type": "int",
+                    "default": 0,
+                    "lowbound": 0,
+                    "highbound": 2,
+                    "varname": "knn"
+                },
                 {
                     "name": "Numpatches",
                     "description": "Number of patches to extract (default=0 i.e. use whole image as opposed to patches)",
@@ -145,6 +154,7 @@ class imageDistanceMatrix(bis_basemodule.baseModule):
             'numthreads' : vals['numthreads'],
             'sparsity' : vals['sparsity'],
             'radius' : vals['radius'],
+            'knn' : vals['knn'],
             'useradius' : self.parseBoolean(vals['useradius'])
             
         };
@@ -0,0 +1,216 @@
+# LICENSE
+#
+# _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+#
+# BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+#
+# - you may not use this software except in compliance with the License.
+# - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+#
+# __Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.__
+#
+# ENDLICENSE
+
+import sys
+import numpy as np
+import biswebpython.core.bis_basemodule as bis_basemodule
+import biswebpython.core.bis_baseutils as bis_baseutils
+import biswebpython.core.bis_objects as bis_objects
+
+class individualizedParcellationBatch(bis_basemodule.baseModule):
+
+    def __init__(self):
+        super().__init__();
+        self.name='individualizedParcellationBatch';
+
+    def createDescription(self):
+
+        return {
+            "name": "Batch Individualized parcellation",
+            "description": "Calculates the individualized parcellation of many subjects (the components of a 5D image) starting from the same (group) parcellation",
+            "author": "Mehraveh Salehi",
+            "version": "1.0",
+            "inputs": [
+                {
+                    "type": "image",
+                    "name": "fMRI Images",
+                    "description": "The fMRI images to parcellate (4D for one subject, 5D with one component per subject)",
+                    "varname": "fmri",
+                    "shortname" : "i",
+                    "required": True
+                },
+                {
+                    "type": "image",
+                    "name": "Input Parcellation",
+                    "description": "The original (group) parcellation to individualize (same dimensions as the fMRI images)",
+                    "varname": "parc",
+                    "shortname" : "p",
+                    "required": True
+                },
+            ],
+            "outputs": bis_baseutils.getImageToImageOutputs('The individualized parcellations (one component per subject)'),
+            "params": [
+                {
+                    "name": "Num Regions",
+                    "description": "The number of regions in the original (group) parcellation",
+                    "type": "int",
+                    "default": 268,
+                    "lowbound": 1,
+                    "highbound": 5000,
+                    "varname": "numregions"
+                },
+                {
+                    "name": "Smoothing",
+                    "description": "Kernel size [mm] of FWHM filter size",
+                    "type": "float",
+                    "default": 4.0,
+                    "lowbound": 0.0,
+                    "highbound": 20.0,
+                    "varname": "smooth"
+                },
+                {
+                    "name": "Save Exemplars?",
+                    "description": "Saves exemplars in second frame",
+                    "priority": 20,
+                    "advanced": True,
+                    "gui": "check",
+                    "varname": "saveexemplars",
+                    "type": 'boolean',
+                    "default": False,
+                },
+                {
+                    "name": "usefloat",
+                    "description": "if true use float processing",
+                    "priority": 1000,
+                    "advanced": True,
+                    "gui": "check",
+                    "varname": "usefloat",
+                    "type": 'boolean',
+                    "default": False,
+                },
+                {
+                    "name": "NumThreads",
+                    "description": "The maximum number of subjects to process in parallel (0=all threads)",
+                    "type": "int",
+                    "default": 0,
+                    "lowbound": 0,
+                    "highbound": 64,
+                    "varname": "numthreads"
+                },
+                {
+                    "name": "Copies",
+                    "description": "Number of times the input subjects are repeated in the batch (for testing)",
+                    "priority": 1000,
+                    "advanced": True,
+                    "type": "int",
+                    "default": 1,
+                    "lowbound": 1,
+                    "highbound": 100,
+                    "varname": "copies"
+                },
+                {
+                    "name": "Subject",
+                    "description": "If >=0 only output the parcellation of this subject of the batch",
+                    "priority": 1000,
+                    "advanced": True,
+                    "type": "int",
+                    "default": -1,
+                    "lowbound": -1,
+                    "highbound": 10000,
+                    "varname": "subject"
+                },
+                bis_baseutils.getDebugParam()
+            ],
+        }
+
+    def directInvokeAlgorithm(self,vals):
+        print('oooo invoking: individualizedParcellationBatch with vals', vals);
+
+        debug=self.parseBoolean(vals['debug']);
+        fmri = self.inputs['fmri'];
+        group = self.inputs['parc'];
+
+        if (fmri.hasSameOrientation(group,'fMRI Images','Group Parcellation',True)==False):
+            return False;
+
+        libbis=self.getDynamicLibraryWrapper();
+
+        # Reslice Group Parcellation if needed
+        fmriDim = fmri.dimensions;
+        groupDim = group.dimensions;
+        if (fmriDim[0] != groupDim[0] or fmriDim[1] != groupDim[1] or fmriDim[2] != groupDim[2]):
+            resl_paramobj = {
+                "interpolation": 0,
+                "dimensions": [ fmri.dimensions[0],fmri.dimensions[1],fmri.dimensions[2] ],
+                "spacing": fmri.spacing,
+                "datatype": "short",
+                "backgroundValue": 0.0,
+            };
+
+            matr=np.eye(4,dtype=np.float32);
+            try:
+                print('++++ Reslicing group parcellation to match dimensions of the fmri images');
+                group=libbis.resliceImageWASM(group,matr,resl_paramobj,debug);
+            except:
+                e = sys.exc_info()[0]
+                print('---- Failed to invoke algorithm',e);
+                return False
+
+        # Smooth If needed (frames and components are smoothed separately)
+        smooth=vals['smooth'];
+        if (smooth > 0.001 ):
+            c = smooth * 0.4247;
+            smooth_paramobj = {
+                "sigmas": [c, c, c],
+                "inmm": True,
+                "radiusfactor": 1.5,
+                "vtkboundary" : True,
+            };
+
+            try:
+                print('++++ Smoothing fmri Images');
+                fmri = libbis.gaussianSmoothImageWASM(fmri, smooth_paramobj, debug);
+            except:
+                e = sys.exc_info()[0]
+                print('---- Failed to invoke algorithm',e);
+                return False
+
+        # Subjects are the components (5th dimension) of the input
+        dim=(list(fmri.dimensions)+[1,1,1,1,1])[0:5];
+        data=fmri.get_data().astype(np.float32).reshape([dim[0],dim[1],dim[2],dim[3],dim[4]],order='F');
+        copies=vals['copies'];
+        if (copies>1):
+            data=np.concatenate([ data ] * copies,axis=4);
+        batch=bis_objects.bisImage().create(data,fmri.spacing,self.inputs['fmri'].affine);
+
+        paramobj= {
+            'numberofexemplars' : vals['numregions'],
+            'usefloat' : self.parseBoolean(vals['usefloat']),
+            'saveexemplars' : self.parseBoolean(vals['saveexemplars']),
+            'numthreads' : vals['numthreads'],
+        };
+        try:
+            out=libbis.individualizedParcellationBatchWASM(batch,group,paramobj,debug);
+        except:
+            e = sys.exc_info()[0]
+            print('---- Failed to invoke algorithm',e);
+            return False
+
+        subject=vals['subject'];
+        if (subject>=0):
+            odim=(list(out.dimensions)+[1,1,1,1,1])[0:5];
+            if (subject>=odim[4]):
+                print('---- Bad subject',subject,' (batch has',odim[4],'subjects)');
+                return False;
+            odata=out.get_data().reshape([odim[0],odim[1],odim[2],odim[3],odim[4]],order='F');
+            single=odata[:,:,:,:,subject];
+            if (odim[3]==1):
+                single=single[:,:,:,0];
+            out=bis_objects.bisImage().create(np.copy(single),out.spacing,group.affine);
+
+        self.outputs['output']=out;
+        return True
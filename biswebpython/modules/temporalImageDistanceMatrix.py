@@ -62,6 +62,24 @@ class temporalImageDistanceMatrix(bis_basemodule.baseModule):
                     "highbound": 0.2,
                     "varname": "sparsity"
                 },
+                {
+                    "name": "Patch Radius",
+                    "description": "If > 0 the frames are the patches of a 3D image of this radius (same as using the output of patchReformatImage)",
+                    "type": "int",
+                    "default": 0,
+                    "lowbound": 0,
+                    "highbound": 4,
+                    "varname": "patchradius"
+                },
+                {
+                    "name": "Increment",
+                    "description": "The spacing of the patch voxels (if patchradius > 0)",
+                    "type": "int",
+                    "default": 1,
+                    "lowbound": 1,
+                    "highbound": 4,
+                    "varname": "increment"
+                },
                 bis_baseutils.getDebugParam()
             ],
         }
@@ -72,6 +90,8 @@ class temporalImageDistanceMatrix(bis_basemodule.baseModule):
         paramobj= {
             'numthreads' : vals['numthreads'],
             'sparsity' : vals['sparsity'],
+            'patchradius' : vals['patchradius'],
+            'increment' : vals['increment'],
         };
 
         out=bis_baseutils.getDynamicLibraryWrapper().computeTemporalImageDistanceMatrixWASM(self.inputs['input'],
@@ -30,6 +30,7 @@ class timeseriesNormalizeImage(bis_basemodule.baseModule):
     def directInvokeAlgorithm(self,vals):
         print('oooo invoking: timeSeriesNormalization with vals', vals);
         self.outputs['output']=bis_baseutils.getDynamicLibraryWrapper().timeSeriesNormalizeImageWASM(self.inputs['input'],
+                                                                                                     { 'inplace' : False },
                                                                                                      self.parseBoolean(vals['debug']));
         return True
 
@@ -606,7 +606,7 @@ var create_wasm_function_call_js=function(function_name_in,names,hasparam,isretu
 };
 
 // --------------------------------------------------------------------------
-var cleanup_pointers_js=function(names) {
+var cleanup_pointers_js=function(names,isreturnpointer=false) {
 
 
     let found=false;
@@ -614,10 +614,14 @@ var cleanup_pointers_js=function(names) {
     for (let k=0;k<names.length;k++) {
         
         if (names[k].isptr===true) {
+            // An input modified in place is returned as the output and was already released with it
+            let inplace='';
+            if (isreturnpointer)
+                inplace=' && '+names[k].argname+' !== wasm_output';
             if (names[k].optional===true)
-                outtext+='    if ('+names[k].argname+' !==0  && '+  names[k].argname + ' !== '+ names[k].variablename+')\n      ';
+                outtext+='    if ('+names[k].argname+' !==0  && '+  names[k].argname + ' !== '+ names[k].variablename+inplace+')\n      ';
             else
-                outtext+='    if ('+names[k].argname +' !== '+names[k].variablename+')\n      ';
+                outtext+='    if ('+names[k].argname +' !== '+names[k].variablename+inplace+')\n      ';
             outtext+='wasmutil.release_memory(Module,'+names[k].argname+');\n';
             found=true;
         }
@@ -630,15 +634,20 @@ var cleanup_pointers_js=function(names) {
 // Python stuff
 // --------------------------------------------------------------------------
 
-var create_pointers_python = function(names) {
+var create_pointers_python = function(names,inplace=false) {
     
     let outtext='',found=false;
     for (let k=0;k<names.length;k++) {
 
         let elem=names[k];
         let ptrname=elem.argname;
-        
-        if (elem.isstring===true) {
+
+        if (k===0 && inplace===true) {
+            // In place operation needs the input in library memory (it is returned as the output)
+            outtext+=`    inplace_input=wasmutil.is_inplace(paramobj);\n`;
+            outtext+=`    ${ptrname}=wasmutil.wrapper_serialize(${elem.variablename},inplace_input);\n`;
+            found=true;
+        } else if (elem.isstring===true) {
             outtext+=`    ${ptrname}=str.encode(${elem.variablename});\n`;
             found=true;
         } else if (elem.isptr===true) {
@@ -836,7 +845,7 @@ var create_function=function(descline,outcmt,orig,funlist,wrapper_mode) {
         if (params.isreturnpointer || params.isreturnstring) {
             outtext+=handle_output_pointer_js(output_type,names[0]);
         }           
-        outtext+=cleanup_pointers_js(names);
+        outtext+=cleanup_pointers_js(names,params.isreturnpointer);
         outtext+='\n    // Return\n    return output;\n  };\n';
     }  else if (wrapper_mode==='python') {
         outtext+='    if debug!=True and debug!=1 and debug!=2:\n        debug=0;\n    elif debug!=2:\n        debug=1;\n\n';
@@ -845,14 +854,26 @@ var create_function=function(descline,outcmt,orig,funlist,wrapper_mode) {
             outtext+='    jsonstring=str.encode(json.dumps(paramobj));\n';
         }
 
-        outtext+=create_pointers_python(names);
+        let inplace=(params.hasparam===true && params.isreturnpointer===true && 
+                     output_type==='bisImage' && names[0].bistype==='bisImage');
+        outtext+=create_pointers_python(names,inplace);
         outtext+=create_wasm_function_call_python(fn_name,names,params.hasparam,params.isreturnpointer,params.isreturnstring,params.returntype);
         if (params.isreturnpointer || params.isreturnstring) {
             outtext+=handle_output_pointer_python(output_type,names[0]);
         } 
+        if (inplace) {
+            outtext+=`    if inplace_input:\n        wasmutil.release_inplace_input(${names[0].argname},wasm_output);\n\n`;
+        }
         outtext+='    # Return\n    return output;\n\n';
     }  else {
         outtext+='    if debug~=1 && debug~=2\n        debug=0;\n    end\n';
+        let inplace=(params.hasparam===true && params.isreturnpointer===true && 
+                     output_type==='bisImage' && names[0].bistype==='bisImage');
+        if (inplace) {
+            // The serialized input is owned by Matlab, so it can not be returned as the output
+            outtext+='    % In place operation is not supported in Matlab, always use a copy\n';
+            outtext+="    if isstruct(paramobj) && isfield(paramobj,'inplace')\n        paramobj.inplace=false;\n    end\n";
+        }
         if (params.hasparam==true)
             outtext+='    jsonstring=biswasm.json_stringify(paramobj);\n';
         
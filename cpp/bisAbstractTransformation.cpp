@@ -19,6 +19,7 @@
 #include "bisSimpleDataStructures.h"
 #include "bisMemoryManagement.h"
 #include "bisUtil.h"
+#include "bisvtkMultiThreader.h"
 
 bisAbstractTransformation::bisAbstractTransformation(std::string n): bisDataObject(n) {
   this->class_name="bisAbstractTransformation";
@@ -39,7 +40,7 @@ void bisAbstractTransformation::computeDisplacement(float x[3],float disp[3])
 }
 
 
-bisSimpleImage<float>* bisAbstractTransformation::computeDisplacementField(int i_dim[3],float i_spa[3])
+bisSimpleImage<float>* bisAbstractTransformation::computeDisplacementField(int i_dim[3],float i_spa[3],int numthreads)
 {
 
   int dim[5] = { i_dim[0],i_dim[1],i_dim[2],3,1};
@@ -49,32 +50,76 @@ bisSimpleImage<float>* bisAbstractTransformation::computeDisplacementField(int i
   bisSimpleImage<float >* out=new bisSimpleImage<float>(n1);
   out->allocate(dim,spa);
 
-  float* data=out->getImageData();
+  int bounds[6] = { 0,dim[0]-1,0,dim[1]-1,0,dim[2]-1 };
+  this->inPlaceComputeDisplacementField(out,bounds,numthreads);
+  return out;
+  
+}
+
+void bisAbstractTransformation::computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3])
+{
   float X[3],U[3];
-  int index=0;
-  int volsize=dim[0]*dim[1]*dim[2];
-  for (int k=0;k<dim[2];k++)
+  X[1]=j*spa[1];
+  X[2]=k*spa[2];
+  int offset=0;
+  for (int i=imin;i<=imax;i++)
     {
-      X[2]=k*spa[2];
-      for (int j=0;j<dim[1];j++)
-	{
-	  X[1]=j*spa[1];
-	  for (int i=0;i<dim[0];i++)
-	    {
-	      X[0]=i*spa[0];
-	      this->computeDisplacement(X,U);
-	      for (int ia=0;ia<=2;ia++)
-		data[index+ia*volsize]=U[ia];
-	      ++index;
-	    }
-	}
+      X[0]=i*spa[0];
+      this->computeDisplacement(X,U);
+      for (int ia=0;ia<=2;ia++)
+        out[ia][offset]=U[ia];
+      ++offset;
     }
+}
 
-  return out;
-  
+// ------------------------------------------------------------------------------------------
+// Multithreaded displacement field computation
+// ------------------------------------------------------------------------------------------
+class bisDisplacementFieldThreadStructure {
+public:
+  bisAbstractTransformation* xform;
+  float* data;
+  int dim[3];
+  float spa[3];
+  int bounds[6];
+  int slabaxis;
+};
+
+static void displacementFieldThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
+{
+  bisDisplacementFieldThreadStructure *ds = (bisDisplacementFieldThreadStructure *)(data->UserData);
+  int thread=data->ThreadID;
+  int numthreads=data->NumberOfThreads;
+
+  // Split the slab axis (k or j) into numthreads contiguous pieces
+  int bounds[6];
+  for (int ia=0;ia<=5;ia++)
+    bounds[ia]=ds->bounds[ia];
+
+  int axis=ds->slabaxis;
+  int length=ds->bounds[2*axis+1]-ds->bounds[2*axis]+1;
+  int step=length/numthreads;
+  bounds[2*axis]=ds->bounds[2*axis]+thread*step;
+  if (thread==numthreads-1)
+    bounds[2*axis+1]=ds->bounds[2*axis+1];
+  else
+    bounds[2*axis+1]=bounds[2*axis]+step-1;
+
+  BISLONG slicesize=BISLONG(ds->dim[0])*BISLONG(ds->dim[1]);
+  BISLONG volsize=slicesize*ds->dim[2];
+  float* out[3];
+  for (int k=bounds[4];k<=bounds[5];k++)
+    for (int j=bounds[2];j<=bounds[3];j++)
+      {
+        BISLONG index=k*slicesize+BISLONG(j)*ds->dim[0]+bounds[0];
+        for (int ia=0;ia<=2;ia++)
+          out[ia]=&ds->data[index+ia*volsize];
+        ds->xform->computeDisplacementRow(ds->spa,j,k,bounds[0],bounds[1],out);
+      }
 }
 
-int bisAbstractTransformation::inPlaceComputeDisplacementField(bisSimpleImage<float>* output, int bounds[6])
+
+int bisAbstractTransformation::inPlaceComputeDisplacementField(bisSimpleImage<float>* output, int bounds[6],int numthreads)
 
 {
 
@@ -92,28 +137,33 @@ int bisAbstractTransformation::inPlaceComputeDisplacementField(bisSimpleImage<fl
       bounds[2*ia]=bisUtil::irange(bounds[2*ia],0,dim[ia]-1);
       bounds[2*ia+1]=bisUtil::irange(bounds[2*ia+1],bounds[2*ia],dim[ia]-1);
     }
-  
-  float* data=output->getImageData();
-  float X[3],U[3];
 
-  int volsize=dim[0]*dim[1]*dim[2];
-  for (int k=bounds[4];k<=bounds[5];k++)
+#ifdef _WIN32
+  numthreads=1;
+#endif
+  
+  bisDisplacementFieldThreadStructure ds;
+  ds.xform=this;
+  ds.data=output->getImageData();
+  for (int ia=0;ia<=2;ia++)
     {
-      X[2]=k*spa[2];
-      for (int j=bounds[2];j<=bounds[3];j++)
-	{
-	  X[1]=j*spa[1];
-	  int index=k*dim[0]*dim[1]+j*dim[0]+bounds[0];
-	  for (int i=bounds[0];i<=bounds[1];i++)
-	    {
-	      X[0]=i*spa[0];
-	      this->computeDisplacement(X,U);
-	      for (int ia=0;ia<=2;ia++)
-		data[index+ia*volsize]=U[ia];
-	      ++index;
-	    }
-	}
+      ds.dim[ia]=dim[ia];
+      ds.spa[ia]=spa[ia];
     }
+  for (int ia=0;ia<=5;ia++)
+    ds.bounds[ia]=bounds[ia];
+
+  ds.slabaxis=2;
+  if (bounds[5]==bounds[4])
+    ds.slabaxis=1;
+
+  // Never use more threads than slabs
+  numthreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
+  int maxthreads=bounds[2*ds.slabaxis+1]-bounds[2*ds.slabaxis]+1;
+  if (numthreads>maxthreads)
+    numthreads=maxthreads;
+  
+  bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&displacementFieldThreadFunction,&ds,"Displacement Field",numthreads,0);
   return 1;
 }
 
@@ -151,16 +201,16 @@ float bisAbstractTransformation::computeDisplacementFieldSSD(bisSimpleImage<floa
   float* data1=dispfield1->getImageData();
   float* data2=dispfield2->getImageData();
 
-  int volsize=dim[0]*dim[1]*dim[2];
-  int slicesize=dim[0]*dim[1];
+  BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+  BISLONG slicesize=BISLONG(dim[0])*BISLONG(dim[1]);
   
   double ssd=0.0;
   for (int k=bounds[4];k<=bounds[5];k++)
     {
-      int k_index=k*slicesize;
+      BISLONG k_index=k*slicesize;
       for (int j=bounds[2];j<=bounds[3];j++)
 	{
-	  int index=k_index+j*dim[0]+bounds[0];
+	  BISLONG index=k_index+BISLONG(j)*dim[0]+bounds[0];
 	  for (int i=bounds[0];i<=bounds[1];i++)
 	    {
 	      for (int ia=0;ia<=2;ia++)
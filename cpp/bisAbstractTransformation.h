@@ -70,9 +70,23 @@ public:
   /** computes the displacement at a point x for region of image bounded by bounds
    * @param output is the image (3 components) to store displacements in 
    * @param bounds [ imin:imax,jmin:jmax;kmin:kmax] is the region to compute
+   * @param numthreads if > 1 the region is split into slabs (along k, or j for 2D regions) computed in parallel
    * @returns 1 if success, 0 if failure
    */
-  virtual int inPlaceComputeDisplacementField(bisSimpleImage<float>* output, int bounds[6]);
+  virtual int inPlaceComputeDisplacementField(bisSimpleImage<float>* output, int bounds[6],int numthreads=1);
+
+  /** computes the displacements for a single row of voxels (j,k fixed, i=imin..imax).
+   * This is the inner kernel of inPlaceComputeDisplacementField. The default implementation
+   * calls computeDisplacement for each voxel, derived classes override it to exploit their structure.
+   * It must be safe to call concurrently for different rows.
+   * @param spa spacing of the displacement field
+   * @param j the row index
+   * @param k the slice index
+   * @param imin first voxel in the row
+   * @param imax last voxel in the row
+   * @param out pointers to the output location of voxel imin for each of the three components
+   */
+  virtual void computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3]);
 
 
   /** computes the SSD between two displacement fields -- this is static member 
@@ -88,14 +102,15 @@ public:
   /** Compute a displacement field over the space specified by dim and spa 
    * @param dim dimensions of output displacement field image
    * @param spa spacing of output field image
-   * @returns 1 if success, 0 if failure
+   * @param numthreads number of threads to use (forced to 1 on Windows)
+   * @returns the displacement field image
    */
 
-  virtual bisSimpleImage <float>* computeDisplacementField(int dim[3],float spa[3]);
+  virtual bisSimpleImage <float>* computeDisplacementField(int dim[3],float spa[3],int numthreads=4);
 
 
   /** Gets the raw size in bytes for this structure */
-  virtual long getRawSize()=0;
+  virtual BISLONG getRawSize()=0;
 
   /** Get Magic Type for this transformation -> used in serialization */
   virtual int getMagicType() { return this->magic_type; }
@@ -39,6 +39,7 @@ void bisComboTransformation::identity()
 {
   this->initialLinearTransformation->identity();
   this->gridTransformationList.clear();
+  this->clearBakedField();
 }
 
 
@@ -46,6 +47,7 @@ void bisComboTransformation::addTransformation(std::shared_ptr<bisGridTransforma
 {
 
   this->gridTransformationList.push_back(additional_transformation);
+  this->clearBakedField();
 }
 
 std::shared_ptr<bisGridTransformation> bisComboTransformation::getGridTransformation(int index)
@@ -90,6 +92,15 @@ void bisComboTransformation::transformPoint(float x[3],float y[3])
   
   
   float temp[3]= { x[0],x[1],x[2] };
+  if (this->bakedField.get()!=0 && this->hasValidBakedField())
+    {
+      if (this->transformPointBaked(x,temp))
+        {
+          this->initialLinearTransformation->transformPoint(temp,y);
+          return;
+        }
+    }
+
   /*  int debug=0;
   if (fabs(x[0]-20.0)+fabs(x[1]-20.0)+fabs(x[2]-20.0)<0.0001)
   debug=1;*/
@@ -118,9 +129,152 @@ void bisComboTransformation::transformPoint(float x[3],float y[3])
       }*/
 }
 
+void bisComboTransformation::computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3])
+{
+  int sz=this->gridTransformationList.size();
+  if (sz<1) {
+    this->initialLinearTransformation->computeDisplacementRow(spa,j,k,imin,imax,out);
+    return;
+  }
+
+  bisUtil::mat44 m;
+  this->initialLinearTransformation->getMatrix(m);
+  float X[3] = { 0.0f, j*spa[1], k*spa[2] };
+  float temp[3],y[3];
+
+  int usebaked=(this->bakedField.get()!=0 && this->hasValidBakedField());
+  
+  // Last grid is applied first, its input is the regular row
+  if (!usebaked)
+    this->gridTransformationList[sz-1]->computeDisplacementRow(spa,j,k,imin,imax,out);
+
+  int offset=0;
+  for (int i=imin;i<=imax;i++)
+    {
+      X[0]=i*spa[0];
+      if (usebaked && this->transformPointBaked(X,temp))
+        {
+          // temp is now the output of the whole grid chain
+        }
+      else
+        {
+          if (usebaked)
+            {
+              this->gridTransformationList[sz-1]->transformPoint(X,temp);
+            }
+          else
+            {
+              for (int ib=0;ib<=2;ib++)
+                temp[ib]=X[ib]+out[ib][offset];
+            }
+          
+          for (int ia=sz-2;ia>=0;ia=ia-1)
+            {
+              this->gridTransformationList[ia]->transformPoint(temp,y);
+              for (int ib=0;ib<=2;ib++)
+                temp[ib]=y[ib];
+            }
+        }
+
+      for (int ib=0;ib<=2;ib++)
+        out[ib][offset]=m[ib][0]*temp[0]+m[ib][1]*temp[1]+m[ib][2]*temp[2]+m[ib][3]-X[ib];
+      ++offset;
+    }
+}
 
 // -------------------------------------------------------------------
-long bisComboTransformation::getRawSize()
+// Baking the grid chain into a single displacement field
+// -------------------------------------------------------------------
+int bisComboTransformation::bakeGridTransformations(int dim[3],float spa[3],int numthreads)
+{
+  this->clearBakedField();
+  if (this->gridTransformationList.size()<1)
+    return 0;
+
+  // A combo sharing our grids but with an identity linear part gives the displacement of the grid chain
+  std::unique_ptr<bisComboTransformation> chain(new bisComboTransformation(this->name+":chain"));
+  for (unsigned int ia=0;ia<this->gridTransformationList.size();ia++)
+    chain->addTransformation(this->gridTransformationList[ia]);
+
+  std::unique_ptr<bisSimpleImage<float> > field(chain->computeDisplacementField(dim,spa,numthreads));
+  this->bakedField=std::move(field);
+
+  for (unsigned int ia=0;ia<this->gridTransformationList.size();ia++)
+    {
+      this->bakedGrids.push_back(this->gridTransformationList[ia].get());
+      this->bakedModificationCounts.push_back(this->gridTransformationList[ia]->getModificationCount());
+    }
+  return 1;
+}
+
+void bisComboTransformation::clearBakedField()
+{
+  this->bakedField.reset();
+  this->bakedGrids.clear();
+  this->bakedModificationCounts.clear();
+}
+
+int bisComboTransformation::hasValidBakedField()
+{
+  if (this->bakedField.get()==0)
+    return 0;
+
+  if (this->bakedGrids.size()!=this->gridTransformationList.size())
+    return 0;
+  
+  for (unsigned int ia=0;ia<this->bakedGrids.size();ia++)
+    {
+      if (this->bakedGrids[ia]!=this->gridTransformationList[ia].get() ||
+          this->bakedModificationCounts[ia]!=this->gridTransformationList[ia]->getModificationCount())
+        return 0;
+    }
+  return 1;
+}
+
+int bisComboTransformation::transformPointBaked(float x[3],float y[3])
+{
+  int dim[5]; this->bakedField->getDimensions(dim);
+  float spa[5]; this->bakedField->getSpacing(spa);
+
+  BISLONG B[3][2];
+  float W[3][2];
+  for (int ia=0;ia<=2;ia++)
+    {
+      float p=x[ia]/spa[ia];
+      if (p<0.0f || p>float(dim[ia]-1))
+        return 0;
+      B[ia][0]=BISLONG(p);
+      B[ia][1]=B[ia][0]+1;
+      if (B[ia][1]>dim[ia]-1)
+        B[ia][1]=dim[ia]-1;
+      W[ia][1]=p-B[ia][0];
+      W[ia][0]=1.0f-W[ia][1];
+    }
+
+  BISLONG slicesize=BISLONG(dim[0])*BISLONG(dim[1]);
+  BISLONG volsize=slicesize*dim[2];
+  for (int ia=0;ia<=1;ia++)
+    {
+      B[1][ia]*=dim[0];
+      B[2][ia]*=slicesize;
+    }
+
+  float* data=this->bakedField->getData();
+  for (int coord=0;coord<=2;coord++)
+    {
+      float* cdata=&data[coord*volsize];
+      double sum=x[coord];
+      for (int k=0;k<=1;k++)
+        for (int j=0;j<=1;j++)
+          for (int i=0;i<=1;i++)
+            sum+=W[2][k]*W[1][j]*W[0][i]*cdata[B[2][k]+B[1][j]+B[0][i]];
+      y[coord]=(float)sum;
+    }
+  return 1;
+}
+
+// -------------------------------------------------------------------
+BISLONG bisComboTransformation::getRawSize()
 {
   // Header
   // 16 bytes big header
@@ -161,7 +315,12 @@ void bisComboTransformation::serializeInPlace(unsigned char* pointer)
       offset+=this->gridTransformationList[ia]->getRawSize();
       //  std::cout << "Post grid offset=" << offset << " (sz=" << this->gridTransformationList[ia]->getRawSize() << " )" << std::endl;
     }
-  std::cout << std::endl << std::endl;
+}
+
+void bisComboTransformation::setSerializationMode(int mode)
+{
+  for (unsigned int ia=0;ia<this->gridTransformationList.size();ia++)
+    this->gridTransformationList[ia]->setSerializationMode(mode);
 }
 
 
@@ -191,7 +350,9 @@ int bisComboTransformation::deSerialize(unsigned char* pointer)
     {
       std::shared_ptr<bisGridTransformation> tmp_g(new bisGridTransformation());
       tmp_g->deSerialize(pointer+offset);
-      offset+=tmp_g->getRawSize();
+      // Use the stored sizes as the grid may have been serialized in a compressed mode
+      int* grid_header=(int*)(pointer+offset);
+      offset+=16+grid_header[2]+grid_header[3];
       this->addTransformation(tmp_g);
       //      float* data=tmp_g->getData();
       //      int numc=tmp_g->getNumberOfControlPoints();
@@ -270,6 +431,7 @@ int bisComboTransformation::textParse(std::vector<std::string>& lines,int& offse
     }
 
   this->gridTransformationList.clear();
+  this->clearBakedField();
   
   for (int i=0;i<numgrids;i++)
     {
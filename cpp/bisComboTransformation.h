@@ -73,6 +73,13 @@ class bisComboTransformation : public bisAbstractTransformation {
    */
   virtual void transformPoint(float x[3],float y[3]);
 
+  /** computes the displacements for a row of voxels. The innermost grid is evaluated with its
+   * row kernel (the input points form a regular row), the remaining grids are applied point by point
+   * and the linear component is applied inline from a cached copy of its matrix.
+   * See \link bisAbstractTransformation::computeDisplacementRow \endlink for parameters.
+   */
+  virtual void computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3]);
+
   /** adds a grid transformation to the list
    * @param additional_transformation grid to add
    */
@@ -92,7 +99,13 @@ class bisComboTransformation : public bisAbstractTransformation {
   virtual void serializeInPlace(unsigned char* output);
 
   /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize();
+  virtual BISLONG getRawSize();
+
+  /** Sets the serialization mode of all current grid transformations
+   * (see bisGridTransformation::setSerializationMode)
+   * @param mode 0=raw float32, 1=zero-run compressed float32, 2=zero-run compressed float16
+   */
+  void setSerializationMode(int mode);
 
 
   /** serialize to Text 
@@ -113,8 +126,44 @@ class bisComboTransformation : public bisAbstractTransformation {
   // Return -1 : I am partly linear
   virtual  int isLinear() { return -1;}
 
+  /** Composes the grid transformations into a single dense displacement field sampled on the lattice defined
+   * by dim and spa (origin is 0,0,0 as for all bisWeb images) and caches it. While the cache is valid, transformPoint
+   * maps points inside the lattice using a single trilinear lookup followed by the linear transformation.
+   * Points outside the lattice use the full chain. The linear transformation is not part of the baked field, so changing
+   * it does not invalidate the cache. Any change to the list of grids or to their parameters (see
+   * bisGridTransformation::getModificationCount) does. A grid's getData() counts as a change; code that keeps that
+   * pointer and writes through it later must call bisGridTransformation::modified() (or clearBakedField()).
+   * @param dim dimensions of the lattice (typically the target image)
+   * @param spa spacing of the lattice
+   * @param numthreads number of threads to use when computing the field
+   * @returns 1 if success, 0 if there are no grids to bake
+   */
+  int bakeGridTransformations(int dim[3],float spa[3],int numthreads=4);
+
+  /** Removes the baked displacement field (if any) */
+  void clearBakedField();
+
+  /** Returns 1 if there is a baked displacement field and it is up to date, else 0 */
+  int hasValidBakedField();
+
 protected:
 
+  /** Baked displacement field of the grid chain (see bakeGridTransformations) */
+  std::unique_ptr<bisSimpleImage<float> > bakedField;
+
+  /** Grids and their modification counts at the time of baking, used to detect changes */
+  std::vector<bisGridTransformation*> bakedGrids;
+
+  /** Modification counts of bakedGrids at the time of baking */
+  std::vector<unsigned long> bakedModificationCounts;
+
+  /** Maps x through the baked grid chain using trilinear interpolation
+   * @param x input point
+   * @param y output point (before the linear transformation)
+   * @returns 1 if x is inside the baked lattice, else 0 (y is not set)
+   */
+  int transformPointBaked(float x[3],float y[3]);
+
   /** Initial Linear Transformation */
   std::shared_ptr<bisMatrixTransformation> initialLinearTransformation;
 
@@ -19,6 +19,7 @@
 #define _bis_DataObject_h
 
 #include "bisObject.h"
+#include "bisMemoryManagement.h"
 
 /**
  * Root Object for serializable objects in bisWeb. Contains functionality to serialize and deserialize objects
@@ -49,7 +50,7 @@ public:
   virtual int deSerialize(unsigned char* pointer)=0;
 
   /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize()=0;
+  virtual BISLONG getRawSize()=0;
 
   
   
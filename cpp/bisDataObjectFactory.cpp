@@ -24,6 +24,7 @@
 #include "bisTransformationCollection.h"
 #include "bisSimpleDataStructures.h"
 #include "bisSurface.h"
+#include "bisSparseMatrix.h"
 
 namespace bisDataObjectFactory {
 
@@ -114,6 +115,15 @@ std::shared_ptr<bisDataObject> deserializeObject(unsigned char* pointer,std::str
 	  }
       }
 
+    if (magic_type==bisDataTypes::s_sparsematrix)
+      {
+	std::shared_ptr<bisSparseMatrix> obj(new bisSparseMatrix(name));
+	if (obj->deSerialize(pointer))
+	  return obj;
+	std::shared_ptr<bisDataObject> tmp(0);
+	return tmp;
+      }
+
     // Else try transformation
     return deserializeTransformation(pointer,name);
   }
@@ -64,6 +64,12 @@ namespace bisDataTypes {
   const int s_collection=20006;
   /** Magic number for collection object=20006 for serialization */
   const int s_surface=20007;
+  /** Magic number for CSR sparse matrix=20008 for serialization (see bisSparseMatrix) */
+  const int s_sparsematrix=20008;
+
+  /** Value of the data size field of the serialization header signalling the 64-bit header.
+   * In this case the actual size (int64) is stored in the last 8 bytes of the object header */
+  const int s_datasize64=-64;
 
   /** Return the code of a given type 
    * @param a dummy variable specificying the type
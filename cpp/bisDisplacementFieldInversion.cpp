@@ -0,0 +1,283 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#include "bisDisplacementFieldInversion.h"
+#include "bisJSONParameterList.h"
+#include "bisImageAlgorithms.h"
+#include "bisDataObjectFactory.h"
+#include "bisvtkMultiThreader.h"
+
+namespace bisDisplacementFieldInversion {
+
+  // ------------------------------------------------------------------------------------------
+  // Slab parallel fixed-point inversion
+  // Each thread handles a range of slices of the output. Every voxel is iterated independently
+  // so no synchronization is needed beyond the final reduction of the convergence statistics.
+  // ------------------------------------------------------------------------------------------
+  class bisInversionThreadStructure {
+  public:
+    float* forward;
+    float* inverse;
+    int dim[3];
+    float spa[3];
+    int maxiterations;
+    float tolerance;
+    long numconverged[VTK_MAX_THREADS];
+    long numiterations[VTK_MAX_THREADS];
+    float maxresidual[VTK_MAX_THREADS];
+  };
+
+  static void inversionThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
+  {
+    bisInversionThreadStructure *ds = (bisInversionThreadStructure *)(data->UserData);
+    int thread=data->ThreadID;
+    int numthreads=data->NumberOfThreads;
+    int* dim=ds->dim;
+    float* spa=ds->spa;
+
+    int step=dim[2]/numthreads;
+    int kbegin=thread*step;
+    int kend=kbegin+step-1;
+    if (thread==numthreads-1)
+      kend=dim[2]-1;
+
+    long numconverged=0,numiterations=0;
+    float maxresidual=0.0;
+
+    int minusdim[3] = { dim[0]-1,dim[1]-1,dim[2]-1 };
+    int slicesize=dim[0]*dim[1];
+    BISLONG volsize=BISLONG(slicesize)*BISLONG(dim[2]);
+    float tol2=ds->tolerance*ds->tolerance;
+    float* fdata=ds->forward;
+    float* idata=ds->inverse;
+
+    float Y[3],V[3],VN[3],TX[3];
+
+    for (int k=kbegin;k<=kend;k++)
+      {
+        Y[2]=k*spa[2];
+        for (int j=0;j<dim[1];j++)
+          {
+            Y[1]=j*spa[1];
+            BISLONG index=BISLONG(k)*BISLONG(slicesize)+BISLONG(j)*dim[0];
+            for (int i=0;i<dim[0];i++)
+              {
+                Y[0]=i*spa[0];
+
+                // Initial guess v0(y) = -u(y)
+                for (int ia=0;ia<=2;ia++)
+                  V[ia]=-fdata[index+ia*volsize];
+
+                float residual=0.0;
+                int iter=0,converged=0;
+                while (iter<ds->maxiterations && converged==0)
+                  {
+                    for (int ia=0;ia<=2;ia++)
+                      {
+                        TX[ia]=(Y[ia]+V[ia])/spa[ia];
+                        if (TX[ia]<0.0f)
+                          TX[ia]=0.0f;
+                        else if (TX[ia]>minusdim[ia])
+                          TX[ia]=float(minusdim[ia]);
+                      }
+
+                    residual=0.0;
+                    for (int ia=0;ia<=2;ia++)
+                      {
+                        VN[ia]=-(float)bisImageAlgorithms::linearInterpolationFunction<float>(fdata,TX,minusdim,dim[0],slicesize,ia*volsize);
+                        residual+=(VN[ia]-V[ia])*(VN[ia]-V[ia]);
+                        V[ia]=VN[ia];
+                      }
+                    ++iter;
+                    if (residual<tol2)
+                      converged=1;
+                  }
+
+                numiterations+=iter;
+                numconverged+=converged;
+                if (residual>maxresidual)
+                  maxresidual=residual;
+
+                for (int ia=0;ia<=2;ia++)
+                  idata[index+ia*volsize]=V[ia];
+                ++index;
+              }
+          }
+      }
+
+    ds->numconverged[thread]=numconverged;
+    ds->numiterations[thread]=numiterations;
+    ds->maxresidual[thread]=sqrt(maxresidual);
+  }
+
+
+  bisSimpleImage<float>* computeInverseDisplacementField(bisSimpleImage<float>* forward,
+                                                         int maxiterations,float tolerance,
+                                                         int numthreads,float& roundtriperror,int debug)
+  {
+    roundtriperror=-1.0;
+
+    int dim[5]; forward->getDimensions(dim);
+    float spa[5]; forward->getSpacing(spa);
+    if (dim[3]!=3 || dim[4]!=1)
+      {
+        std::cerr << "Inverse displacement field: input must have three frames (has " << dim[3] << "," << dim[4] << ")" << std::endl;
+        return 0;
+      }
+
+    bisSimpleImage<float>* inverse=new bisSimpleImage<float>("inverse_dispfield");
+    inverse->allocate(dim,spa);
+
+    bisInversionThreadStructure ds;
+    ds.forward=forward->getImageData();
+    ds.inverse=inverse->getImageData();
+    for (int ia=0;ia<=2;ia++) {
+      ds.dim[ia]=dim[ia];
+      ds.spa[ia]=spa[ia];
+    }
+    ds.maxiterations=bisUtil::irange(maxiterations,1,1000);
+    ds.tolerance=bisUtil::frange(tolerance,1e-6f,100.0f);
+    for (int ia=0;ia<VTK_MAX_THREADS;ia++) {
+      ds.numconverged[ia]=0;
+      ds.numiterations[ia]=0;
+      ds.maxresidual[ia]=0.0;
+    }
+
+#ifdef _WIN32
+    numthreads=1;
+#endif
+    numthreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
+    if (numthreads>dim[2])
+      numthreads=bisUtil::irange(dim[2],1,VTK_MAX_THREADS);
+
+    bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&inversionThreadFunction,&ds,"Inverse Field",numthreads,debug);
+
+    int bounds[6] = { 0,dim[0]-1,0,dim[1]-1,0,dim[2]-1 };
+    roundtriperror=bisImageAlgorithms::computeDisplacementFieldRoundTripError(forward,inverse,bounds,0);
+
+    if (debug)
+      {
+        long numconverged=0,numiterations=0;
+        float maxresidual=0.0;
+        for (int ia=0;ia<VTK_MAX_THREADS;ia++) {
+          numconverged+=ds.numconverged[ia];
+          numiterations+=ds.numiterations[ia];
+          if (ds.maxresidual[ia]>maxresidual)
+            maxresidual=ds.maxresidual[ia];
+        }
+        long numvoxels=long(dim[0])*long(dim[1])*long(dim[2]);
+        std::cout << "..... Inverse displacement field: converged=" << numconverged << "/" << numvoxels;
+        std::cout << " average iterations=" << double(numiterations)/double(numvoxels) << " max residual=" << maxresidual;
+        std::cout << " round trip error=" << roundtriperror << std::endl;
+      }
+
+    return inverse;
+  }
+
+  bisSimpleImage<float>* computeInverseDisplacementField(bisAbstractTransformation* transformation,int dim[3],float spa[3],
+                                                         int maxiterations,float tolerance,
+                                                         int numthreads,float& roundtriperror,int debug)
+  {
+    std::unique_ptr<bisSimpleImage<float> > forward(transformation->computeDisplacementField(dim,spa,numthreads));
+    return computeInverseDisplacementField(forward.get(),maxiterations,tolerance,numthreads,roundtriperror,debug);
+  }
+}
+
+
+// BIS: { 'computeInverseDisplacementFieldWASM', 'bisImage', [ 'bisTransformation', 'ParamObj',  'debug' ] }
+unsigned char* computeInverseDisplacementFieldWASM(unsigned char* xform,const char* jsonstring,int debug)
+{
+  if (debug)
+    std::cout << "_____ Beginning computeInverseDisplacementFieldJSON" << std::endl;
+
+  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
+  if (!params->parseJSONString(jsonstring))
+    return 0;
+
+  if(debug)
+    params->print("from computeInverseDisplacementField","_____");
+
+  std::shared_ptr<bisAbstractTransformation> inputXform=bisDataObjectFactory::deserializeTransformation(xform,"invxform");
+  if (inputXform.get()==0) {
+    std::cerr << "Failed to deserialize transformation " << std::endl;
+    return 0;
+  }
+
+  int dim[3];
+  float spa[3];
+  for (int ia=0;ia<=2;ia++)
+    {
+      dim[ia]=params->getIntValue("dimensions",64,ia);
+      spa[ia]=params->getFloatValue("spacing",1.0,ia);
+    }
+  int maxiterations=params->getIntValue("iterations",20);
+  float tolerance=params->getFloatValue("tolerance",0.001f);
+  int numthreads=params->getIntValue("numthreads",4);
+
+  if (debug)
+    {
+      std::cout << "Computing Inverse Displacement Field dim=" << dim[0] << "," << dim[1] << "," << dim[2];
+      std::cout << "  spa=" << spa[0] << "," << spa[1] << "," << spa[2] << " with " << inputXform->getClassName();
+      std::cout << " iterations=" << maxiterations << " tolerance=" << tolerance << std::endl;
+    }
+
+  float roundtriperror=0.0;
+  std::unique_ptr< bisSimpleImage<float> > output(bisDisplacementFieldInversion::computeInverseDisplacementField(inputXform.get(),dim,spa,
+                                                                                                                  maxiterations,tolerance,
+                                                                                                                  numthreads,roundtriperror,debug));
+  if (output.get()==0)
+    return 0;
+
+  return output->releaseAndReturnRawArray();
+}
+
+// BIS: { 'computeDisplacementFieldRoundTripErrorWASM', 'Float', [ 'bisImage', 'bisImage',  'debug' ] }
+float computeDisplacementFieldRoundTripErrorWASM(unsigned char* forward,unsigned char* inverse,int debug)
+{
+  std::unique_ptr<bisSimpleImage<float> > forward_field(new bisSimpleImage<float>("forward_field"));
+  if (!forward_field->linkIntoPointer(forward))
+    return -1.0;
+
+  std::unique_ptr<bisSimpleImage<float> > inverse_field(new bisSimpleImage<float>("inverse_field"));
+  if (!inverse_field->linkIntoPointer(inverse))
+    return -1.0;
+
+  int dim[5]; forward_field->getDimensions(dim);
+  int inverse_dim[5]; inverse_field->getDimensions(inverse_dim);
+  float spa[5]; forward_field->getSpacing(spa);
+  float inverse_spa[5]; inverse_field->getSpacing(inverse_spa);
+
+  // The error is computed voxel by voxel, so both fields must sample the same lattice
+  int match=(dim[3]==3 && inverse_dim[3]==3 && dim[4]==1 && inverse_dim[4]==1);
+  for (int ia=0;ia<=2;ia++)
+    {
+      if (dim[ia]!=inverse_dim[ia] || fabs(spa[ia]-inverse_spa[ia])>0.001*fabs(spa[ia]))
+        match=0;
+    }
+  if (!match)
+    {
+      std::cerr << "Round trip error: forward and inverse fields must have the same dimensions, spacing and 3 components (";
+      std::cerr << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << " vs " << inverse_dim[0] << "," << inverse_dim[1] << "," << inverse_dim[2] << "," << inverse_dim[3] << ")" << std::endl;
+      return 0.0;
+    }
+
+  int bounds[6] = { 0,dim[0]-1,0,dim[1]-1,0,dim[2]-1 };
+  float error=bisImageAlgorithms::computeDisplacementFieldRoundTripError(forward_field.get(),inverse_field.get(),bounds,0);
+  if (debug)
+    std::cout << "_____ Displacement field round trip error=" << error << std::endl;
+  return error;
+}
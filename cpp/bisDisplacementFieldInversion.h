@@ -0,0 +1,90 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#ifndef __bisDisplacementFieldInversion_h
+#define __bisDisplacementFieldInversion_h
+
+#include "bisDefinitions.h"
+#include "bisSimpleDataStructures.h"
+#include "bisAbstractTransformation.h"
+
+/** @file bisDisplacementFieldInversion.h
+
+    Functions to compute the inverse of a displacement field (or of a transformation sampled
+    as a displacement field) using a parallel fixed-point iteration. Given the forward field u
+    the inverse field v satisfies v(y) = -u(y+v(y)); each voxel of v is iterated independently
+    until the update is smaller than the tolerance.
+*/
+
+namespace bisDisplacementFieldInversion {
+
+  /** Computes the inverse of a displacement field. The inverse is sampled on the same lattice as the input.
+   * @param forward the forward displacement field (dim[3]=3)
+   * @param maxiterations the maximum number of fixed-point iterations per voxel
+   * @param tolerance the convergence threshold (in mm) for the update at each voxel
+   * @param numthreads number of threads to use
+   * @param roundtriperror on output the round trip error (see bisImageAlgorithms::computeDisplacementFieldRoundTripError)
+   * @param debug if > 0 print diagnostics
+   * @returns the inverse displacement field or 0 if failed
+   */
+  bisSimpleImage<float>* computeInverseDisplacementField(bisSimpleImage<float>* forward,
+                                                         int maxiterations,float tolerance,
+                                                         int numthreads,float& roundtriperror,int debug=0);
+
+  /** Computes the inverse displacement field of a transformation on a given lattice.
+   * @param transformation the transformation to invert
+   * @param dim the dimensions of the output field
+   * @param spa the spacing of the output field
+   * @param maxiterations the maximum number of fixed-point iterations per voxel
+   * @param tolerance the convergence threshold (in mm) for the update at each voxel
+   * @param numthreads number of threads to use
+   * @param roundtriperror on output the round trip error (see bisImageAlgorithms::computeDisplacementFieldRoundTripError)
+   * @param debug if > 0 print diagnostics
+   * @returns the inverse displacement field or 0 if failed
+   */
+  bisSimpleImage<float>* computeInverseDisplacementField(bisAbstractTransformation* transformation,int dim[3],float spa[3],
+                                                         int maxiterations,float tolerance,
+                                                         int numthreads,float& roundtriperror,int debug=0);
+}
+
+extern "C" {
+
+  /** Computes the inverse displacement field of a transformation using fixed-point iteration
+   * @param xform the transformation to invert (typically a bisGridTransformation or a bisComboTransformation)
+   * @param jsonstring the parameter string for the algorithm
+   *   { "dimensions":  [ 20,20,20 ], "spacing": [ 2.0,2.5,2.5 ], "iterations" : 20, "tolerance" : 0.001, "numthreads" : 4 };
+   * @param debug if > 0 print debug messages (including the round trip error)
+   * @returns a pointer to the inverse displacement field image (bisSimpleImage<float>)
+   */
+  // BIS: { 'computeInverseDisplacementFieldWASM', 'bisImage', [ 'bisTransformation', 'ParamObj',  'debug' ] }
+  BISEXPORT unsigned char* computeInverseDisplacementFieldWASM(unsigned char* xform,const char* jsonstring,int debug);
+
+  /** Computes the round trip error of a forward and an inverse displacement field
+   * (see bisImageAlgorithms::computeDisplacementFieldRoundTripError). Use this to check the output of computeInverseDisplacementFieldWASM.
+   * @param forward the forward displacement field
+   * @param inverse the inverse displacement field
+   * @param debug if > 0 print debug messages
+   * The two fields must have the same dimensions and spacing and 3 components.
+   * @returns the root mean square round trip error (mm), 0 if the fields do not match or -1.0 if they can not be read
+   */
+  // BIS: { 'computeDisplacementFieldRoundTripErrorWASM', 'Float', [ 'bisImage', 'bisImage',  'debug' ] }
+  BISEXPORT float computeDisplacementFieldRoundTripErrorWASM(unsigned char* forward,unsigned char* inverse,int debug);
+
+}
+
+
+#endif
@@ -33,6 +33,7 @@
 #include "bisSurface.h"
 #include "bisPointRegistrationUtils.h"
 #include "bisMemoryManagement.h"
+#include "bisThreadPool.h"
 #include <memory>
 
 
@@ -48,6 +49,22 @@ void set_large_memory_mode(int m) {
   bisMemoryManagement::setLargeMemoryMode(m);
 }
 
+void set_pool_memory_mode(int m,int limitmb) {
+  bisMemoryManagement::setPoolMemoryMode(m,BISLONG(limitmb)*1024*1024);
+}
+
+void release_pool_memory() {
+  bisMemoryManagement::release_pool();
+}
+
+int set_num_threads(int n) {
+  return bisThreadPool::setNumberOfThreads(n);
+}
+
+int get_num_threads() {
+  return bisThreadPool::getNumberOfThreads();
+}
+
 void print_memory()
 {
   bisMemoryManagement::print_map();
@@ -79,12 +96,30 @@ int getGridTransformMagicCode() { return bisDataTypes::s_gridtransform; }
 int getComboTransformMagicCode() { return bisDataTypes::s_combotransform; }
 int getCollectionMagicCode() { return bisDataTypes::s_collection; }
 int getSurfaceMagicCode() { return bisDataTypes::s_surface; }
+int getSparseMatrixMagicCode() { return bisDataTypes::s_sparsematrix; }
 
 
 // --------------------------------------------------------------------------------------------------------------------------------------------------------
 // Wrappers for Image operations
 // --------------------------------------------------------------------------------------------------------------------------------------------------------
 
+template <class BIS_TT> unsigned char* gaussianSmoothImageTemplate(unsigned char* input,float sigmas[3],int inmm,float radiusfactor,int vtkboundary,int debug,BIS_TT*) {
+
+  std::unique_ptr<bisSimpleImage<BIS_TT> > in_image(new bisSimpleImage<BIS_TT>("smooth_input"));
+  if (!in_image->linkIntoPointer(input))
+    return 0;
+
+  int dim[5];   in_image->getDimensions(dim);
+  float spa[5]; in_image->getSpacing(spa);
+  std::unique_ptr<bisSimpleImage<float> > out_image(new bisSimpleImage<float>("smooth_output_float"));
+  out_image->allocate(dim,spa);
+  float outsigmas[3];
+  bisImageAlgorithms::gaussianSmoothImage(in_image.get(),out_image.get(),sigmas,outsigmas,inmm,radiusfactor,vtkboundary);
+  if (debug)
+    std::cout << "outsigmas=" << outsigmas[0] << "," << outsigmas[1] << "," << outsigmas[2] << std::endl;
+  return out_image->releaseAndReturnRawArray();
+}
+
 unsigned char*  gaussianSmoothImageWASM(unsigned char* input,const char* jsonstring,int debug) {
 
   if (debug)
@@ -118,19 +153,33 @@ unsigned char*  gaussianSmoothImageWASM(unsigned char* input,const char* jsonstr
 
   if (debug)
     std::cout << "Using sigmas=" << sigmas[0] << "," << sigmas[1] << "," << sigmas[2] << std::endl;
-  
-  std::unique_ptr<bisSimpleImage<float> > in_image(new bisSimpleImage<float>("smooth_input_float"));
+
+  // Link the input in its native type (no cast copy), output is always float
+  int* header=(int*)input;
+  switch (header[1])
+    {
+      bisvtkTemplateMacro( return gaussianSmoothImageTemplate(input,sigmas,inmm,radiusfactor,vtkboundary,debug,static_cast<BIS_TT*>(0)));
+    }
+  return 0;
+}
+
+template <class BIS_TT> unsigned char* gradientImageTemplate(unsigned char* input,float sigmas[3],int inmm,float radiusfactor,int debug,BIS_TT*) {
+
+  std::unique_ptr<bisSimpleImage<BIS_TT> > in_image(new bisSimpleImage<BIS_TT>("gradient_input"));
   if (!in_image->linkIntoPointer(input))
     return 0;
 
-  std::unique_ptr<bisSimpleImage<float> > out_image(new bisSimpleImage<float>("smooth_output_float"));
-  out_image->copyStructure(in_image.get());
+  std::unique_ptr<bisSimpleImage<float> > out_image(new bisSimpleImage<float>("gradient_output_float"));
+  int dim[5];   in_image->getDimensions(dim);
+  dim[3]=dim[3]*3;
+  float spa[5]; in_image->getSpacing(spa);
+  out_image->allocate(dim,spa);
+
   float outsigmas[3];
-  bisImageAlgorithms::gaussianSmoothImage(in_image.get(),out_image.get(),sigmas,outsigmas,inmm,radiusfactor,vtkboundary);
+  bisImageAlgorithms::gradientImage(in_image.get(),out_image.get(),sigmas,outsigmas,inmm,radiusfactor);
   if (debug)
     std::cout << "outsigmas=" << outsigmas[0] << "," << outsigmas[1] << "," << outsigmas[2] << std::endl;
   return out_image->releaseAndReturnRawArray();
-
 }
 
 unsigned char*  gradientImageWASM(unsigned char* input,const char* jsonstring,int debug) {
@@ -163,23 +212,12 @@ unsigned char*  gradientImageWASM(unsigned char* input,const char* jsonstring,in
   int inmm=params->getBooleanValue("inmm");
   float radiusfactor=params->getFloatValue("radiusfactor",1.5);
 
-  
-  std::unique_ptr<bisSimpleImage<float> > in_image(new bisSimpleImage<float>("smooth_input_float"));
-  if (!in_image->linkIntoPointer(input))
-    return 0;
-
-  std::unique_ptr<bisSimpleImage<float> > out_image(new bisSimpleImage<float>("smooth_output_float"));
-  int dim[5];   in_image->getDimensions(dim);
-  dim[3]=dim[3]*3;
-  float spa[5]; in_image->getSpacing(spa);
-  out_image->allocate(dim,spa);
-
-  
-  float outsigmas[3];
-  bisImageAlgorithms::gradientImage(in_image.get(),out_image.get(),sigmas,outsigmas,inmm,radiusfactor);
-  if (debug)
-    std::cout << "outsigmas=" << outsigmas[0] << "," << outsigmas[1] << "," << outsigmas[2] << std::endl;
-  return out_image->releaseAndReturnRawArray();
+  int* header=(int*)input;
+  switch (header[1])
+    {
+      bisvtkTemplateMacro( return gradientImageTemplate(input,sigmas,inmm,radiusfactor,debug,static_cast<BIS_TT*>(0)));
+    }
+  return 0;
 }
 
 
@@ -276,6 +314,18 @@ template <class BIS_TT> unsigned char* resliceImageTemplate(unsigned char* input
                                                bounds,interpolation,backgroundValue);
   } else {
     if (debug) std::cout << "___ Reslice normal " << std::endl;
+
+    // A grid chain is evaluated once per output voxel, in parallel, and stored as a single field on the output
+    // lattice (exact at the voxels), the reslice then needs one lookup per voxel instead of the whole chain.
+    int bake=params->getBooleanValue("bake",1);
+    if (bake && resliceXform->getMagicType()==bisDataTypes::s_combotransform)
+      {
+        bisComboTransformation* combo=(bisComboTransformation*)resliceXform.get();
+        int numthreads=params->getIntValue("numthreads",4);
+        if (combo->bakeGridTransformations(dim,spa,numthreads) && debug)
+          std::cout << "___ Baked " << combo->getNumberOfGridTransformations() << " grid transformations" << std::endl;
+      }
+    
     bisImageAlgorithms::resliceImage(inp_image.get(),
                                      out_image.get(),
                                      resliceXform.get(),
@@ -489,6 +539,20 @@ unsigned char* extractImageSliceWASM(unsigned char* input,
 
 }
 
+// --------------------------------------------------------------------------------------------------------------------------------------------------------
+// In place helpers: return the input image as the output image if inplace is set, the types match and
+// the image is linked directly to the serialized input (i.e. not a cast copy), else 0
+// --------------------------------------------------------------------------------------------------------------------------------------------------------
+template <class BIS_IT,class BIS_OT> bisSimpleImage<BIS_OT>* getInPlaceOutput(bisSimpleImage<BIS_IT>* ,unsigned char* ,int ,BIS_OT*) {
+  return 0;
+}
+
+template <class BIS_TT> bisSimpleImage<BIS_TT>* getInPlaceOutput(bisSimpleImage<BIS_TT>* image,unsigned char* input,int inplace,BIS_TT*) {
+  if (inplace && image->getRawArray()==input)
+    return image;
+  return 0;
+}
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------------
 template <class BIS_TT> unsigned char* normalizeImageTemplate(unsigned char* input,bisJSONParameterList* params,int debug,BIS_TT*) {
 
@@ -506,6 +570,15 @@ template <class BIS_TT> unsigned char* normalizeImageTemplate(unsigned char* inp
   }
 
   double outdata[2];
+  bisSimpleImage<short>* inplace_image=getInPlaceOutput(inp_image.get(),input,params->getBooleanValue("inplace",0),static_cast<short*>(0));
+  if (inplace_image)
+    {
+      bisImageAlgorithms::imageNormalize(inp_image.get(),inplace_image,perlow,perhigh,outmaxvalue,outdata);
+      if (debug)
+        std::cout << "\t Normalizing Image Done (in place) : " << outdata[0] << "," << outdata[1] << std::endl;
+      return input;
+    }
+  
   std::unique_ptr<bisSimpleImage<short> > out_image(bisImageAlgorithms::imageNormalize(inp_image.get(),
 										       perlow,perhigh,outmaxvalue,outdata));
 
@@ -726,6 +799,7 @@ unsigned char* computeDisplacementFieldWASM(unsigned char* transformation,
       dim[ia]=params->getIntValue("dimensions",64,ia);
       spa[ia]=params->getFloatValue("spacing",1.0,ia);
     }
+  int numthreads=params->getIntValue("numthreads",4);
   
   if (debug)
     {
@@ -737,27 +811,16 @@ unsigned char* computeDisplacementFieldWASM(unsigned char* transformation,
       std::cout << "Mapping " << resliceXform->getClassName() << " (20,20,20) -> " << TX[0] << ", " << TX[1] << ", " << TX[2] << std::endl;
     }
 
-  std::unique_ptr< bisSimpleImage<float> > output(resliceXform->computeDisplacementField(dim,spa));
+  std::unique_ptr< bisSimpleImage<float> > output(resliceXform->computeDisplacementField(dim,spa,numthreads));
   return output->releaseAndReturnRawArray();
 }
   
 
 // ------------------------------- fMRI ------------------------
 
-unsigned char* computeGLMWASM(unsigned char* input_ptr,unsigned char* mask_ptr,unsigned char* matrix_ptr,const char* jsonstring,int debug)
+template<class BIS_TT> unsigned char* computeGLMTemplate(unsigned char* input_ptr,unsigned char* mask_ptr,unsigned char* matrix_ptr,bisJSONParameterList* params,int debug,BIS_TT*)
 {
-
-  if (debug)
-    std::cout << "_____ Beginning computeGLMJSON" << std::endl;
-  
-  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
-  if (!params->parseJSONString(jsonstring))
-    return 0;
-
-  if(debug)
-    params->print("from computeGLMJSON","_____");
-
-  std::unique_ptr<bisSimpleImage<float> > timeseries(new bisSimpleImage<float>("timeseries_json"));
+  std::unique_ptr<bisSimpleImage<BIS_TT> > timeseries(new bisSimpleImage<BIS_TT>("timeseries_json"));
   if (!timeseries->linkIntoPointer(input_ptr))
     return 0;
 
@@ -790,9 +853,33 @@ unsigned char* computeGLMWASM(unsigned char* input_ptr,unsigned char* mask_ptr,u
     }
       
   std::unique_ptr<bisSimpleImage<float > > output(bisfMRIAlgorithms::computeGLM(timeseries.get(),mask.get(),glm.get(),numtasks));
+  if (output.get()==0)
+    return 0;
   return output->releaseAndReturnRawArray();
 }
 
+unsigned char* computeGLMWASM(unsigned char* input_ptr,unsigned char* mask_ptr,unsigned char* matrix_ptr,const char* jsonstring,int debug)
+{
+
+  if (debug)
+    std::cout << "_____ Beginning computeGLMJSON" << std::endl;
+  
+  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
+  if (!params->parseJSONString(jsonstring))
+    return 0;
+
+  if(debug)
+    params->print("from computeGLMJSON","_____");
+
+  // Link the time series in its native type (no cast copy)
+  int* header=(int*)input_ptr;
+  switch (header[1])
+    {
+      bisvtkTemplateMacro( return computeGLMTemplate(input_ptr,mask_ptr,matrix_ptr,params.get(),debug,static_cast<BIS_TT*>(0)));
+    }
+  return 0;
+}
+
 // -----------------------
 // ROI Mean
 // -----------------------
@@ -1093,6 +1180,15 @@ template <class BIS_IT,class BIS_OT> unsigned char* thresholdImageTemplate(unsig
 
   }
   
+  bisSimpleImage<BIS_OT>* inplace_image=getInPlaceOutput(inp_image.get(),input,params->getBooleanValue("inplace",0),static_cast<BIS_OT*>(0));
+  if (inplace_image)
+    {
+      bisImageAlgorithms::thresholdImage(inp_image.get(),inplace_image,thresholds,replace,replacevalue);
+      if (debug)
+        std::cout << "Thresholding Done (in place)" << std::endl;
+      return input;
+    }
+
   std::unique_ptr<bisSimpleImage<BIS_OT> > out_image=bisImageAlgorithms::thresholdImage<BIS_IT,BIS_OT>(inp_image.get(),
 											thresholds,replace,replacevalue);
 
@@ -1270,6 +1366,56 @@ unsigned char* createComboTransformationTextFileWASM(unsigned char* input_ptr,in
 
 }
 
+unsigned char* compressComboTransformationWASM(unsigned char* input_ptr,const char* jsonstring,int debug)
+{
+  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
+  if (!params->parseJSONString(jsonstring))
+    return 0;
+
+  std::unique_ptr<bisComboTransformation> input(new bisComboTransformation());
+  if (!input->deSerialize(input_ptr))
+    {
+      std::cerr << "Failed to deserialize ptr for combo" << std::endl;
+      return 0;
+    }
+
+  int mode=1;
+  if (params->getBooleanValue("float16",0))
+    mode=2;
+  input->setSerializationMode(mode);
+
+  long rawsize=input->getRawSize();
+  if (debug)
+    std::cout << "Compressing combo transformation, mode=" << mode << " size=" << rawsize << std::endl;
+  
+  std::unique_ptr<bisSimpleVector<unsigned char> > outvect(new bisSimpleVector<unsigned char>("compressed_combo"));
+  outvect->allocate(rawsize);
+  input->serializeInPlace(outvect->getData());
+  return outvect->releaseAndReturnRawArray();
+}
+
+unsigned char* decompressComboTransformationWASM(unsigned char* input_ptr,int debug)
+{
+  std::unique_ptr<bisSimpleVector<unsigned char> > s_vector(new bisSimpleVector<unsigned char>("compressed_combo"));
+  if (!s_vector->linkIntoPointer(input_ptr))
+    {
+      std::cerr << "Failed to deserialize compressed combo vector" << std::endl;
+      return 0;
+    }
+
+  std::unique_ptr<bisComboTransformation> output(new bisComboTransformation());
+  if (!output->deSerialize(s_vector->getData()))
+    {
+      std::cerr << "Failed to deserialize compressed combo transformation" << std::endl;
+      return 0;
+    }
+
+  if (debug)
+    std::cout << "Decompressed combo transformation with " << output->getNumberOfGridTransformations() << " grids" << std::endl;
+  
+  return output->serialize();
+}
+
 
 
 /** Crop an image using \link bisImageAlgorithms::cropImage \endlink
@@ -1364,6 +1510,15 @@ template <class BIS_TT> unsigned char* flipImageTemplate(unsigned char* input,bi
     std::cout << "Flip Axis: " << flip[0] << ", " << flip[1] << ", " << flip[2] << std::endl;
   }
   
+  bisSimpleImage<BIS_TT>* inplace_image=getInPlaceOutput(inp_image.get(),input,params->getBooleanValue("inplace",0),static_cast<BIS_TT*>(0));
+  if (inplace_image)
+    {
+      bisImageAlgorithms::flipImage(inp_image.get(),inplace_image,flip);
+      if (debug)
+        std::cout << "Fliping Done (in place)" << std::endl;
+      return input;
+    }
+  
   std::unique_ptr<bisSimpleImage<BIS_TT> > out_image=bisImageAlgorithms::flipImage(inp_image.get(),flip);
   if (debug)
     std::cout << "Fliping Done" << std::endl;
@@ -1422,6 +1577,15 @@ template <class BIS_TT> unsigned char* blankImageTemplate(unsigned char* input,b
     std::cout << " outside=" << outside << std::endl;
   }
   
+  bisSimpleImage<BIS_TT>* inplace_image=getInPlaceOutput(inp_image.get(),input,params->getBooleanValue("inplace",0),static_cast<BIS_TT*>(0));
+  if (inplace_image)
+    {
+      bisImageAlgorithms::blankImage(inp_image.get(),inplace_image,bounds,outside);
+      if (debug)
+        std::cout << "Blanking Done (in place)" << std::endl;
+      return input;
+    }
+  
   std::unique_ptr<bisSimpleImage<BIS_TT> > out_image=bisImageAlgorithms::blankImage(inp_image.get(),bounds,outside);
 
   if (debug)
@@ -1564,6 +1728,15 @@ template <class BIS_IT,class BIS_OT> unsigned char* shiftScaleImageTemplate(unsi
     std::cout << "Shift=" << shift << ", scale=" << scale << std::endl;
   }
 
+  bisSimpleImage<BIS_OT>* inplace_image=getInPlaceOutput(inp_image.get(),input,params->getBooleanValue("inplace",0),static_cast<BIS_OT*>(0));
+  if (inplace_image)
+    {
+      bisImageAlgorithms::shiftScaleImage(inp_image.get(),inplace_image,shift,scale);
+      if (debug)
+        std::cout << "Shift+Scale Done (in place)" << std::endl;
+      return input;
+    }
+
   std::unique_ptr<bisSimpleImage<BIS_OT> > out_image=bisImageAlgorithms::shiftScaleImage<BIS_IT,BIS_OT>(inp_image.get(),shift,scale);
 
   
@@ -1768,13 +1941,26 @@ unsigned char* computeSeedCorrelationImageWASM(unsigned char* input_ptr,unsigned
  * @param debug if > 0 print debug messages
  * @returns a pointer to a (unsigned char) serialized timeseries normalized image
  */
-// BIS: { 'timeSeriesNormalizeImageWASM', 'bisImage', [ 'bisImage', 'debug' ] } 
-unsigned char* timeSeriesNormalizeImageWASM(unsigned char* input,int debug) {
+// BIS: { 'timeSeriesNormalizeImageWASM', 'bisImage', [ 'bisImage', 'ParamObj', 'debug' ] } 
+unsigned char* timeSeriesNormalizeImageWASM(unsigned char* input,const char* jsonstring,int debug) {
+
+  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
+  if (!params->parseJSONString(jsonstring))
+    return 0;
 
   std::unique_ptr<bisSimpleImage<float> > in_image(new bisSimpleImage<float>("input_float"));
   if (!in_image->linkIntoPointer(input))
     return 0;
 
+  bisSimpleImage<float>* inplace_image=getInPlaceOutput(in_image.get(),input,params->getBooleanValue("inplace",0),static_cast<float*>(0));
+  if (inplace_image)
+    {
+      int ok=bisfMRIAlgorithms::normalizeTimeSeriesImage(in_image.get(),inplace_image);
+      if (debug)
+        std::cout << "timeSeriesNormalizeImage done (in place) " << ok << std::endl;
+      return input;
+    }
+
   std::unique_ptr<bisSimpleImage<float> > out_image(new bisSimpleImage<float>("smooth_output_float"));
   out_image->copyStructure(in_image.get());
 
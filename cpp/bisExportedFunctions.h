@@ -52,9 +52,28 @@ extern "C" {
    */
   BISEXPORT void set_large_memory_mode(int m);
 
+  /** 
+   *  Set Pooled memory mode (recycles large buffers, useful for long running python sessions)
+   * @param m if > 0 enable the pool
+   * @param limitmb if > 0 sets the maximum size of the pool in MB
+   */
+  BISEXPORT void set_pool_memory_mode(int m,int limitmb);
+
+  /** release all memory cached by the pool */
+  BISEXPORT void release_pool_memory();
+
   /** print current state of allocated objects */
   BISEXPORT void print_memory();
 
+  /** Set the number of threads of the global thread pool (see bisThreadPool)
+   * @param n number of threads (0 = number of hardware cores)
+   * @returns the new number of threads
+   */
+  BISEXPORT int set_num_threads(int n);
+
+  /** @returns the number of threads of the global thread pool */
+  BISEXPORT int get_num_threads();
+
   /** delete all allocated objects (allocate via bisMemoryManagement) */
   BISEXPORT void delete_all_memory();
 
@@ -94,6 +113,9 @@ extern "C" {
   /** @returns Magic Code for Serialized Object Collection */
   BISEXPORT int getSurfaceMagicCode();
 
+  /** @returns Magic Code for Serialized CSR Sparse Matrix */
+  BISEXPORT int getSparseMatrixMagicCode();
+
   // -----------------------------------
   // Functions
   // -----------------------------------
@@ -141,6 +163,24 @@ extern "C" {
   // BIS: { 'createComboTransformationTextFileWASM', 'String', [ 'bisComboTransformation', 'debug' ] }  
   BISEXPORT unsigned char* createComboTransformationTextFileWASM(unsigned char* input,int debug);
 
+  /** return a compressed binary version of a combo transformation (zero-run compression of the grid displacements, optionally float16)
+   * see \link bisGridTransformation::setSerializationMode \endlink
+   * @param input serialized input combo transformation as unsigned char array 
+   * @param jsonstring the parameter string for this algorithm { "float16" : false }
+   * @param debug if > 0 print debug messages
+   * @returns a pointer to a serialized unsigned char vector containing the compressed combo transformation
+   */
+  // BIS: { 'compressComboTransformationWASM', 'Vector', [ 'bisComboTransformation', 'ParamObj', 'debug' ] }  
+  BISEXPORT unsigned char* compressComboTransformationWASM(unsigned char* input,const char* jsonstring,int debug);
+
+  /** return a combo transformation from its compressed binary version (created by compressComboTransformationWASM)
+   * @param input serialized unsigned char vector containing the compressed combo transformation
+   * @param debug if > 0 print debug messages
+   * @returns a pointer to a serialized bisComboTransformation 
+   */
+  // BIS: { 'decompressComboTransformationWASM', 'bisComboTransformation', [ 'Vector', 'debug' ] }  
+  BISEXPORT unsigned char* decompressComboTransformationWASM(unsigned char* input,int debug);
+
   /** return a matrix with a qform description from an sform desription (NIFTI-1 code)
    * @param input serialized input 4x4 Matrix as unsigned char array 
    * @param debug if > 0 print debug messages
@@ -167,10 +207,16 @@ extern "C" {
   // BIS: { 'extractImageSliceWASM', 'bisImage', [ 'bisImage', 'ParamObj', 'debug' ] } 
   BISEXPORT unsigned char* extractImageSliceWASM(unsigned char* input,const char* jsonstring,int debug);
 
+
+  // In place operation: the elementwise filters below (normalize, threshold, shiftScale, flip, blank and
+  // timeSeriesNormalize) accept "inplace" : true. If the output type matches the input type the result is
+  // written into the input buffer and the input pointer itself is returned (no new allocation). The caller
+  // must own the input pointer (allocated by this library) and must release it only once, as the output.
+  // The JS and Python wrappers support this, the Matlab wrappers always set "inplace" to false.
   
   /** Normalize image using \link bisImageAlgorithms::imageNormalize \endlink
    * @param input serialized input as unsigned char array 
-   * @param jsonstring the parameter string for the algorithm { "perlow" : 0.0 , "perhigh" : 1.0, "outmaxvalue" : 1024 }
+   * @param jsonstring the parameter string for the algorithm { "perlow" : 0.0 , "perhigh" : 1.0, "outmaxvalue" : 1024, "inplace" : false } (inplace only if input is short)
    * @param debug if > 0 print debug messages
    * @returns a pointer to a normalized image
    */
@@ -180,7 +226,7 @@ extern "C" {
 
   /** Threshold image using \link bisImageAlgorithms::thresholdImage \endlink
    * @param input serialized input as unsigned char array 
-   * @param jsonstring the parameter string for the algorithm { "low" : 50.0, "high": 100, "replacein" :  true, "replaceout" : false, "invalue: 100.0 , "outvalue" : 0.0, "datatype: -1 }, (datatype=-1 same as input)
+   * @param jsonstring the parameter string for the algorithm { "low" : 50.0, "high": 100, "replacein" :  true, "replaceout" : false, "invalue: 100.0 , "outvalue" : 0.0, "datatype: -1, "inplace" : false }, (datatype=-1 same as input)
    * @param debug if > 0 print debug messages
    * @returns a pointer to a serialized image
    */
@@ -189,7 +235,7 @@ extern "C" {
 
   /** ShiftScale image using \link bisImageAlgorithms::shiftScaleImage \endlink
    * @param input serialized input as unsigned char array 
-   * @param jsonstring the parameter string for the algorithm { "shift" : 0.0, "scale": 1.0, "datatype: -1 }, (datatype=-1 same as input)
+   * @param jsonstring the parameter string for the algorithm { "shift" : 0.0, "scale": 1.0, "datatype: -1, "inplace" : false }, (datatype=-1 same as input)
    * @param debug if > 0 print debug messages
    * @returns a pointer to a serialized image
    */
@@ -227,7 +273,9 @@ extern "C" {
   /** Reslice image using \link bisImageAlgorithms::resliceImage \endlink
    * @param input serialized input as unsigned char array 
    * @param transformation serialized transformation as unsigned char array 
-   * @param jsonstring the parameter string for the algorithm  { int interpolation=3, 1 or 0, float backgroundValue=0.0; int ouddim[3], int outspa[3], int bounds[6] = None, int numthreads=2 -- use out image size }
+   * @param jsonstring the parameter string for the algorithm  { int interpolation=3, 1 or 0, float backgroundValue=0.0; int ouddim[3], int outspa[3], int bounds[6] = None, int numthreads=2 -- use out image size, bool bake=true }
+   * bake: if the transformation is a combo transformation its grids are composed into one field on the output lattice first
+   *  (see bisComboTransformation::bakeGridTransformations), only used if no bounds are given
    * @param debug if > 0 print debug messages
    * @returns a pointer to a serialized image
    */
@@ -251,7 +299,7 @@ extern "C" {
   
   /** Flip an image using \link bisImageAlgorithms::flipImage \endlink
    * @param input serialized input as unsigned char array 
-   * @param jsonstring the parameter string for the algorithm { "flipi" : 0, "flipj" : 0 , "flipk" : 0 }
+   * @param jsonstring the parameter string for the algorithm { "flipi" : 0, "flipj" : 0 , "flipk" : 0, "inplace" : false }
    * @param debug if > 0 print debug messages
    * @returns a pointer to a serialized image
    */
@@ -262,7 +310,7 @@ extern "C" {
   /** Blank an image using \link bisImageAlgorithms::blankImage \endlink
    * @param input serialized input as unsigned char array 
    * @param jsonstring the parameter string for the algorithm 
-   * { "i0" : 0: ,"i1" : 100, "j0" : 0: ,"j1" : 100,"k0" : 0: ,"k1" : 100, "outside" : 0 }
+   * { "i0" : 0: ,"i1" : 100, "j0" : 0: ,"j1" : 100,"k0" : 0: ,"k1" : 100, "outside" : 0, "inplace" : false }
    * @param debug if > 0 print debug messages
    * @returns a pointer to a serialized image
    */
@@ -313,7 +361,7 @@ extern "C" {
   /** Compute Displacement Field 
    * @param transformation the transformation to use to compute a displacement field
    * @param jsonstring the parameter string for the algorithm 
-   *   { "dimensions":  [ 8,4,4 ], "spacing": [ 2.0,2.5,2.5 ] };
+   *   { "dimensions":  [ 8,4,4 ], "spacing": [ 2.0,2.5,2.5 ], "numthreads" : 4 };
    * @param debug if > 0 print debug messages
    * @returns a pointer to the displacement field image (bisSimpleImage<float>)
    */
@@ -445,11 +493,12 @@ extern "C" {
 
   /** Perform time series normalization 
    * @param input 4d image
+   * @param jsonstring the parameter string for the algorithm { "inplace" : false } (inplace only if input is float)
    * @param debug if > 0 print debug messages
    * @returns a pointer to a (unsigned char) serialized timeseries normalized image
    */
-  // BIS: { 'timeSeriesNormalizeImageWASM', 'bisImage', [ 'bisImage', 'debug' ] } 
-  BISEXPORT unsigned char* timeSeriesNormalizeImageWASM(unsigned char* input,int debug);
+  // BIS: { 'timeSeriesNormalizeImageWASM', 'bisImage', [ 'bisImage', 'ParamObj', 'debug' ] } 
+  BISEXPORT unsigned char* timeSeriesNormalizeImageWASM(unsigned char* input,const char* jsonstring,int debug);
 
   /** Transform a surface using a transformation
    * @param input surface
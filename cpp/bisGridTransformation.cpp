@@ -20,6 +20,7 @@
 #include "math.h"
 #include <iostream>
 #include <sstream>
+#include <string.h>
 
 bisGridTransformation::bisGridTransformation(std::string n) : bisAbstractTransformation(n) {
 
@@ -34,6 +35,11 @@ bisGridTransformation::bisGridTransformation(std::string n) : bisAbstractTransfo
   this->dobspline_interpolation=1;
   this->magic_type=bisDataTypes::s_gridtransform;
   this->grid_vol_size=0;
+  this->modification_count=0;
+  this->serialization_mode=0;
+  this->encoded_size=0;
+  this->encoded_mode=0;
+  this->encoded_modification_count=0;
   this->class_name="bisGridTransformation";
 }
 
@@ -61,6 +67,7 @@ void bisGridTransformation::initializeGrid(int dim[3],float spa[3],float origin[
   this->grid_vol_size=this->grid_slice_size*this->grid_dimensions[2];
 
   this->dobspline_interpolation=(dobspline>0);
+  this->modification_count++;
 
   /* std::cout << "Grid Initialized dim= " << this->grid_dimensions[0] << "," << this->grid_dimensions[1] << "," << this->grid_dimensions[2] << std::endl;
   std::cout << "Grid Initialized spa=" << this->grid_spacing[0] << "," << this->grid_spacing[1] << "," << this->grid_spacing[2] << std::endl;
@@ -77,6 +84,7 @@ void bisGridTransformation::identity()
   if (this->grid_vol_size==0)
     return;
   this->displacementField->fill(0.0);
+  this->modification_count++;
 }
 
 unsigned int bisGridTransformation::getNumberOfDOF()
@@ -150,6 +158,26 @@ void bisGridTransformation::transformPointLinearInterpolation(float X[3],float T
   
 
 
+void bisGridTransformation::computeBSplineWeights(float x,int axis,int B[4],double W[4])
+{
+  float p= (x-this->grid_origin[axis])/this->grid_spacing[axis];
+
+  B[1]=int(p);
+  float t=p-B[1];
+
+  B[0]=B[1]-1;
+  B[2]=B[1]+1;
+  B[3]=B[1]+2;
+      
+  for (int ib=0;ib<=3;ib++)
+    B[ib]=bisUtil::irange(B[ib],0,this->minusdim[axis]);
+      
+  W[0]=pow(1.0-t,3.0)/6.0;
+  W[1]=(3.0*t*t*t - 6.0*t*t + 4.0)/6.0;
+  W[2]=(-3.0*t*t*t + 3.0*t*t + 3.0*t + 1.0)/6.0;
+  W[3]=(t*t*t)/6.0;
+}
+
 void bisGridTransformation::transformPointBSplineInterpolation(float X[3],float TX[3])
 {
 
@@ -161,25 +189,7 @@ void bisGridTransformation::transformPointBSplineInterpolation(float X[3],float
   double W[3][4];
   
   for (int ia=0;ia<=maxcoord;ia++)
-    {
-      float p= (X[ia]-this->grid_origin[ia])/this->grid_spacing[ia];
-
-      B[ia][1]=int(p);
-      float t=p-B[ia][1];
-
-      B[ia][0]=B[ia][1]-1;
-      B[ia][2]=B[ia][1]+1;
-      B[ia][3]=B[ia][1]+2;
-      
-      for (int ib=0;ib<=3;ib++)
-        B[ia][ib]=bisUtil::irange(B[ia][ib],0,this->minusdim[ia]);
-      
-      W[ia][0]=pow(1.0-t,3.0)/6.0;
-      W[ia][1]=(3.0*t*t*t - 6.0*t*t + 4.0)/6.0;
-      W[ia][2]=(-3.0*t*t*t + 3.0*t*t + 3.0*t + 1.0)/6.0;
-      W[ia][3]=(t*t*t)/6.0;
-
-    }
+    this->computeBSplineWeights(X[ia],ia,B[ia],W[ia]);
 
   
   for (int ia=0;ia<=3;ia++)
@@ -209,9 +219,10 @@ void bisGridTransformation::transformPointBSplineInterpolation(float X[3],float
      for (int coord=0;coord<=1;coord++)
        {
          double sum=X[coord];
+         int offset=coord*this->grid_vol_size;
          for (int ja=0;ja<=3;ja++)  {
            for (int ia=0;ia<=3;ia++) {
-             sum+=W[1][ja]*W[0][ia]*data[B[1][ja]+B[0][ia]];
+             sum+=W[1][ja]*W[0][ia]*data[offset+B[1][ja]+B[0][ia]];
            }
          }
          TX[coord]=(float)sum;
@@ -245,6 +256,80 @@ void bisGridTransformation::transformPoint(float x[3],float y[3])
   
 }
 
+void bisGridTransformation::computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3])
+{
+  if (this->grid_vol_size<1 || this->dobspline_interpolation==0)
+    {
+      bisAbstractTransformation::computeDisplacementRow(spa,j,k,imin,imax,out);
+      return;
+    }
+
+  int maxcoord=2;
+  if (this->grid_dimensions[2]<2)
+    maxcoord=1;
+
+  // Weights along y and z are constant for the whole row
+  int B[3][4];
+  double W[3][4];
+  this->computeBSplineWeights(j*spa[1],1,B[1],W[1]);
+  if (maxcoord==2)
+    {
+      this->computeBSplineWeights(k*spa[2],2,B[2],W[2]);
+    }
+  else
+    {
+      // Single slice grid, only the first z-term is used with weight 1
+      for (int ia=0;ia<=3;ia++)
+        {
+          B[2][ia]=0;
+          W[2][ia]=0.0;
+        }
+      W[2][0]=1.0;
+    }
+
+  // Range of control point columns touched by this row
+  int BX[4];
+  double WX[4];
+  this->computeBSplineWeights(imin*spa[0],0,BX,WX);
+  int gmin=BX[0];
+  this->computeBSplineWeights(imax*spa[0],0,BX,WX);
+  int gmax=BX[3];
+  int ncols=gmax-gmin+1;
+
+  // Collapse the grid along y and z to a line of control points for each component
+  std::vector<double> line(3*ncols,0.0);
+  float* data=this->displacementField->getData();
+  int numz=(maxcoord==2) ? 4 : 1;
+  for (int coord=0;coord<=maxcoord;coord++)
+    {
+      double* linep=&line[coord*ncols];
+      float* cdata=&data[coord*this->grid_vol_size+gmin];
+      for (int ka=0;ka<numz;ka++)
+        for (int ja=0;ja<=3;ja++)
+          {
+            double w=W[2][ka]*W[1][ja];
+            float* rowp=&cdata[B[2][ka]*this->grid_slice_size+B[1][ja]*this->grid_dimensions[0]];
+            for (int gi=0;gi<ncols;gi++)
+              linep[gi]+=w*rowp[gi];
+          }
+    }
+
+  // Now each voxel only needs the four x-weights
+  int offset=0;
+  for (int i=imin;i<=imax;i++)
+    {
+      this->computeBSplineWeights(i*spa[0],0,BX,WX);
+      for (int coord=0;coord<=maxcoord;coord++)
+        {
+          double* linep=&line[coord*ncols];
+          out[coord][offset]=(float)(WX[0]*linep[BX[0]-gmin]+WX[1]*linep[BX[1]-gmin]+
+                                     WX[2]*linep[BX[2]-gmin]+WX[3]*linep[BX[3]-gmin]);
+        }
+      if (maxcoord==1)
+        out[2][offset]=0.0f;
+      ++offset;
+    }
+}
 
 int bisGridTransformation::setParameterVector(std::vector<float>& params)
 {
@@ -258,6 +343,7 @@ int bisGridTransformation::setParameterVector(std::vector<float>& params)
   float* dispfield=this->displacementField->getData();
   for (unsigned int i=0;i<params.size();i++)
     dispfield[i]=params[i];
+  this->modification_count++;
   return 1;
 }
 
@@ -340,6 +426,7 @@ float bisGridTransformation::computeGradientForOptimization(std::vector<float>&
           
                   int index=cp_index+coord*nc;
                   dispfield[index]=params[index]+stepsize;
+                  this->modification_count++;
                   /*          if (cp_index==debug_index)
                               {
                               this->transformPoint(X,TX);
@@ -347,6 +434,7 @@ float bisGridTransformation::computeGradientForOptimization(std::vector<float>&
                               }*/
                   float a=optimizable->computeValueFunctionPiece(this,bounds,cp_index);
                   dispfield[index]=params[index]-stepsize;
+                  this->modification_count++;
                   /*          if (cp_index==debug_index)
                               {
                               this->transformPoint(X,TX);
@@ -354,6 +442,7 @@ float bisGridTransformation::computeGradientForOptimization(std::vector<float>&
                               }*/
                   float b=optimizable->computeValueFunctionPiece(this,bounds,cp_index);
                   dispfield[index]=params[index];
+                  this->modification_count++;
 
                   /*          if (cp_index==debug_index)
                               {
@@ -476,18 +565,129 @@ float bisGridTransformation::getTotalBendingEnergy()
 // ----------------------------------------------------
 
     
-long bisGridTransformation::getRawSize()
+BISLONG bisGridTransformation::getRawSize()
 {
   // Header
   // 8 bytes raw
   // actual header
   // 3x4 -- interp mode (int[1] 4), dimensions, int[3]x4 spacing float[3]x4 origin float[3]x4  = 40
   // raw bytes = num control points *3 * 4
+  // compressed modes add 4 bytes (encoding) to the header and store the encoded bytes instead
+  if (this->serialization_mode>0)
+    {
+      if (this->encoded_mode!=this->serialization_mode ||
+          this->encoded_modification_count!=this->modification_count)
+        {
+          this->encoded_size=this->encodeCompressedData(0,this->serialization_mode==2);
+          this->encoded_mode=this->serialization_mode;
+          this->encoded_modification_count=this->modification_count;
+        }
+      return 16+44+this->encoded_size;
+    }
+  
   long databytes=4*3*this->grid_dimensions[0]*this->grid_dimensions[1]*this->grid_dimensions[2];
   int headerbytes=16+40;
   return  databytes+headerbytes;
 }
 
+// Compressed layout (after the 16 byte header and 40 byte grid header + 4 bytes for the encoding)
+// a sequence of [ uint32 number of zeros, uint32 number of literals, literals (float32 or float16) ]
+// covering all 3*number of control points values. Read and written with memcpy as float16
+// literals break 4-byte alignment.
+long bisGridTransformation::encodeCompressedData(unsigned char* output,int usehalf,long capacity)
+{
+  long n=3*(long)this->grid_vol_size;
+  if (n<1)
+    return 0;
+  
+  float* data=this->displacementField->getData();
+  int literalsize=4;
+  if (usehalf)
+    literalsize=2;
+
+  long numbytes=0;
+  long index=0;
+  while (index<n)
+    {
+      unsigned int zeros=0,literals=0;
+      // In half mode values that round to zero are zero
+      while (index+zeros<n && (usehalf ? ((bisUtil::floatToHalf(data[index+zeros]) & 0x7FFF)==0) : (data[index+zeros]==0.0f)))
+        zeros++;
+      long start=index+zeros;
+      while (start+literals<n && (usehalf ? ((bisUtil::floatToHalf(data[start+literals]) & 0x7FFF)!=0) : (data[start+literals]!=0.0f)))
+        literals++;
+
+      if (output && capacity>=0 && numbytes+8+long(literals)*literalsize>capacity)
+        return -1;
+
+      if (output)
+        {
+          unsigned char* p=output+numbytes;
+          memcpy(p,&zeros,4);
+          memcpy(p+4,&literals,4);
+          p+=8;
+          for (unsigned int ia=0;ia<literals;ia++)
+            {
+              if (usehalf)
+                {
+                  unsigned short h=bisUtil::floatToHalf(data[start+ia]);
+                  memcpy(p,&h,2);
+                }
+              else
+                {
+                  memcpy(p,&data[start+ia],4);
+                }
+              p+=literalsize;
+            }
+        }
+      numbytes+=8+literals*literalsize;
+      index=start+literals;
+    }
+  return numbytes;
+}
+
+int bisGridTransformation::decodeCompressedData(unsigned char* input,long numbytes,int usehalf)
+{
+  long n=3*(long)this->grid_vol_size;
+  float* data=this->displacementField->getData();
+  int literalsize=4;
+  if (usehalf)
+    literalsize=2;
+
+  long index=0;
+  long offset=0;
+  while (offset+8<=numbytes)
+    {
+      unsigned int zeros,literals;
+      memcpy(&zeros,input+offset,4);
+      memcpy(&literals,input+offset+4,4);
+      offset+=8;
+      if (index+zeros+literals>n || offset+literals*literalsize>numbytes)
+        return 0;
+      
+      for (unsigned int ia=0;ia<zeros;ia++)
+        data[index++]=0.0f;
+      
+      unsigned char* p=input+offset;
+      for (unsigned int ia=0;ia<literals;ia++)
+        {
+          if (usehalf)
+            {
+              unsigned short h;
+              memcpy(&h,p,2);
+              data[index++]=bisUtil::halfToFloat(h);
+            }
+          else
+            {
+              memcpy(&data[index++],p,4);
+            }
+          p+=literalsize;
+        }
+      offset+=literals*literalsize;
+    }
+  return (index==n);
+}
+
 void bisGridTransformation::serializeInPlace(unsigned char* pointer)
 {
   int* begin_int=(int*)pointer;
@@ -496,6 +696,13 @@ void bisGridTransformation::serializeInPlace(unsigned char* pointer)
   begin_int[2]=40;
   begin_int[3]=this->grid_vol_size*12;
 
+  if (this->serialization_mode>0)
+    {
+      begin_int[1]=bisDataTypes::b_uint8;
+      begin_int[2]=44;
+      begin_int[3]=this->getRawSize()-60;
+    }
+
   int* i_head=(int*)(pointer+16);
   float* f_head=(float*)(pointer+32);
 
@@ -507,6 +714,28 @@ void bisGridTransformation::serializeInPlace(unsigned char* pointer)
       f_head[ia+3]=this->grid_origin[ia];
     }
 
+  if (this->serialization_mode>0)
+    {
+      // The buffer was allocated with getRawSize(). A write through getData() after that call is not seen by the
+      // cached size, so never write past it: store the raw grid instead if it fits, else an invalid header
+      long capacity=begin_int[3];
+      int* e_head=(int*)(pointer+56);
+      e_head[0]=this->serialization_mode;
+      if (this->encodeCompressedData(pointer+60,this->serialization_mode==2,capacity)>=0)
+        return;
+
+      this->encoded_mode=0;
+      if (long(this->grid_vol_size)*12>capacity+4)
+        {
+          std::cerr << "---- Grid changed after getRawSize (not enough space to serialize), call modified() after writing through getData()" << std::endl;
+          begin_int[0]=0;
+          return;
+        }
+      begin_int[1]=bisDataTypes::b_float32;
+      begin_int[2]=40;
+      begin_int[3]=this->grid_vol_size*12;
+    }
+
   int databytes=begin_int[3];
   bisMemoryManagement::copy_memory(pointer+56,(unsigned char*)(this->displacementField->getData()),databytes);
   //  for (int i=10;i<=11;i++)
@@ -521,7 +750,10 @@ int bisGridTransformation::deSerialize(unsigned char* pointer)
   //  int data_type=begin_int[1];
   int header_size=begin_int[2];
   int data_size=begin_int[3];
-  if (incoming_magic_type!=this->magic_type || begin_int[1]!=bisDataTypes::b_float32 || header_size!=40  )
+
+  int compressed=(begin_int[1]==bisDataTypes::b_uint8 && header_size==44);
+  
+  if (incoming_magic_type!=this->magic_type || ( compressed==0 && ( begin_int[1]!=bisDataTypes::b_float32 || header_size!=40 )))
     {
       std::cerr << "Bad Magic Type or not float or bad header size. Can not deserialize pointer as bisGridTransform " << std::endl;
       return 0;
@@ -535,6 +767,20 @@ int bisGridTransformation::deSerialize(unsigned char* pointer)
   float spa[3] = { f_head[0],f_head[1], f_head[2] };
   float ori[3] = { f_head[3],f_head[4], f_head[5] };
   int volsize_inbytes=dim[0]*dim[1]*dim[2]*12;
+
+  if (compressed)
+    {
+      int mode=((int*)(pointer+56))[0];
+      this->initializeGrid(dim,spa,ori,interp_mode);
+      if (mode<1 || mode>2 || !this->decodeCompressedData(pointer+60,data_size,mode==2))
+        {
+          std::cerr << "Bad compressed data .. can not deserialize pointer as bisGridTransform " << std::endl;
+          return 0;
+        }
+      this->modification_count++;
+      return 1;
+    }
+  
   if (data_size!=volsize_inbytes)
     {
       std::cerr << "Not enough data .. can not deserialize pointer as bisGridTransform " << std::endl;
@@ -547,6 +793,7 @@ int bisGridTransformation::deSerialize(unsigned char* pointer)
 
   float* data=this->displacementField->getData();
   bisMemoryManagement::copy_memory((unsigned char*)data,(pointer+56),volsize_inbytes);
+  this->modification_count++;
 
   return 1;
 }
@@ -613,6 +860,7 @@ int bisGridTransformation::textParse(std::vector<std::string>& lines,int& offset
         data[i+ia*np]=dx[ia];
       offset+=1;
     }
+  this->modification_count++;
 
   return 1;
 }
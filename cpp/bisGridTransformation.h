@@ -59,6 +59,15 @@ class bisGridTransformation : public bisAbstractTransformation {
   /** returns 1 if using bspline interpolation or 0 if linear */
   int getBSplineMode();
 
+  /** returns a counter that is incremented every time the grid is changed via initializeGrid, identity,
+   * setParameterVector, deSerialize, textParse or getData() (which hands out the mutable displacements).
+   * This is used to invalidate the cached compressed size and the baked displacement field of bisComboTransformation.
+   * Call modified() after writing through a pointer from getData() if the grid was serialized or baked in between. */
+  unsigned long getModificationCount() { return this->modification_count; }
+
+  /** marks the grid as modified (increments the modification count), call this after writing through getData() */
+  void modified() { this->modification_count++; }
+
   /** Sets the underlying displacement grid to zero */
   virtual void identity();
 
@@ -69,6 +78,13 @@ class bisGridTransformation : public bisAbstractTransformation {
    */
   virtual void transformPoint(float x[3],float y[3]);
 
+  /** computes the displacements for a row of voxels. For b-spline grids this exploits the
+   * separability of the tensor b-spline: the y and z weights are fixed along a row, so the grid is first
+   * collapsed to a single line of control points and each voxel then needs only 4 x-weights per component.
+   * See \link bisAbstractTransformation::computeDisplacementRow \endlink for parameters.
+   */
+  virtual void computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3]);
+
 
   /** Initialize Grid to given dimensions, spacing ,origin and interpolation mode
    * @param dim grid dimensions (but will be increased if < 4 in any direction)
@@ -125,11 +141,25 @@ class bisGridTransformation : public bisAbstractTransformation {
    */
   virtual void serializeInPlace(unsigned char* output);
 
-  /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize();
+  /** returns size needed to serialize this object in bytes. In the compressed modes the encoded size
+   * is cached until the grid is modified (see getModificationCount()) or the mode changes */
+  virtual BISLONG getRawSize();
+
+  /** Sets the binary serialization mode used by serializeInPlace and getRawSize.
+   * Mode 0 is the default raw float32 format (this is what the JS code reads).
+   * Modes 1 and 2 store the displacements as alternating runs of zeros and literal values
+   * (float32 for mode=1, float16 for mode=2). Near-identity regions of large grids are mostly zero
+   * so this shrinks archives of many high resolution grids substantially.
+   * deSerialize detects the mode automatically (and leaves the mode of this object unchanged).
+   * @param mode 0=raw float32, 1=zero-run compressed float32, 2=zero-run compressed float16
+   */
+  void setSerializationMode(int mode) { this->serialization_mode=bisUtil::irange(mode,0,2); }
+
+  /** Returns the current serialization mode (see setSerializationMode) */
+  int getSerializationMode() { return this->serialization_mode; }
 
-  /** returns raw data as float pointer */
-  virtual float* getData() { return displacementField->getData(); }
+  /** returns raw data as float pointer, the grid counts as modified (see getModificationCount) */
+  virtual float* getData() { this->modification_count++; return displacementField->getData(); }
 
 
   /** serialize to Text 
@@ -184,12 +214,49 @@ protected:
   /** Interpolation flag */
   int dobspline_interpolation;
 
+  /** Modification counter, see getModificationCount() */
+  unsigned long modification_count;
+
+  /** Binary serialization mode, see setSerializationMode() */
+  int serialization_mode;
+
+  /** Cached encoded size (bytes) for the compressed modes, see getRawSize() */
+  long encoded_size;
+
+  /** Serialization mode and modification count at which encoded_size was computed (mode=0 means none) */
+  int encoded_mode;
+  unsigned long encoded_modification_count;
+
+  /** Encode the displacements as runs of zeros and literals (used for serialization modes 1 and 2)
+   * @param output the place to store the encoded data (if 0 only the size is computed)
+   * @param usehalf if 1 literals are stored as float16 else as float32
+   * @param capacity if >=0 the size of output in bytes, nothing is written past it
+   * @returns the number of bytes of the encoded data (-1 if it does not fit in capacity)
+   */
+  long encodeCompressedData(unsigned char* output,int usehalf,long capacity=-1);
+
+  /** Decode the displacements from runs of zeros and literals (inverse of encodeCompressedData)
+   * @param input the encoded data
+   * @param numbytes the size of the encoded data in bytes
+   * @param usehalf if 1 literals are stored as float16 else as float32
+   * @returns 1 if success, 0 if the data is inconsistent with the grid size
+   */
+  int decodeCompressedData(unsigned char* input,long numbytes,int usehalf);
+
   /** transform X -> TX using linear interpolation */
   void transformPointLinearInterpolation(float X[3],float TX[3]);
 
   /** transform X -> TX using b-spline interpolation */
   void transformPointBSplineInterpolation(float X[3],float TX[3]);
 
+  /** compute the cubic b-spline control point indices and weights along one axis
+   * @param x the coordinate (mm) along the axis
+   * @param axis the axis (0,1,2)
+   * @param B output control point indices (clamped to the grid)
+   * @param W output weights
+   */
+  void computeBSplineWeights(float x,int axis,int B[4],double W[4]);
+
   /** Get Pointer to value of grid at control point (i,j,k) */
   float* getGridPointer(float* basepointer,int i,int j,int k);
 
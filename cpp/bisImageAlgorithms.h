@@ -22,8 +22,10 @@
 #include "bisDataTypes.h"
 #include "bisSimpleDataStructures.h"
 #include "bisAbstractTransformation.h"
+#include "bisImageStream.h"
 #include "bisUtil.h"
 #include "bisEigenUtil.h"
+#include "bisSIMD.h"
 #include "math.h"
 #include <vector>
 
@@ -67,6 +69,16 @@ namespace bisImageAlgorithms {
    */
   template<class IT,class OT> std::unique_ptr<bisSimpleImage<OT> >  thresholdImage(bisSimpleImage<IT>* input,float thresholds[2],int replace[3],OT replacevalues[2]);
 
+  /** thresholds an image storing the result in an existing output (see above for the parameters)
+   * @param input the input image
+   * @param output the output image (same dimensions as input). If IT=OT this can be the input image itself (in place operation)
+   * @param thresholds the lower and upper threshold , if intensity is v then in   thresholds[0]<=v<=thresholds[1] else out
+   * @param replace  whether to replace "out" values (replace[0]>0) and "in" values (replace[1]>0). If replace is zero then input value is kept
+   * @param replacevalues values to replace out and in cases respectively
+   * @returns 1 if success 0 if failed
+   */
+  template<class IT,class OT> int thresholdImage(bisSimpleImage<IT>* input,bisSimpleImage<OT>* output,float thresholds[2],int replace[3],OT replacevalues[2]);
+
   /** Shifts Scales and Casts an image. Essentially out = (input+shift)*scale and then cast to desired type
    * @param input the input image
    * @param shift the shift value 
@@ -75,6 +87,15 @@ namespace bisImageAlgorithms {
    */
   template<class IT,class OT> std::unique_ptr<bisSimpleImage<OT> >  shiftScaleImage(bisSimpleImage<IT>* input,double shift,double scale);
 
+  /** Shifts Scales and Casts an image storing the result in an existing output
+   * @param input the input image
+   * @param output the output image (same dimensions as input). If IT=OT this can be the input image itself (in place operation)
+   * @param shift the shift value 
+   * @param scale the scale value 
+   * @returns 1 if success 0 if failed
+   */
+  template<class IT,class OT> int shiftScaleImage(bisSimpleImage<IT>* input,bisSimpleImage<OT>* output,double shift,double scale);
+
   
   /** extract single Frame and Component from Image[i][j][j][frame][component]
    * @param input the input image
@@ -118,7 +139,8 @@ namespace bisImageAlgorithms {
                                                                                    float outsigmas[3],int inmm=0,float radiusfactor=1.5,int vtkboundary=0);
 
 
-  /** Gaussian smooth image storing in existing output
+  /** Gaussian smooth image storing in existing output. The output may have a different type than
+   * the input (e.g. short in, float out) in which case the input is read directly in its native type
    * @param input the input image
    * @param output the output image (assumed to have same size as input)
    * @param sigmas the standard deviations of the gaussian kernel
@@ -127,8 +149,23 @@ namespace bisImageAlgorithms {
    * @param radiusfactor use to determine the size of the smoothing kernel
    * @param vtkboundary if true use normalizing kernel to handle edge if not just tile (default)
    */
-  template<class T> static void gaussianSmoothImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,float sigmas[3],
-                                                    float outsigmas[3],int inmm=0,float radiusfactor=1.5,int vtkboundary=0);
+  template<class T,class OT> static void gaussianSmoothImage(bisSimpleImage<T>* input,bisSimpleImage<OT>* output,float sigmas[3],
+                                                             float outsigmas[3],int inmm=0,float radiusfactor=1.5,int vtkboundary=0);
+
+  /** Gaussian smooth an image stream. Frames are read, smoothed and written framesperchunk at a time
+   * so memory use is bounded by the chunk size (see \link bisAbstractImageStream \endlink)
+   * @param input the input stream
+   * @param output the output stream (must have the same dimensions as the input)
+   * @param sigmas the standard deviations of the gaussian kernel
+   * @param outsigmas the sigmas actually used (this is an output parameter)
+   * @param inmm if 1 the input sigmas are in mm else in voxels
+   * @param radiusfactor use to determine the size of the smoothing kernel
+   * @param vtkboundary if true use normalizing kernel to handle edge if not just tile (default)
+   * @param framesperchunk number of frames to process at a time
+   * @returns 1 if success 0 if failed
+   */
+  template<class T,class OT> static int gaussianSmoothImage(bisAbstractImageStream<T>* input,bisAbstractImageStream<OT>* output,float sigmas[3],
+                                                            float outsigmas[3],int inmm=0,float radiusfactor=1.5,int vtkboundary=0,int framesperchunk=1);
 
   // ------------------------------------------------- Normalize Image ---------------------------------
   /** Compute image Gradient by gaussian gradient convolution -- this blurs the other directions in addition to computing 
@@ -187,7 +224,7 @@ namespace bisImageAlgorithms {
    * if value > intensity at percentage per_high then it is set to outmaxvalue
    * else linear interpolate in between
    * @param input the input image
-   * @param output the output image
+   * @param output the output image (if T=short this can be the input image itself, the range is computed before any value is changed)
    * @param per_low the percentage of the cumulative histogram at the low range 
    * @param per_high the percentage of the cumulative histogram at the upper range 
    * @param outmaxvalue the maximum value of the output (often this is used as input o histogram operations)
@@ -207,7 +244,7 @@ namespace bisImageAlgorithms {
    * @param offset offset to add to calculated index -- used for interpolating 4D images at other frames
    * @returns the interpolated value as a double
    */
-  template<class T> double linearInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,int offset=0);
+  template<class T> double linearInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,BISLONG offset=0);
   
   /** Performs nearest neigbour interpolation (needed by reslicing operations)
    * @param data the raw image data vector
@@ -218,7 +255,7 @@ namespace bisImageAlgorithms {
    * @param offset offset to add to calculated index -- used for interpolating 4D images at other frames
    * @returns the interpolated value as a double
    */
-  template<class T>  double nearestInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,int offset=0);
+  template<class T>  double nearestInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,BISLONG offset=0);
   
   /** Performs cubic interpolation (needed by reslicing operations)
    * @param data the raw image data vector
@@ -229,7 +266,7 @@ namespace bisImageAlgorithms {
    * @param offset offset to add to calculated index -- used for interpolating 4D images at other frames
    * @returns the interpolated value as a double
    */
-  template<class T>  double cubicInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,int offset=0);
+  template<class T>  double cubicInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,BISLONG offset=0);
 
 
   /** Reslices an image given a transformation
@@ -243,6 +280,19 @@ namespace bisImageAlgorithms {
   template<class T> void resliceImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,bisAbstractTransformation* xform,
 				      int interpolation=1,double backgroundValue=0);
 
+  /** Reslices an image stream given a transformation. Frames are read, resliced and written framesperchunk at a time
+   * so memory use is bounded by the chunk size (see \link bisAbstractImageStream \endlink)
+   * @param input the input stream
+   * @param output the output stream (its dimensions and spacing define the output grid)
+   * @param xform the reslicing transformation
+   * @param interpolation 0=NN, 3=cubic 1= linear (linear used if other value specified)
+   * @param backgroundValue value to use if points fall outside the domain of the input image
+   * @param framesperchunk number of frames to process at a time
+   * @returns 1 if success 0 if failed
+   */
+  template<class T> int resliceImage(bisAbstractImageStream<T>* input,bisAbstractImageStream<T>* output,bisAbstractTransformation* xform,
+                                     int interpolation=1,double backgroundValue=0,int framesperchunk=1);
+
 
   /** Reslices part of a 2D image given a transformation and bounds. This is called from resliceImageWithBounds if image is 2D.
    * @param input the input image (assumed to be 2D, only first slice is done).
@@ -392,6 +442,15 @@ namespace bisImageAlgorithms {
    */
   template<class T> std::unique_ptr<bisSimpleImage<T> >  flipImage(bisSimpleImage<T>* input,int flips[3]);
 
+  /** flip an image storing the result in an existing output
+   * @param input the input image
+   * @param output the output image (same dimensions as input). This can be the input image itself in which
+   * case voxel pairs are swapped in place
+   * @param flips an integer array[3] containing the flips [ flipi,flipj,flipk ]
+   * @returns 1 if success 0 if failed
+   */
+  template<class T> int flipImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,int flips[3]);
+
   /** blank an image -- set values outside bbox to 0
    * @param input the input image
    * @param bounds an integer array[6] contain mini:maxi, minj:maxj, mink:maxk 
@@ -400,6 +459,15 @@ namespace bisImageAlgorithms {
    */
   template<class T> std::unique_ptr<bisSimpleImage<T> >  blankImage(bisSimpleImage<T>* input,int bounds[6],float outside);
 
+  /** blank an image storing the result in an existing output
+   * @param input the input image
+   * @param output the output image (same dimensions as input). This can be the input image itself (in place operation)
+   * @param bounds an integer array[6] contain mini:maxi, minj:maxj, mink:maxk 
+   * @param outside -- value to fill outside part of the image
+   * @returns 1 if success 0 if failed
+   */
+  template<class T> int blankImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,int bounds[6],float outside);
+
   /** median normalize an image -- set values so that median = 0 and interquartile range = 1
    * @param input the input image
    * @param debug a debug flag
@@ -81,8 +81,8 @@ namespace bisImageAlgorithms {
     frame=bisUtil::irange(frame,0,dim[3]);
     component=bisUtil::irange(component,0,dim[4]);
 
-    int volsize=dim[0]*dim[1]*dim[2];
-    int offset=(component*dim[3]+frame)*volsize;
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+    BISLONG offset=(component*dim[3]+frame)*volsize;
 
     dim[3]=1;
     dim[4]=1;
@@ -91,7 +91,7 @@ namespace bisImageAlgorithms {
     output->allocate(dim,spa);
     T* input_data= input->getImageData();
     T* output_data = output->getImageData();
-    for (int i=0;i<volsize;i++)
+    for (BISLONG i=0;i<volsize;i++)
       output_data[i]=input_data[i+offset];
     return std::move(output);
   }
@@ -150,8 +150,13 @@ namespace bisImageAlgorithms {
   
 
   
-  template<class T> void oneDConvolution(T* imagedata_in,T* imagedata_out,int dim[5],std::vector<float>& kernel,int axis,int vtkboundary=0)
+  template<class IT,class OT> void oneDConvolution(IT* imagedata_in,OT* imagedata_out,int dim[5],std::vector<float>& kernel,int axis,int vtkboundary=0)
   {
+#ifdef BIS_SIMD
+    if (bisSIMD::convolveIfFloat(imagedata_in,imagedata_out,dim,kernel,axis,vtkboundary))
+      return;
+#endif
+
     int slicesize=dim[0]*dim[1];
 
     int radius=int((kernel.size()-1)/2);
@@ -181,7 +186,7 @@ namespace bisImageAlgorithms {
     int outdim0minus=outdim[0]-1;
     int maxia=outdim[0]-radius;
 
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
 
     int numcompframes=dim[3]*dim[4];
 
@@ -226,7 +231,7 @@ namespace bisImageAlgorithms {
                 if (sumw>0.0)
                   sum=sum/sumw;
               }
-              imagedata_out[index]=(T)sum;
+              imagedata_out[index]=(OT)sum;
               index=index+outoffsets[0];
             }
         }
@@ -245,8 +250,8 @@ namespace bisImageAlgorithms {
   }
 
 
-  template<class T> void gaussianSmoothImage(bisSimpleImage<T>* input,
-                                             bisSimpleImage<T>* output,float sigmas[3], float outsigmas[3],int inmm,float radiusfactor,int vtkboundary)
+  template<class T,class OT> void gaussianSmoothImage(bisSimpleImage<T>* input,
+                                                      bisSimpleImage<OT>* output,float sigmas[3], float outsigmas[3],int inmm,float radiusfactor,int vtkboundary)
   {
 
     int dim[5];    input->getDimensions(dim);
@@ -256,23 +261,23 @@ namespace bisImageAlgorithms {
         sigmas[1]<0.000000001 &&
         sigmas[2]<0.000000001 ) {
       std::cout << "Just copying, no smoothing ... " << sigmas[0] << "," << sigmas[1] << "," << sigmas[2] << std::endl;
-      output->copyStructure(input);
+      output->allocateIfDifferent(dim,spa);
       T* inp=input->getData();
-      T* out=output->getData();
-      int l=dim[0]*dim[1]*dim[2]*dim[3]*dim[3];
-      for (int i=0;i<l;i++)
-        out[i]=inp[i];
+      OT* out=output->getData();
+      BISLONG l=input->getLength();
+      for (BISLONG i=0;i<l;i++)
+        out[i]=(OT)inp[i];
       return;
     }
         
         
-
-    std::unique_ptr<bisSimpleImage<T> > temp(new bisSimpleImage<T>("temporary_smooth_image"));
-    temp->copyStructure(input);
+    // The intermediate image has the output type, the first pass reads the input directly
+    std::unique_ptr<bisSimpleImage<OT> > temp(new bisSimpleImage<OT>("temporary_smooth_image"));
+    temp->allocate(dim,spa);
     
     T* input_data= input->getImageData();
-    T* output_data = output->getImageData();
-    T* temp_data = temp->getImageData();
+    OT* output_data = output->getImageData();
+    OT* temp_data = temp->getImageData();
 
     for(int ia=0;ia<=2;ia++)
       {
@@ -298,8 +303,8 @@ namespace bisImageAlgorithms {
     if (dim[2]>1)
       {
         std::vector<float> kernelz=internal::generateSmoothingKernel(outsigmas[2],radii[2]);
-        int len=input->getLength();
-        for(int j=0;j<len;j++)
+        BISLONG len=input->getLength();
+        for(BISLONG j=0;j<len;j++)
           temp_data[j]=output_data[j];
         oneDConvolution(temp_data,output_data,dim,kernelz,2,vtkboundary);
       }
@@ -307,25 +312,56 @@ namespace bisImageAlgorithms {
   }
 
 
+  template<class T,class OT> int gaussianSmoothImage(bisAbstractImageStream<T>* input,bisAbstractImageStream<OT>* output,
+                                                     float sigmas[3], float outsigmas[3],int inmm,float radiusfactor,int vtkboundary,int framesperchunk)
+  {
+    int dim[5]; input->getDimensions(dim);
+    int odim[5]; output->getDimensions(odim);
+    int numframes=input->getNumberOfFrames();
+    if (odim[0]!=dim[0] || odim[1]!=dim[1] || odim[2]!=dim[2] || output->getNumberOfFrames()!=numframes)
+      {
+        std::cerr << "Bad output stream dimensions for smoothing" << std::endl;
+        return 0;
+      }
+
+    framesperchunk=bisUtil::irange(framesperchunk,1,numframes);
+
+    // Chunk images are reused, only the last (smaller) chunk reallocates
+    std::unique_ptr<bisSimpleImage<T> > chunk(new bisSimpleImage<T>("smooth_input_chunk"));
+    std::unique_ptr<bisSimpleImage<OT> > outchunk(new bisSimpleImage<OT>("smooth_output_chunk"));
+    for (int frame=0;frame<numframes;frame+=framesperchunk)
+      {
+        int number=framesperchunk;
+        if (frame+number>numframes)
+          number=numframes-frame;
+
+        if (!input->readFrames(frame,number,chunk.get()))
+          return 0;
+        int cdim[5]; chunk->getDimensions(cdim);
+        float cspa[5]; chunk->getSpacing(cspa);
+        outchunk->allocateIfDifferent(cdim,cspa);
+        gaussianSmoothImage(chunk.get(),outchunk.get(),sigmas,outsigmas,inmm,radiusfactor,vtkboundary);
+        if (!output->writeFrames(frame,outchunk.get()))
+          return 0;
+      }
+    return 1;
+  }
+
+
   template<class T> void simpleGradientImage(bisSimpleImage<T>* original_input,
                                              bisSimpleImage<float>* output,float sigmas[3], float outsigmas[3],int inmm,float radiusfactor)
   {
-    T* orig=original_input->getImageData();
+    // The first convolution pass reads the input in its native type, no float copy is made
+    T* input_data=original_input->getImageData();
 
     int dim[5];   original_input->getDimensions(dim);
     float spa[5]; original_input->getSpacing(spa);
     
-    std::unique_ptr<bisSimpleImage<float> > input(new bisSimpleImage<float>("copy_image"));
-    input->allocate(dim,spa);
-    float* input_data=input->getImageData();
-    for (int i=0;i<input->getLength();i++)
-      input_data[i]=orig[i];
-    
     std::unique_ptr<bisSimpleImage<float> > temp(new bisSimpleImage<float>("temporary_grad_image"));
-    temp->copyStructure(input.get());
+    temp->allocate(dim,spa);
 
     std::unique_ptr<bisSimpleImage<float> > temp2(new bisSimpleImage<float>("temporary_grad_image2"));
-    temp2->copyStructure(input.get());
+    temp2->allocate(dim,spa);
 
     float* output_data = output->getImageData();
     float* temp_data = temp->getImageData();
@@ -348,22 +384,22 @@ namespace bisImageAlgorithms {
     std::vector<float> kernel_dx=internal::generateGradientKernel(outsigmas[0],radii[0]);
     std::vector<float> kernel_dy=internal::generateGradientKernel(outsigmas[1],radii[1]);
 
-    int volumesize=dim[0]*dim[1]*dim[2];
-    int offset=volumesize*dim[3];
+    BISLONG volumesize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+    BISLONG offset=volumesize*dim[3];
     
     oneDConvolution(input_data,temp_data,dim,kernel_dx,0);
-    for (int i=0;i<volumesize;i++)
+    for (BISLONG i=0;i<volumesize;i++)
       output_data[i]=temp_data[i];
     
     oneDConvolution(input_data,temp_data,dim,kernel_dy,1);
-    for (int i=0;i<volumesize;i++)
+    for (BISLONG i=0;i<volumesize;i++)
       output_data[offset+i]=temp_data[i];
 
     if (dim[2]>0)
       {
         std::vector<float> kernel_dz=internal::generateGradientKernel(outsigmas[2],radii[2]);
         oneDConvolution(input_data,temp_data,dim,kernel_dz,2);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[2*offset+i]=temp_data[i];
       }
   }
@@ -372,22 +408,17 @@ namespace bisImageAlgorithms {
   template<class T> void gradientImage(bisSimpleImage<T>* original_input,
                                        bisSimpleImage<float>* output,float sigmas[3], float outsigmas[3],int inmm,float radiusfactor)
   {
-    T* orig=original_input->getImageData();
+    // The first convolution pass reads the input in its native type, no float copy is made
+    T* input_data=original_input->getImageData();
 
     int dim[5];   original_input->getDimensions(dim);
     float spa[5]; original_input->getSpacing(spa);
     
-    std::unique_ptr<bisSimpleImage<float> > input(new bisSimpleImage<float>("copy_image"));
-    input->allocate(dim,spa);
-    float* input_data=input->getImageData();
-    for (int i=0;i<input->getLength();i++)
-      input_data[i]=orig[i];
-    
     std::unique_ptr<bisSimpleImage<float> > temp(new bisSimpleImage<float>("temporary_grad_image"));
-    temp->copyStructure(input.get());
+    temp->allocate(dim,spa);
 
     std::unique_ptr<bisSimpleImage<float> > temp2(new bisSimpleImage<float>("temporary_grad_image2"));
-    temp2->copyStructure(input.get());
+    temp2->allocate(dim,spa);
 
     float* output_data = output->getImageData();
     float* temp_data = temp->getImageData();
@@ -413,19 +444,19 @@ namespace bisImageAlgorithms {
     std::vector<float> kernel_y=internal::generateSmoothingKernel(outsigmas[1],radii[1]);
     std::vector<float> kernel_dy=internal::generateGradientKernel(outsigmas[1],radii[1]);
 
-    int volumesize=dim[0]*dim[1]*dim[2];
-    int offset=volumesize*dim[3];
+    BISLONG volumesize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+    BISLONG offset=volumesize*dim[3];
     
     if (dim[2]<2)
       {
         oneDConvolution(input_data,temp_data,dim,kernel_dx,0);
         oneDConvolution(temp_data,temp_data2,dim,kernel_y,1);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[i]=temp_data2[i];
         
         oneDConvolution(input_data,temp_data,dim,kernel_x,0);
         oneDConvolution(temp_data,temp_data2,dim,kernel_dy,1);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[offset+i]=temp_data2[i];
       }
     else
@@ -436,19 +467,19 @@ namespace bisImageAlgorithms {
         oneDConvolution(input_data,temp_data,dim,kernel_dx,0);
         oneDConvolution(temp_data,temp_data2,dim,kernel_y,1);
         oneDConvolution(temp_data2,temp_data,dim,kernel_z,2);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[i]=temp_data[i];
 
         oneDConvolution(input_data,temp_data,dim,kernel_x,0);
         oneDConvolution(temp_data,temp_data2,dim,kernel_dy,1);
         oneDConvolution(temp_data2,temp_data,dim,kernel_z,2);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[offset+i]=temp_data[i];
         
         oneDConvolution(input_data,temp_data,dim,kernel_x,0);
         oneDConvolution(temp_data,temp_data2,dim,kernel_y,1);
         oneDConvolution(temp_data2,temp_data,dim,kernel_dz,2);
-        for (int i=0;i<volumesize;i++)
+        for (BISLONG i=0;i<volumesize;i++)
           output_data[2*offset+i]=temp_data[i];
       }
   }
@@ -469,7 +500,7 @@ namespace bisImageAlgorithms {
     double min=arr[0],max=arr[0];
     double total = (double) image->getLength();
 	
-    for (int i=0;i<image->getLength();i++)
+    for (BISLONG i=0;i<image->getLength();i++)
       {
         if (min>arr[i])
           min=arr[i];
@@ -499,7 +530,7 @@ namespace bisImageAlgorithms {
     //    std::cout << "scale=" << scale << ", numbis=" << numbins << std::endl;
     //    std::cout << "Length= " << image->getLength() << std::endl;
     // Compute Histogram !!!
-    for (int i=0;i<image->getLength();i++)
+    for (BISLONG i=0;i<image->getLength();i++)
       bins[int(scale*(arr[i]-min))]+=1;
 
     //    for (int ia=10;ia<200;ia+=20)
@@ -562,7 +593,7 @@ namespace bisImageAlgorithms {
 
     //    std::cout << "scale=" << scale << " thr=" << outdata[0] << "," << outdata[1] << "," << outthigh << std::endl;
     
-    for (int i=0;i<output->getLength();i++)
+    for (BISLONG i=0;i<output->getLength();i++)
       {
         double v=data[i]-outdata[0];
         if (v>outthigh)
@@ -575,7 +606,10 @@ namespace bisImageAlgorithms {
 
 
   // ------------------------------------------------- Resample/Reslice ---------------------------------
-  template<class T> double linearInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,int offset ) {
+  template<class T> double linearInterpolationFunction(T* input_data,float TX[3],int minusdim[3],int dim0,int slicesize,BISLONG offset ) {
+
+    // The frame offset may exceed 2^31, the indices within a frame do not
+    T* data=input_data+offset;
 
     double W[3][2];
     int   B[3][2];
@@ -594,8 +628,13 @@ namespace bisImageAlgorithms {
     B[1][0]*=dim0;
     B[1][1]*=dim0;
     
-    B[2][0]=B[2][0]*slicesize+offset;
-    B[2][1]=B[2][1]*slicesize+offset;
+    B[2][0]*=slicesize;
+    B[2][1]*=slicesize;
+
+#ifdef BIS_SIMD
+    if (bisSIMD::isExactInFloat<T>::value)
+      return bisSIMD::trilinear(data,B,W);
+#endif
 
     double sum=0.0;
     for (int i=0;i<=1;i++)
@@ -608,7 +647,7 @@ namespace bisImageAlgorithms {
     
   }
 
-  template<class T>  double nearestInterpolationFunction(T* data,float TX[3],int*,int dim0,int slicesize,int offset ) {
+  template<class T>  double nearestInterpolationFunction(T* data,float TX[3],int*,int dim0,int slicesize,BISLONG offset ) {
     return data[int(TX[2]+0.5)*slicesize+
                 int(TX[1]+0.5)*dim0+
                 int(TX[0]+0.5)+offset];
@@ -616,7 +655,7 @@ namespace bisImageAlgorithms {
   }
 
 
-  template<class T> double cubicInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,int offset ) {
+  template<class T> double cubicInterpolationFunction(T* data,float TX[3],int minusdim[3],int dim0,int slicesize,BISLONG offset ) {
 
     int B[3][4];
     float W[3][4];
@@ -670,7 +709,7 @@ namespace bisImageAlgorithms {
   // _-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_2D Versions_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-_-
   
   
-  template<class T> double linearInterpolationFunction2D(T* data,float TX[3],int minusdim[2],int dim0,int offset ) {
+  template<class T> double linearInterpolationFunction2D(T* data,float TX[3],int minusdim[2],int dim0,BISLONG offset ) {
 
     double W[2][2];
     int   B[2][2];
@@ -696,13 +735,13 @@ namespace bisImageAlgorithms {
     return sum;
   }
 
-  template<class T>  double nearestInterpolationFunction2D(T* data,float TX[3],int*,int dim0 ,int offset ) {
+  template<class T>  double nearestInterpolationFunction2D(T* data,float TX[3],int*,int dim0 ,BISLONG offset ) {
     return data[int(TX[1]+0.5)*dim0+
                 int(TX[0]+0.5)+offset];
   }
 
 
-  template<class T> double cubicInterpolationFunction2D(T* data,float TX[3],int minusdim[2],int dim0 ,int offset ) {
+  template<class T> double cubicInterpolationFunction2D(T* data,float TX[3],int minusdim[2],int dim0 ,BISLONG offset ) {
 
     int B[2][4];
     float W[2][4];
@@ -767,6 +806,37 @@ namespace bisImageAlgorithms {
 
 
 
+  template<class T> int resliceImage(bisAbstractImageStream<T>* input,bisAbstractImageStream<T>* output,bisAbstractTransformation* xform,
+                                     int interpolation,double backgroundValue,int framesperchunk)
+  {
+    int numframes=input->getNumberOfFrames();
+    if (output->getNumberOfFrames()<numframes)
+      numframes=output->getNumberOfFrames();
+    framesperchunk=bisUtil::irange(framesperchunk,1,numframes);
+
+    int outdim[5]; output->getDimensions(outdim);
+    float outspa[5]; output->getSpacing(outspa);
+
+    std::unique_ptr<bisSimpleImage<T> > chunk(new bisSimpleImage<T>("reslice_input_chunk"));
+    std::unique_ptr<bisSimpleImage<T> > outchunk(new bisSimpleImage<T>("reslice_output_chunk"));
+    for (int frame=0;frame<numframes;frame+=framesperchunk)
+      {
+        int number=framesperchunk;
+        if (frame+number>numframes)
+          number=numframes-frame;
+
+        if (!input->readFrames(frame,number,chunk.get()))
+          return 0;
+        outdim[3]=number;
+        outdim[4]=1;
+        outchunk->allocateIfDifferent(outdim,outspa);
+        resliceImage(chunk.get(),outchunk.get(),xform,interpolation,backgroundValue);
+        if (!output->writeFrames(frame,outchunk.get()))
+          return 0;
+      }
+    return 1;
+  }
+
   // ----------- 2D -------------------------------------
   template<class T> void resliceImageWithBounds2D(bisSimpleImage<T>* input,bisSimpleImage<T>* output,bisAbstractTransformation* xform,
                                                   int bounds[6],int interpolation,double backgroundValue)
@@ -777,13 +847,13 @@ namespace bisImageAlgorithms {
     int dim0=dim[0];
     
     int outdim[5]; output->getDimensions(outdim);
-    int outvolsize = outdim[0]*outdim[1]*outdim[2];
+    BISLONG outvolsize = BISLONG(outdim[0])*BISLONG(outdim[1])*BISLONG(outdim[2]);
     float outspa[3]; output->getImageSpacing(outspa);
 
     T* input_data = input->getImageData();
     T* output_data = output->getImageData();
     int minusdim[2] = { dim[0]-1,dim[1]-1 };
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
 
     float X[3],TX[3];
 
@@ -800,7 +870,7 @@ namespace bisImageAlgorithms {
         bounds[2*ia+1]=bisUtil::irange(bounds[2*ia+1],bounds[2*ia],outdim[ia]-1);
       }
 
-    double (*interpFun2D)(T* data,float TX[3],int minusdim[2], int dim0,int offset);
+    double (*interpFun2D)(T* data,float TX[3],int minusdim[2], int dim0,BISLONG offset);
     interpFun2D=linearInterpolationFunction2D;
     if (interpolation==0)
       interpFun2D=nearestInterpolationFunction2D;
@@ -834,9 +904,9 @@ namespace bisImageAlgorithms {
               {
                 for (int framecomp=0;framecomp<numcompframes;framecomp++)
                   {
-                    int offset=volsize*framecomp;
+                    BISLONG offset=volsize*framecomp;
                     double v=interpFun2D(input_data,TX,minusdim,dim0,offset);
-                    output_data[outindex+framecomp*outvolsize]=(T)(v+intensity_offset);
+                    output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)(v+intensity_offset);
                   }
                 ++numgood;
               }
@@ -848,9 +918,9 @@ namespace bisImageAlgorithms {
 		
                 for (int framecomp=0;framecomp<numcompframes;framecomp++)
                   {
-                    int offset=volsize*framecomp;
+                    BISLONG offset=volsize*framecomp;
                     double v=interpFun2D(input_data,TX,minusdim,dim0,offset);
-                    output_data[outindex+framecomp*outvolsize]=(T)(v+intensity_offset);
+                    output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)(v+intensity_offset);
                   }
                 ++numsaved;
               }
@@ -859,7 +929,7 @@ namespace bisImageAlgorithms {
                 for (int framecomp=0;framecomp<numcompframes;framecomp++)
                   {
                     //int offset=volsize*framecomp;
-                    output_data[outindex+framecomp*outvolsize]=(T)backgroundValue;
+                    output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)backgroundValue;
                   }
                 ++numbad;
               }
@@ -886,7 +956,7 @@ namespace bisImageAlgorithms {
     
     int outdim[5]; output->getDimensions(outdim);
     int outslicesize = outdim[0]*outdim[1];
-    int outvolsize = outdim[0]*outdim[1]*outdim[2];
+    BISLONG outvolsize = BISLONG(outdim[0])*BISLONG(outdim[1])*BISLONG(outdim[2]);
     float outspa[3]; output->getImageSpacing(outspa);
 
     T* input_data = input->getImageData();
@@ -894,7 +964,7 @@ namespace bisImageAlgorithms {
     int minusdim[3] = { dim[0]-1,dim[1]-1,dim[2]-1 };
     //    float insidedim[3] = { dim[0]-1.05f,dim[1]-1.05f,dim[2]-1.05f };
     //float outsidedim[3] = { dim[0]-0.95f,dim[1]-0.95f,dim[2]-0.95f };
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
 
     float X[3],TX[3];
 
@@ -914,7 +984,7 @@ namespace bisImageAlgorithms {
 
 
 
-    double (*interpFun)(T* data,float TX[3],int minusdim[3], int dim0,int slicesize,int offset);
+    double (*interpFun)(T* data,float TX[3],int minusdim[3], int dim0,int slicesize,BISLONG offset);
     interpFun=linearInterpolationFunction;
     if (interpolation==0)
       interpFun=nearestInterpolationFunction;
@@ -937,11 +1007,11 @@ namespace bisImageAlgorithms {
     for (int k=bounds[4];k<=bounds[5];k++)
       {
         X[2]=k*outspa[2];
-        int outbase=k*outslicesize+bounds[0];
+        BISLONG outbase=BISLONG(k)*outslicesize+bounds[0];
         for (int j=bounds[2];j<=bounds[3];j++)
           {
             X[1]=j*outspa[1];
-            int outindex=j*outdim[0]+outbase;
+            BISLONG outindex=j*outdim[0]+outbase;
             for (int i=bounds[0];i<=bounds[1];i++)
               {
                 X[0]=i*outspa[0];
@@ -953,9 +1023,9 @@ namespace bisImageAlgorithms {
                   {
                     for (int framecomp=0;framecomp<numcompframes;framecomp++)
                       {
-                        int offset=volsize*framecomp;
+                        BISLONG offset=volsize*framecomp;
                         double v=interpFun(input_data,TX,minusdim,dim0,slicesize,offset);
-                        output_data[outindex+framecomp*outvolsize]=(T)(v+intensity_offset);
+                        output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)(v+intensity_offset);
                       }
                     ++numgood;
                   }
@@ -968,9 +1038,9 @@ namespace bisImageAlgorithms {
 		    
                     for (int framecomp=0;framecomp<numcompframes;framecomp++)
                       {
-                        int offset=volsize*framecomp;
+                        BISLONG offset=volsize*framecomp;
                         double v=interpFun(input_data,TX,minusdim,dim0,slicesize,offset);
-                        output_data[outindex+framecomp*outvolsize]=(T)(v+intensity_offset);
+                        output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)(v+intensity_offset);
                       }
                     ++numsaved;
                   }
@@ -979,7 +1049,7 @@ namespace bisImageAlgorithms {
                     for (int framecomp=0;framecomp<numcompframes;framecomp++)
                       {
                         //int offset=volsize*framecomp;
-                        output_data[outindex+framecomp*outvolsize]=(T)backgroundValue;
+                        output_data[outindex+BISLONG(framecomp)*outvolsize]=(T)backgroundValue;
                       }
                     ++numbad;
                   }
@@ -1156,7 +1226,7 @@ namespace bisImageAlgorithms {
     float reverse_spa[3]; reverse->getImageSpacing(reverse_spa);
     
     
-    int volsize=dim[0]*dim[1]*dim[2],slicesize=dim[0]*dim[1];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]),slicesize=dim[0]*dim[1];
     float spa[3]; forward->getImageSpacing(spa);
     
     float*  fordata=forward->getImageData();
@@ -1256,7 +1326,7 @@ namespace bisImageAlgorithms {
 
     int dim[5]; input->getDimensions(dim);
 
-    int volsize = dim[0]*dim[1]*dim[2];
+    BISLONG volsize = BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int numframes = dim[3];
     int numrois=int(r[1]);
     int extra=0;
@@ -1276,7 +1346,7 @@ namespace bisImageAlgorithms {
     
     std::cout << "\t Computing ROI: volsize=" << volsize << " numrois=" << numrois << " numframes=" << numframes << " range=" << r[0] << ":" << r[1] << std::endl;
 
-    int voxel=0;
+    BISLONG voxel=0;
 
     for (int k=0;k<dim[2];k++) {
       for (int j=0;j<dim[1];j++) {
@@ -1341,7 +1411,7 @@ namespace bisImageAlgorithms {
     if (outputis100)
       good=100;
     
-    for (int i=0;i<input->getLength();i++)
+    for (BISLONG i=0;i<input->getLength();i++)
       {
         if (idata[i]>=thr)
           odata[i]=good;
@@ -1359,14 +1429,22 @@ namespace bisImageAlgorithms {
     int dim[5];    input->getDimensions(dim);
     float spa[5];    input->getSpacing(spa);
     output->allocate(dim,spa);
+    thresholdImage(input,output.get(),thresholds,replace,replacevalue);
+    return std::move(output);
+  }
+
+  template<class IT,class OT> int thresholdImage(bisSimpleImage<IT>* input,bisSimpleImage<OT>* output,float thresholds[2],int replace[3],OT replacevalue[2])
+  {
+    if (output->getLength()!=input->getLength())
+      return 0;
 
     OT upper=(OT)thresholds[1];
     
     OT* odata=output->getData();
     IT* idata=input->getData();
-    output->fill(replacevalue[0]);
-    
-    for (int i=0;i<input->getLength();i++)
+
+    // Each output value depends only on the same input value, so odata may alias idata
+    for (BISLONG i=0;i<input->getLength();i++)
       {
         double v=idata[i];
 
@@ -1386,21 +1464,7 @@ namespace bisImageAlgorithms {
           odata[i]=(OT)v;
         }
       }
-
-    /*if (!replace[0] && !replace[1]) {
-      double sum=0.0;
-      for (int i=0;i<input->getLength();i++)
-        {
-          sum+=fabs(odata[i]-idata[i]);
-          if (i<10)
-            std::cout << "Values (WASM) " << i << ":" << idata[i] << " vs " << odata[i] << std::endl;
-        }
-      
-      std::cout << "Difference post threshold=" << sum << std::endl;
-      }*/
-		
-    
-    return std::move(output);
+    return 1;
   }
 
   template<class IT,class OT> std::unique_ptr<bisSimpleImage<OT> >  shiftScaleImage(bisSimpleImage<IT>* input,double shift,double scale)
@@ -1410,20 +1474,27 @@ namespace bisImageAlgorithms {
     int dim[5];    input->getDimensions(dim);
     float spa[5];    input->getSpacing(spa);
     output->allocate(dim,spa);
+    shiftScaleImage(input,output.get(),shift,scale);
+    return std::move(output);
+  }
+
+  template<class IT,class OT> int shiftScaleImage(bisSimpleImage<IT>* input,bisSimpleImage<OT>* output,double shift,double scale)
+  {
+    if (output->getLength()!=input->getLength())
+      return 0;
 
     OT* odata=output->getData();
     IT* idata=input->getData();
-    output->fill(1.0);
 
     //    std::cout << "Shift=" << shift << ", scale=" << scale << "\t inp=" << bisDataTypes::getTypeCode(IT(0)) << "--> " << bisDataTypes::getTypeCode(OT(0)) << std::endl;
     
-    for (int i=0;i<input->getLength();i++)
+    for (BISLONG i=0;i<input->getLength();i++)
       {
         double inp=idata[i];
         double out=(inp+shift)*scale;
         odata[i]=(OT)out;
       }
-    return std::move(output);
+    return 1;
   }
 
 
@@ -1466,8 +1537,8 @@ namespace bisImageAlgorithms {
     frame=bisUtil::irange(frame,0,dim[3]-1);
     component=bisUtil::irange(component,0,dim[4]-1);
     int slicesize=dim[0]*dim[1];
-    unsigned long volsize=dim[0]*dim[1]*dim[2];
-    int offset=(component*dim[3]+frame)*volsize;
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+    BISLONG offset=BISLONG(component*dim[3]+frame)*volsize;
 
     dim[3]=1;  dim[4]=1;
     
@@ -1667,7 +1738,7 @@ namespace bisImageAlgorithms {
     std::cout << "___ Filtering: Number of Clusters=" << clusters.size() << " maxsize=" << maxsize << " clustersizethreshold=" << clustersizethreshold << std::endl;
 
     int dim[5]; output->getDimensions(dim);
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int numcomp=dim[3]*dim[4];
 
     short* clustdata=clusterImage->getImageData();
@@ -1675,7 +1746,7 @@ namespace bisImageAlgorithms {
     T* idata=input->getImageData();
     int numpass=0;
 
-    for (int i=0;i<volsize;i++)
+    for (BISLONG i=0;i<volsize;i++)
       {
         int clusterno=clustdata[i];
         if (clusterno>0) {
@@ -1816,6 +1887,15 @@ namespace bisImageAlgorithms {
     if (!ok)
       return std::move(output);
 
+    flipImage(input,output.get(),flips);
+    return std::move(output);
+  }
+
+  template<class T> int flipImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,int flips[3])
+  {
+    if (output->getLength()!=input->getLength())
+      return 0;
+    
     int dim[5];    input->getDimensions(dim);
 
     int maxdim[3];
@@ -1824,14 +1904,16 @@ namespace bisImageAlgorithms {
     
     T* odata=output->getData();
     T* idata=input->getData();
+    int inplace=(odata==idata);
 
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int slicesize=dim[0]*dim[1];
 
-    int in_index=0;
+    // A flip is its own inverse, so in place each pair (in_index,out_index) is swapped once
+    BISLONG in_index=0;
     for (int c=0;c<dim[3]*dim[4];c++)
       {
-        int offset=c*volsize;
+        BISLONG offset=c*volsize;
         for (int k=0;k<dim[2];k++)
           {
             int flipk=k;
@@ -1848,15 +1930,24 @@ namespace bisImageAlgorithms {
                     if (flips[0])
                       flipi=maxdim[0]-i;
 
-                    int out_index=offset+flipk*slicesize+flipj*dim[0]+flipi;
-                    odata[out_index]=idata[in_index];
+                    BISLONG out_index=offset+flipk*slicesize+flipj*dim[0]+flipi;
+                    if (!inplace)
+                      {
+                        odata[out_index]=idata[in_index];
+                      }
+                    else if (out_index>in_index)
+                      {
+                        T tmp=odata[out_index];
+                        odata[out_index]=idata[in_index];
+                        odata[in_index]=tmp;
+                      }
                     in_index=in_index+1;
                   }
               }
           }
       }
 
-    return std::move(output);
+    return 1;
   }
 
   // ---------------------- -------------------
@@ -1865,6 +1956,19 @@ namespace bisImageAlgorithms {
     int dim[5]; input->getDimensions(dim);
     float spa[5];  input->getSpacing(spa);
 
+    std::unique_ptr<bisSimpleImage<T> >output(new bisSimpleImage<T>("blank_result"));
+    output->allocate(dim,spa);
+    blankImage(input,output.get(),bounds,outside);
+    return std::move(output);
+  }
+
+  template<class T> int blankImage(bisSimpleImage<T>* input,bisSimpleImage<T>* output,int bounds[6],float outside)
+  {
+    if (output->getLength()!=input->getLength())
+      return 0;
+
+    int dim[5]; input->getDimensions(dim);
+
     for (int i=0;i<=2;i++) {
 
       int mina=bounds[i*2];
@@ -1878,39 +1982,37 @@ namespace bisImageAlgorithms {
       bounds[i*2+1]=maxa;
     }
 
-    int slicesize=dim[0]*dim[1];
-    int volsize=slicesize*dim[2];
-
-
-    std::unique_ptr<bisSimpleImage<T> >output(new bisSimpleImage<T>("blank_result"));
-    output->allocate(dim,spa);
-
     T* odata=output->getData();
     T* idata=input->getData();
+    T outvalue=(T)outside;
+    int inplace=(odata==idata);
 
-    int total=dim[0]*dim[1]*dim[2]*dim[3]*dim[4];
-    for (int i=0;i<total;i++)
-      odata[i]=outside;
-    
+    // Single pass, each voxel is either copied (inside) or set to outside, so odata may alias idata
+    BISLONG index=0;
     int numcf=dim[4]*dim[3];
-    
-    for (int k=bounds[4];k<=bounds[5];k++)
-      {
-        int k_offset=k*slicesize;
-        for (int j=bounds[2];j<=bounds[3];j++)
-          {
-            int offset=j*dim[0]+k_offset;
-            for (int i=bounds[0];i<=bounds[1];i++)
-              {
-                for (int f=0;f<numcf;f++)
-                  {
-                    int f_offset=f*volsize;
-                    odata[f_offset+offset+i]=idata[f_offset+offset+i];
-                  }
-              }
-          }
-      }
-    return std::move(output);
+    for (int f=0;f<numcf;f++)
+      for (int k=0;k<dim[2];k++)
+        {
+          int kin=(k>=bounds[4] && k<=bounds[5]);
+          for (int j=0;j<dim[1];j++)
+            {
+              int jin=kin && (j>=bounds[2] && j<=bounds[3]);
+              for (int i=0;i<dim[0];i++)
+                {
+                  if (jin && i>=bounds[0] && i<=bounds[1])
+                    {
+                      if (!inplace)
+                        odata[index]=idata[index];
+                    }
+                  else
+                    {
+                      odata[index]=outvalue;
+                    }
+                  ++index;
+                }
+            }
+        }
+    return 1;
   }
 
   // ---------------------- -------------------
@@ -2094,24 +2196,23 @@ namespace bisImageAlgorithms {
   {
     int dim[5]; input->getDimensions(dim);
     float spa[5];  input->getSpacing(spa);
-    int slicesize=dim[0]*dim[1];
-    int volsize=slicesize*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
 
     bisSimpleImage<float>* output=new bisSimpleImage<float>("normalized_image");
     output->allocate(dim,spa);
 
     float* odata=output->getData();
     T* idata=input->getData();
-    int datasize=dim[0]*dim[1]*dim[2]*dim[3]*dim[4];
+    BISLONG datasize=output->getLength();
 
     // Copy data first as nth largest is destructive
-    for (int i=0;i<datasize;i++)
+    for (BISLONG i=0;i<datasize;i++)
       odata[i]=idata[i];
 
     
-    int quarter=(volsize/4);
-    int middle=(volsize/2);
-    int threequarter=(volsize*3/4);
+    BISLONG quarter=(volsize/4);
+    BISLONG middle=(volsize/2);
+    BISLONG threequarter=(volsize*3/4);
 
     /*        
               if (debug>1) {
@@ -2135,7 +2236,7 @@ namespace bisImageAlgorithms {
     if (range<0.001)
       range=0.001;
 
-    for (int i=0;i<datasize;i++) 
+    for (BISLONG i=0;i<datasize;i++) 
       odata[i]=(idata[i]-m)/range;
     
     return output;
@@ -2147,7 +2248,7 @@ namespace bisImageAlgorithms {
     int dim[5];    input->getDimensions(dim);
     radius=bisUtil::irange(radius,1,32);
 
-    int volsize=dim[0]*dim[1]*dim[2];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int slicesize=dim[0]*dim[1];
     int numframes=dim[3]*dim[4];
     
@@ -2170,7 +2271,7 @@ namespace bisImageAlgorithms {
     T* data=new T[windowsize];
     
     for (int frame=0;frame<numframes;frame++) {
-      int frameoffset=frame*volsize;
+      BISLONG frameoffset=frame*volsize;
 
       for (int k=0;k<dim[2];k++) {
         int km=bisUtil::irange(k-zradius,0,dim[2]-1);
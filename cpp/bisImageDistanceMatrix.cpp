@@ -13,17 +13,19 @@
 
 
 #include <bisvtkMultiThreader.h>
+#include "bisThreadPool.h"
+#include "bisSIMD.h"
+#include "bisKNNGraph.h"
+#include "bisSparseMatrix.h"
 #include "bisImageDistanceMatrix.h"
 #include "bisJSONParameterList.h"
 #include "bisUtil.h"
 #include <algorithm>
 #include <sstream>
 #include <Eigen/Core>
-#include <Eigen/SparseCore>
 #ifndef _WIN32
 #include <Spectra/SymEigsSolver.h>
 #include <Spectra/GenEigsSolver.h>
-#include <Spectra/MatOp/SparseGenMatProd.h>
 #endif
 
 
@@ -34,6 +36,61 @@ namespace bisImageDistanceMatrix {
   // ------------------------------------------------------------------------------------------------
   // Payload classes
 
+  // A virtual patch reformatted image (see reformatImage). Frame f of voxel (i,j,k) is the input voxel at
+  // (i,j,k)+(di,dj,dk)*increment (clamped to the image), where (di,dj,dk) runs over the patch with di fastest.
+  // Consumers read it one row (dim[0] voxels) of one frame at a time, so the (2r+1)^3 times larger image is
+  // never stored.
+  class bisPatchView {
+  public:
+    bisPatchView(bisSimpleImage<float>* input,int radius[3],int increment[3]) {
+      int d[5]; input->getDimensions(d);
+      this->idata=input->getImageData();
+      this->numframes=1;
+      for (int i=0;i<=2;i++) {
+        this->dim[i]=d[i];
+        this->radius[i]=bisUtil::irange(radius[i],1,4);
+        this->increment[i]=bisUtil::irange(increment[i],1,4);
+        this->numframes=this->numframes*(1+2*this->radius[i]);
+      }
+      this->numvoxels=long(d[0])*long(d[1])*long(d[2]);
+
+      for (int ka=-this->radius[2];ka<=this->radius[2];ka++)
+        for (int ja=-this->radius[1];ja<=this->radius[1];ja++)
+          for (int ia=-this->radius[0];ia<=this->radius[0];ia++) {
+            this->offsets.push_back(ia*this->increment[0]);
+            this->offsets.push_back(ja*this->increment[1]);
+            this->offsets.push_back(ka*this->increment[2]);
+          }
+    }
+
+    // Stores frame f of row (j,k) in out (dim[0] values)
+    void getRow(int frame,int j,int k,float* out) const {
+      const int* o=&this->offsets[3*frame];
+      int newj=bisUtil::irange(j+o[1],0,this->dim[1]-1);
+      int newk=bisUtil::irange(k+o[2],0,this->dim[2]-1);
+      const float* in=this->idata+(long(newk)*this->dim[1]+newj)*this->dim[0];
+      int di=o[0];
+      int nx=this->dim[0];
+      for (int i=0;i<nx;i++) {
+        int newi=i+di;
+        out[i]=in[newi<0 ? 0 : (newi>=nx ? nx-1 : newi)];
+      }
+    }
+
+    // Stores frame f of row (row=j+k*dim[1])
+    void getRow(int frame,long row,float* out) const {
+      this->getRow(frame,int(row % this->dim[1]),int(row/this->dim[1]),out);
+    }
+
+    float* idata;
+    int dim[3];
+    int radius[3];
+    int increment[3];
+    int numframes;
+    long numvoxels;
+    std::vector<int> offsets;
+  };
+
   class bisMThreadStructure {
   public:
     short* wgt_dat;
@@ -54,10 +111,20 @@ namespace bisImageDistanceMatrix {
     std::vector<double> output_array[VTK_MAX_THREADS];
     int numcols;
 
+    // Radius stencil (see createRadiusStencil), neighbor n is at (di,dj,dk)=stencil_ijk[3n..3n+2]
+    int stencil_radius[3];
+    std::vector<int> stencil_ijk;
+    std::vector<long> stencil_offset;
+    std::vector<double> stencil_dist;
+
+    // Temporal matrix of a patch view (frames are patch offsets), used instead of img_dat if set
+    const bisPatchView* patchview;
+
     bisMThreadStructure() {
       this->wgt_dat=NULL;
       this->index_dat=NULL;
       this->img_dat=NULL;
+      this->patchview=NULL;
       this->numcols=4;
     }
 
@@ -73,15 +140,6 @@ namespace bisImageDistanceMatrix {
     }
   };
 
-  class bisMImagePair {
-  public:
-    float* idata;
-    float* odata;
-    int dim[3];
-    int radius[3];
-    int increment[3];
-    int numframes;
-  };
 
 
   // ------------------------------------------------------------------------------------------------
@@ -91,6 +149,51 @@ namespace bisImageDistanceMatrix {
     return arr0offset[k0offset];
   }
 
+  template<class V> float estimateMedianDistanceTemplate(const V* dist,const V* euclid,double lambda,BISLONG n,BISLONG maxsamples) {
+
+    // Every samplerate-th entry would sample the same positions in rows of similar length,
+    // step through the array with a stride coprime to n instead
+    BISLONG numvalues=n,stride=1;
+    if (n>maxsamples)
+      {
+        numvalues=maxsamples;
+        stride=BISLONG(0.6180339887*double(n));
+        BISLONG a=0,b=0;
+        do
+          {
+            stride++;
+            a=n; b=stride;
+            while (b>0)
+              {
+                BISLONG t=a%b; a=b; b=t;
+              }
+          }
+        while (a!=1);
+      }
+
+    std::vector<float> values(numvalues);
+    BISLONG e=0;
+    for (BISLONG i=0;i<numvalues;i++)
+      {
+        double v=dist[e];
+        if (euclid)
+          v+=lambda*euclid[e];
+        values[i]=v;
+        e+=stride;
+        if (e>=n)
+          e-=n;
+      }
+    return selectKthLargest(numvalues/2,numvalues,&values[0]);
+  }
+
+  float estimateMedianDistance(const float* dist,const float* euclid,double lambda,BISLONG n,BISLONG maxsamples) {
+    return estimateMedianDistanceTemplate(dist,euclid,lambda,n,maxsamples);
+  }
+
+  float estimateMedianDistance(const double* dist,const double* euclid,double lambda,BISLONG n,BISLONG maxsamples) {
+    return estimateMedianDistanceTemplate(dist,euclid,lambda,n,maxsamples);
+  }
+
   bisSimpleImage<int>* createIndexMap(bisSimpleImage<short>* objectmap) {
 
     bisSimpleImage<int>* temp=new bisSimpleImage<int>("indexmap");
@@ -190,16 +293,21 @@ namespace bisImageDistanceMatrix {
   // ------------------------------------------------------------------------------------------------------
   // Threaded Version Of Code
   // ------------------------------------------------------------------------------------------------------
-  void combineVectorsToCreateSparseMatrix(bisSimpleMatrix<double>* combined,std::vector<double> output_array[VTK_MAX_THREADS],int nc,int NumberOfThreads)
+  // perthread=1 if output_array has one array per thread (print per array counts), 0 if it has one per chunk of work
+  void combineVectorsToCreateSparseMatrix(bisSimpleMatrix<double>* combined,std::vector<double>* output_array,int nc,int numarrays,int perthread)
   {
     int nt=0;
 
-    fprintf(stdout,"++++ \n++++ Threads completed, combining %d arrays (comp=%d): ",NumberOfThreads,nc);
-    for (int i=0;i<NumberOfThreads;i++)
+    if (perthread)
+      fprintf(stdout,"++++ \n++++ Threads completed, combining %d thread arrays (comp=%d): ",numarrays,nc);
+    else
+      fprintf(stdout,"++++ \n++++ Threads completed, combining %d chunk arrays (comp=%d)",numarrays,nc);
+    for (int i=0;i<numarrays;i++)
       {
         int n=output_array[i].size()/nc;
         nt+=n;
-        std::cout << n << " ";
+        if (perthread)
+          std::cout << n << " ";
       }
 
     std::cout << ", total rows (pairs)=" << nt << " cols=" << nc <<  std::endl;
@@ -209,10 +317,11 @@ namespace bisImageDistanceMatrix {
     double* c_dat=combined->getData();
 
     int index=0;
-    for (int i=0;i<NumberOfThreads;i++)
+    for (int i=0;i<numarrays;i++)
       {
         int num=output_array[i].size();
-        std::cout << "+++ Combining thread=" << i+1 << " num=" << num << " elements=" << num/nc << std::endl;
+        if (perthread)
+          std::cout << "+++ Combining thread=" << i+1 << " num=" << num << " elements=" << num/nc << std::endl;
         if (num>0)
           {
             for (int j=0;j<num;j++)
@@ -226,7 +335,7 @@ namespace bisImageDistanceMatrix {
   bisMThreadStructure* createThreadStructure(bisSimpleImage<float>* Input,
                                              bisSimpleImage<short>* ObjectMap,
                                              bisSimpleImage<int>* IndexMap,
-                                             int NumberOfThreads,float Sparsity,long NumBest=-1)
+                                             int NumberOfThreads,float Sparsity,long NumBest=-1,int reserveoutput=1)
   {
     bisMThreadStructure* ds=  new bisMThreadStructure();
     int dim[5]; IndexMap->getDimensions(dim);
@@ -260,11 +369,14 @@ namespace bisImageDistanceMatrix {
       ds->numbest=ds->numgoodvox;
 
 
-    int piecesize=2*(ds->numgoodvox*ds->numbest)/NumberOfThreads;
-    for (int i=0;i<NumberOfThreads;i++)
+    if (reserveoutput)
       {
-        ds->output_array[i].clear();
-        ds->output_array[i].reserve(piecesize);
+        int piecesize=2*(ds->numgoodvox*ds->numbest)/NumberOfThreads;
+        for (int i=0;i<NumberOfThreads;i++)
+          {
+            ds->output_array[i].clear();
+            ds->output_array[i].reserve(piecesize);
+          }
       }
     return ds;
   }
@@ -280,43 +392,15 @@ namespace bisImageDistanceMatrix {
       range[1]=numvoxels;
   }
   // --------------------------------------------------------------------------------------------------------
-  static void sparseThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
+  // Computes the rows of the sparse matrix for voxels [voxelbegin,voxelend) and appends them to output.
+  // d_dist, d_tmp and d_index are scratch arrays of size numgoodvox+10
+  static void computeSparseMatrixRows(bisMThreadStructure* ds,long voxelbegin,long voxelend,std::vector<double>& output,
+                                      float* d_dist,float* d_tmp,int* d_index)
   {
-
-    bisMThreadStructure   *ds = (bisMThreadStructure *)(data->UserData);
-    int thread=data->ThreadID;
-    int numthreads=data->NumberOfThreads;
-
-    int voxelrange[2];
-    bisImageDistanceMatrix_ComputeFraction(thread,numthreads,ds->numvoxels,voxelrange);
-    std::cout << "++++ Sparse Matrix Thread (" << thread << ") output_array numvoxels= " << ds->numgoodvox << " * " << ds->numbest << ", numframes=" << ds->numframes <<
-      ". Computing " << voxelrange[0] << ":" << voxelrange[1] << std::endl;
-
-    float* d_dist=new float[ds->numgoodvox+10];
-    float* d_tmp =new float[ds->numgoodvox+10];
-    int*   d_index=new  int[ds->numgoodvox+10];
-
-
-    int voxelfraction=(voxelrange[1]-voxelrange[0])/5;
-    int dvoxel=voxelrange[1]-voxelrange[0];
-    if (dvoxel<1)
-      dvoxel=1;
-    if (voxelfraction<1)
-      voxelfraction=1;
-    if (voxelfraction>2500)
-      voxelfraction=2500;
-    //    int first=0;
-
-    for (int voxel1=voxelrange[0];voxel1<voxelrange[1];voxel1++)
+    for (long voxel1=voxelbegin;voxel1<voxelend;voxel1++)
       {
-        /*if ((voxel1-voxelrange[0])%voxelfraction==0 && voxel1>voxelrange[0])
-          {
-            std::cout << "_____ Thread (" << thread << "). Processed " << 100.0*double(voxel1-voxelrange[0])/double(dvoxel) << "%, " <<
-              "(voxel " << voxel1 << " of " << voxelrange[0] << "->" << voxelrange[1] << ")." << std::endl;
-              }*/
         int v1=ds->index_dat[voxel1];
         short w1=ds->wgt_dat[voxel1];
-        //std::cout << "voxel1=" << voxel1 << " (" << v1 << "," << w1 << ")" << std::endl;
         if (v1>0)
           {
             int num_used=0;
@@ -330,6 +414,9 @@ namespace bisImageDistanceMatrix {
                       {
                         int index1=voxel1*ds->numframes;
                         int index2=voxel2*ds->numframes;
+#ifdef BIS_SIMD
+                        double sum=bisSIMD::sumSquaredDifferences(&ds->img_dat[index1],&ds->img_dat[index2],ds->numframes);
+#else
                         double sum=0.0;
                         for (int frame=0;frame<ds->numframes;frame++)
                           {
@@ -337,6 +424,7 @@ namespace bisImageDistanceMatrix {
                             ++index1;
                             ++index2;
                           }
+#endif
                         d_dist[num_used]=sum;
                         d_tmp[num_used]=sum;
                         d_index[num_used]=voxel2;
@@ -345,13 +433,7 @@ namespace bisImageDistanceMatrix {
                   }
               }
 
-            //std::cout << "voxel1=" << voxel1 << ", v1=" << v1 << " " << w1 << " num_used=" << num_used << std::endl;
-
             double thr=selectKthLargest(ds->numbest,num_used,d_tmp);
-            //            ++first;
-            //            if (first<3)
-            //  std::cout << "***** Thread ("<< thread << ") thr=" << thr << ", numbest=" << ds->numbest
-            //        << "num_used=" << num_used << " numgood=" << ds->numgoodvox << " nvox=" << ds->numvoxels << std::endl;
 
             for (int ia=0;ia<num_used;ia++)
               {
@@ -359,30 +441,113 @@ namespace bisImageDistanceMatrix {
                   {
                     int index1=ds->index_dat[voxel1];
                     int index2=ds->index_dat[d_index[ia]];
-                    //std::cout << index1 << "," << index2 << std::endl;
                     double dist=computeDistance(index1,index2,ds->dim,ds->spa);
-                    //std::cout << index1 << "," << index2 << ":" << dist << std::endl;
-                    ds->output_array[thread].push_back(index1);
-                    ds->output_array[thread].push_back(index2);
-                    ds->output_array[thread].push_back(d_dist[ia]);
-                    ds->output_array[thread].push_back(dist);
+                    output.push_back(index1);
+                    output.push_back(index2);
+                    output.push_back(d_dist[ia]);
+                    output.push_back(dist);
                   }
               }
             // This adds itself as a zero
             int index=ds->index_dat[voxel1];
-            ds->output_array[thread].push_back(index);
-            ds->output_array[thread].push_back(index);
-            ds->output_array[thread].push_back(0.0);
-            ds->output_array[thread].push_back(0.0);
+            output.push_back(index);
+            output.push_back(index);
+            output.push_back(0.0);
+            output.push_back(0.0);
           }
       }
+  }
 
-    std::cout << "++++      Thread (" << thread << ") done numpairs=" << ds->output_array[thread].size()/ds->numcols << std::endl;
+  // ---------------------------------------------------------------------------
+  // Radius Matrix Helpers
+  // ---------------------------------------------------------------------------
+  // The neighborhood is the same for all voxels so the offsets of the voxels within the radius (and their squared
+  // spatial distances in mm) are computed once, in voxel order, excluding the voxel itself
+  void createRadiusStencil(bisMThreadStructure* ds)
+  {
+    float DistanceRadius2=ds->DistanceRadius*ds->DistanceRadius;
+    for (int ia=0;ia<=2;ia++)
+      ds->stencil_radius[ia]=int(ds->DistanceRadius/ds->spa[ia]);
+
+    ds->stencil_ijk.clear();
+    ds->stencil_offset.clear();
+    ds->stencil_dist.clear();
+    long slicesize=ds->dim[0]*ds->dim[1];
+    for (int kb=-ds->stencil_radius[2];kb<=ds->stencil_radius[2];kb++)
+      for (int jb=-ds->stencil_radius[1];jb<=ds->stencil_radius[1];jb++)
+        for (int ib=-ds->stencil_radius[0];ib<=ds->stencil_radius[0];ib++)
+          {
+            double dist=
+              pow(double(kb)*ds->spa[2],2.0)+
+              pow(double(jb)*ds->spa[1],2.0)+
+              pow(double(ib)*ds->spa[0],2.0);
+            if (dist<=DistanceRadius2 && dist>0.01)
+              {
+                ds->stencil_ijk.push_back(ib);
+                ds->stencil_ijk.push_back(jb);
+                ds->stencil_ijk.push_back(kb);
+                ds->stencil_offset.push_back(ib+jb*ds->dim[0]+kb*slicesize);
+                ds->stencil_dist.push_back(dist);
+              }
+          }
+    std::cout << "++++ Radius stencil: " << ds->stencil_dist.size() << " neighbors (box=" << 2*ds->stencil_radius[0]+1 << "*"
+              << 2*ds->stencil_radius[1]+1 << "*" << 2*ds->stencil_radius[2]+1 << ")" << std::endl;
+  }
 
-    delete [] d_dist;
-    delete [] d_index;
-    delete [] d_tmp;
+  // Calls fn(sec_index,dist) for each voxel within the radius of voxel (i,j,k) that is in the mask and has the same
+  // label (excluding the voxel itself), in voxel order. dist is the squared spatial distance in mm.
+  // Requires createRadiusStencil.
+  template<class F> void forEachRadiusNeighbor(bisMThreadStructure* ds,int i,int j,int k,F fn)
+  {
+    int vox_index=i+j*ds->dim[0]+k*ds->dim[0]*ds->dim[1];
+    short w0=ds->wgt_dat[vox_index];
+    int numneighbors=ds->stencil_dist.size();
+    const long* offset=ds->stencil_offset.data();
+    const double* dist=ds->stencil_dist.data();
+
+    int interior=
+      i>=ds->stencil_radius[0] && i+ds->stencil_radius[0]<ds->dim[0] &&
+      j>=ds->stencil_radius[1] && j+ds->stencil_radius[1]<ds->dim[1] &&
+      k>=ds->stencil_radius[2] && k+ds->stencil_radius[2]<ds->dim[2];
+
+    if (interior)
+      {
+        for (int n=0;n<numneighbors;n++)
+          {
+            long sec_index=vox_index+offset[n];
+            if (ds->index_dat[sec_index]>0 && ds->wgt_dat[sec_index]==w0)
+              fn(int(sec_index),dist[n]);
+          }
+        return;
+      }
+
+    const int* ijk=ds->stencil_ijk.data();
+    for (int n=0;n<numneighbors;n++)
+      {
+        int ia=i+ijk[3*n],ja=j+ijk[3*n+1],ka=k+ijk[3*n+2];
+        if (ia<0 || ia>=ds->dim[0] || ja<0 || ja>=ds->dim[1] || ka<0 || ka>=ds->dim[2])
+          continue;
+        long sec_index=vox_index+offset[n];
+        if (ds->index_dat[sec_index]>0 && ds->wgt_dat[sec_index]==w0)
+          fn(int(sec_index),dist[n]);
+      }
+  }
+
+  // Squared intensity distance between the timeseries of two voxels (times the normalization)
+  static double computeIntensityDistance(bisMThreadStructure* ds,int voxel1,int voxel2)
+  {
+    int index1=voxel1*ds->numframes;
+    int index2=voxel2*ds->numframes;
+#ifdef BIS_SIMD
+    double v=bisSIMD::sumSquaredDifferences(&ds->img_dat[index1],&ds->img_dat[index2],ds->numframes);
+#else
+    double v=0.0;
+    for (int frame=0;frame<ds->numframes;frame++)
+      v+=pow(ds->img_dat[index1+frame]-ds->img_dat[index2+frame],2.0f);
+#endif
+    return v*ds->normalization;
   }
+
   // ---------------------------------------------------------------------------
   static void radiusThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
   {
@@ -397,70 +562,46 @@ namespace bisImageDistanceMatrix {
 
     std::cout << "++++ Radius Matrix Thread(" << thread << ") radius=" << ds->DistanceRadius << " computing slices " << slicerange[0] << "->" << slicerange[1] << std::endl;
 
-    float DistanceRadius2=ds->DistanceRadius*ds->DistanceRadius;
     int slicesize=ds->dim[0]*ds->dim[1];
-    int dslice=(slicerange[1]-slicerange[0])/5;
-    if (dslice<1)
-      dslice=1;
-    // Normalize maxintensity
+
+    // Count the rows first so that the output is allocated once at its exact size
+    long numpairs=0;
+    for (int k=slicerange[0];k<slicerange[1];k++)
+      for (int j=0;j<ds->dim[1];j++)
+        for (int i=0;i<ds->dim[0];i++)
+          {
+            if (ds->index_dat[i+j*ds->dim[0]+k*slicesize]>0)
+              {
+                ++numpairs;
+                forEachRadiusNeighbor(ds,i,j,k,[&](int,double) { ++numpairs; });
+              }
+          }
+
+    std::vector<double>& output=ds->output_array[thread];
+    output.resize(numpairs*ds->numcols);
+    double* out=output.data();
     for (int k=slicerange[0];k<slicerange[1];k++)
       {
-        int kmin=k-int(ds->DistanceRadius/ds->spa[2]); if (kmin<0) kmin=0;
-        int kmax=k+int(ds->DistanceRadius/ds->spa[2]); if (kmax>=ds->dim[2]) kmax=ds->dim[2]-1;
         for (int j=0;j<ds->dim[1];j++)
           {
-            int jmin=j-int(ds->DistanceRadius/ds->spa[1]); if (jmin<0) jmin=0;
-            int jmax=j+int(ds->DistanceRadius/ds->spa[1]); if (jmax>=ds->dim[1]) jmax=ds->dim[1]-1;
             for (int i=0;i<ds->dim[0];i++)
               {
-                int imin=i-int(ds->DistanceRadius/ds->spa[0]); if (imin<0) imin=0;
-                int imax=i+int(ds->DistanceRadius/ds->spa[0]); if (imax>=ds->dim[0]) imax=ds->dim[0]-1;
                 int vox_index=i+j*ds->dim[0]+k*slicesize;
-                double v[3];
-                v[0]=ds->index_dat[vox_index];
-                short w0=ds->wgt_dat[vox_index];
-                int index1=vox_index*ds->numframes;
-
-                if (v[0]>0.0)
+                double v0=ds->index_dat[vox_index];
+                if (v0>0.0)
                   {
-                    v[1]=v[0];
-                    v[2]=0.0;
-                    //		  v[3]=0.0;
-                    ds->output_array[thread].push_back(v[0]);
-                    ds->output_array[thread].push_back(v[1]);
-                    ds->output_array[thread].push_back(0.0);
-                    ds->output_array[thread].push_back(0.0);
-
-
-                    for (int ka=kmin;ka<=kmax;ka++)
-                      for (int ja=jmin;ja<=jmax;ja++)
-                        for (int ia=imin;ia<=imax;ia++)
-                          {
-                            int sec_index=ia+ja*ds->dim[0]+ka*slicesize;
-                            v[1]=ds->index_dat[sec_index];
-                            short w1=ds->wgt_dat[sec_index];
-
-                            if (v[1]>0.0 && w1==w0)
-                              {
-                                double dist=
-                                  pow(double(ka-k)*ds->spa[2],2.0)+
-                                  pow(double(ja-j)*ds->spa[1],2.0)+
-                                  pow(double(ia-i)*ds->spa[0],2.0);
-                                if (dist<=DistanceRadius2 && dist>0.01)
-                                  {
-                                    int index2=sec_index*ds->numframes;
-                                    v[2]=0.0;
-                                    for (int frame=0;frame<ds->numframes;frame++)
-                                      v[2]+=pow(ds->img_dat[index1+frame]-ds->img_dat[index2+frame],2.0f);
-                                    v[2]=(v[2])*ds->normalization;
-                                    //  v[3]=dist;
-                                    ds->output_array[thread].push_back(v[0]);
-                                    ds->output_array[thread].push_back(v[1]);
-                                    ds->output_array[thread].push_back(v[2]);
-                                    ds->output_array[thread].push_back(dist);
-                                  }
-                              }
-                          }
+                    out[0]=v0;
+                    out[1]=v0;
+                    out[2]=0.0;
+                    out[3]=0.0;
+                    out+=4;
+                    forEachRadiusNeighbor(ds,i,j,k,[&](int sec_index,double dist) {
+                        out[0]=v0;
+                        out[1]=ds->index_dat[sec_index];
+                        out[2]=computeIntensityDistance(ds,vox_index,sec_index);
+                        out[3]=dist;
+                        out+=4;
+                      });
                   }
               }
           }
@@ -471,8 +612,14 @@ namespace bisImageDistanceMatrix {
 
 
   // --------------------------------------------------------------------------------------------------------
+  // The distances between the frames of this thread and all frames are accumulated a block of rows at a time, so
+  // that all frames of a block are read once (and generated once for a patch view) instead of once per frame pair.
+  // Each sum still adds the voxels in increasing order, i.e. the distances are the same as frame by frame.
+  // The sums of all threads together are numframes*numframes doubles, so at most MAX_SUMS are kept per thread:
+  // for long series the frames of the thread are done in chunks, each one reading all the frames again.
   static void temporalSparseThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
   {
+    const long MAX_SUMS=1<<22;
     bisMThreadStructure *ds = (bisMThreadStructure *)(data->UserData);
     int thread=data->ThreadID;
     int numthreads=data->NumberOfThreads;
@@ -480,37 +627,84 @@ namespace bisImageDistanceMatrix {
 
     bisImageDistanceMatrix_ComputeFraction(thread,numthreads,ds->numframes,framerange);
     std::cout << "++++ Temporal Sparse Matrix Thread (" << thread << "). Computing " << framerange[0] << ":" << framerange[1] << std::endl;
-    float* d_dist=new float[ds->numframes];
-    float* d_tmp =new float[ds->numframes];
 
-    for (int frame1=framerange[0];frame1<framerange[1];frame1++)
+    int numframes=ds->numframes;
+    int nrange=framerange[1]-framerange[0];
+    int chunkframes=int(std::max(1L,std::min(long(nrange),MAX_SUMS/numframes)));
+    std::vector<double> sums(long(chunkframes)*numframes,0.0);
+
+    long rowlength=ds->dim[0];
+    long numrows=ds->numvoxels/rowlength;
+    long blockrows=1+1023/rowlength;
+    std::vector<float> buffer;
+    if (ds->patchview)
+      buffer.resize(numframes*blockrows*rowlength);
+    std::vector<const float*> block(numframes);
+
+    float* d_dist=new float[numframes];
+    float* d_tmp =new float[numframes];
+
+    for (int firstframe=framerange[0];firstframe<framerange[1];firstframe+=chunkframes)
       {
-        d_tmp[frame1]=0.0;
-        d_dist[frame1]=0.0;
+        int lastframe=std::min(firstframe+chunkframes,framerange[1]);
+        std::fill(sums.begin(),sums.end(),0.0);
 
-        for (int frame2=0;frame2<ds->numframes;frame2++)
+        for (long firstrow=0;firstrow<numrows;firstrow+=blockrows)
           {
-            if (frame2!=frame1)
+            long lastrow=std::min(firstrow+blockrows,numrows);
+            long blocklength=(lastrow-firstrow)*rowlength;
+            for (int frame=0;frame<numframes;frame++)
               {
-                int index1=frame1*ds->numvoxels;
-                int index2=frame2*ds->numvoxels;
-                double sum=0.0;
-                for (int voxel=0;voxel<ds->numvoxels;voxel++)
-                  sum+=pow(ds->img_dat[index1+voxel]-ds->img_dat[index2+voxel],2.0f);
-                d_dist[frame2]=sum;
-                d_tmp[frame2]=sum;
+                if (ds->patchview)
+                  {
+                    float* out=&buffer[frame*blockrows*rowlength];
+                    for (long row=firstrow;row<lastrow;row++)
+                      ds->patchview->getRow(frame,row,out+(row-firstrow)*rowlength);
+                    block[frame]=out;
+                  }
+                else
+                  {
+                    block[frame]=ds->img_dat+long(frame)*ds->numvoxels+firstrow*rowlength;
+                  }
               }
-          }
 
-        double thr=selectKthLargest(ds->numbest,ds->numframes,d_tmp);
+            for (int frame1=firstframe;frame1<lastframe;frame1++)
+              {
+                const float* d1=block[frame1];
+                double* sum1=&sums[long(frame1-firstframe)*numframes];
+                for (int frame2=0;frame2<numframes;frame2++)
+                  {
+                    if (frame2!=frame1)
+                      {
+                        const float* d2=block[frame2];
+                        double sum=sum1[frame2];
+                        for (long voxel=0;voxel<blocklength;voxel++)
+                          sum+=pow(d1[voxel]-d2[voxel],2.0f);
+                        sum1[frame2]=sum;
+                      }
+                  }
+              }
+          }
 
-        for (int frame2=0;frame2<ds->numframes;frame2++)
+        for (int frame1=firstframe;frame1<lastframe;frame1++)
           {
-            if (d_dist[frame2]<thr)
+            double* sum1=&sums[long(frame1-firstframe)*numframes];
+            for (int frame2=0;frame2<numframes;frame2++)
               {
-                ds->output_array[thread].push_back(frame1);
-                ds->output_array[thread].push_back(frame2);
-                ds->output_array[thread].push_back(d_dist[frame2]);
+                d_dist[frame2]=sum1[frame2];
+                d_tmp[frame2]=sum1[frame2];
+              }
+
+            double thr=selectKthLargest(ds->numbest,numframes,d_tmp);
+
+            for (int frame2=0;frame2<numframes;frame2++)
+              {
+                if (d_dist[frame2]<thr)
+                  {
+                    ds->output_array[thread].push_back(frame1);
+                    ds->output_array[thread].push_back(frame2);
+                    ds->output_array[thread].push_back(d_dist[frame2]);
+                  }
               }
           }
       }
@@ -522,15 +716,70 @@ namespace bisImageDistanceMatrix {
   }
 
   // ---------------------------------------------------------------------------
-  int createSparseMatrixParallel(bisSimpleImage<float>* Input,
-                                 bisSimpleImage<short>* ObjectMap,
-                                 bisSimpleImage<int>* IndexMap,
-                                 bisSimpleMatrix<double>* Output,
-                                 float sparsity,int numthreads)
+  // Stores per-thread (or per-chunk) arrays of (row,col,values...) in a CSR matrix. Each row must come from one
+  // array only (true for all the distance matrices as the arrays cover disjoint voxels or frames) so the arrays are
+  // copied into their row slots in parallel. The diagonal entry (at most one per row) is placed first.
+  // ---------------------------------------------------------------------------
+  int combineVectorsToCreateCSRMatrix(bisSparseMatrix* combined,std::vector<double>* output_array,int nc,int numarrays,
+                                      int numrows,int indexoffset,int numthreads)
   {
-    float Sparsity=bisUtil::frange(sparsity,0.001,50.0);
-    int NumberOfThreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
+    std::vector<int> counts(numrows,0);
+    std::vector<int> next(numrows,0);
+    for (int i=0;i<numarrays;i++)
+      {
+        const std::vector<double>& arr=output_array[i];
+        for (size_t j=0;j<arr.size();j+=nc)
+          {
+            int row=int(arr[j])-indexoffset;
+            counts[row]++;
+            if (row==int(arr[j+1])-indexoffset)
+              next[row]=1;
+          }
+      }
+
+    if (!combined->allocate(numrows,numrows,&counts[0],nc-2))
+      return 0;
+
+    int* rowptr=combined->getRowPointers();
+    int* colind=combined->getColumnIndices();
+    int numnonzero=combined->getNumNonZero();
+    float* values=combined->getValues(0);
+    for (int r=0;r<numrows;r++)
+      next[r]+=rowptr[r];
+
+    bisThreadPool::parallelFor(0,numarrays,1,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG i=begin;i<end;i++)
+          {
+            const std::vector<double>& arr=output_array[i];
+            for (size_t j=0;j<arr.size();j+=nc)
+              {
+                int row=int(arr[j])-indexoffset;
+                int col=int(arr[j+1])-indexoffset;
+                int slot=rowptr[row];
+                if (row!=col)
+                  slot=next[row]++;
+                colind[slot]=col;
+                for (int c=0;c<nc-2;c++)
+                  values[BISLONG(c)*numnonzero+slot]=float(arr[j+2+c]);
+              }
+          }
+      },numthreads);
 
+    std::cout << "++++ Combined " << numarrays << " arrays into CSR matrix rows=" << numrows << " entries=" << numnonzero << std::endl;
+    return 1;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Computes the rows of the sparsity based matrix in chunks of voxels. Returns the thread structure (to be deleted
+  // by the caller) or 0 if failed.
+  static bisMThreadStructure* computeSparseMatrixChunks(bisSimpleImage<float>* Input,
+                                                        bisSimpleImage<short>* ObjectMap,
+                                                        bisSimpleImage<int>* IndexMap,
+                                                        float sparsity,int& NumberOfThreads,
+                                                        std::vector<std::vector<double> >& chunk_output)
+  {
+    float Sparsity=bisUtil::frange(sparsity,0.001,50.0);
+    NumberOfThreads=bisUtil::irange(NumberOfThreads,1,VTK_MAX_THREADS);
 
     if (!checkInputImages(Input,ObjectMap,IndexMap))
       return 0;
@@ -541,37 +790,270 @@ namespace bisImageDistanceMatrix {
       NumberOfThreads=nv;
 
     std::cout << "++++ CreateSparseMatrixParallel sparsity=" << Sparsity << " Number Of Threads= "
-              << NumberOfThreads << " (max=" << VTK_MAX_THREADS  << ")" << std::endl;
-    bisMThreadStructure* ds=  createThreadStructure(Input,ObjectMap,IndexMap,NumberOfThreads,Sparsity);
+              << NumberOfThreads << " (pool=" << bisThreadPool::getNumberOfThreads()  << ")" << std::endl;
+    bisMThreadStructure* ds=  createThreadStructure(Input,ObjectMap,IndexMap,NumberOfThreads,Sparsity,-1,0);
     Input->getImageDimensions(ds->dim);
     Input->getImageSpacing(ds->spa);
+    std::cout << "++++ Numgoodvox=" << ds->numgoodvox << ", expected total size=" << ds->numgoodvox*ds->numbest << std::endl;
+
+    // Only voxels inside the mask do any work, so the voxels are processed in small chunks on the thread pool
+    // (load balanced by work stealing). Each chunk stores its rows separately and the chunks are combined in
+    // voxel order, hence the output does not depend on the number of threads.
+    const long grain=64;
+    long numchunks=(ds->numvoxels+grain-1)/grain;
+    chunk_output.resize(numchunks);
+    int poolthreads=bisThreadPool::getNumberOfThreads();
+    std::vector<std::vector<float> > d_dist(poolthreads),d_tmp(poolthreads);
+    std::vector<std::vector<int> > d_index(poolthreads);
+
+    bisThreadPool::parallelFor(0,ds->numvoxels,grain,[&](BISLONG begin,BISLONG end,int thread) {
+        if (d_dist[thread].size()==0)
+          {
+            d_dist[thread].resize(ds->numgoodvox+10);
+            d_tmp[thread].resize(ds->numgoodvox+10);
+            d_index[thread].resize(ds->numgoodvox+10);
+          }
+        computeSparseMatrixRows(ds,begin,end,chunk_output[begin/grain],&d_dist[thread][0],&d_tmp[thread][0],&d_index[thread][0]);
+      },NumberOfThreads);
 
+    return ds;
+  }
 
-    std::stringstream strss;  strss <<  "Numgoodvox=" << ds->numgoodvox << ", expected total size=" << ds->numgoodvox*ds->numbest;
-    bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&sparseThreadFunction,ds,strss.str(),NumberOfThreads,1);
-    combineVectorsToCreateSparseMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads);
+  int createSparseMatrixParallel(bisSimpleImage<float>* Input,
+                                 bisSimpleImage<short>* ObjectMap,
+                                 bisSimpleImage<int>* IndexMap,
+                                 bisSimpleMatrix<double>* Output,
+                                 float sparsity,int numthreads)
+  {
+    std::vector<std::vector<double> > chunk_output;
+    bisMThreadStructure* ds=computeSparseMatrixChunks(Input,ObjectMap,IndexMap,sparsity,numthreads,chunk_output);
+    if (ds==0)
+      return 0;
+
+    combineVectorsToCreateSparseMatrix(Output,&chunk_output[0],ds->numcols,chunk_output.size(),0);
     double density=100.0*Output->getNumRows()/(double(ds->numgoodvox*ds->numgoodvox));
     std::cout << "++++ Sparse matrix done. Final density: num_rows=" << ds->numgoodvox << " density=" << density << "% (components=" << Output->getNumCols() << ")" << std::endl;
 
-
     delete ds;
     return 1;
   }
 
-
-  int createRadiusMatrixParallel(bisSimpleImage<float>* Input,
+  int createSparseMatrixParallel(bisSimpleImage<float>* Input,
                                  bisSimpleImage<short>* ObjectMap,
                                  bisSimpleImage<int>* IndexMap,
-                                 bisSimpleMatrix<double>* Output,
-                                 float radius,int numthreads)
+                                 bisSparseMatrix* Output,
+                                 float sparsity,int numthreads)
   {
+    std::vector<std::vector<double> > chunk_output;
+    bisMThreadStructure* ds=computeSparseMatrixChunks(Input,ObjectMap,IndexMap,sparsity,numthreads,chunk_output);
+    if (ds==0)
+      return 0;
+
+    int ok=combineVectorsToCreateCSRMatrix(Output,&chunk_output[0],ds->numcols,chunk_output.size(),ds->numgoodvox,1,numthreads);
+    delete ds;
+    return ok;
+  }
 
-    int NumberOfThreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
-    float DistanceRadius=bisUtil::frange(radius,1.0,4000.0);
+
+  // ---------------------------------------------------------------------------
+  // The numbest+1 nearest neighbors of each voxel come from the k-NN graph engine (blocked GEMM or NN-descent)
+  // instead of comparing every pair of voxels. As in computeSparseMatrixRows the neighbors closer than the
+  // (numbest+1)-th nearest are kept, in voxel order. On output the neighbors of masked voxel p (voxel rows[p]) are
+  // neighbors[rowpointers[p]] to neighbors[rowpointers[p+1]-1] (as indices into rows). Returns the thread
+  // structure (to be deleted by the caller) or 0 if failed.
+  static bisMThreadStructure* computeSparseNeighbors(bisSimpleImage<float>* Input,
+                                                     bisSimpleImage<short>* ObjectMap,
+                                                     bisSimpleImage<int>* IndexMap,
+                                                     float sparsity,int approximate,int NumberOfThreads,
+                                                     std::vector<long>& rows,std::vector<int>& rowpointers,
+                                                     std::vector<int>& neighbors,std::vector<float>& distances)
+  {
+    float Sparsity=bisUtil::frange(sparsity,0.001,50.0);
+    NumberOfThreads=bisUtil::irange(NumberOfThreads,1,VTK_MAX_THREADS);
 
     if (!checkInputImages(Input,ObjectMap,IndexMap))
       return 0;
 
+    bisMThreadStructure* ds=  createThreadStructure(Input,ObjectMap,IndexMap,NumberOfThreads,Sparsity,-1,0);
+    Input->getImageDimensions(ds->dim);
+    Input->getImageSpacing(ds->spa);
+    std::cout << "++++ CreateSparseMatrixKNN sparsity=" << Sparsity << " method=" << (approximate ? "approximate" : "exact")
+              << " Number Of Threads= " << NumberOfThreads << std::endl;
+    std::cout << "++++ Numgoodvox=" << ds->numgoodvox << ", expected total size=" << ds->numgoodvox*ds->numbest << std::endl;
+
+    int numpoints=ds->numgoodvox;
+    rows.resize(numpoints);
+    std::vector<short> labels(numpoints);
+    int np=0;
+    for (long voxel=0;voxel<ds->numvoxels;voxel++)
+      {
+        if (ds->index_dat[voxel]>0)
+          {
+            rows[np]=voxel;
+            labels[np]=ds->wgt_dat[voxel];
+            ++np;
+          }
+      }
+
+    int numbest=ds->numbest;
+    int k=numbest+1;
+    std::vector<int> knn;
+    std::vector<float> knndist;
+    if (!bisKNNGraph::computeNearestNeighbors(ds->img_dat,ds->numframes,&rows[0],&labels[0],numpoints,k,approximate,
+                                              knn,knndist,NumberOfThreads,1))
+      {
+        delete ds;
+        return 0;
+      }
+
+    rowpointers.resize(numpoints+1);
+    rowpointers[0]=0;
+    for (int p=0;p<numpoints;p++)
+      {
+        const int* nbr=&knn[long(p)*k];
+        const float* dist=&knndist[long(p)*k];
+        int n=0;
+        for (int j=0;j<numbest;j++)
+          if (nbr[j]>=0 && (nbr[numbest]<0 || dist[j]<dist[numbest]))
+            ++n;
+        rowpointers[p+1]=rowpointers[p]+n;
+      }
+
+    neighbors.resize(rowpointers[numpoints]);
+    distances.resize(rowpointers[numpoints]);
+    bisThreadPool::parallelFor(0,numpoints,256,[&](BISLONG begin,BISLONG end,int) {
+        std::vector<int> keep;
+        for (BISLONG p=begin;p<end;p++)
+          {
+            const int* nbr=&knn[long(p)*k];
+            const float* dist=&knndist[long(p)*k];
+            keep.clear();
+            for (int j=0;j<numbest;j++)
+              if (nbr[j]>=0 && (nbr[numbest]<0 || dist[j]<dist[numbest]))
+                keep.push_back(j);
+            std::sort(keep.begin(),keep.end(),[&](int a,int b) { return nbr[a]<nbr[b]; });
+            int offset=rowpointers[p];
+            for (unsigned int j=0;j<keep.size();j++)
+              {
+                neighbors[offset+j]=nbr[keep[j]];
+                distances[offset+j]=dist[keep[j]];
+              }
+          }
+      },NumberOfThreads);
+
+    return ds;
+  }
+
+  int createSparseMatrixKNN(bisSimpleImage<float>* Input,
+                            bisSimpleImage<short>* ObjectMap,
+                            bisSimpleImage<int>* IndexMap,
+                            bisSimpleMatrix<double>* Output,
+                            float sparsity,int approximate,int numthreads)
+  {
+    std::vector<long> rows;
+    std::vector<int> rowpointers,neighbors;
+    std::vector<float> distances;
+    bisMThreadStructure* ds=computeSparseNeighbors(Input,ObjectMap,IndexMap,sparsity,approximate,numthreads,
+                                                   rows,rowpointers,neighbors,distances);
+    if (ds==0)
+      return 0;
+
+    // Rows as in computeSparseMatrixRows, the neighbors in voxel order then the voxel itself
+    int numpoints=rows.size();
+    int numentries=neighbors.size()+numpoints;
+    Output->zero(numentries,ds->numcols);
+    double* out=Output->getData();
+    for (int p=0;p<numpoints;p++)
+      {
+        int index1=ds->index_dat[rows[p]];
+        for (int e=rowpointers[p];e<rowpointers[p+1];e++)
+          {
+            int index2=ds->index_dat[rows[neighbors[e]]];
+            out[0]=index1;
+            out[1]=index2;
+            out[2]=distances[e];
+            out[3]=computeDistance(index1,index2,ds->dim,ds->spa);
+            out+=4;
+          }
+        out[0]=index1;
+        out[1]=index1;
+        out[2]=0.0;
+        out[3]=0.0;
+        out+=4;
+      }
+
+    double density=100.0*Output->getNumRows()/(double(ds->numgoodvox*ds->numgoodvox));
+    std::cout << "++++ Sparse matrix done. Final density: num_rows=" << ds->numgoodvox << " density=" << density << "% (components=" << Output->getNumCols() << ")" << std::endl;
+
+    delete ds;
+    return 1;
+  }
+
+  int createSparseMatrixKNN(bisSimpleImage<float>* Input,
+                            bisSimpleImage<short>* ObjectMap,
+                            bisSimpleImage<int>* IndexMap,
+                            bisSparseMatrix* Output,
+                            float sparsity,int approximate,int numthreads)
+  {
+    std::vector<long> rows;
+    std::vector<int> rowpointers,neighbors;
+    std::vector<float> distances;
+    bisMThreadStructure* ds=computeSparseNeighbors(Input,ObjectMap,IndexMap,sparsity,approximate,numthreads,
+                                                   rows,rowpointers,neighbors,distances);
+    if (ds==0)
+      return 0;
+
+    int numpoints=rows.size();
+    std::vector<int> counts(numpoints);
+    for (int p=0;p<numpoints;p++)
+      counts[p]=rowpointers[p+1]-rowpointers[p]+1;
+    if (!Output->allocate(numpoints,numpoints,&counts[0],2))
+      {
+        delete ds;
+        return 0;
+      }
+
+    // Each row goes to its own slots, the diagonal first
+    int* rowptr=Output->getRowPointers();
+    int* colind=Output->getColumnIndices();
+    float* dist=Output->getValues(0);
+    float* euclid=Output->getValues(1);
+    bisThreadPool::parallelFor(0,numpoints,256,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG p=begin;p<end;p++)
+          {
+            int index1=ds->index_dat[rows[p]];
+            int slot=rowptr[p];
+            colind[slot]=index1-1;
+            ++slot;
+            for (int e=rowpointers[p];e<rowpointers[p+1];e++)
+              {
+                int index2=ds->index_dat[rows[neighbors[e]]];
+                colind[slot]=index2-1;
+                dist[slot]=distances[e];
+                euclid[slot]=float(computeDistance(index1,index2,ds->dim,ds->spa));
+                ++slot;
+              }
+          }
+      },numthreads);
+
+    std::cout << "++++ Sparse CSR matrix done. rows=" << numpoints << " entries=" << Output->getNumNonZero() << std::endl;
+    delete ds;
+    return 1;
+  }
+
+
+  // ---------------------------------------------------------------------------
+  // Sets up the radius matrix computation. Returns the thread structure (to be deleted by the caller) or 0 if failed
+  static bisMThreadStructure* createRadiusThreadStructure(bisSimpleImage<float>* Input,
+                                                          bisSimpleImage<short>* ObjectMap,
+                                                          bisSimpleImage<int>* IndexMap,
+                                                          float radius,int& NumberOfThreads)
+  {
+    NumberOfThreads=bisUtil::irange(NumberOfThreads,1,VTK_MAX_THREADS);
+    float DistanceRadius=bisUtil::frange(radius,1.0,4000.0);
+
+    if (!checkInputImages(Input,ObjectMap,IndexMap))
+      return 0;
 
     int d[3]; Input->getImageDimensions(d);
     if (d[2]<NumberOfThreads)
@@ -598,22 +1080,36 @@ namespace bisImageDistanceMatrix {
     if (maxintensity<0.0001)
       maxintensity=0.0001;
 
-    bisMThreadStructure* ds=createThreadStructure(Input,ObjectMap,IndexMap,NumberOfThreads,0.0,nbest);
+    bisMThreadStructure* ds=createThreadStructure(Input,ObjectMap,IndexMap,NumberOfThreads,0.0,nbest,0);
 
     ds->DistanceRadius=DistanceRadius;
     Input->getImageDimensions(ds->dim);
     Input->getImageSpacing(ds->spa);
     ds->maxintensity=maxintensity;
     ds->normalization=1.0;
+    createRadiusStencil(ds);
 
     std::cout << "++++ Parameters: maxintensity" << ds->maxintensity << ", numframes=" << ds->numframes << " distradius=" <<
       ds->DistanceRadius << std::endl;
     std::cout << "++++ Normalization=" << ds->normalization << " Mean spacing=" << meanspa << std::endl;
+    return ds;
+  }
+
+  int createRadiusMatrixParallel(bisSimpleImage<float>* Input,
+                                 bisSimpleImage<short>* ObjectMap,
+                                 bisSimpleImage<int>* IndexMap,
+                                 bisSimpleMatrix<double>* Output,
+                                 float radius,int numthreads)
+  {
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createRadiusThreadStructure(Input,ObjectMap,IndexMap,radius,NumberOfThreads);
+    if (ds==0)
+      return 0;
 
     std::stringstream strss;  strss <<  "Numgoodvox=" << ds->numgoodvox << ", expected total size=" << ds->numgoodvox*ds->numbest;
     bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&radiusThreadFunction,ds,strss.str(),NumberOfThreads,1);
 
-    combineVectorsToCreateSparseMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads);
+    combineVectorsToCreateSparseMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads,1);
     double density=100.0*Output->getNumRows()/(double(ds->numgoodvox*ds->numgoodvox));
     std::cout << "++++ Radius matrix done. Final density: num_rows=" << ds->numgoodvox << " density=" << density << "% (components=" << Output->getNumCols() << ")" << std::endl;
 
@@ -621,28 +1117,110 @@ namespace bisImageDistanceMatrix {
     return 1;
   }
 
-  // ---------------------------------------------------------------------------
-  int createSparseMatrixParallelTemporal(bisSimpleImage<float>* Input,
-                                         bisSimpleMatrix<double>* Output,
-                                         float sparsity,int numthreads)
+  int createRadiusMatrixParallel(bisSimpleImage<float>* Input,
+                                 bisSimpleImage<short>* ObjectMap,
+                                 bisSimpleImage<int>* IndexMap,
+                                 bisSparseMatrix* Output,
+                                 float radius,int numthreads)
   {
-    float Sparsity=bisUtil::frange(sparsity,0.001,50.0);
-    int NumberOfThreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createRadiusThreadStructure(Input,ObjectMap,IndexMap,radius,NumberOfThreads);
+    if (ds==0)
+      return 0;
 
+    // Count the entries of each row (no timeseries distances needed) so that the rows can be written in place
+    int slicesize=ds->dim[0]*ds->dim[1];
+    std::vector<int> counts(ds->numgoodvox,0);
+    bisThreadPool::parallelFor(0,ds->dim[2],1,[&](BISLONG begin,BISLONG end,int) {
+        for (int k=begin;k<end;k++)
+          for (int j=0;j<ds->dim[1];j++)
+            for (int i=0;i<ds->dim[0];i++)
+              {
+                int row=ds->index_dat[i+j*ds->dim[0]+k*slicesize]-1;
+                if (row>=0)
+                  {
+                    int n=1;
+                    forEachRadiusNeighbor(ds,i,j,k,[&](int,double) { ++n; });
+                    counts[row]=n;
+                  }
+              }
+      },NumberOfThreads);
 
-    int d[3]; Input->getImageDimensions(d);
-    int nv=d[0]*d[1]*d[2];
-    if (nv<NumberOfThreads)
-      NumberOfThreads=nv;
+    if (!Output->allocate(ds->numgoodvox,ds->numgoodvox,&counts[0],2))
+      {
+        delete ds;
+        return 0;
+      }
 
-    std::cout << "++++ CreateSparseMatrixParallel sparsity=" << Sparsity << " Number Of Threads= "
-              << NumberOfThreads << " (max=" << VTK_MAX_THREADS  << ")" << std::endl;
+    int* rowptr=Output->getRowPointers();
+    int* colind=Output->getColumnIndices();
+    float* dist=Output->getValues(0);
+    float* euclid=Output->getValues(1);
+    bisThreadPool::parallelFor(0,ds->dim[2],1,[&](BISLONG begin,BISLONG end,int) {
+        for (int k=begin;k<end;k++)
+          for (int j=0;j<ds->dim[1];j++)
+            for (int i=0;i<ds->dim[0];i++)
+              {
+                int vox_index=i+j*ds->dim[0]+k*slicesize;
+                int row=ds->index_dat[vox_index]-1;
+                if (row>=0)
+                  {
+                    int slot=rowptr[row];
+                    colind[slot]=row;
+                    ++slot;
+                    forEachRadiusNeighbor(ds,i,j,k,[&](int sec_index,double d) {
+                        colind[slot]=ds->index_dat[sec_index]-1;
+                        dist[slot]=float(computeIntensityDistance(ds,vox_index,sec_index));
+                        euclid[slot]=float(d);
+                        ++slot;
+                      });
+                  }
+              }
+      },NumberOfThreads);
+
+    std::cout << "++++ Radius CSR matrix done. rows=" << ds->numgoodvox << " entries=" << Output->getNumNonZero() << std::endl;
+    delete ds;
+    return 1;
+  }
 
+  // ---------------------------------------------------------------------------
+  // Creates the temporal thread structure for the frames of an image or for the frames of a patch view
+  static bisMThreadStructure* createTemporalThreadStructure(bisSimpleImage<float>* Input)
+  {
     bisMThreadStructure* ds=  new bisMThreadStructure();
     int dim[5]; Input->getDimensions(dim);
     ds->img_dat=Input->getData();
+    for (int i=0;i<=2;i++)
+      ds->dim[i]=dim[i];
     ds->numvoxels=dim[0]*dim[1]*dim[2];
     ds->numframes=dim[3]*dim[4];
+    return ds;
+  }
+
+  static bisMThreadStructure* createTemporalThreadStructure(const bisPatchView* view)
+  {
+    bisMThreadStructure* ds=  new bisMThreadStructure();
+    ds->patchview=view;
+    for (int i=0;i<=2;i++)
+      ds->dim[i]=view->dim[i];
+    ds->numvoxels=view->numvoxels;
+    ds->numframes=view->numframes;
+    return ds;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Runs the temporal threads on ds (see createTemporalThreadStructure)
+  static void computeTemporalSparseMatrixThreads(bisMThreadStructure* ds,float sparsity,int& NumberOfThreads)
+  {
+    float Sparsity=bisUtil::frange(sparsity,0.001,50.0);
+    NumberOfThreads=bisUtil::irange(NumberOfThreads,1,VTK_MAX_THREADS);
+
+    if (ds->numvoxels<NumberOfThreads)
+      NumberOfThreads=ds->numvoxels;
+
+    std::cout << "++++ CreateSparseMatrixParallel sparsity=" << Sparsity << " Number Of Threads= "
+              << NumberOfThreads << " (max=" << VTK_MAX_THREADS  << ")" << std::endl;
+
     ds->numbest=int(sparsity*ds->numframes)+1;
     ds->numcols=3;
 
@@ -655,7 +1233,12 @@ namespace bisImageDistanceMatrix {
 
     std::stringstream strss;  strss <<  "Numbest=" << ds->numbest << ", expected total size=" << ds->numframes*ds->numbest;
     bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&temporalSparseThreadFunction,ds,strss.str(),NumberOfThreads,1);
-    combineVectorsToCreateSparseMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads);
+  }
+
+  // Stores the output of the temporal threads and deletes ds
+  static int storeTemporalSparseMatrix(bisMThreadStructure* ds,bisSimpleMatrix<double>* Output,int NumberOfThreads)
+  {
+    combineVectorsToCreateSparseMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads,1);
     std::cout << "Total Rows=" << Output->getNumRows() << " frames=" << ds->numframes << std::endl;
     double density=100.0*Output->getNumRows()/(double(ds->numframes*ds->numframes));
     std::cout << "++++ Sparse matrix done. Final density: num_rows=" << ds->numframes << " density=" << density << "% (components=" << Output->getNumCols() << ")" << std::endl;
@@ -663,9 +1246,54 @@ namespace bisImageDistanceMatrix {
     return 1;
   }
 
+  static int storeTemporalSparseMatrix(bisMThreadStructure* ds,bisSparseMatrix* Output,int NumberOfThreads)
+  {
+    int ok=combineVectorsToCreateCSRMatrix(Output,ds->output_array,ds->numcols,NumberOfThreads,ds->numframes,0,NumberOfThreads);
+    delete ds;
+    return ok;
+  }
+
+  int createSparseMatrixParallelTemporal(bisSimpleImage<float>* Input,
+                                         bisSimpleMatrix<double>* Output,
+                                         float sparsity,int numthreads)
+  {
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createTemporalThreadStructure(Input);
+    computeTemporalSparseMatrixThreads(ds,sparsity,NumberOfThreads);
+    return storeTemporalSparseMatrix(ds,Output,NumberOfThreads);
+  }
 
+  int createSparseMatrixParallelTemporal(bisSimpleImage<float>* Input,
+                                         bisSparseMatrix* Output,
+                                         float sparsity,int numthreads)
+  {
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createTemporalThreadStructure(Input);
+    computeTemporalSparseMatrixThreads(ds,sparsity,NumberOfThreads);
+    return storeTemporalSparseMatrix(ds,Output,NumberOfThreads);
+  }
 
+  // Same as above for the frames of a patch view, equal to using the output of reformatImage without storing it
+  // (static as bisPatchView is only defined in this file)
+  static int createSparseMatrixParallelTemporal(bisPatchView* Input,
+                                                bisSimpleMatrix<double>* Output,
+                                                float sparsity,int numthreads)
+  {
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createTemporalThreadStructure(Input);
+    computeTemporalSparseMatrixThreads(ds,sparsity,NumberOfThreads);
+    return storeTemporalSparseMatrix(ds,Output,NumberOfThreads);
+  }
 
+  static int createSparseMatrixParallelTemporal(bisPatchView* Input,
+                                                bisSparseMatrix* Output,
+                                                float sparsity,int numthreads)
+  {
+    int NumberOfThreads=numthreads;
+    bisMThreadStructure* ds=createTemporalThreadStructure(Input);
+    computeTemporalSparseMatrixThreads(ds,sparsity,NumberOfThreads);
+    return storeTemporalSparseMatrix(ds,Output,NumberOfThreads);
+  }
 
 
   // ----------------------------------------------------------------------------------
@@ -673,111 +1301,42 @@ namespace bisImageDistanceMatrix {
   // -------------------------- reformat Image Code -- make patches into frames
 
 
-  static void reformatThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data) {
-
-    bisMImagePair   *ds = (bisMImagePair *)(data->UserData);
-    int thread=data->ThreadID;
-    int numthreads=data->NumberOfThreads;
-
-    int slicerange[2];
-    bisImageDistanceMatrix_ComputeFraction(thread,numthreads,ds->dim[2],slicerange);
-    if (slicerange[1]==0)
-      slicerange[1]=1;
-
-    std::cout << "++++ reformatImage Thread(" << thread << ") radius=" << ds->radius[0] << "," << ds->radius[1] << "," << ds->radius[2];
-    std::cout << ", computing slices " << slicerange[0] << "->" << slicerange[1] << " numframes=" << ds->numframes << std::endl;
-
-
-    int volumesize=ds->dim[0]*ds->dim[1]*ds->dim[2];
-    int slicesize=ds->dim[0]*ds->dim[1];
-
-    int voxel=slicerange[0]*slicesize;
-
-    for (int k=slicerange[0];k<slicerange[1];k++) {
-      for (int j=0;j<ds->dim[1];j++) {
-        for (int i=0;i<ds->dim[0];i++) {
-
-          int frame=0;
-
-          for (int ka=-ds->radius[2];ka<=ds->radius[2];ka++) {
-            int newk=k+ka*ds->increment[2];
-            if (newk<0)
-              newk=0;
-            else if (newk>=ds->dim[2])
-              newk=ds->dim[2]-1;
-
-            //std::cout << "ka = " << ka << "-->" << newk << std::endl;
-
-            for (int ja=-ds->radius[1];ja<=ds->radius[1];ja++) {
-              int newj=j+ja*ds->increment[1];
-              if (newj<0)
-                newj=0;
-              else if (newj>=ds->dim[1])
-                newj=ds->dim[1]-1;
-
-              //std::cout << "ja = " << ja << "-->" << newj << std::endl;
-
-              for (int ia=-ds->radius[0];ia<=ds->radius[0];ia++) {
-                int newi=i+ia*ds->increment[0];
-                if (newi<0)
-                  newi=0;
-                else if (newi>=ds->dim[0])
-                  newi=ds->dim[0]-1;
-
-
+  // Stores the patch view in output (allocated to the exact size, dim[3]=number of patch voxels). The image is
+  // written a block of rows at a time (all frames of a block), the blocks run in parallel on bisThreadPool.
+  static int reformatImage(bisPatchView* view,bisSimpleImage<float>* output,float spa[5],int NumberOfThreads=4) {
 
-                ds->odata[volumesize*frame+voxel]=ds->idata[newk*slicesize+newj*ds->dim[0]+newi];
-                ++frame;
-              } //ia
-            } //ja
-          } //ka
-          ++voxel;
-        } //i
-      } //j
-    } //k
+    int dim[5] = { view->dim[0],view->dim[1],view->dim[2],view->numframes,1 };
+    output->allocateIfDifferent(dim,spa);
 
+    std::cout << "++++ Allocating output image " << dim[0] << "*" << dim[1] << "*" << dim[2] << ", numframes=" << view->numframes << std::endl;
+    std::cout << "++++ \t radius = " << view->radius[0] << "," << view->radius[1] << "," << view->radius[2] << std::endl;
 
+    float* odata=output->getImageData();
+    long rowlength=dim[0];
+    long numrows=view->numvoxels/rowlength;
+    long blockrows=1+1023/rowlength;
+    long numblocks=(numrows+blockrows-1)/blockrows;
 
+    bisThreadPool::parallelFor(0,numblocks,1,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG block=begin;block<end;block++)
+          {
+            long firstrow=block*blockrows;
+            long lastrow=std::min(firstrow+blockrows,numrows);
+            for (int frame=0;frame<view->numframes;frame++)
+              {
+                float* out=odata+long(frame)*view->numvoxels+firstrow*rowlength;
+                for (long row=firstrow;row<lastrow;row++)
+                  view->getRow(frame,row,out+(row-firstrow)*rowlength);
+              }
+          }
+      },NumberOfThreads);
+    return view->numframes;
   }
 
-
   int reformatImage(bisSimpleImage<float>* input, bisSimpleImage<float>* output,int radius[3],int increment[3],int NumberOfThreads=4) {
-
-    // First copy data around
-    int numframes=1;
-    for (int i=0;i<=2;i++) {
-      if (increment[i]<1)
-        increment[i]=1;
-      if (increment[i]>4)
-        increment[i]=4;
-      if (radius[i]<1)
-        radius[i]=1;
-      else if (radius[i]>4)
-        radius[i]=4;
-      numframes=numframes*(1+2*radius[i]);
-    }
-
-    int dim[5]; input->getDimensions(dim);
-    dim[3]=numframes; dim[4]=1;
+    bisPatchView view(input,radius,increment);
     float spa[5]; input->getSpacing(spa);
-    output->allocateIfDifferent(dim,spa);
-
-    std::cout << "++++ Allocating output image " << dim[0] << "*" << dim[1] << "*" << dim[2] << ", numframes=" << numframes << std::endl;
-    std::cout << "++++ \t radius = " << radius[0] << "," << radius[1] << "," << radius[2] << std::endl;
-
-    bisMImagePair* ds=  new bisMImagePair();
-    ds->idata=input->getImageData();
-    ds->odata=output->getImageData();
-    for (int i=0;i<=2;i++) {
-      ds->dim[i]=dim[i];
-      ds->radius[i]=radius[i];
-      ds->increment[i]=increment[i];
-    }
-    ds->numframes=numframes;
-
-    bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&reformatThreadFunction,ds,"Reformat Image",NumberOfThreads);
-    delete ds;
-    return numframes;
+    return reformatImage(&view,output,spa,NumberOfThreads);
   }
 
   // End name space
@@ -787,147 +1346,126 @@ namespace bisImageDistanceMatrix {
 
 namespace bisSparseEigenSystem {
 
-
-
-  // sparseMatrix is output of createSparseMatrixParallel/createSparseMatrixRadius  4 columns i,j, dist and euc dist
-
-  int computeEigenVectors(bisSimpleMatrix<double>* sparseMatrix,
-                          bisSimpleImage<int>*     indexMap,
-                          bisSimpleImage<float>*   eigenVectors,
-                          int maxeigen=10,
-                          double sigma=1.0, double lambda=0.0,double tolerance=0.001,int maxiter=50,float scale=10000) {
-
-
 #ifndef _WIN32
+  // ----------------------------------------------------------------------------------
+  // Spectra matrix operation (y=M*x) for the normalized affinity matrix stored in the CSR distance matrix.
+  // The structure of the distance matrix is used as is (no copy), weights has one value (float or double) per
+  // stored entry and the products are accumulated in double. Each off-diagonal entry (r,c) stands for both M(r,c)
+  // and M(c,r), i.e. the matrix is symmetric and only one half is needed.
+  //
+  // The rows are split into a fixed number of blocks with about the same number of entries. Each block computes
+  // its own rows of y (the M(r,c) part) and adds the M(c,r) part to a private buffer that covers the columns it
+  // touches; the buffers are then added to y in block order, so the result does not depend on the number of threads.
+  template<class T> class bisCSRMatrixProduct {
 
-    int nt=sparseMatrix->getNumRows();
-    int nc=sparseMatrix->getNumCols();
-
-    if (nc!=4 || nt< 4) {
-      std::cerr << "Bad Distance Matrix " << nt << "*" << nc << std::endl;
-      return 0;
-    }
-
-    double* inp_dat=sparseMatrix->getData();
-    double r[2]; indexMap->getRange(r);
-    int numrows=int(r[1]);
-
-    std::cout << "+++++ Beginning sparse eigensystem: numelements=" << nt << " numrows=" << numrows << std::endl;
-
-    // Assume I have exponentiated and normalized
-    // 1. Compute Median
-    // 2. Exponentiate
-
-    // Inp_dat is an array of size nt*3
-
-
-
-    // Compute The Median
-    // Take every nth value to compute the median (for now n=1)
-    int samplerate=1;
-    int numvalues=int(nt/samplerate);
-    float* values=new float[numvalues];
-    for(int i=0;i<numvalues;i++) {
-      int offset=i*(nc*samplerate);
-      values[i]=inp_dat[offset+2]+lambda*inp_dat[offset+3];
+  public:
+    bisCSRMatrixProduct(bisSparseMatrix* m,const T* w,int nthreads) : matrix(m),weights(w),numthreads(nthreads) {
+
+      const int NUMBLOCKS=16;
+      int numrows=this->matrix->getNumRows();
+      const int* rowptr=this->matrix->getRowPointers();
+      const int* colind=this->matrix->getColumnIndices();
+      BISLONG numnonzero=this->matrix->getNumNonZero();
+
+      this->blockrows.push_back(0);
+      for (int b=1;b<NUMBLOCKS;b++)
+        {
+          int row=std::upper_bound(rowptr,rowptr+numrows+1,int(numnonzero*b/NUMBLOCKS))-rowptr-1;
+          if (row>this->blockrows.back())
+            this->blockrows.push_back(row);
+        }
+      if (numrows>this->blockrows.back())
+        this->blockrows.push_back(numrows);
+      int numblocks=this->blockrows.size()-1;
+
+      // Range of columns (other than its own rows) touched by each block and the offset of its buffer
+      this->colmin.resize(numblocks);
+      this->colmax.resize(numblocks);
+      this->bufferoffset.resize(numblocks+1);
+      this->bufferoffset[0]=0;
+      for (int b=0;b<numblocks;b++)
+        {
+          int cmin=numrows,cmax=-1;
+          for (int e=rowptr[this->blockrows[b]];e<rowptr[this->blockrows[b+1]];e++)
+            {
+              cmin=std::min(cmin,colind[e]);
+              cmax=std::max(cmax,colind[e]);
+            }
+          this->colmin[b]=cmin;
+          this->colmax[b]=cmax;
+          this->bufferoffset[b+1]=this->bufferoffset[b]+std::max(cmax-cmin+1,0);
+        }
+      this->buffer.resize(this->bufferoffset[numblocks]);
+      std::cout << "+++++ CSR product: rows=" << numrows << " entries=" << numnonzero << " blocks=" << numblocks
+                << " buffer=" << this->buffer.size() << " weights=" << sizeof(T)*8 << "-bit" << std::endl;
     }
-    float median=bisImageDistanceMatrix::selectKthLargest(numvalues/2,numvalues,values);
-    delete [] values;
-    if (median<0.00001)
-      median=0.00001;
-    if (sigma<0.0001)
-      sigma=0.0001;
-    double factor=1.0/(median*sigma);
-
-
-    std::cout << "+++++ Computing Degree ... median= " << median << "factor= " << factor << " lamda=" << lambda << " sigma=" << sigma << std::endl;
-
-
-    // remember row,col in input sparse matrix triple are 1-offset so subtract 1 for row,col
-    BISTYPE* D=new BISTYPE[numrows];
-    for (int i=0;i<numrows;i++)
-      D[i]=0.0;
-    int index=0;
-
-    int minrow=(int)inp_dat[0],maxrow=(int)inp_dat[0];
-
-
-    for (int i=0;i<nt;i++)
-      {
-        int row=(long)inp_dat[index]-1;
-        double v2=inp_dat[index+2]+lambda*inp_dat[index+3];
-        double v=exp(-v2*factor);
-
-        //        inp_dat[index+2]=v;
-        //      if (row%step==0 && abs(col-row)<10 )
-        //fprintf(stdout,"Reporting %d,%d = \t %f->%f\n",row,col,v2,v);
-
-        D[row]+=v;
-        if (row<minrow)
-          minrow=row;
-        else if (row>maxrow)
-          maxrow=row;
-        index+=nc;
-      }
-
-    std::cout << "++++ Minrow=" << minrow << "\t maxrow=" << maxrow << std::endl;
 
-    // Compute Dinv plus regularizer
-    int step=numrows/7;
-    for (int row=0;row<numrows;row++)
-      {
-        D[row]=1.0/sqrt(D[row]+1.0);
-        if (row%step == 0 || row==numrows-1)
-          std::cout << "+++++ 1.0/sqrt(Degree) row=" << row+1 << " D=" << D[row] << std::endl;
-      }
-
-
-    std::cout << "+++++ Storing in Sparse matrix " << numrows << "*" << numrows << std::endl;
-    // Store in Sparse Matrix
-    // remember row,col in input sparse matrix triple are 1-offset so subtract 1 for row,col -- Ignore
-
-    typedef Eigen::Triplet<BISTYPE> T;
-    std::vector<T> tripletList;
-    tripletList.reserve(nt*2);
-    index=0;
-    std::cout << "+++++ Allocated in Sparse matrix " << std::endl;
-    for(int i = 0; i < nt; i++) {
-      long row=(long)inp_dat[index]-1;
-      long col=(long)inp_dat[index+1]-1;
-      double v0=inp_dat[index+2]+lambda*inp_dat[index+3];
-      double v1=exp(-v0*factor);
-
-      if (row==col)
-	{
-	  // Add 0.5 regularizer to diagonal ...
-	  BISTYPE v=D[row]*D[row]*(v1+0.5);
-	  tripletList.push_back(T(row,col,v));
-	}
-      else
-	{
-	  BISTYPE v=0.5*D[row]*D[col]*v1;
-	  tripletList.push_back(T(row,col,v));
-	  tripletList.push_back(T(col,row,v));
-	}
-      index+=nc;
+    int rows() const { return this->matrix->getNumRows(); }
+    int cols() const { return this->matrix->getNumRows(); }
+
+    void perform_op(const BISTYPE* x_in,BISTYPE* y_out) const {
+
+      int numrows=this->matrix->getNumRows();
+      int numblocks=this->blockrows.size()-1;
+      const int* rowptr=this->matrix->getRowPointers();
+      const int* colind=this->matrix->getColumnIndices();
+
+      bisThreadPool::parallelFor(0,numblocks,1,[&](BISLONG begin,BISLONG end,int) {
+          for (BISLONG b=begin;b<end;b++)
+            {
+              BISTYPE* buf=&this->buffer[this->bufferoffset[b]]-this->colmin[b];
+              for (int c=this->colmin[b];c<=this->colmax[b];c++)
+                buf[c]=0.0;
+              for (int row=this->blockrows[b];row<this->blockrows[b+1];row++)
+                {
+                  BISTYPE sum=0.0;
+                  BISTYPE xr=x_in[row];
+                  for (int e=rowptr[row];e<rowptr[row+1];e++)
+                    {
+                      int col=colind[e];
+                      BISTYPE w=this->weights[e];
+                      sum+=w*x_in[col];
+                      if (col!=row)
+                        buf[col]+=w*xr;
+                    }
+                  y_out[row]=sum;
+                }
+            }
+        },this->numthreads);
+
+      bisThreadPool::parallelFor(0,numrows,4096,[&](BISLONG begin,BISLONG end,int) {
+          for (BISLONG row=begin;row<end;row++)
+            {
+              BISTYPE sum=y_out[row];
+              for (int b=0;b<numblocks;b++)
+                if (row>=this->colmin[b] && row<=this->colmax[b])
+                  sum+=this->buffer[this->bufferoffset[b]+row-this->colmin[b]];
+              y_out[row]=sum;
+            }
+        },this->numthreads);
     }
 
-    delete [] D;
-
-    std::cout << "+++++ Beginning eigendecomposition num triplets=" << tripletList.size() << std::endl;
-    // Now On To Solver from Spectra
-    Eigen::SparseMatrix<BISTYPE> M(numrows,numrows);
-    M.setFromTriplets(tripletList.begin(),tripletList.end());
-    std::cout << "+++++ Compressed Matrix created" << std::endl;
-
+  protected:
+    bisSparseMatrix* matrix;
+    const T* weights;
+    int numthreads;
+    std::vector<int> blockrows,colmin,colmax;
+    std::vector<BISLONG> bufferoffset;
+    mutable std::vector<BISTYPE> buffer;
+  };
 
-    Spectra::SparseGenMatProd<BISTYPE> op(M);
-    Spectra::SymEigsSolver< BISTYPE, Spectra::LARGEST_ALGE, Spectra::SparseGenMatProd<BISTYPE> > eigs(&op,  maxeigen, maxeigen*2);
+  // ----------------------------------------------------------------------------------
+  // Computes the largest eigenvectors of op and stores them (scaled) in eigenVectors, one frame per eigenvector
+  template<class OP> int solveAndStoreEigenVectors(OP* op,bisSimpleImage<int>* indexMap,bisSimpleImage<float>* eigenVectors,
+                                                   int maxeigen,double tolerance,int maxiter,float scale)
+  {
+    Spectra::SymEigsSolver< BISTYPE, Spectra::LARGEST_ALGE, OP > eigs(op,  maxeigen, maxeigen*2);
 
     eigs.init();
     std::cout << "+++++ Init Done on to Compute " << maxeigen << " Eigenvalues (tolerance=" << tolerance << " maxiter=" << maxiter << ")" << std::endl;
 
     int nconv = eigs.compute(maxiter,tolerance);
+    std::cout << "+++++ Iterations=" << eigs.num_iterations() << " matrix products=" << eigs.num_operations() << std::endl;
 
     // Retrieve results
     if(eigs.info() != Spectra::SUCCESSFUL) {
@@ -946,8 +1484,10 @@ namespace bisSparseEigenSystem {
       std::cout << "+++++\t Eigenvalue " << ia+1 << "/" << numeigen << " = " << l << std::endl;
     }
 
-    int numeigenrows=eigs.eigenvectors().rows();
-    int numeigencols=eigs.eigenvectors().cols();
+    // eigenvectors() returns a copy, keep it while its data is used below
+    Eigen::Matrix<BISTYPE,Eigen::Dynamic,Eigen::Dynamic> evecs=eigs.eigenvectors();
+    int numeigenrows=evecs.rows();
+    int numeigencols=evecs.cols();
 
     std::cout << "+++++ numeigenrows*numeigencols=" << numeigenrows << "*" << numeigencols << std::endl;
     std::cout.flush();
@@ -961,7 +1501,20 @@ namespace bisSparseEigenSystem {
     float* eig_dat=eigenVectors->getImageData();
 
     int* ind_dat=indexMap->getImageData();
-    BISTYPE *eigcolmajor=eigs.eigenvectors().data();
+    BISTYPE *eigcolmajor=evecs.data();
+
+    // The sign of an eigenvector is arbitrary (it can change with the starting vector or the thread count),
+    // store each one with its largest magnitude component positive
+    for (int frame=0;frame<numeigencols;frame++) {
+      BISTYPE* col=eigcolmajor+BISLONG(frame)*numeigenrows;
+      int best=0;
+      for (int row=1;row<numeigenrows;row++)
+        if (fabs(col[row])>fabs(col[best]))
+          best=row;
+      if (col[best]<0.0)
+        for (int row=0;row<numeigenrows;row++)
+          col[row]=-col[row];
+    }
 
     int volumesize=dim[0]*dim[1]*dim[2];
     int eleventh=volumesize/11;
@@ -987,11 +1540,164 @@ namespace bisSparseEigenSystem {
     eigenVectors->getRange(range);
     std::cout << "+++++ Range of eigenvector image =" << range[0] << ":" << range[1] << " Numeigen=" << numeigen << std::endl;
     return numeigen;
+  }
+
+
+  // ----------------------------------------------------------------------------------
+  // Computes the weights of the normalized affinity matrix (one per entry of the CSR distance matrix,
+  // component 0 = distance, component 1 = euclidean distance) in two parallel passes over the rows:
+  // the first evaluates exp(-v*factor) once per entry and sums the degree of each row, the second scales the
+  // entries by the degrees. The median of v is estimated from at most MAX_MEDIAN_SAMPLES entries
+  // (exact for smaller matrices, see estimateMedianDistance).
+  // dist and euclid (may be 0) are the two components in the entry order of sparseMatrix (its own values or a double copy)
+  template<class T,class V> void computeAffinityWeights(bisSparseMatrix* sparseMatrix,const V* dist,const V* euclid,
+                                                        double sigma,double lambda,T* weights,int numthreads)
+  {
+    const BISLONG MAX_MEDIAN_SAMPLES=1<<20;
+    int numrows=sparseMatrix->getNumRows();
+    BISLONG nt=sparseMatrix->getNumNonZero();
+    const int* rowptr=sparseMatrix->getRowPointers();
+    const int* colind=sparseMatrix->getColumnIndices();
+
+    float median=bisImageDistanceMatrix::estimateMedianDistance(dist,euclid,lambda,nt,MAX_MEDIAN_SAMPLES);
+    if (median<0.00001)
+      median=0.00001;
+    if (sigma<0.0001)
+      sigma=0.0001;
+    double factor=1.0/(median*sigma);
+
+    std::cout << "+++++ Computing Degree ... median= " << median << "factor= " << factor << " lamda=" << lambda << " sigma=" << sigma
+              << " (samples=" << std::min(nt,MAX_MEDIAN_SAMPLES) << "/" << nt << ")" << std::endl;
+
+    std::vector<BISTYPE> D(numrows,0.0);
+    bisThreadPool::parallelFor(0,numrows,1024,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG row=begin;row<end;row++)
+          {
+            BISTYPE sum=0.0;
+            for (int e=rowptr[row];e<rowptr[row+1];e++)
+              {
+                double v=dist[e];
+                if (euclid)
+                  v+=lambda*euclid[e];
+                weights[e]=exp(-v*factor);
+                sum+=weights[e];
+              }
+            D[row]=1.0/sqrt(sum+1.0);
+          }
+      },numthreads);
+
+    // Add 0.5 regularizer to diagonal ...
+    bisThreadPool::parallelFor(0,numrows,1024,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG row=begin;row<end;row++)
+          {
+            for (int e=rowptr[row];e<rowptr[row+1];e++)
+              {
+                int col=colind[e];
+                if (col==row)
+                  weights[e]=D[row]*D[row]*(weights[e]+0.5);
+                else
+                  weights[e]=0.5*D[row]*D[col]*weights[e];
+              }
+          }
+      },numthreads);
+  }
+#endif
+
+  // Eigenvectors of the CSR matrix sparseMatrix using the distances dist/euclid (V=float: the matrix values,
+  // V=double: a double copy of the COO input), see the two versions below
+  template<class V> int computeEigenVectorsFromDistances(bisSparseMatrix* sparseMatrix,const V* dist,const V* euclid,
+                                                         bisSimpleImage<int>*     indexMap,
+                                                         bisSimpleImage<float>*   eigenVectors,
+                                                         int maxeigen,double sigma, double lambda,double tolerance,int maxiter,float scale,
+                                                         int singleprecision,int numthreads) {
+
+#ifndef _WIN32
+
+    int numrows=sparseMatrix->getNumRows();
+    int nt=sparseMatrix->getNumNonZero();
+    double r[2]; indexMap->getRange(r);
+
+    if (nt< 4 || numrows!=int(r[1])) {
+      std::cerr << "Bad Distance Matrix " << numrows << "*" << sparseMatrix->getNumCols() << " entries=" << nt << " (indexmap max=" << r[1] << ")" << std::endl;
+      return 0;
+    }
+
+    std::cout << "+++++ Beginning sparse eigensystem: numelements=" << nt << " numrows=" << numrows << " numthreads=" << numthreads << std::endl;
+
+    std::cout << "+++++ Beginning eigendecomposition num entries=" << nt << std::endl;
+    if (singleprecision) {
+      std::vector<float> weights(nt);
+      computeAffinityWeights(sparseMatrix,dist,euclid,sigma,lambda,&weights[0],numthreads);
+      bisCSRMatrixProduct<float> op(sparseMatrix,&weights[0],numthreads);
+      return solveAndStoreEigenVectors(&op,indexMap,eigenVectors,maxeigen,tolerance,maxiter,scale);
+    }
+
+    std::vector<double> weights(nt);
+    computeAffinityWeights(sparseMatrix,dist,euclid,sigma,lambda,&weights[0],numthreads);
+    bisCSRMatrixProduct<double> op(sparseMatrix,&weights[0],numthreads);
+    return solveAndStoreEigenVectors(&op,indexMap,eigenVectors,maxeigen,tolerance,maxiter,scale);
 #else
     return 0;
 #endif
   }
 
+  // sparseMatrix is the CSR distance matrix (see bisImageDistanceMatrix), component 0 = distance, component 1 = euclidean distance
+  // The matrix is used in place, only the weights (float if singleprecision>0) are allocated.
+  int computeEigenVectors(bisSparseMatrix* sparseMatrix,
+                          bisSimpleImage<int>*     indexMap,
+                          bisSimpleImage<float>*   eigenVectors,
+                          int maxeigen=10,
+                          double sigma=1.0, double lambda=0.0,double tolerance=0.001,int maxiter=50,float scale=10000,
+                          int singleprecision=0,int numthreads=4) {
+
+    const float* euclid=0;
+    if (sparseMatrix->getNumComponents()>1)
+      euclid=sparseMatrix->getValues(1);
+    return computeEigenVectorsFromDistances(sparseMatrix,sparseMatrix->getValues(0),euclid,indexMap,eigenVectors,
+                                            maxeigen,sigma,lambda,tolerance,maxiter,scale,
+                                            singleprecision,numthreads);
+  }
+
+  // sparseMatrix is output of createSparseMatrixParallel/createSparseMatrixRadius  4 columns i,j, dist and euc dist
+  // (stored as a CSR matrix and passed to the version above). Unless singleprecision>0 the distances are kept
+  // in double (the float values of the CSR matrix are not used).
+  int computeEigenVectors(bisSimpleMatrix<double>* sparseMatrix,
+                          bisSimpleImage<int>*     indexMap,
+                          bisSimpleImage<float>*   eigenVectors,
+                          int maxeigen=10,
+                          double sigma=1.0, double lambda=0.0,double tolerance=0.001,int maxiter=50,float scale=10000,
+                          int singleprecision=0,int numthreads=4) {
+
+    int nt=sparseMatrix->getNumRows();
+    int nc=sparseMatrix->getNumCols();
+
+    if (nc!=4 || nt< 4) {
+      std::cerr << "Bad Distance Matrix " << nt << "*" << nc << std::endl;
+      return 0;
+    }
+
+    double r[2]; indexMap->getRange(r);
+    bisSparseMatrix csr("csr");
+    std::vector<int> slots(nt);
+    if (!csr.importCOO(sparseMatrix,int(r[1]),1,&slots[0]))
+      return 0;
+
+    if (singleprecision)
+      return computeEigenVectors(&csr,indexMap,eigenVectors,maxeigen,sigma,lambda,tolerance,maxiter,scale,
+                                 singleprecision,numthreads);
+
+    std::vector<double> dist(nt),euclid(nt);
+    double* dat=sparseMatrix->getData();
+    for (int i=0;i<nt;i++)
+      {
+        dist[slots[i]]=dat[BISLONG(i)*4+2];
+        euclid[slots[i]]=dat[BISLONG(i)*4+3];
+      }
+    return computeEigenVectorsFromDistances(&csr,&dist[0],&euclid[0],indexMap,eigenVectors,
+                                            maxeigen,sigma,lambda,tolerance,maxiter,scale,
+                                            singleprecision,numthreads);
+  }
+
   // ----------------------------------------------------------------------------------
 
   int eigenvectorDenoiseImage(bisSimpleImage<float>* Input,
@@ -1056,7 +1762,9 @@ namespace bisSparseEigenSystem {
  * @param input serialized 4D input file as unsigned char array
  * @param objectmap serialized input objectmap as unsigned char array
  * @param jsonstring the parameter string for the algorithm
- * { "useradius" : false, "radius" : 2.0, sparsity : 0.01, numthreads: 4}
+ * { "useradius" : false, "radius" : 2.0, sparsity : 0.01, knn : 0, numthreads: 4, csr : false }
+ * knn (sparsity only) selects the nearest neighbor search: 0 = compare all pairs, 1 = exact k-NN graph (blocked), 2 = approximate (NN-descent)
+ * if csr is true the output is a serialized bisSparseMatrix (float values) instead of the double COO matrix
  * @param debug if > 0 print debug messages
  * @returns a pointer to the sparse distance matrix serialized
  */
@@ -1071,6 +1779,8 @@ unsigned char* computeImageDistanceMatrixWASM(unsigned char* input, unsigned cha
   if (debug)
     params->print();
 
+  // Unlike the smoothing/GLM wrappers there is no data type dispatch here: the distance kernels (and the k-NN
+  // blocks) compare float time series many times per voxel, so a non-float input is converted once on linking
   std::unique_ptr<bisSimpleImage<float> > inp_image(new bisSimpleImage<float>("inp_image"));
   if (!inp_image->linkIntoPointer(input))
     return 0;
@@ -1092,7 +1802,9 @@ unsigned char* computeImageDistanceMatrixWASM(unsigned char* input, unsigned cha
   int useradius=params->getBooleanValue("useradius",true);
   float radius=params->getFloatValue("radius",2.0);
   float sparsity=params->getFloatValue("sparsity",0.01);
+  int knn=params->getIntValue("knn",0);
   int numthreads=params->getIntValue("numthreads",4);
+  int csr=params->getBooleanValue("csr",0);
 #ifdef _WIN32
   if (numthreads>1) {
 	std::cout << ".... Windows: forcing numthreads=" << 1 << std::endl;
@@ -1112,12 +1824,29 @@ unsigned char* computeImageDistanceMatrixWASM(unsigned char* input, unsigned cha
 
 
   std::unique_ptr<bisSimpleImage<int> > indexmap(bisImageDistanceMatrix::createIndexMap(obj_image.get()));
+
+  if (csr) {
+    std::unique_ptr<bisSparseMatrix> CSROutput(new bisSparseMatrix("combined"));
+    if (useradius)
+      ok=bisImageDistanceMatrix::createRadiusMatrixParallel(inp_image.get(),obj_image.get(),indexmap.get(),CSROutput.get(),radius,numthreads);
+    else if (knn>0)
+      ok=bisImageDistanceMatrix::createSparseMatrixKNN(inp_image.get(),obj_image.get(),indexmap.get(),CSROutput.get(),sparsity,knn>1,numthreads);
+    else
+      ok=bisImageDistanceMatrix::createSparseMatrixParallel(inp_image.get(),obj_image.get(),indexmap.get(),CSROutput.get(),sparsity,numthreads);
+    if (!ok)
+      return 0;
+    return CSROutput->releaseAndReturnRawArray();
+  }
+
   std::unique_ptr<bisSimpleMatrix<double> > Output(new bisSimpleMatrix<double>("combined"));
 
   if (useradius) {
     bisImageDistanceMatrix::createRadiusMatrixParallel(inp_image.get(),obj_image.get(),indexmap.get(),Output.get(),radius,numthreads);
   } else {
-    bisImageDistanceMatrix::createSparseMatrixParallel(inp_image.get(),obj_image.get(),indexmap.get(),Output.get(),sparsity,numthreads);
+    if (knn>0)
+      bisImageDistanceMatrix::createSparseMatrixKNN(inp_image.get(),obj_image.get(),indexmap.get(),Output.get(),sparsity,knn>1,numthreads);
+    else
+      bisImageDistanceMatrix::createSparseMatrixParallel(inp_image.get(),obj_image.get(),indexmap.get(),Output.get(),sparsity,numthreads);
   }
 
   return Output->releaseAndReturnRawArray();
@@ -1127,7 +1856,10 @@ unsigned char* computeImageDistanceMatrixWASM(unsigned char* input, unsigned cha
 /** Computes a sparse temporal distance matrix among frames in the image (patches perhaps)
  * @param input serialized 4D input file as unsigned char array
  * @param jsonstring the parameter string for the algorithm
- * { sparsity : 0.01, numthreads: 4 }
+ * { sparsity : 0.01, numthreads: 4, patchradius : 0, increment : 1, csr : false }
+ * if patchradius > 0 the frames are the patch offsets of a 3D image, i.e. the same as using the output of
+ * createPatchReformatedImage (with radius=patchradius) but without creating it
+ * if csr is true the output is a serialized bisSparseMatrix (float values) instead of the double COO matrix
  * @param debug if > 0 print debug messages
  * @returns a pointer to the sparse distance matrix serialized
  */
@@ -1142,12 +1874,16 @@ unsigned char* computeTemporalImageDistanceMatrixWASM(unsigned char* input,const
   if (debug)
     params->print();
 
+  // Float input as in computeImageDistanceMatrixWASM (non-float images are converted once on linking)
   std::unique_ptr<bisSimpleImage<float> > inp_image(new bisSimpleImage<float>("inp_image"));
   if (!inp_image->linkIntoPointer(input))
     return 0;
 
   float sparsity=params->getFloatValue("sparsity",0.01);
   int numthreads=params->getIntValue("numthreads",4);
+  int patchradius=params->getIntValue("patchradius",0);
+  int increment=params->getIntValue("increment",1);
+  int csr=params->getBooleanValue("csr",0);
 
 #ifdef _WIN32
   if (numthreads>1) {
@@ -1162,11 +1898,34 @@ unsigned char* computeTemporalImageDistanceMatrixWASM(unsigned char* input,const
     std::cout << ".... Beginning temporal image distance matrix computation " << std::endl;
     int dim[5]; inp_image->getDimensions(dim);
     std::cout << "....      Input  dimensions=" << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << "," << dim[4] << std::endl;
+    if (patchradius>0)
+      std::cout << "....      Patch radius=" << patchradius << " increment=" << increment << std::endl;
   }
 
 
   std::unique_ptr<bisSimpleMatrix<double> > Output(new bisSimpleMatrix<double>("combined"));
-  bisImageDistanceMatrix::createSparseMatrixParallelTemporal(inp_image.get(),Output.get(),sparsity,numthreads);
+  std::unique_ptr<bisSparseMatrix> CSROutput(new bisSparseMatrix("combined"));
+  if (patchradius>0)
+    {
+      int rad[3] = { patchradius,patchradius,patchradius };
+      int incr[3] = { increment,increment,increment };
+      bisImageDistanceMatrix::bisPatchView view(inp_image.get(),rad,incr);
+      if (csr)
+        ok=bisImageDistanceMatrix::createSparseMatrixParallelTemporal(&view,CSROutput.get(),sparsity,numthreads);
+      else
+        ok=bisImageDistanceMatrix::createSparseMatrixParallelTemporal(&view,Output.get(),sparsity,numthreads);
+    }
+  else
+    {
+      if (csr)
+        ok=bisImageDistanceMatrix::createSparseMatrixParallelTemporal(inp_image.get(),CSROutput.get(),sparsity,numthreads);
+      else
+        ok=bisImageDistanceMatrix::createSparseMatrixParallelTemporal(inp_image.get(),Output.get(),sparsity,numthreads);
+    }
+  if (!ok)
+    return 0;
+  if (csr)
+    return CSROutput->releaseAndReturnRawArray();
   return Output->releaseAndReturnRawArray();
 }
 
@@ -1266,9 +2025,16 @@ unsigned char* computeSparseImageEigenvectorsWASM(unsigned char* input, unsigned
   if (debug)
     params->print();
 
+  // The distance matrix is either the COO matrix or (from native code) a bisSparseMatrix, used in place
   std::unique_ptr<bisSimpleMatrix<double> > dist_matrix(new bisSimpleMatrix<double>("inp_matrix"));
-  if (!dist_matrix->linkIntoPointer(input))
+  std::unique_ptr<bisSparseMatrix> csr_matrix;
+  if (((int*)input)[0]==bisDataTypes::s_sparsematrix) {
+    csr_matrix.reset(new bisSparseMatrix("inp_csr"));
+    if (!csr_matrix->linkIntoPointer(input))
+      return 0;
+  } else if (!dist_matrix->linkIntoPointer(input)) {
     return 0;
+  }
 
   std::unique_ptr<bisSimpleImage<int> > obj_image(new bisSimpleImage<int>("indexmap_image"));
   if (!obj_image->linkIntoPointer(indexmap))
@@ -1280,14 +2046,19 @@ unsigned char* computeSparseImageEigenvectorsWASM(unsigned char* input, unsigned
   float  tolerance=params->getFloatValue("tolerance",1.0e-5);
   int iter=params->getIntValue("maxiter",500);
   float scale=params->getFloatValue("scale",10000);
+  int singleprecision=params->getBooleanValue("singleprecision",false);
+  int numthreads=params->getIntValue("numthreads",4);
 
   if (debug)  {
     std::cout << "........................" << std::endl;
     std::cout << ".... Beginning image distance matrix computation " << std::endl;
-    int rows=dist_matrix->getNumRows();
-    int cols=dist_matrix->getNumCols();
-
-    std::cout << "....      Input  Matrix=" << rows << "*" << cols << std::endl;
+    if (csr_matrix) {
+      std::cout << "....      Input  CSR Matrix=" << csr_matrix->getNumRows() << "*" << csr_matrix->getNumCols() << " entries=" << csr_matrix->getNumNonZero() << std::endl;
+    } else {
+      int rows=dist_matrix->getNumRows();
+      int cols=dist_matrix->getNumCols();
+      std::cout << "....      Input  Matrix=" << rows << "*" << cols << std::endl;
+    }
     int dim[5]; obj_image->getDimensions(dim);
     std::cout << "....      Indexmap  dimensions=" << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << "," << dim[4] << std::endl;
     std::cout << "........................" << std::endl << std::endl;
@@ -1295,8 +2066,14 @@ unsigned char* computeSparseImageEigenvectorsWASM(unsigned char* input, unsigned
 
 
   std::unique_ptr<bisSimpleImage<float> > Output(new bisSimpleImage<float>("eigenvect"));
-  bisSparseEigenSystem::computeEigenVectors(dist_matrix.get(),obj_image.get(),Output.get(),
-                                            maxeigen,sigma,lambda,tolerance,iter,scale);
+  if (csr_matrix)
+    bisSparseEigenSystem::computeEigenVectors(csr_matrix.get(),obj_image.get(),Output.get(),
+                                              maxeigen,sigma,lambda,tolerance,iter,scale,
+                                              singleprecision,numthreads);
+  else
+    bisSparseEigenSystem::computeEigenVectors(dist_matrix.get(),obj_image.get(),Output.get(),
+                                              maxeigen,sigma,lambda,tolerance,iter,scale,
+                                              singleprecision,numthreads);
   return Output->releaseAndReturnRawArray();
 }
 
@@ -24,13 +24,32 @@
 
 #include <vector>
 
+namespace bisImageDistanceMatrix {
+
+  /** Estimates the median of dist[e]+lambda*euclid[e] (e=0..n-1) from at most maxsamples entries (exact if n<=maxsamples).
+   * The samples are the entries (i*stride) mod n with stride coprime to n and close to n times the golden ratio,
+   * so they are distinct and spread over the whole array without lining up with the row structure of a sparse matrix
+   * @param dist the first component
+   * @param euclid the second component (may be 0)
+   * @param lambda the weight of the second component
+   * @param n the number of entries
+   * @param maxsamples the maximum number of entries to use
+   * @returns the median
+   */
+  float estimateMedianDistance(const float* dist,const float* euclid,double lambda,BISLONG n,BISLONG maxsamples=1048576);
+  float estimateMedianDistance(const double* dist,const double* euclid,double lambda,BISLONG n,BISLONG maxsamples=1048576);
+}
+
 extern "C" {
 
   /** Computes a sparse distance matrix among voxels in the image
-   * @param input serialized 4D input file as unsigned char array 
+   * @param input serialized 4D input file as unsigned char array (any type, converted to float)
    * @param objectmap serialized input objectmap as unsigned char array 
    * @param jsonstring the parameter string for the algorithm 
-   * { "useradius" : false, "radius" : 2.0, sparsity : 0.01, numthreads: 4 }
+   * { "useradius" : false, "radius" : 2.0, sparsity : 0.01, knn : 0, numthreads: 4, csr : false }
+   * knn (sparsity only) selects the nearest neighbor search: 0 = compare all pairs, 1 = exact k-NN graph (blocked), 2 = approximate (NN-descent)
+   * if csr is true the output is a serialized bisSparseMatrix (float values, used in place by computeSparseImageEigenvectorsWASM)
+   * instead of the double COO matrix
    * @param debug if > 0 print debug messages
    * @returns a pointer to the sparse distance matrix serialized 
    */
@@ -62,7 +81,10 @@ extern "C" {
   /** Computes a sparse temporal distance matrix among frames in the image (patches perhaps)
    * @param input serialized 4D input file as unsigned char array 
    * @param jsonstring the parameter string for the algorithm 
-   * { sparsity : 0.01, numthreads: 4 }
+   * { sparsity : 0.01, numthreads: 4, patchradius : 0, increment : 1, csr : false }
+   * if patchradius > 0 the frames are the patch offsets of a 3D image, i.e. the same as using the output of
+   * createPatchReformatedImage (with radius=patchradius) but without creating it
+   * if csr is true the output is a serialized bisSparseMatrix (float values) instead of the double COO matrix
    * @param debug if > 0 print debug messages
    * @returns a pointer to the sparse distance matrix serialized 
    */
@@ -81,13 +103,14 @@ extern "C" {
   BISEXPORT unsigned char* createPatchReformatedImage(unsigned char* input,const char* jsonstring,int debug);
 
   /** Compute sparse Eigen Vectors based on distance Matrix and IndexMap 
-   * @param sparseMatrix the sparse Matrix (output of computeImageDistanceMatrix)
+   * @param sparseMatrix the sparse Matrix (output of computeImageDistanceMatrix or a serialized bisSparseMatrix (CSR), used in place)
    * @param indexMap the indexMap image (output of computeImageIndexMap)
    * @param eigenVectors the output eigenVector image
    * @param jsonstring the parameter string for the algorithm 
-   * { "maxeigen" : 10, "sigma" : 1.0, "lambda" : 0.0, "tolerance" : 0.00001 , "maxiter" : 500, "scale" : 10000 }
+   * { "maxeigen" : 10, "sigma" : 1.0, "lambda" : 0.0, "tolerance" : 0.00001 , "maxiter" : 500, "scale" : 10000, "singleprecision" : false, "numthreads" : 4 }
+   * singleprecision if 1 the matrix weights are stored as float (products still accumulated in double)
    * @param debug if > 0 print debug messages
-   * @returns a pointer to the reformated image
+   * @returns a pointer to the eigenvector image
    */
   // BIS: { 'computeSparseImageEigenvectorsWASM', 'bisImage', [ 'Matrix', 'bisImage', 'ParamObj',  'debug' ] }
   BISEXPORT unsigned char* computeSparseImageEigenvectorsWASM(unsigned char* input, unsigned char* indexmap,const char* jsonstring,int debug);
@@ -0,0 +1,234 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+
+#ifndef _bis_ImageStream_h
+#define _bis_ImageStream_h
+
+#include "bisSimpleDataStructures.h"
+#include <fstream>
+#include <vector>
+
+/** @file bisImageStream.h
+
+    Streaming access to 4D images so that algorithms can run with memory bounded by a chunk size rather
+    than the size of the whole time series. A stream exposes the image in two orders:
+    - frames: a contiguous block of frames (frame index = frame+component*numframes, as in the serialized image)
+      -- used by frame independent operations (smoothing, reslicing)
+    - voxel blocks: a contiguous range of voxels with all frames, stored as buffer[frame*numvoxels+voxel]
+      -- used by voxel independent operations (GLM, regression, filtering)
+
+    Two implementations are provided, an in memory stream that wraps a bisSimpleImage and a file stream
+    that reads and writes an uncompressed .nii file on disk.
+*/
+
+/** Abstract interface for streaming image access */
+template<class T> class bisAbstractImageStream : public bisObject {
+
+public:
+
+  /** Constructor
+   * @param name used to set class name
+   */
+  bisAbstractImageStream(std::string name="imagestream");
+
+  /** Destructor */
+  virtual ~bisAbstractImageStream();
+
+  /** returns the dimensions
+   * @param dimensions the dimensions (all 5)
+   */
+  void getDimensions(int dimensions[5]);
+
+  /** returns the spacing
+   * @param spacing the spacing (all 5)
+   */
+  void getSpacing(float spacing[5]);
+
+  /** @returns the number of frames (frames*components) */
+  int getNumberOfFrames() { return this->dimensions[3]*this->dimensions[4]; }
+
+  /** @returns the number of voxels in a frame */
+  BISLONG getVolumeSize() { return BISLONG(this->dimensions[0])*BISLONG(this->dimensions[1])*BISLONG(this->dimensions[2]); }
+
+  /** Reads a block of frames
+   * @param begin the first frame
+   * @param number the number of frames
+   * @param buffer the output buffer (number*getVolumeSize() elements)
+   * @returns 1 if success 0 if failed
+   */
+  virtual int readFrames(int begin,int number,T* buffer)=0;
+
+  /** Writes a block of frames
+   * @param begin the first frame
+   * @param number the number of frames
+   * @param buffer the input buffer (number*getVolumeSize() elements)
+   * @returns 1 if success 0 if failed
+   */
+  virtual int writeFrames(int begin,int number,T* buffer)=0;
+
+  /** Reads a block of voxels with all frames
+   * @param begin the first voxel
+   * @param number the number of voxels
+   * @param buffer the output buffer (number*getNumberOfFrames() elements, stored as buffer[frame*number+voxel])
+   * @returns 1 if success 0 if failed
+   */
+  virtual int readVoxelBlock(BISLONG begin,BISLONG number,T* buffer)=0;
+
+  /** Writes a block of voxels with all frames
+   * @param begin the first voxel
+   * @param number the number of voxels
+   * @param buffer the input buffer (number*getNumberOfFrames() elements, stored as buffer[frame*number+voxel])
+   * @returns 1 if success 0 if failed
+   */
+  virtual int writeVoxelBlock(BISLONG begin,BISLONG number,T* buffer)=0;
+
+  /** Reads a block of frames into an image. The image is (re)allocated as x,y,z,number,1 if needed
+   * @param begin the first frame
+   * @param number the number of frames
+   * @param output the output image
+   * @returns 1 if success 0 if failed
+   */
+  int readFrames(int begin,int number,bisSimpleImage<T>* output);
+
+  /** Writes all frames of an image starting at frame begin
+   * @param begin the first frame
+   * @param input the input image (x,y,z must match this stream)
+   * @returns 1 if success 0 if failed
+   */
+  int writeFrames(int begin,bisSimpleImage<T>* input);
+
+protected:
+
+  /** Checks the range of a frame block */
+  int checkFrames(int begin,int number);
+
+  /** Checks the range of a voxel block */
+  int checkVoxels(BISLONG begin,BISLONG number);
+
+#ifndef DOXYGEN_SKIP
+  int dimensions[5];
+  float spacing[5];
+#endif
+
+};
+
+/** Image stream that wraps an existing image (the image is not owned by the stream) */
+template<class T> class bisMemoryImageStream : public bisAbstractImageStream<T> {
+
+public:
+
+  /** Constructor
+   * @param image the image to wrap
+   * @param name used to set class name
+   */
+  bisMemoryImageStream(bisSimpleImage<T>* image,std::string name="memoryimagestream");
+
+  /** Destructor */
+  virtual ~bisMemoryImageStream();
+
+  virtual int readFrames(int begin,int number,T* buffer);
+  virtual int writeFrames(int begin,int number,T* buffer);
+  virtual int readVoxelBlock(BISLONG begin,BISLONG number,T* buffer);
+  virtual int writeVoxelBlock(BISLONG begin,BISLONG number,T* buffer);
+
+protected:
+
+  /** The wrapped image */
+  bisSimpleImage<T>* image;
+};
+
+/** Image stream backed by an uncompressed .nii file. Files opened for reading may have any data type, the data is
+ * cast to T as it is read. Files created for writing store data of type T. */
+template<class T> class bisNIFTIFileImageStream : public bisAbstractImageStream<T> {
+
+public:
+
+  /** Constructor
+   * @param name used to set class name
+   */
+  bisNIFTIFileImageStream(std::string name="niftiimagestream");
+
+  /** Destructor, closes the file */
+  virtual ~bisNIFTIFileImageStream();
+
+  /** Opens an existing .nii file (NIFTI-1 or NIFTI-2, uncompressed, native byte order)
+   * @param filename the file to open
+   * @param writable if 1 the file is also opened for writing (data type must be T)
+   * @param debug if > 0 print debug messages
+   * @returns 1 if success 0 if failed
+   */
+  int openFile(std::string filename,int writable=0,int debug=0);
+
+  /** Creates a n_e_w NIFTI-1 .nii file of type T with the given size. The voxel data is zero.
+   * @param filename the file to create
+   * @param dimensions the dimensions of the image (5d)
+   * @param spacing the spacing of the image (5d)
+   * @param templateheader if not empty a NIFTI-1 header to copy (e.g. orientation) from (see getNIFTIHeader)
+   * @param debug if > 0 print debug messages
+   * @returns 1 if success 0 if failed
+   */
+  int createFile(std::string filename,int dimensions[5],float spacing[5],std::vector<unsigned char> templateheader=std::vector<unsigned char>(),int debug=0);
+
+  /** Closes the file */
+  void closeFile();
+
+  /** @returns the header of the file (348 bytes for NIFTI-1, 540 for NIFTI-2) */
+  std::vector<unsigned char> getNIFTIHeader() { return this->niftiheader; }
+
+  /** @returns the data type of the file (see \link bisDataTypes \endlink) */
+  int getFileDataType() { return this->file_data_type; }
+
+  virtual int readFrames(int begin,int number,T* buffer);
+  virtual int writeFrames(int begin,int number,T* buffer);
+  virtual int readVoxelBlock(BISLONG begin,BISLONG number,T* buffer);
+  virtual int writeVoxelBlock(BISLONG begin,BISLONG number,T* buffer);
+
+protected:
+
+  /** Reads number elements starting at element offset, casting from the file data type */
+  int readElements(BISLONG offset,BISLONG number,T* buffer);
+
+  /** Writes number elements starting at element offset (file data type must be T) */
+  int writeElements(BISLONG offset,BISLONG number,T* buffer);
+
+  /** Reads and casts for a file of type FT */
+  template<class FT> int readAndCast(BISLONG offset,BISLONG number,T* buffer,FT*);
+
+#ifndef DOXYGEN_SKIP
+  std::fstream file;
+  std::vector<unsigned char> niftiheader;
+  std::vector<unsigned char> staging;
+  BISLONG voxel_offset;
+  int file_data_type;
+  int writable;
+#endif
+
+private:
+
+  /** Copy constructor disabled */
+  bisNIFTIFileImageStream(const bisNIFTIFileImageStream&);
+  /** Assignment disabled */
+  void operator=(const bisNIFTIFileImageStream&);
+};
+
+
+#ifndef BIS_MANUAL_INSTANTIATION
+#include "bisImageStream.txx"
+#endif
+
+#endif
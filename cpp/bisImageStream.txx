@@ -0,0 +1,432 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+
+#ifndef _bis_ImageStream_txx
+#define _bis_ImageStream_txx
+
+#include "bisImageStream.h"
+#include "bisMemoryMappedImage.h"
+#include "bisDataTypes.h"
+#include <cstring>
+
+// ---------------------------------------------------------------------------------------------------
+// bisAbstractImageStream
+// ---------------------------------------------------------------------------------------------------
+template<class T> bisAbstractImageStream<T>::bisAbstractImageStream(std::string n) : bisObject(n) {
+
+  this->class_name="bisAbstractImageStream";
+  for (int ia=0;ia<=4;ia++) {
+    this->dimensions[ia]=0;
+    this->spacing[ia]=1.0;
+  }
+}
+
+template<class T> bisAbstractImageStream<T>::~bisAbstractImageStream() {
+
+}
+
+template<class T> void bisAbstractImageStream<T>::getDimensions(int dim[5]) {
+  for (int ia=0;ia<=4;ia++)
+    dim[ia]=this->dimensions[ia];
+}
+
+template<class T> void bisAbstractImageStream<T>::getSpacing(float spa[5]) {
+  for (int ia=0;ia<=4;ia++)
+    spa[ia]=this->spacing[ia];
+}
+
+template<class T> int bisAbstractImageStream<T>::checkFrames(int begin,int number) {
+
+  if (begin<0 || number<1 || begin+number>this->getNumberOfFrames())
+    {
+      std::cerr << this->name << ": bad frame block " << begin << ":" << begin+number-1 << " (numframes=" << this->getNumberOfFrames() << ")" << std::endl;
+      return 0;
+    }
+  return 1;
+}
+
+template<class T> int bisAbstractImageStream<T>::checkVoxels(BISLONG begin,BISLONG number) {
+
+  if (begin<0 || number<1 || begin+number>this->getVolumeSize())
+    {
+      std::cerr << this->name << ": bad voxel block " << begin << ":" << begin+number-1 << " (volsize=" << this->getVolumeSize() << ")" << std::endl;
+      return 0;
+    }
+  return 1;
+}
+
+template<class T> int bisAbstractImageStream<T>::readFrames(int begin,int number,bisSimpleImage<T>* output) {
+
+  if (!this->checkFrames(begin,number))
+    return 0;
+
+  int dim[5] = { this->dimensions[0],this->dimensions[1],this->dimensions[2],number,1 };
+  float spa[5] = { this->spacing[0],this->spacing[1],this->spacing[2],this->spacing[3],1.0 };
+  output->allocateIfDifferent(dim,spa);
+  return this->readFrames(begin,number,output->getData());
+}
+
+template<class T> int bisAbstractImageStream<T>::writeFrames(int begin,bisSimpleImage<T>* input) {
+
+  int dim[5]; input->getDimensions(dim);
+  for (int ia=0;ia<=2;ia++)
+    {
+      if (dim[ia]!=this->dimensions[ia])
+        {
+          std::cerr << this->name << ": bad image dimensions for writing " << dim[0] << "*" << dim[1] << "*" << dim[2] << std::endl;
+          return 0;
+        }
+    }
+  return this->writeFrames(begin,dim[3]*dim[4],input->getData());
+}
+
+// ---------------------------------------------------------------------------------------------------
+// bisMemoryImageStream
+// ---------------------------------------------------------------------------------------------------
+template<class T> bisMemoryImageStream<T>::bisMemoryImageStream(bisSimpleImage<T>* img,std::string n) : bisAbstractImageStream<T>(n) {
+
+  this->class_name="bisMemoryImageStream";
+  this->image=img;
+  img->getDimensions(this->dimensions);
+  img->getSpacing(this->spacing);
+}
+
+template<class T> bisMemoryImageStream<T>::~bisMemoryImageStream() {
+
+  this->image=0;
+}
+
+template<class T> int bisMemoryImageStream<T>::readFrames(int begin,int number,T* buffer) {
+
+  if (!this->checkFrames(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  bisMemoryManagement::copy_memory((unsigned char*)buffer,(unsigned char*)(this->image->getData()+begin*volsize),number*volsize*sizeof(T));
+  return 1;
+}
+
+template<class T> int bisMemoryImageStream<T>::writeFrames(int begin,int number,T* buffer) {
+
+  if (!this->checkFrames(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  bisMemoryManagement::copy_memory((unsigned char*)(this->image->getData()+begin*volsize),(unsigned char*)buffer,number*volsize*sizeof(T));
+  return 1;
+}
+
+template<class T> int bisMemoryImageStream<T>::readVoxelBlock(BISLONG begin,BISLONG number,T* buffer) {
+
+  if (!this->checkVoxels(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  int numframes=this->getNumberOfFrames();
+  T* data=this->image->getData();
+  for (int frame=0;frame<numframes;frame++)
+    bisMemoryManagement::copy_memory((unsigned char*)(buffer+frame*number),(unsigned char*)(data+frame*volsize+begin),number*sizeof(T));
+  return 1;
+}
+
+template<class T> int bisMemoryImageStream<T>::writeVoxelBlock(BISLONG begin,BISLONG number,T* buffer) {
+
+  if (!this->checkVoxels(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  int numframes=this->getNumberOfFrames();
+  T* data=this->image->getData();
+  for (int frame=0;frame<numframes;frame++)
+    bisMemoryManagement::copy_memory((unsigned char*)(data+frame*volsize+begin),(unsigned char*)(buffer+frame*number),number*sizeof(T));
+  return 1;
+}
+
+// ---------------------------------------------------------------------------------------------------
+// bisNIFTIFileImageStream
+// ---------------------------------------------------------------------------------------------------
+template<class T> bisNIFTIFileImageStream<T>::bisNIFTIFileImageStream(std::string n) : bisAbstractImageStream<T>(n) {
+
+  this->class_name="bisNIFTIFileImageStream";
+  this->voxel_offset=0;
+  this->file_data_type=-1;
+  this->writable=0;
+}
+
+template<class T> bisNIFTIFileImageStream<T>::~bisNIFTIFileImageStream() {
+
+  this->closeFile();
+}
+
+template<class T> void bisNIFTIFileImageStream<T>::closeFile() {
+
+  if (this->file.is_open())
+    this->file.close();
+  this->file_data_type=-1;
+  this->writable=0;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::openFile(std::string filename,int in_writable,int debug) {
+
+  this->closeFile();
+
+  std::ios::openmode mode=std::ios::in | std::ios::binary;
+  if (in_writable)
+    mode=mode | std::ios::out;
+  this->file.open(filename.c_str(),mode);
+  if (!this->file.is_open())
+    {
+      std::cerr << "Failed to open " << filename << std::endl;
+      return 0;
+    }
+
+  this->file.seekg(0,std::ios::end);
+  BISLONG filesize=(BISLONG)this->file.tellg();
+  this->file.seekg(0,std::ios::beg);
+
+  std::vector<unsigned char> header(540,0);
+  BISLONG toread=filesize;
+  if (toread>540)
+    toread=540;
+  this->file.read((char*)&header[0],toread);
+
+  int datatype=0;
+  BISLONG datasize=0;
+  if (!this->file || !bisMemoryMappedImageUtil::parseNIFTIHeader(&header[0],filesize,this->dimensions,this->spacing,datatype,this->voxel_offset,datasize))
+    {
+      std::cerr << "Failed to read NIFTI header from " << filename << std::endl;
+      this->closeFile();
+      return 0;
+    }
+
+  T tmp=0;
+  if (in_writable && datatype!=bisDataTypes::getTypeCode(tmp))
+    {
+      std::cerr << "Can not open " << filename << " for writing, data type " << datatype << " != " << bisDataTypes::getTypeCode(tmp) << std::endl;
+      this->closeFile();
+      return 0;
+    }
+
+  int sizeof_hdr=0;
+  memcpy(&sizeof_hdr,&header[0],4);
+  header.resize(sizeof_hdr);
+  this->niftiheader=header;
+  this->file_data_type=datatype;
+  this->writable=in_writable;
+
+  if (debug)
+    std::cout << "..... Opened " << filename << " dim=" << this->dimensions[0] << "," << this->dimensions[1] << "," << this->dimensions[2] << "," << this->dimensions[3] << "," << this->dimensions[4] << " type=" << datatype << std::endl;
+  return 1;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::createFile(std::string filename,int dim[5],float spa[5],std::vector<unsigned char> templateheader,int debug) {
+
+  this->closeFile();
+
+  for (int ia=0;ia<=4;ia++)
+    {
+      if (dim[ia]<1 || dim[ia]>32767)
+        {
+          std::cerr << "Bad dimension " << ia << "=" << dim[ia] << " for a NIFTI-1 file" << std::endl;
+          return 0;
+        }
+      this->dimensions[ia]=dim[ia];
+      this->spacing[ia]=spa[ia];
+    }
+
+  T tmp=0;
+  this->file_data_type=bisDataTypes::getTypeCode(tmp);
+  this->voxel_offset=352;
+
+  // NIFTI-1 header, copy orientation etc. from the template (if NIFTI-1) and reset the size and type fields
+  std::vector<unsigned char> header(352,0);
+  int sizeof_hdr=348;
+  if (templateheader.size()>=348 && memcmp(&templateheader[0],&sizeof_hdr,4)==0)
+    memcpy(&header[0],&templateheader[0],348);
+  memset(&header[348],0,4);
+
+  short ndim[8] = { 3,0,0,0,0,0,0,0 };
+  if (dim[4]>1)
+    ndim[0]=5;
+  else if (dim[3]>1)
+    ndim[0]=4;
+  float pixdim[8] = { 1.0,0,0,0,0,0,0,0 };
+  memcpy(&pixdim[0],&header[76],4);
+  if (pixdim[0]!=-1.0f)
+    pixdim[0]=1.0f;
+  for (int ia=0;ia<=4;ia++)
+    {
+      ndim[ia+1]=(short)dim[ia];
+      pixdim[ia+1]=spa[ia];
+    }
+  for (int ia=6;ia<=7;ia++)
+    ndim[ia]=1;
+  short datatype=(short)this->file_data_type;
+  short bitpix=(short)(8*sizeof(T));
+  float voxoffset=352.0f,zero=0.0f;
+
+  memcpy(&header[0],&sizeof_hdr,4);
+  memcpy(&header[40],ndim,16);
+  memcpy(&header[70],&datatype,2);
+  memcpy(&header[72],&bitpix,2);
+  memcpy(&header[76],pixdim,32);
+  memcpy(&header[108],&voxoffset,4);
+  memcpy(&header[112],&zero,4);
+  memcpy(&header[116],&zero,4);
+  memcpy(&header[344],"n+1",4);
+
+  this->file.open(filename.c_str(),std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!this->file.is_open())
+    {
+      std::cerr << "Failed to create " << filename << std::endl;
+      this->file_data_type=-1;
+      return 0;
+    }
+
+  this->file.write((char*)&header[0],352);
+
+  // Extend the file to its final size, the data is filled in as blocks are written
+  BISLONG total=this->voxel_offset+this->getVolumeSize()*this->getNumberOfFrames()*BISLONG(sizeof(T));
+  this->file.seekp(total-1,std::ios::beg);
+  this->file.put(0);
+  if (!this->file)
+    {
+      std::cerr << "Failed to allocate " << total << " bytes for " << filename << std::endl;
+      this->closeFile();
+      return 0;
+    }
+
+  header.resize(348);
+  this->niftiheader=header;
+  this->writable=1;
+
+  if (debug)
+    std::cout << "..... Created " << filename << " dim=" << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << "," << dim[4] << " type=" << datatype << std::endl;
+  return 1;
+}
+
+template<class T> template<class FT> int bisNIFTIFileImageStream<T>::readAndCast(BISLONG offset,BISLONG number,T* buffer,FT*) {
+
+  this->staging.resize(number*sizeof(FT));
+  this->file.seekg(this->voxel_offset+offset*BISLONG(sizeof(FT)),std::ios::beg);
+  this->file.read((char*)&this->staging[0],number*sizeof(FT));
+  if (!this->file)
+    return 0;
+
+  FT* data=(FT*)&this->staging[0];
+  for (BISLONG i=0;i<number;i++)
+    buffer[i]=(T)data[i];
+  return 1;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::readElements(BISLONG offset,BISLONG number,T* buffer) {
+
+  if (!this->file.is_open())
+    {
+      std::cerr << this->name << ": no file open" << std::endl;
+      return 0;
+    }
+
+  this->file.clear();
+  int ok=0;
+  T tmp=0;
+  if (this->file_data_type==bisDataTypes::getTypeCode(tmp))
+    {
+      this->file.seekg(this->voxel_offset+offset*BISLONG(sizeof(T)),std::ios::beg);
+      this->file.read((char*)buffer,number*sizeof(T));
+      ok=(this->file) ? 1 : 0;
+    }
+  else
+    {
+      switch (this->file_data_type)
+        {
+          bisvtkTemplateMacro( ok=this->readAndCast(offset,number,buffer,static_cast<BIS_TT*>(0)) );
+        }
+    }
+
+  if (!ok)
+    std::cerr << this->name << ": failed to read " << number << " elements at " << offset << std::endl;
+  return ok;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::writeElements(BISLONG offset,BISLONG number,T* buffer) {
+
+  if (!this->file.is_open() || !this->writable)
+    {
+      std::cerr << this->name << ": no file open for writing" << std::endl;
+      return 0;
+    }
+
+  this->file.clear();
+  this->file.seekp(this->voxel_offset+offset*BISLONG(sizeof(T)),std::ios::beg);
+  this->file.write((char*)buffer,number*sizeof(T));
+  if (!this->file)
+    {
+      std::cerr << this->name << ": failed to write " << number << " elements at " << offset << std::endl;
+      return 0;
+    }
+  return 1;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::readFrames(int begin,int number,T* buffer) {
+
+  if (!this->checkFrames(begin,number))
+    return 0;
+  BISLONG volsize=this->getVolumeSize();
+  return this->readElements(begin*volsize,number*volsize,buffer);
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::writeFrames(int begin,int number,T* buffer) {
+
+  if (!this->checkFrames(begin,number))
+    return 0;
+  BISLONG volsize=this->getVolumeSize();
+  return this->writeElements(begin*volsize,number*volsize,buffer);
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::readVoxelBlock(BISLONG begin,BISLONG number,T* buffer) {
+
+  if (!this->checkVoxels(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  int numframes=this->getNumberOfFrames();
+  for (int frame=0;frame<numframes;frame++)
+    {
+      if (!this->readElements(frame*volsize+begin,number,buffer+frame*number))
+        return 0;
+    }
+  return 1;
+}
+
+template<class T> int bisNIFTIFileImageStream<T>::writeVoxelBlock(BISLONG begin,BISLONG number,T* buffer) {
+
+  if (!this->checkVoxels(begin,number))
+    return 0;
+
+  BISLONG volsize=this->getVolumeSize();
+  int numframes=this->getNumberOfFrames();
+  for (int frame=0;frame<numframes;frame++)
+    {
+      if (!this->writeElements(frame*volsize+begin,number,buffer+frame*number))
+        return 0;
+    }
+  return 1;
+}
+
+#endif
@@ -17,6 +17,8 @@
 #include "bisAbstractTransformation.h"
 #include "bisComboTransformation.h"
 #include "bisDataObjectFactory.h"
+#include "bisvtkMultiThreader.h"
+#include <vector>
 
 namespace bisImageTransformationJacobian {
 
@@ -53,7 +55,128 @@ namespace bisImageTransformationJacobian {
     return d;
   }
     
-  bisSimpleImage<float>* computeJacobian(bisAbstractTransformation* transformation, int dim[3],float spa[3],int nonlinearonly=0,int enabledebug=0) {
+  // ------------------------------------------------------------------------------------------
+  // Slab parallel jacobian computation
+  // Each thread handles a range of slices and keeps a rolling window of three displacement
+  // slices (k-1,k,k+1) computed on the fly using the transformation's row kernel, so the
+  // full displacement field is never stored.
+  // ------------------------------------------------------------------------------------------
+  class bisJacobianThreadStructure {
+  public:
+    bisAbstractTransformation* transformation;
+    float* odata;
+    int dim[3];
+    float spa[3];
+    int scaleinplace;
+    int enabledebug;
+    double sum[VTK_MAX_THREADS];
+    int num[VTK_MAX_THREADS];
+  };
+
+  static void computeDisplacementSlice(bisAbstractTransformation* transformation,int dim[3],float spa[3],int k,float* slice)
+  {
+    int slicesize=dim[0]*dim[1];
+    float* out[3];
+    for (int ja=0;ja<dim[1];ja++)
+      {
+        for (int comp=0;comp<=2;comp++)
+          out[comp]=&slice[comp*slicesize+ja*dim[0]];
+        transformation->computeDisplacementRow(spa,ja,k,0,dim[0]-1,out);
+      }
+  }
+  
+  static void jacobianThreadFunction(bisvtkMultiThreader::vtkMultiThreader::ThreadInfo *data)
+  {
+    bisJacobianThreadStructure *ds = (bisJacobianThreadStructure *)(data->UserData);
+    int thread=data->ThreadID;
+    int numthreads=data->NumberOfThreads;
+    int* dim=ds->dim;
+    float* spa=ds->spa;
+    
+    // Interior slices 1..dim[2]-2 are split among the threads
+    int numslices=dim[2]-2;
+    int step=numslices/numthreads;
+    int kbegin=1+thread*step;
+    int kend=kbegin+step-1;
+    if (thread==numthreads-1)
+      kend=dim[2]-2;
+
+    ds->sum[thread]=0.0;
+    ds->num[thread]=0;
+    if (kend<kbegin)
+      return;
+
+    int slicesize=dim[0]*dim[1];
+    std::vector<float> buffer(9*slicesize);
+    float* window[3] = { &buffer[0], &buffer[3*slicesize], &buffer[6*slicesize] };
+    computeDisplacementSlice(ds->transformation,dim,spa,kbegin-1,window[0]);
+    computeDisplacementSlice(ds->transformation,dim,spa,kbegin,window[1]);
+
+    bisUtil::mat44 temp;
+    double sum=0.0;
+    int num=0;
+    float scale=1.0;
+    if (ds->scaleinplace)
+      scale=100.0;
+    
+    for (int ka=kbegin;ka<=kend;ka++)
+      {
+        computeDisplacementSlice(ds->transformation,dim,spa,ka+1,window[2]);
+        float* KM=window[0];
+        float* K=window[1];
+        float* KP=window[2];
+        
+        for (int ja=1;ja<dim[1]-1;ja++) {
+        
+          int JM=(ja-1)*dim[0];
+          int JP=(ja+1)*dim[0];
+          int J=ja*dim[0];
+          
+          for (int ia=1;ia<dim[0]-1;ia++) {
+            
+            int IM=ia-1;
+            int IP=ia+1;
+            int I=ia;
+            
+            int debug=0;
+            if (ia==dim[0]/2 && ja==dim[1]/2 && ( ka == dim[2]/2 || ka==dim[2]/4 || ka==3*dim[2]/4) && ds->enabledebug>0) {
+              debug=1;
+              std::cout << std::endl << "       IJK=" << ia << "," << ja << "," << ka << std::endl;
+            }
+            
+            for (int comp=0;comp<=2;comp++) {
+              int C=comp*slicesize;
+              
+              temp[comp][0]= 0.5*( K[J  + IP + C] - K[J  + IM + C] )/spa[0];
+              temp[comp][1]= 0.5*( K[JP + I  + C] - K[JM + I  + C] )/spa[1];
+              temp[comp][2]= 0.5*( KP[J + I  + C] - KM[J + I  + C] )/spa[2];
+              
+              if (debug)  {
+                std::cout << " [ " << K[J  + IP + C] << " ," << K[J  + IM + C] << "-->" <<  temp[comp][0] << "] ,";
+                std::cout << " [ " << K[JP + I  + C] << " ," << K[JM + I  + C] << "-->" <<  temp[comp][1] << "] ,";
+                std::cout << " [ " << KP[J + I  + C] << " ," << KM[J + I  + C] << "-->" <<  temp[comp][2] << "]" << std::endl;
+              }
+            }
+            
+            float d=float(determ(temp,debug));
+            ds->odata[ka*slicesize+J+I]=scale*(d-1.0f);
+            sum+=d;
+            num+=1;
+          }
+        }
+
+        // Roll the window
+        float* tmp=window[0];
+        window[0]=window[1];
+        window[1]=window[2];
+        window[2]=tmp;
+      }
+    
+    ds->sum[thread]=sum;
+    ds->num[thread]=num;
+  }
+  
+  bisSimpleImage<float>* computeJacobian(bisAbstractTransformation* transformation, int dim[3],float spa[3],int nonlinearonly=0,int enabledebug=0,int numthreads=4) {
 
     // If Combo then set linear component to identity --> nonlinearonly!
     bisUtil::mat44 linear;
@@ -78,18 +201,6 @@ namespace bisImageTransformationJacobian {
       combo->setInitialTransformation(identity);
     }
 
-    // COmpute Displacement Field
-    std::unique_ptr< bisSimpleImage<float> > dispfield(transformation->computeDisplacementField(dim,spa));
-    
-    
-    // Restore combo if needed
-    if (nonlinearcombo) { 
-      bisComboTransformation* combo=(bisComboTransformation*)(transformation);
-      combo->setInitialTransformation(linear);
-    }
-
-
-    
     int o_dim[5] = { dim[0],dim[1],dim[2],1,1};
     float o_spa[5] = { spa[0],spa[1],spa[2],1.0,1.0};
     std::string n1="jacobian";
@@ -97,85 +208,71 @@ namespace bisImageTransformationJacobian {
     out->allocate(o_dim,o_spa);
     out->fill(0.0);
     
-    
-    
-    
-    // ------------------------------- Compute Jacobian -----------------------------------------
-    int offsets[4]= {  1,dim[0],dim[0]*dim[1],dim[0]*dim[1]*dim[2]  };
-
-    bisUtil::mat44 temp;
-    float* idata=dispfield->getImageData();
-    float* odata=out->getImageData();
+    // Mean removal needs a second pass, otherwise the final scaling is done in the kernel
+    int removemean=(nonlinearonly>0 && nonlinearcombo==0);
 
-    double sum=0.0;
-    int   num=0;
-    
-    for (int ka=1;ka<dim[2]-1;ka++) {
-      int KM=(ka-1)*offsets[2];
-      int KP=(ka+1)*offsets[2];
-      int K=ka*offsets[2];
-      
-      for (int ja=1;ja<dim[1]-1;ja++) {
-        
-        int JM=(ja-1)*offsets[1];
-        int JP=(ja+1)*offsets[1];
-        int J=ja*offsets[1];
-        
-        for (int ia=1;ia<dim[0]-1;ia++) {
-          
-          int IM=ia-1;
-          int IP=ia+1;
-          int I=ia;
+    bisJacobianThreadStructure ds;
+    ds.transformation=transformation;
+    ds.odata=out->getImageData();
+    for (int ia=0;ia<=2;ia++) {
+      ds.dim[ia]=dim[ia];
+      ds.spa[ia]=spa[ia];
+    }
+    ds.scaleinplace=(removemean==0);
+    ds.enabledebug=enabledebug;
+    for (int ia=0;ia<VTK_MAX_THREADS;ia++) {
+      ds.sum[ia]=0.0;
+      ds.num[ia]=0;
+    }
 
-          int debug=0;
-          if (ia==dim[0]/2 && ja==dim[1]/2 && ( ka == dim[2]/2 || ka==dim[2]/4 || ka==3*dim[2]/4) && enabledebug>0) {
-              debug=1;
-              std::cout << std::endl << "       IJK=" << ia << "," << ja << "," << ka << std::endl;
-            }
+#ifdef _WIN32
+    numthreads=1;
+#endif
+    numthreads=bisUtil::irange(numthreads,1,VTK_MAX_THREADS);
+    if (numthreads>dim[2]-2)
+      numthreads=bisUtil::irange(dim[2]-2,1,VTK_MAX_THREADS);
 
-            for (int comp=0;comp<=2;comp++) {
-              int C=comp*offsets[3];
-            
-              temp[comp][0]= 0.5*( idata[K  + J  + IP + C] - idata[K  + J  + IM + C] )/spa[0];
-              temp[comp][1]= 0.5*( idata[K  + JP + I  + C] - idata[K  + JM + I  + C] )/spa[1];
-              temp[comp][2]= 0.5*( idata[KP + J  + I  + C] - idata[KM + J  + I  + C] )/spa[2];
+    if (dim[2]>2)
+      bisvtkMultiThreader::runMultiThreader((bisvtkMultiThreader::vtkThreadFunctionType)&jacobianThreadFunction,&ds,"Jacobian",numthreads,enabledebug);
+    
+    // Restore combo if needed
+    if (nonlinearcombo) { 
+      bisComboTransformation* combo=(bisComboTransformation*)(transformation);
+      combo->setInitialTransformation(linear);
+    }
 
-              if (debug)  {
-                std::cout << " [ " <<idata[K  + J  + IP + C] << " ," << idata[K  + J  + IM + C] << "-->" <<  temp[comp][0] << "] ,";
-                std::cout << " [ " <<idata[K  + JP + I  + C] << " ," << idata[K  + JM + I  + C] << "-->" <<  temp[comp][1] << "] ,";
-                std::cout << " [ " <<idata[KP + J  + I  + C] << " ," << idata[KM + J  + I  + C] << "-->" <<  temp[comp][2] << "]" << std::endl;
-              }
-            }
-            
-            float d=float(determ(temp,debug));
-            odata[I+J+K]=d-1.0;
+    if (removemean) {
+      double sum=0.0;
+      int num=0;
+      for (int ia=0;ia<VTK_MAX_THREADS;ia++) {
+        sum+=ds.sum[ia];
+        num+=ds.num[ia];
+      }
+      float mean=0.0;
+      if (num>0)
+        mean=sum/float(num);
+      std::cout << ".... nonlinear non-combo mean=" << sum << "/" << num << "=" << mean  << std::endl;
 
-            sum+=d;
-            num+=1;
+      float* odata=out->getImageData();
+      int offsets[3]= {  1,dim[0],dim[0]*dim[1] };
+      for (int ka=1;ka<dim[2]-1;ka++) {
+        int K=ka*offsets[2];
+        for (int ja=1;ja<dim[1]-1;ja++) {
+          int J=ja*offsets[1];
+          for (int ia=1;ia<dim[0]-1;ia++) {
+            int I=ia;
+            odata[I+J+K]=100.0*(odata[I+J+K]-mean);
+          }
         }
       }
     }
 
-    float mean=0.0;
-    
-    if (nonlinearonly>0 && nonlinearcombo==0) {
-
-      // remove mean
-      mean=sum/float(num);
-      std::cout << ".... nonlinear non-combo mean=" << sum << "/" << num << "=" << mean  << std::endl;
-    }
-
-      
-    for (int ka=1;ka<dim[2]-1;ka++) {
-      int K=ka*offsets[2];
-      for (int ja=1;ja<dim[1]-1;ja++) {
-        int J=ja*offsets[1];
-        for (int ia=1;ia<dim[0]-1;ia++) {
-          int I=ia;
-          odata[I+J+K]=100.0*(odata[I+J+K]-mean);
-          if (ia==dim[0]/2 && ja==dim[1]/2 && ( ka == dim[2]/2 || ka==dim[2]/4 || ka==3*dim[2]/4) && enabledebug>0) {
-            std::cout << "Final d  IJK=" << ia << "," << ja << "," << ka << " d=" << odata[I+J+K] << std::endl;
-          }
+    if (enabledebug>0 && dim[2]>2) {
+      float* odata=out->getImageData();
+      for (int ka=1;ka<dim[2]-1;ka++) {
+        if (ka == dim[2]/2 || ka==dim[2]/4 || ka==3*dim[2]/4) {
+          int index=ka*dim[0]*dim[1]+(dim[1]/2)*dim[0]+dim[0]/2;
+          std::cout << "Final d  IJK=" << dim[0]/2 << "," << dim[1]/2 << "," << ka << " d=" << odata[index] << std::endl;
         }
       }
     }
@@ -215,6 +312,7 @@ unsigned char* computeJacobianImageWASM(unsigned char* input,unsigned char* xfor
   int dim[3];   in_image->getImageDimensions(dim);
   float spa[3]; in_image->getImageSpacing(spa);
   int nonlinearonly=params->getBooleanValue("nonlinearonly",0);
+  int numthreads=params->getIntValue("numthreads",4);
   
   if (debug)
     {
@@ -222,7 +320,7 @@ unsigned char* computeJacobianImageWASM(unsigned char* input,unsigned char* xfor
       std::cout << "  spa=" << spa[0] << "," << spa[1] << "," << spa[2] << " with " << dispXform->getClassName() << std::endl;
     }
   
-  std::unique_ptr< bisSimpleImage<float> > output(bisImageTransformationJacobian::computeJacobian(dispXform.get(),dim,spa,nonlinearonly,debug));
+  std::unique_ptr< bisSimpleImage<float> > output(bisImageTransformationJacobian::computeJacobian(dispXform.get(),dim,spa,nonlinearonly,debug,numthreads));
   return output->releaseAndReturnRawArray();
   
   
@@ -24,7 +24,7 @@ extern "C" {
   /** Computes the jacobian image of the transformation on the space of the image
    * @param xform the transformation to use to compute a displacement field
    * @param jsonstring the parameter string for the algorithm 
-   *   { "nonlinearonly" : "false" };
+   *   { "nonlinearonly" : "false", "numthreads" : 4 };
    *   nonlinearonly is only used if the transformation is a bisComboTransformation
    * @param debug if > 0 print debug messages
    * @returns a pointer to the Jacobian field image (bisSimpleImage<float>)
@@ -3,7 +3,7 @@
 #include <algorithm>
 #include <vector>
 #include <queue>
-#include <unordered_map>
+#include <tuple>
 #include <functional>
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
@@ -13,13 +13,9 @@ using Eigen::VectorXd;
 using Eigen::VectorXf;
 using Eigen::VectorXi;
 using Eigen::Map;
-#include "igl/slice.h"
-#include "igl/colon.h"
 #include "igl/mat_min.h"
 #include "igl/mat_max.h"
 #include "igl/find.h"
-using igl::slice;
-using igl::colon;
 using igl::mat_min;
 using igl::mat_max;
 using igl::find;
@@ -28,6 +24,7 @@ using igl::find;
 #include "bisJSONParameterList.h"
 #include "bisDataObjectFactory.h"
 #include "bisIndividualizedParcellation.h"
+#include "bisThreadPool.h"
 
 namespace bisIndividualizedParcellation {
 
@@ -80,858 +77,504 @@ namespace bisIndividualizedParcellation {
     return 1;
   }
   
-  bool ismember(VectorXi V, int p)
-  {
-    for (int i=0;i<V.size();i++)
-      {
-        if (V(i)==p)
-          return 1;
-      }
-    return 0;
-  }
-  
-  int runIndividualizedParcellation(bisSimpleImage<float>* FMRIImage, bisSimpleImage<short>* groupparcellation, bisSimpleImage<short>* indiv,
-                                    int numexemplars)
-  {
-    // Zero everything
-    indiv->fill(0);
-    
-    
-    int dim[5], dim2[5];
-    FMRIImage->getDimensions(dim);
-    groupparcellation->getDimensions(dim2);
-    std::cout << "++++ Beginning Indiv Parc (Salehi et al 2019) " << std::endl;
-    std::cout << "++++ \t fMRI Image dim = " << dim[0] << "," << dim[1] << "," << dim[2] << "  " << dim[3] << std::endl;
-    std::cout << "++++ \t Group Parcellation Image dim2 = " << dim2[0] << "," << dim2[1] << "," << dim2[2] << "  " << dim2[3] << std::endl;
-
-    int slicesize=dim[0]*dim[1];
-
-    
-    int sum=0;
-    for (int ia=0;ia<=2;ia++)
-      sum+=abs(dim[ia]-dim2[ia]);
-    if (sum>0)
-      {
-        std::cerr << "---- Bad FMRI Input to runIndividualizedParcelllation sum = " << sum << " > 0 " << std::endl;
-        return 0;
-      }
-    
-    //    vtkDataArray* group=input->GetPointData()->GetScalars(); 
-    int N=dim2[0]*dim2[1]*dim2[2];
-    
-    const int t=dim[3];//this->FMRIImage->GetNumberOfScalarComponents(); //nc
-    
-    double range[2]; 
-    groupparcellation->getRange(range);
-  
-    int Pmax = numexemplars;
-    int RangeMax=int(range[1]);
-    
-    if (Pmax != RangeMax) {
-      std::cerr << "---- Bad Group Parcellation Input to vtkbisIndividualizeParcellation pmax = " << Pmax << "range[1] = " << RangeMax << std::endl;
-      return 0;
+  // Squared distance between the (normalized) voxel timeseries and the exemplars, |x|^2-2x.s+|s|^2 as in the
+  // dense version. A distance is computed when a voxel is pushed onto an exemplar queue (only voxels next to the
+  // region of the exemplar) instead of for all voxel/exemplar pairs (n*Pmax). The last distance of each voxel is
+  // cached as it is usually pushed by the same exemplar from more than one of its neighbors.
+  template<class T> class bisExemplarDistance {
+  public:
+    typedef Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic> MatrixT;
+    typedef Eigen::Matrix<T,Eigen::Dynamic,1> VectorT;
+
+    bisExemplarDistance(const MatrixT& d,const VectorXi& ex) : data(d),exemplars(ex) {
+      this->norm2=this->data.colwise().squaredNorm().transpose();
+      this->cachedexemplar.resize(this->data.cols(),-1);
+      this->cacheddistance.resize(this->data.cols(),0);
     }
 
-    std::cout << "++++ \t number of frames is " << t << std::endl;
-    std::cout << "++++ \t number of voxels is " << dim[0] << "x" << dim[1] << "x" << dim[2] << " = " << N << std::endl;
-    std::cout << "++++ \t number of exemplars is " << Pmax << std::endl;
-    //    fprintf(stdout,"lambda is %f\n",lambda);
-    
-    //fprintf(stdout,"START: the elapsed time is = %f s \n",float(clock()-begin_time)/CLOCKS_PER_SEC);
-
-  
-
-    // Copying data to matrixXd and VectorXd
-    std::cout << "++++ COPYING DATA TO EIGEN MATRIX & VECTOR" << std::endl;
-    
-    int count=0;
-
-    short* group=groupparcellation->getImageData();
-    
-    for (int voxel=0;voxel<N;voxel++) {
-      if(group[voxel]>0) {
-        count++;
-      }
-    }
-    
-    MatrixXd X(t,count);
-    count=0;
-    //double position[3];
-
-    float* fmri=FMRIImage->getImageData();
-    
-    for (int voxel=0;voxel<N;voxel++) {
-      if(group[voxel]>0) {
-        for (int frame=0;frame<t;frame++) {
-          X(frame,count) = fmri[N*frame+voxel];
-        }
-        count++;
-      }
-    }
-  
-    VectorXd parcel(count);
-    std::unordered_map<int,int> ntoNvoxel;
-    std::unordered_map<int,int> Ntonvoxel;
-    count=0;
-    for (int voxel=0;voxel<N;voxel++)
-      if (group[voxel]>0)
+    T operator()(int voxel,int p) {
+      if (this->cachedexemplar[voxel]!=p)
         {
-          parcel(count) = group[voxel]; // this is the group label for all the nonzero voxels
-          ntoNvoxel.insert( std::make_pair(count,voxel) );
-          Ntonvoxel.insert( std::make_pair(voxel,count) );
-          count++;
+          int e=this->exemplars(p);
+          this->cacheddistance[voxel]=(this->data.col(voxel).dot(this->data.col(e))*-2+this->norm2(voxel))+this->norm2(e);
+          this->cachedexemplar[voxel]=p;
         }
-    
-    int n = count;
-    
-    std::cout << "++++ \t number of non-zero voxels n = " << n << std::endl;
-    
-    VectorXd mean_subtract(t);
-    mean_subtract = (X.rowwise().sum())/double(n);
-
-    
-    
-
-    // Normalizing data points to 0 mean
-    //double newValue;
-    MatrixXd V = MatrixXd(t,n);
-    V = X.colwise()-mean_subtract; // mean of V is all 0 [VERIFIED]
-    
-    X.resize(0,0);
-    
-    // Calculating the l2-norm
-    VectorXd twoNorm(n);
-    twoNorm =V.colwise().norm();
-    VectorXd inverse_twoNorm(n);
-    inverse_twoNorm = twoNorm.array().inverse();
-    
-    ////////////////////////////////////////////////  1- Dividing with the maximum norm 
-    //// finding the maximum value in the array
-    //  double maxValue = twoNorm.maxCoeff();
-    ////  Normalizing data points to a unit ball sphere
-    //  MatrixXd v = V/maxValue;
-    //  fprintf(stdout,"NORMALIZATION INTO UNIT SPHERE (DIVIDE BY MAX NORM): the elapsed time is = %f s \n",float(clock()-timebegin11)/CLOCKS_PER_SEC);
-    
-    ////////////////////////////////////////////////  2- Normalizing to the unit norm (all vectors norm = 1)
-    std::cout << "++++ NORMALIZATION ONTO UNIT SPHERE (ALL NORM=1)" << std::endl;
-
-    MatrixXd v = V.array().rowwise()* inverse_twoNorm.transpose().array();
-    twoNorm = v.colwise().norm(); // twoNorm is all 1 [VERIFIED]
-    V.resize(0,0);
-    
-    //  VectorXd test_ii(t);
-    //  test_ii = (V.rowwise().sum())/double(n);
-    //  for (int ii=0; ii<t; ii++)
-    //	  fprintf(stdout,"V norm = %f\n",twoNorm(ii)); 
-    
-    
-    
-    ////////// Finding the voxels within each parcel ///////////////
-    std::cout << "++++ FINDING VOXELS:" << std::endl;
-    
-    std::vector< std::vector<int> > indice_p;
-    std::vector<int> p_vector;
-    for (int p=0;p<Pmax;p++)
-      {	
-	for (int voxel=0;voxel<n;voxel++)
-          if (parcel(voxel) == p+1)
-            p_vector.push_back(voxel);
-	indice_p.push_back(p_vector);
-	p_vector.clear(); // p_vector's size is 0 [VERIFIED]
-      }
-    
-
-    // Calculating the squared distance matrix between voxels within each parcel
-    std::cout << "++++ SQUARED DISTANCES" << std::endl;
-
-//    std::vector<MatrixXd> sqrDist;
-    std::vector<VectorXd> sqrDist;
-
-    MatrixXd D;
-    VectorXi R(t);
-    
-    colon(0,1,t-1,R);
-    
-    
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-      MatrixXd sqrMatrix(psize,psize);
-      int* ptr = &indice_p[p][0];
-      Map<VectorXi> C(ptr,psize);
-      MatrixXd vP(t,psize);
-      slice(v,R,C,vP);		
-      sqrMatrix = ((vP.transpose()*vP*-2).colwise() + vP.colwise().squaredNorm().transpose()).rowwise() + vP.colwise().squaredNorm();
-//      sqrDist.push_back( sqrMatrix );
-      sqrDist.push_back( sqrMatrix.colwise().sum() );
-      vP.resize(0,0);
-      sqrMatrix.resize(0,0);
-    }
-    
-
-    
-    // Calculating the distance between auxiliary exemplar and the rest of the voxels
-    std::cout << "++++ AUXILIARY DISTANCES" << std::endl;
-
-    std::vector<VectorXd> e0sqrDist;
-    VectorXd e0 = VectorXd::Zero(t);
-    e0(0) = 3;
-
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-      VectorXd sqrArray(psize);
-      int* ptr = &indice_p[p][0];
-      Map<VectorXi> C(ptr,psize);
-      MatrixXd vP(t,psize);
-      slice(v,R,C,vP);		
-      sqrArray = ((vP.transpose()*e0*-2).colwise() + vP.colwise().squaredNorm().transpose()).rowwise() + e0.colwise().squaredNorm();	
-      e0sqrDist.push_back( sqrArray );
-      
-      
-      //	delete [] sqrArray;
+      return this->cacheddistance[voxel];
     }
-    //	for (int pp1=0;pp1<indice_p[p].size();pp1++)
-    //		for (int pp2=0;pp2<indice_p[p].size();pp2++)
-    //			fprintf(stdout,"p=%d, pp1=%d, pp2=%d, sqrDist[p][pp1][pp2] = %f\n",p,pp1,pp2,sqrDist[p][pp1][pp2]);
-    
-    
-
-    //  Calculating the exemplar within each parcel
-    std::cout << "++++ EXEMPLAR IDENTIFICATION" << std::endl;
 
-    VectorXi Sopt(Pmax);
-    VectorXi SoptN(Pmax);
-    //double loss;
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-      double sumd0 = e0sqrDist[p].sum();
-      MatrixXd::Index maxFindex;
-      VectorXd sumD(psize);	
-//      sumD = sqrDist[p].colwise().sum();
-      sumD = sqrDist[p];
-
-      
-      VectorXd pFunc(psize);
-      pFunc = sumd0 - sumD.array();  // we should divide by n but does not matter as it does not change the maximum!
-      pFunc.maxCoeff(&maxFindex);
-      Sopt(p) = indice_p[p][maxFindex];
-      std::unordered_map<int,int>::const_iterator voxelN = ntoNvoxel.find (Sopt(p));
-      if (voxelN != ntoNvoxel.end())
-        SoptN(p) = voxelN->second;
-//	std::cout << "p=" << SoptN(p) << std::endl;
-    }
-    
-    
-    //  for (int p=0; p<Pmax; p++)
-    //	fprintf(stdout,"Sopt(%f) = %d, ", group->GetComponent(SoptN(p),0),SoptN(p));
-    
-    // Assigning each voxel to the closest exemplar using the priority queue algorithm
-    std::cout << "++++ FINAL STEP: ASSIGNING VOXELS TO EXEMPLARS (double)" << std::endl;
-    
-    
-    std::vector<double> label(n,-1);
-    
-    // minDistIndexR and inDistIndexL need to be double, otherwise the result differs from MATLAB. It is perhaps because of the SetComponent() command.
-    
-    MatrixXd vSopt(t,Pmax);
-    slice(v,R,Sopt,vSopt);
-    
-    MatrixXd distvSopt(n,Pmax);
-    
-    distvSopt = ((v.transpose()*vSopt*-2).colwise() + v.colwise().squaredNorm().transpose()).rowwise() + vSopt.colwise().squaredNorm();	
-    
-    
+  protected:
+    const MatrixT& data;
+    const VectorXi& exemplars;
+    VectorT norm2;
+    std::vector<int> cachedexemplar;
+    std::vector<T> cacheddistance;
+  };
+
+  // Assigns each in-mask voxel to an exemplar by growing the regions of the exemplars one voxel at a time, always
+  // adding the closest (to the exemplar) voxel next to any region. A single heap of (distance,parcel,voxel) entries
+  // gives the same order as taking the smallest top of one heap per exemplar (ties go to the lowest parcel).
+  template<class T> void assignVoxelsToExemplars(bisExemplarDistance<T>& distance,const bisParcellationAtlas& atlas,
+                                                 const VectorXi& Sopt,std::vector<int>& label)
+  {
+    typedef std::tuple<T,int,int> Node;
+    std::priority_queue<Node,std::vector<Node>,std::greater<Node> > heap;
+
+    const std::vector<int>& ntoNvoxel=atlas.ntoNvoxel;
+    const std::vector<int>& Ntonvoxel=atlas.Ntonvoxel;
+    const int* dim=atlas.dim;
+    const int* incr=atlas.incr;
+    int n=ntoNvoxel.size();
+    int Pmax=Sopt.size();
+    int N=atlas.numvoxels;
+    int slicesize=dim[0]*dim[1];
     const int neighbors = 6;
-    int incr[neighbors]; computeMRFIncrements(dim,incr);
-    
+
     int sumVisited = 0;
-    std::vector<int> VISITED(n,0);
-    
-    
+    std::vector<char> VISITED(n,0);
+    label.assign(n,-1);
+
     // Assigning labels to exemplars and marking them as visited
-    for (int p=0; p<Pmax; p++){
-      label[Sopt(p)] = p;
-      VISITED[Sopt(p)] = 1;
-      sumVisited ++;		
-    }
-    
-    std::vector<std::priority_queue<std::pair<double, int> , std::vector<std::pair<double,int> >, std::greater<std::pair<double, int> > > > exemplar_min_heaps (Pmax);
     for (int p=0; p<Pmax; p++)
       {
-	int exemplarN = SoptN(p);
-        //	if (NONBOUNDARY[exemplarN] == 1)
+        label[Sopt(p)] = p;
+        VISITED[Sopt(p)] = 1;
+        sumVisited ++;
+      }
+
+    for (int p=0; p<Pmax; p++)
+      {
+        int exemplarN = ntoNvoxel[Sopt(p)];
         for (int ia=0;ia<neighbors;ia++)
-          {	
-            int currVoxN = exemplarN+incr[ia]; 
-            if (group[currVoxN]>0)
+          {
+            int currVoxN = exemplarN+incr[ia];
+            if (currVoxN>=0 && currVoxN<N && Ntonvoxel[currVoxN]>=0)
               {
-                std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (currVoxN);
-                if (voxeln != Ntonvoxel.end())
-                  {
-                    int currVox = voxeln->second; 
-                    exemplar_min_heaps[p].push(std::make_pair(distvSopt(currVox,p),currVox));
-                  }
+                int currVox = Ntonvoxel[currVoxN];
+                heap.push(Node(distance(currVox,p),p,currVox));
               }
-          }  
+          }
       }
-    
 
-    while (sumVisited < n)
+    while (sumVisited < n && !heap.empty())
       {
-        int min_idx = -1;
-        double min_val = 10000000;
-        for (int p=0; p<Pmax; p++)
+        Node chosenNode = heap.top();
+        heap.pop();
+        int p=std::get<1>(chosenNode);
+        int chosenVoxel = std::get<2>(chosenNode);
+        if (VISITED[chosenVoxel])
+          continue;
+
+        label[chosenVoxel] = p;
+        VISITED[chosenVoxel] = 1;
+        sumVisited ++;
+
+        int chosenVoxelN = ntoNvoxel[chosenVoxel];
+        for (int ia=0;ia<neighbors;ia++)
           {
-            if (!exemplar_min_heaps[p].empty())
+            int currVoxN = chosenVoxelN + incr[ia];
+            int v_k=int(currVoxN/slicesize);
+            int v_j=currVoxN-v_k*slicesize;
+            int v_i=v_j % dim[0];
+            v_j=int(v_j/dim[0]);
+
+            if (v_i>=0 && v_i<dim[0] &&
+                v_j>=0 && v_j<dim[1] &&
+                v_k>=0 && v_k<dim[2] && Ntonvoxel[currVoxN]>=0)
               {
-		std::pair<double,int> curNode = exemplar_min_heaps[p].top();		
-		if (curNode.first < min_val)
-                  {
-                    min_val = curNode.first; // all distances <=4 [VERIFIED]
-                    min_idx = p;
-                  }
-              }	
-            
+                int currVox = Ntonvoxel[currVoxN];
+                if (VISITED[currVox] == 0)
+                  heap.push(Node(distance(currVox,p),p,currVox));
+              }
           }
-        // selected exemplar queue (min_idx) is correct [VERIFIED]
-        //if (sumVisited==7886)
-        //          std::cout << "\n(selected queue,min_val)=" << min_idx << "," << min_val << std::endl;
+      }
+  }
 
-        
-        
-        if (min_idx >=0)
+  // Picks the exemplar of each parcel, the voxel i maximizing sum_j |x_j-e0|^2 - sum_j |x_i-x_j|^2 over the voxels
+  // j of the parcel (e0 is the auxiliary exemplar (3,0,0,...)). Both sums come from the parcel sum s=sum_j x_j as
+  // sum_j |x_i-x_j|^2 = psize*|x_i|^2 + sum_j |x_j|^2 - 2 x_i.s so the psize*psize distance matrix is never formed.
+  // Parcels run in parallel on bisThreadPool (serially if called from a batch thread).
+  void findParcelExemplars(const MatrixXd& v,const bisParcellationAtlas& atlas,VectorXi& Sopt)
+  {
+    const std::vector<int>& start=atlas.parcelstart;
+    const std::vector<int>& members=atlas.parcelmembers;
+    int Pmax=atlas.numexemplars;
+    int t=v.rows();
+    Sopt.resize(Pmax);
+
+    bisThreadPool::parallelFor(0,Pmax,1,[&](BISLONG begin,BISLONG end,int) {
+        VectorXd sum(t);
+        std::vector<double> norm2;
+        for (int p=int(begin);p<int(end);p++)
           {
-            std::pair<double,int> chosenNode = exemplar_min_heaps[min_idx].top();
-            exemplar_min_heaps[min_idx].pop();
-            int chosenVoxel = chosenNode.second;
-            if (VISITED[chosenVoxel] == 0)
+            const int* voxels=&members[start[p]];
+            int psize=start[p+1]-start[p];
+            norm2.resize(psize);
+            sum.setZero();
+            double sumnorm2=0.0;
+            for (int j=0;j<psize;j++)
+              {
+                sum+=v.col(voxels[j]);
+                norm2[j]=v.col(voxels[j]).squaredNorm();
+                sumnorm2+=norm2[j];
+              }
+
+            double sumd0=sumnorm2-6.0*sum(0)+9.0*psize;
+            int best=0;
+            double bestvalue=0.0;
+            for (int i=0;i<psize;i++)
               {
-                label[chosenVoxel] = min_idx;
-                VISITED[chosenVoxel] = 1;
-                sumVisited ++;
-                //    if (sumVisited==7886)
-                //    std::cout << "number of visited = " << sumVisited << std::endl;
-                std::unordered_map<int,int>::const_iterator voxelN = ntoNvoxel.find (chosenVoxel);
-                //       if (sumVisited==7886)
-                //std::cout << "Here " << chosenVoxel << std::endl;
-                if (voxelN != ntoNvoxel.end())
+                double sumd=psize*norm2[i]+sumnorm2-2.0*v.col(voxels[i]).dot(sum);
+                double value=sumd0-sumd; // we should divide by psize but this does not change the maximum
+                if (i==0 || value>bestvalue)
                   {
-                    int chosenVoxelN = voxelN->second;
-                    //  if (sumVisited==7886)
-                    //std::cout << "Here " << chosenVoxelN << " " << neighbors << std::endl;
-                    //      if(NONBOUNDARY[chosenVoxelN] == 1)
-                    for (int ia=0;ia<neighbors;ia++)
-                      {
-                        int currVoxN = chosenVoxelN + incr[ia];
-                        int v_k=int(currVoxN/slicesize);
-                        int v_j=currVoxN-v_k*slicesize;
-                        int v_i=v_j % dim[0];
-                        v_j=int(v_j/dim[0]);
-                        
-                        if (v_i>=0 && v_i<dim[0] &&
-                            v_j>=0 && v_j<dim[1] &&
-                            v_k>=0 && v_k<dim[2]) {
-                          if (group[currVoxN]>0)
-                            {
-                              std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (currVoxN);
-                              if (voxeln != Ntonvoxel.end())
-                                {
-                                  int currVox = voxeln->second;
-                                  if (VISITED[currVox] == 0){
-                                    exemplar_min_heaps[min_idx].push(std::make_pair(distvSopt(currVox,min_idx),currVox));
-                                  }
-                                }
-                            }
-                        }
-                      }
+                    best=i;
+                    bestvalue=value;
                   }
               }
+            Sopt(p)=voxels[best];
+          }
+      });
+  }
 
-          } 
-	/* testing the order of elements in the priority queue is from smallest dist to largest dist [VERIFIED]
-           std::queue<std::pair<double, int> > tteesstt;	
-           for (int ii=0;ii<exemplar_min_heaps[min_idx].size();ii++)
-           {
-           std::pair<double,int> testNode = exemplar_min_heaps[min_idx].top();
-           tteesstt.push(testNode);
-           exemplar_min_heaps[min_idx].pop();
-           fprintf(stdout,"(%d,%f), ",testNode.second,testNode.first);
-           }
-           fprintf(stdout,"next...\n");
-	*/
-
-        if (min_idx < 0)
-          break;
+  bool ismember(VectorXi V, int p)
+  {
+    for (int i=0;i<V.size();i++)
+      {
+        if (V(i)==p)
+          return 1;
       }
+    return 0;
+  }
+
+  // ----------------------------------------------------------------------------------------------------------------
+  // Atlas context
+  // ----------------------------------------------------------------------------------------------------------------
+  bisParcellationAtlas::bisParcellationAtlas() {
+    for (int ia=0;ia<=4;ia++)
+      this->dim[ia]=0;
+    for (int ia=0;ia<6;ia++)
+      this->incr[ia]=0;
+    this->numvoxels=0;
+    this->numexemplars=0;
+  }
 
-    //int Voxel_indices[N];
-    count = 0;
+  int bisParcellationAtlas::initialize(bisSimpleImage<short>* groupparcellation,int nexemplars)
+  {
+    groupparcellation->getDimensions(this->dim);
+    this->numvoxels=this->dim[0]*this->dim[1]*this->dim[2];
+    this->numexemplars=nexemplars;
 
-    short* indivdata=indiv->getImageData();
-    
+    double range[2];
+    groupparcellation->getRange(range);
+    int RangeMax=int(range[1]);
+    if (nexemplars != RangeMax) {
+      std::cerr << "---- Bad Group Parcellation Input to vtkbisIndividualizeParcellation pmax = " << nexemplars << "range[1] = " << RangeMax << std::endl;
+      return 0;
+    }
+
+    // Voxel index maps and the voxels of each parcel in one counting sort pass (increasing voxel order in a parcel)
+    int N=this->numvoxels;
+    short* group=groupparcellation->getImageData();
+    this->Ntonvoxel.assign(N,-1);
+    this->ntoNvoxel.clear();
+    this->parcelstart.assign(nexemplars+1,0);
     for (int voxel=0;voxel<N;voxel++)
       {
-	if(group[voxel]>0) { 
-          std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (voxel);
-          if (voxeln != Ntonvoxel.end()) {
-            int finalvoxeln = voxeln->second; 
-            indivdata[voxel]=label[finalvoxeln]+1;
+        if (group[voxel]>0)
+          {
+            this->Ntonvoxel[voxel]=this->ntoNvoxel.size();
+            this->ntoNvoxel.push_back(voxel);
+            this->parcelstart[group[voxel]]++;
           }
-        }
       }
+    for (int p=0;p<nexemplars;p++)
+      this->parcelstart[p+1]+=this->parcelstart[p];
 
-    // Second frame
-    int i_dim[5]; indiv->getDimensions(i_dim);
-    if (i_dim[3]>1) 
-      {   
-	for (int p=0; p<Pmax; p++)
-	 {
-	   int index = int(SoptN(p));
-	   indivdata[index + N] = p+1;
+    int n=this->ntoNvoxel.size();
+    this->parcelmembers.resize(n);
+    std::vector<int> next(this->parcelstart.begin(),this->parcelstart.end()-1);
+    for (int voxel=0;voxel<n;voxel++)
+      {
+        int p=group[this->ntoNvoxel[voxel]]-1;
+        this->parcelmembers[next[p]++]=voxel;
+      }
 
-	   int xyz[3];
-	   computeXYZ(index, dim, xyz);
-//    	   std::cout << "x = " << xyz[0] << ", y = " << xyz[1] << ", z = " << xyz[2] << std::endl;
-	   indivdata[index + (2 * N)] = xyz[0];
-	   indivdata[index + (3 * N)] = xyz[1];
-	   indivdata[index + (4 * N)] = xyz[2];		
-	 }
-       }     
+    for (int p=0;p<nexemplars;p++)
+      {
+        if (this->parcelstart[p+1]==this->parcelstart[p])
+          {
+            std::cerr << "---- Parcel " << p+1 << " has no voxels in the mask" << std::endl;
+            return 0;
+          }
+      }
 
+    computeMRFIncrements(this->dim,this->incr);
     return 1;
   }
 
   // ----------------------------------------------------------------------------------------------------------------
+  // Single subject
   // ----------------------------------------------------------------------------------------------------------------
-  // ----------------------------------------------------------------------------------------------------------------
-  /// float
-  int runIndividualizedParcellationFloat(bisSimpleImage<float>* FMRIImage, bisSimpleImage<short>* groupparcellation, bisSimpleImage<short>* indiv,
-                                         int numexemplars)
-  {
-    // Zero everything
-    indiv->fill(0);
-    
-    
-    int dim[5], dim2[5];
-    FMRIImage->getDimensions(dim);
-    groupparcellation->getDimensions(dim2);
-      std::cout << "++++ Beginning (FLOAT) Indiv Parc (Salehi et al 2019) " << std::endl;
-    std::cout << "++++ \t fMRI Image dim = " << dim[0] << "," << dim[1] << "," << dim[2] << "  " << dim[3] << std::endl;
-    std::cout << "++++ \t Group Parcellation Image dim2 = " << dim2[0] << "," << dim2[1] << "," << dim2[2] << "  " << dim2[3] << std::endl;
-
-    int slicesize=dim[0]*dim[1];
-    
-    int sum=0;
-    for (int ia=0;ia<=2;ia++)
-      sum+=abs(dim[ia]-dim2[ia]);
-    if (sum>0)
-      {
-        std::cerr << "---- Bad FMRI Input to runIndividualizedParcelllation sum = " << sum << " > 0 " << std::endl;
-        return 0;
-      }
-    
-    //    vtkDataArray* group=input->GetPointData()->GetScalars(); 
-    int N=dim2[0]*dim2[1]*dim2[2];
-    
-    const int t=dim[3];//this->FMRIImage->GetNumberOfScalarComponents(); //nc
-    
-    double range[2]; 
-    groupparcellation->getRange(range);
-  
-    int Pmax = numexemplars;
-    int RangeMax=int(range[1]);
-    
-    if (Pmax != RangeMax) {
-      std::cerr << "---- Bad Group Parcellation Input to vtkbisIndividualizeParcellation pmax = " << Pmax << "range[1] = " << RangeMax << std::endl;
-      return 0;
-    }
 
-    std::cout << "++++ \t number of frames is " << t << std::endl;
-    std::cout << "++++ \t number of voxels is " << dim[0] << "x" << dim[1] << "x" << dim[2] << " = " << N << std::endl;
-    std::cout << "++++ \t number of exemplars is " << Pmax << std::endl;
-    //    fprintf(stdout,"lambda is %f\n",lambda);
-    
-    //fprintf(stdout,"START: the elapsed time is = %f s \n",float(clock()-begin_time)/CLOCKS_PER_SEC);
+  // Copies the in-mask timeseries (t frames) into X (one column per voxel), removes the mean timeseries and
+  // normalizes each voxel to unit norm
+  void loadNormalizedTimeseries(const bisParcellationAtlas& atlas,const float* fmri,int t,MatrixXd& X,int debug)
+  {
+    int N=atlas.numvoxels;
+    int n=atlas.ntoNvoxel.size();
 
-  
+    if (debug)
+      std::cout << "++++ COPYING DATA TO EIGEN MATRIX & VECTOR" << std::endl;
 
-    // Copying data to matrixXd and VectorXf
-    std::cout << "++++ COPYING DATA TO EIGEN MATRIX & VECTOR" << std::endl;
-    
-    int count=0;
-
-    short* group=groupparcellation->getImageData();
-    
-    for (int voxel=0;voxel<N;voxel++) {
-      if(group[voxel]>0) {
-        count++;
+    X.resize(t,n);
+    for (int voxel=0;voxel<n;voxel++)
+      {
+        BISLONG offset=atlas.ntoNvoxel[voxel];
+        for (int frame=0;frame<t;frame++)
+          X(frame,voxel) = fmri[BISLONG(N)*frame+offset];
       }
-    }
-    
-    MatrixXd X(t,count);
-    count=0;
-    //double position[3];
 
-    float* fmri=FMRIImage->getImageData();
-    
-    for (int voxel=0;voxel<N;voxel++) {
-      if(group[voxel]>0) {
-        for (int frame=0;frame<t;frame++) {
-          X(frame,count) = fmri[N*frame+voxel];
-        }
-        count++;
-      }
-    }
+    if (debug)
+      std::cout << "++++ \t number of non-zero voxels n = " << n << std::endl;
 
-    int dummy_dim[5]= { 1,1,1,1,1 };
-    float dummy_spa[5]={ 1.0,1.0,1.0,1.0,1.0 };
-    FMRIImage->allocate(dummy_dim,dummy_spa);
-  
-    VectorXd parcel(count);
-    std::unordered_map<int,int> ntoNvoxel;
-    std::unordered_map<int,int> Ntonvoxel;
-    count=0;
-    for (int voxel=0;voxel<N;voxel++)
-      if (group[voxel]>0)
-        {
-          parcel(count) = group[voxel]; // this is the group label for all the nonzero voxels
-          ntoNvoxel.insert( std::make_pair(count,voxel) );
-          Ntonvoxel.insert( std::make_pair(voxel,count) );
-          count++;
-        }
-    
-    int n = count;
-    
-    std::cout << "++++ \t number of non-zero voxels n = " << n << std::endl;
-    
+    // Normalizing data points to 0 mean
     VectorXd mean_subtract(t);
     mean_subtract = (X.rowwise().sum())/double(n);
-	
-    
+    X = X.colwise()-mean_subtract; // mean of V is all 0 [VERIFIED]
 
-    // Normalizing data points to 0 mean
-    //double newValue;
-//    MatrixXd V = MatrixXd(t,n);
-//    V = X.colwise()-mean_subtract; // mean of V is all 0 [VERIFIED]
-//    X.resize(0,0);
+    ////////////////////////////////////////////////  Normalizing to the unit norm (all vectors norm = 1)
+    if (debug)
+      std::cout << "++++ NORMALIZATION ONTO UNIT SPHERE (ALL NORM=1)" << std::endl;
 
-    
-    X = X.colwise()-mean_subtract; // mean of V is all 0 [VERIFIED]
-    
-    // Calculating the l2-norm
-    VectorXd twoNorm(n);
-//    twoNorm = V.colwise().norm();
-    twoNorm = X.colwise().norm();
     VectorXd inverse_twoNorm(n);
-    inverse_twoNorm = twoNorm.array().inverse();
-    
-    ////////////////////////////////////////////////  1- Dividing with the maximum norm 
-    //// finding the maximum value in the array
-    //  double maxValue = twoNorm.maxCoeff();
-    ////  Normalizing data points to a unit ball sphere
-    //  MatrixXf v = V/maxValue;
-    //  fprintf(stdout,"NORMALIZATION INTO UNIT SPHERE (DIVIDE BY MAX NORM): the elapsed time is = %f s \n",float(clock()-timebegin11)/CLOCKS_PER_SEC);
-    
-    ////////////////////////////////////////////////  2- Normalizing to the unit norm (all vectors norm = 1)
-    std::cout << "++++ NORMALIZATION ONTO UNIT SPHERE (ALL NORM=1)" << std::endl;
-    
-//    MatrixXd v = V.array().rowwise()* inverse_twoNorm.transpose().array();
-//    MatrixXd v = X.array().rowwise()* inverse_twoNorm.transpose().array();
-//    twoNorm = v.colwise().norm(); // twoNorm is all 1 [VERIFIED]
-      X = X.array().rowwise()* inverse_twoNorm.transpose().array();
-//    V.resize(0,0);
-
-    
-    //  VectorXf test_ii(t);
-    //  test_ii = (V.rowwise().sum())/double(n);
-    //  for (int ii=0; ii<t; ii++)
-    //	  fprintf(stdout,"V norm = %f\n",twoNorm(ii)); 
-    
-    
-    
-    ////////// Finding the voxels within each parcel ///////////////
-    std::cout << "++++ FINDING VOXELS:" << std::endl;
-    
-    std::vector< std::vector<int> > indice_p;
-    std::vector<int> p_vector;
-    for (int p=0;p<Pmax;p++)
-      {	
-	for (int voxel=0;voxel<n;voxel++)
-          if (parcel(voxel) == p+1)
-            p_vector.push_back(voxel);
-	indice_p.push_back(p_vector);
-	p_vector.clear(); // p_vector's size is 0 [VERIFIED]
-      }
-    
+    inverse_twoNorm = X.colwise().norm().array().inverse();
+    X = X.array().rowwise()* inverse_twoNorm.transpose().array();
+  }
 
-    // Calculating the squared distance matrix between voxels within each parcel
-    std::cout << "++++ SQUARED DISTANCES" << std::endl;
-    
-    std::vector<VectorXd> sqrDist;
-//    MatrixXd D;
-    VectorXi R(t);
-    colon(0,1,t-1,R);
-
-//    int maxPsize=-1;
-//    for (int p=0;p<Pmax;p++) {
-//     int psize = indice_p[p].size();
-//      if (psize>maxPsize)
-//        maxPsize=psize;
-//    }
-//    std::cout << "Max P Size =" << maxPsize << std::endl;
-    
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-//      if (p%20 == 0) 
-//        std::cout << "p=" << p << "/" << Pmax << " , " << psize << std::endl;
-      MatrixXd sqrMatrix(psize,psize);
-      int* ptr = &indice_p[p][0];
-      Map<VectorXi> C(ptr,psize);
-      MatrixXd vP(t,psize);
-      slice(X,R,C,vP);		
-      sqrMatrix = ((vP.transpose()*vP*-2).colwise() + vP.colwise().squaredNorm().transpose()).rowwise() + vP.colwise().squaredNorm();
-      sqrDist.push_back( sqrMatrix.colwise().sum() );
-      vP.resize(0,0);
-      sqrMatrix.resize(0,0);
-    }
+  // Moves the normalized timeseries to the precision used for the final distances (no copy for double)
+  template<class T> void convertPrecision(MatrixXd& X,Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic>& out)
+  {
+    out=X.cast<T>();
+    X.resize(0,0);
+  }
 
+  template<> void convertPrecision<double>(MatrixXd& X,MatrixXd& out)
+  {
+    out.swap(X);
+  }
 
-    
-    // Calculating the distance between auxiliary exemplar and the rest of the voxels
-    std::cout << "++++ AUXILIARY DISTANCES" << std::endl;
-    
-    std::vector<double> e0sqrDist(Pmax);
-    VectorXd e0 = VectorXd::Zero(t);
-    e0(0) = 3;
-
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-//      if (p%20 == 0) 
-//        std::cout << "p=" << p << ", " << psize << std::endl;
-      VectorXd sqrArray(psize);
-      int* ptr = &indice_p[p][0];
-      Map<VectorXi> C(ptr,psize);
-      MatrixXd vP(t,psize);
-      slice(X,R,C,vP);		
-      sqrArray = ((vP.transpose()*e0*-2).colwise() + vP.colwise().squaredNorm().transpose()).rowwise() + e0.colwise().squaredNorm();	
-      e0sqrDist[p]=sqrArray.sum();
-      vP.resize(0,0);
-      sqrArray.resize(0);
-      //	delete [] sqrArray;
-    }
-    //	for (int pp1=0;pp1<indice_p[p].size();pp1++)
-    //		for (int pp2=0;pp2<indice_p[p].size();pp2++)
-    //			fprintf(stdout,"p=%d, pp1=%d, pp2=%d, sqrDist[p][pp1][pp2] = %f\n",p,pp1,pp2,sqrDist[p][pp1][pp2]);
-    
-    
+  // Finds the exemplars of the normalized timeseries X (released on return) and labels the voxels. T is the precision
+  // of the final voxel/exemplar distances. output points to the first frame of the output image, if numoutputframes>1
+  // the exemplar labels and coordinates are stored in frames 1-4. The inputs are checked by the callers (this can not fail).
+  template<class T> void individualizeSubject(const bisParcellationAtlas& atlas,MatrixXd& X,short* output,
+                                             int numoutputframes,int debug)
+  {
+    int N=atlas.numvoxels;
+    int Pmax=atlas.numexemplars;
 
     //  Calculating the exemplar within each parcel
-    std::cout << "++++ EXEMPLAR IDENTIFICATION" << std::endl;
+    if (debug)
+      std::cout << "++++ EXEMPLAR IDENTIFICATION" << std::endl;
 
     VectorXi Sopt(Pmax);
-    VectorXi SoptN(Pmax);
-    //double loss;
-    for (int p=0;p<Pmax;p++) {
-      int psize = indice_p[p].size();
-
-//      double sumd0 = e0sqrDist[p];//.sum();
-      MatrixXd::Index maxFindex;
-//      VectorXd sumD(psize);	
-//      sumD = sqrDist[p];//.colwise().sum();
-
-      VectorXd pFunc(psize);
-//      pFunc = sumd0 - sumD.array();  // we should divide by n but does not matter as it does not change the maximum!
-      pFunc = e0sqrDist[p] - sqrDist[p].array();
-      pFunc.maxCoeff(&maxFindex);
-      Sopt(p) = indice_p[p][maxFindex];
-      std::unordered_map<int,int>::const_iterator voxelN = ntoNvoxel.find (Sopt(p));
-      if (voxelN != ntoNvoxel.end())
-        SoptN(p) = voxelN->second;
-//	std::cout << "p=" << SoptN(p) << std::endl;
-      
-    }
-    
-    
-    //  for (int p=0; p<Pmax; p++)
-    //	fprintf(stdout,"Sopt(%f) = %d, ", group->GetComponent(SoptN(p),0),SoptN(p));
-    
+    findParcelExemplars(X,atlas,Sopt);
+
     // Assigning each voxel to the closest exemplar using the priority queue algorithm
-    std::cout << "++++ FINAL STEP: ASSIGNING VOXELS TO EXEMPLARS (float)" << std::endl;
-    
-    
-    std::vector<float> label(n,-1);
-    
-    // minDistIndexR and minDistIndexL need to be double, otherwise the result differs from MATLAB. It is perhaps because of the SetComponent() command.
-    
-    MatrixXf Xf = X.cast<float>();
-    X.resize(0,0); 
-    MatrixXf vSopt(t,Pmax);
-    slice(Xf,R,Sopt,vSopt);
-    
-//    MatrixXf distvSopt(n,Pmax);
+    if (debug)
+      std::cout << "++++ FINAL STEP: ASSIGNING VOXELS TO EXEMPLARS (" << (sizeof(T)==4 ? "float" : "double") << ")" << std::endl;
 
-//    distvSopt = ((X.transpose()*vSopt*-2).colwise() + X.colwise().squaredNorm().transpose()).rowwise() + vSopt.colwise().squaredNorm();
-    Xf = ((Xf.transpose()*vSopt*-2).colwise() + Xf.colwise().squaredNorm().transpose()).rowwise() + vSopt.colwise().squaredNorm();
-//    X = ((X.transpose()*vSopt*-2).colwise() + X.colwise().squaredNorm().transpose()).rowwise() + vSopt.colwise().squaredNorm();	
+    Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic> Xt;
+    convertPrecision<T>(X,Xt);
 
+    std::vector<int> label;
+    bisExemplarDistance<T> distvSopt(Xt,Sopt);
+    assignVoxelsToExemplars(distvSopt,atlas,Sopt,label);
 
-    
-    const int neighbors = 6;
-    int incr[neighbors]; computeMRFIncrements(dim,incr);
-    
-    int sumVisited = 0;
-    std::vector<int> VISITED(n,0);
-    
-    
-    // Assigning labels to exemplars and marking them as visited
-    for (int p=0; p<Pmax; p++){
-      label[Sopt(p)] = p;
-      VISITED[Sopt(p)] = 1;
-      sumVisited ++;		
-    }
+    for (BISLONG voxel=0;voxel<BISLONG(N)*numoutputframes;voxel++)
+      output[voxel]=0;
 
+    int n=atlas.ntoNvoxel.size();
+    for (int voxel=0;voxel<n;voxel++)
+      output[atlas.ntoNvoxel[voxel]]=label[voxel]+1;
 
-    
-    std::vector<std::priority_queue<std::pair<float, int> , std::vector<std::pair<float,int> >, std::greater<std::pair<float, int> > > > exemplar_min_heaps (Pmax);
-    for (int p=0; p<Pmax; p++)
+    // Second frame
+    if (numoutputframes>1)
       {
-	int exemplarN = SoptN(p);
-        //	if (NONBOUNDARY[exemplarN] == 1)
-        for (int ia=0;ia<neighbors;ia++)
-          {	
-            int currVoxN = exemplarN+incr[ia];
-            if (group[currVoxN]>0)
-              {
-                std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (currVoxN);
-                if (voxeln != Ntonvoxel.end())
-                  {
-                    int currVox = voxeln->second; 
-                    //                    exemplar_min_heaps[p].push(std::make_pair(distvSopt(currVox,p),currVox));
-                    exemplar_min_heaps[p].push(std::make_pair(Xf(currVox,p),currVox));
-                    
-                  }
-              }
-          }  
+        int dim[5];
+        for (int ia=0;ia<=4;ia++)
+          dim[ia]=atlas.dim[ia];
+	for (int p=0; p<Pmax; p++)
+	 {
+	   int index = atlas.ntoNvoxel[Sopt(p)];
+	   output[index + N] = p+1;
+
+	   int xyz[3];
+	   computeXYZ(index, dim, xyz);
+	   output[index + (2 * N)] = xyz[0];
+	   output[index + (3 * N)] = xyz[1];
+	   output[index + (4 * N)] = xyz[2];
+	 }
       }
+  }
 
-    
-    
-    while (sumVisited < n)
+  void individualizeSubject(const bisParcellationAtlas& atlas,MatrixXd& X,short* output,int numoutputframes,
+                            int usefloat,int debug)
+  {
+    if (usefloat)
+      individualizeSubject<float>(atlas,X,output,numoutputframes,debug);
+    else
+      individualizeSubject<double>(atlas,X,output,numoutputframes,debug);
+  }
+
+  // Checks that the fmri and output images match the atlas
+  int checkSubjectImages(const bisParcellationAtlas& atlas,bisSimpleImage<float>* FMRIImage,bisSimpleImage<short>* indiv)
+  {
+    int dim[5],i_dim[5];
+    FMRIImage->getDimensions(dim);
+    indiv->getDimensions(i_dim);
+
+    int sum=0;
+    for (int ia=0;ia<=2;ia++)
+      sum+=abs(dim[ia]-atlas.dim[ia])+abs(i_dim[ia]-atlas.dim[ia]);
+    if (sum>0)
+      {
+        std::cerr << "---- Bad FMRI Input to runIndividualizedParcelllation sum = " << sum << " > 0 " << std::endl;
+        return 0;
+      }
+    if (i_dim[3]!=1 && i_dim[3]<5)
       {
+        std::cerr << "---- Bad output image to runIndividualizedParcelllation frames = " << i_dim[3] << " (1 or 5)" << std::endl;
+        return 0;
+      }
+    return 1;
+  }
+
+  int runIndividualizedParcellation(bisParcellationAtlas* atlas,bisSimpleImage<float>* FMRIImage,bisSimpleImage<short>* indiv,
+                                    int usefloat,int debug)
+  {
+    if (!checkSubjectImages(*atlas,FMRIImage,indiv))
+      return 0;
+
+    int dim[5]; FMRIImage->getDimensions(dim);
+    int i_dim[5]; indiv->getDimensions(i_dim);
+    MatrixXd X;
+    loadNormalizedTimeseries(*atlas,FMRIImage->getImageData(),dim[3],X,debug);
+    individualizeSubject(*atlas,X,indiv->getImageData(),i_dim[3],usefloat,debug);
+    return 1;
+  }
+
+  // ----------------------------------------------------------------------------------------------------------------
+  // Many subjects
+  // ----------------------------------------------------------------------------------------------------------------
 
-        int min_idx = -1;
-        float min_val = 10000000;
-        for (int p=0; p<Pmax; p++)
+  // One subject per thread. The fmri data of subject i is fmri[i] (numframes[i] frames), the output output[i] has
+  // numoutputframes[i] frames. The images must have been checked against the atlas (see checkSubjectImages).
+  void runBatch(const bisParcellationAtlas& atlas,const std::vector<const float*>& fmri,const std::vector<int>& numframes,
+               const std::vector<short*>& output,const std::vector<int>& numoutputframes,int usefloat,int numthreads)
+  {
+    int numsubjects=fmri.size();
+    bisThreadPool::parallelFor(0,numsubjects,1,[&](BISLONG begin,BISLONG end,int) {
+        for (int i=int(begin);i<int(end);i++)
           {
-            if (!exemplar_min_heaps[p].empty())
-              {
-		std::pair<float,int> curNode = exemplar_min_heaps[p].top();		
-		if (curNode.first < min_val)
-                  {
-                    min_val = curNode.first; // all distances <=4 [VERIFIED]
-                    min_idx = p;
-                  }
-              }	
-            
+            MatrixXd X;
+            loadNormalizedTimeseries(atlas,fmri[i],numframes[i],X,0);
+            individualizeSubject(atlas,X,output[i],numoutputframes[i],usefloat,0);
           }
-        // selected exemplar queue (min_idx) is correct [VERIFIED]
-        // fprintf(stdout,"\n(selected queue,min_val)=(%d,%f)\n",min_idx,min_val);
-        
-        if (min_idx >=0)
-          {
-            std::pair<float,int> chosenNode = exemplar_min_heaps[min_idx].top();
-            exemplar_min_heaps[min_idx].pop();
-            int chosenVoxel = chosenNode.second;
-            if (VISITED[chosenVoxel] == 0)
-              {
-                label[chosenVoxel] = min_idx;
-                VISITED[chosenVoxel] = 1;
-                sumVisited ++;
-                std::unordered_map<int,int>::const_iterator voxelN = ntoNvoxel.find (chosenVoxel);
-                if (voxelN != ntoNvoxel.end())
-                  {
-                    int chosenVoxelN = voxelN->second; 
-                    //      if(NONBOUNDARY[chosenVoxelN] == 1)
-                    for (int ia=0;ia<neighbors;ia++)
-                      {
-                        int currVoxN = chosenVoxelN + incr[ia];
-                        int v_k=int(currVoxN/slicesize);
-                        int v_j=currVoxN-v_k*slicesize;
-                        int v_i=v_j % dim[0];
-                        v_j=int(v_j/dim[0]);
-                        
-                        if (v_i>=0 && v_i<dim[0] &&
-                            v_j>=0 && v_j<dim[1] &&
-                            v_k>=0 && v_k<dim[2]) {
-                          
-                          if (group[currVoxN]>0)
-                            {
-                              std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (currVoxN);
-                              if (voxeln != Ntonvoxel.end())
-                                {
-                                  int currVox = voxeln->second;
-                                  if (VISITED[currVox] == 0){
-                                    //                                  exemplar_min_heaps[min_idx].push(std::make_pair(distvSopt(currVox,min_idx),currVox));
-                                    exemplar_min_heaps[min_idx].push(std::make_pair(Xf(currVox,min_idx),currVox));
-                                    
-                                  }
-                                }
-                            }
-                        }
-                      }
-                  }
-              }
+      },numthreads);
+  }
 
-          } 
-	/* testing the order of elements in the priority queue is from smallest dist to largest dist [VERIFIED]
-           std::queue<std::pair<float, int> > tteesstt;	
-           for (int ii=0;ii<exemplar_min_heaps[min_idx].size();ii++)
-           {
-           std::pair<float,int> testNode = exemplar_min_heaps[min_idx].top();
-           tteesstt.push(testNode);
-           exemplar_min_heaps[min_idx].pop();
-           fprintf(stdout,"(%d,%f), ",testNode.second,testNode.first);
-           }
-           fprintf(stdout,"next...\n");
-	*/
-
-        if (min_idx < 0)
-          break;
+  int runBatchIndividualizedParcellation(bisParcellationAtlas* atlas,
+                                         std::vector<bisSimpleImage<float>*>& FMRIImages,
+                                         std::vector<bisSimpleImage<short>*>& indiv,
+                                         int usefloat,int numthreads)
+  {
+    int numsubjects=FMRIImages.size();
+    if (int(indiv.size())!=numsubjects)
+      {
+        std::cerr << "---- Bad number of outputs to runBatchIndividualizedParcellation " << indiv.size() << " != " << numsubjects << std::endl;
+        return numsubjects;
       }
 
-    //int Voxel_indices[N];
-    count = 0;
-
-    short* indivdata=indiv->getImageData();
-    
-    for (int voxel=0;voxel<N;voxel++)
+    // Subjects with bad inputs count as failed, their outputs are left as they are
+    std::vector<const float*> fmri;
+    std::vector<int> numframes,numoutputframes;
+    std::vector<short*> output;
+    int failed=0;
+    for (int i=0;i<numsubjects;i++)
       {
-	if(group[voxel]>0) { 
-          std::unordered_map<int,int>::const_iterator voxeln = Ntonvoxel.find (voxel);
-          if (voxeln != Ntonvoxel.end()) {
-            int finalvoxeln = voxeln->second; 
-            indivdata[voxel]=label[finalvoxeln]+1;
+        if (!checkSubjectImages(*atlas,FMRIImages[i],indiv[i]))
+          {
+            ++failed;
+            continue;
           }
-        }
+        int dim[5]; FMRIImages[i]->getDimensions(dim);
+        int i_dim[5]; indiv[i]->getDimensions(i_dim);
+        fmri.push_back(FMRIImages[i]->getImageData());
+        numframes.push_back(dim[3]);
+        output.push_back(indiv[i]->getImageData());
+        numoutputframes.push_back(i_dim[3]);
       }
 
-    // Second frame
-    int i_dim[5]; indiv->getDimensions(i_dim);
-    if (i_dim[3]>1) 
-      {   
-	for (int p=0; p<Pmax; p++)
-	 {
-	   int index = int(SoptN(p));
-	   indivdata[index + N] = p+1;
+    runBatch(*atlas,fmri,numframes,output,numoutputframes,usefloat,numthreads);
+    return failed;
+  }
 
-	   int xyz[3];
-	   computeXYZ(index, dim, xyz);
-//    	   std::cout << "x = " << xyz[0] << ", y = " << xyz[1] << ", z = " << xyz[2] << std::endl;
-	   indivdata[index + (2 * N)] = xyz[0];
-	   indivdata[index + (3 * N)] = xyz[1];
-	   indivdata[index + (4 * N)] = xyz[2];		
-	 }
-       }     
-    
+  // ----------------------------------------------------------------------------------------------------------------
+  // Original interface (group parcellation processed on every call)
+  // ----------------------------------------------------------------------------------------------------------------
+  int runIndividualizedParcellation(bisSimpleImage<float>* FMRIImage, bisSimpleImage<short>* groupparcellation, bisSimpleImage<short>* indiv,
+                                    int numexemplars)
+  {
+    int dim[5], dim2[5];
+    FMRIImage->getDimensions(dim);
+    groupparcellation->getDimensions(dim2);
+    std::cout << "++++ Beginning Indiv Parc (Salehi et al 2019) " << std::endl;
+    std::cout << "++++ \t fMRI Image dim = " << dim[0] << "," << dim[1] << "," << dim[2] << "  " << dim[3] << std::endl;
+    std::cout << "++++ \t Group Parcellation Image dim2 = " << dim2[0] << "," << dim2[1] << "," << dim2[2] << "  " << dim2[3] << std::endl;
+    std::cout << "++++ \t number of exemplars is " << numexemplars << std::endl;
+
+    // Zero everything
+    indiv->fill(0);
+
+    bisParcellationAtlas atlas;
+    if (!atlas.initialize(groupparcellation,numexemplars))
+      return 0;
+
+    return runIndividualizedParcellation(&atlas,FMRIImage,indiv,0,1);
+  }
+
+  // ----------------------------------------------------------------------------------------------------------------
+  /// float, also releases the fmri image once it has been copied to save memory
+  int runIndividualizedParcellationFloat(bisSimpleImage<float>* FMRIImage, bisSimpleImage<short>* groupparcellation, bisSimpleImage<short>* indiv,
+                                         int numexemplars)
+  {
+    int dim[5], dim2[5];
+    FMRIImage->getDimensions(dim);
+    groupparcellation->getDimensions(dim2);
+    std::cout << "++++ Beginning (FLOAT) Indiv Parc (Salehi et al 2019) " << std::endl;
+    std::cout << "++++ \t fMRI Image dim = " << dim[0] << "," << dim[1] << "," << dim[2] << "  " << dim[3] << std::endl;
+    std::cout << "++++ \t Group Parcellation Image dim2 = " << dim2[0] << "," << dim2[1] << "," << dim2[2] << "  " << dim2[3] << std::endl;
+    std::cout << "++++ \t number of exemplars is " << numexemplars << std::endl;
+
+    // Zero everything
+    indiv->fill(0);
+
+    bisParcellationAtlas atlas;
+    if (!atlas.initialize(groupparcellation,numexemplars))
+      return 0;
+
+    if (!checkSubjectImages(atlas,FMRIImage,indiv))
+      return 0;
+
+    MatrixXd X;
+    loadNormalizedTimeseries(atlas,FMRIImage->getImageData(),dim[3],X,1);
+
+    int dummy_dim[5]= { 1,1,1,1,1 };
+    float dummy_spa[5]={ 1.0,1.0,1.0,1.0,1.0 };
+    FMRIImage->allocate(dummy_dim,dummy_spa);
+
+    int i_dim[5]; indiv->getDimensions(i_dim);
+    individualizeSubject<float>(atlas,X,indiv->getImageData(),i_dim[3],1);
     return 1;
   }
 
@@ -999,3 +642,80 @@ unsigned char* individualizedParcellationWASM(unsigned char* input, unsigned cha
   return out_image->releaseAndReturnRawArray();
 
 }
+
+// -------------------------------------------------------------
+// individualizedParcellationBatch adjusts the parcellation for many subjects, the subjects are the components of the
+// input image. The group parcellation is processed once and the subjects run in parallel.
+
+unsigned char* individualizedParcellationBatchWASM(unsigned char* input, unsigned char* groupparcellation,const char* jsonstring,int debug)
+{
+  std::unique_ptr<bisJSONParameterList> params(new bisJSONParameterList());
+  int ok=params->parseJSONString(jsonstring);
+  if (!ok) 
+    return 0;
+
+  if (debug)
+    params->print();
+
+  std::unique_ptr<bisSimpleImage<float> > inp_image(new bisSimpleImage<float>("inp_image"));
+  if (!inp_image->linkIntoPointer(input))
+    return 0;
+
+  std::unique_ptr<bisSimpleImage<short> > parc_image(new bisSimpleImage<short>("parc_image"));
+  if (!parc_image->linkIntoPointer(groupparcellation))
+    return 0;
+
+  int numexemplars=params->getIntValue("numberofexemplars",268);
+  int usefloat=params->getBooleanValue("usefloat");
+  int saveexemplars=params->getBooleanValue("saveexemplars",false);
+  int numthreads=params->getIntValue("numthreads",0);
+
+  int dim[5]; inp_image->getDimensions(dim);
+  int out_dim[5]; parc_image->getDimensions(out_dim);
+  float out_spa[5]; parc_image->getSpacing(out_spa);
+  
+  if (debug)  {
+    std::cout << "........................" << std::endl;
+    std::cout << ".... Beginning batch individualizedparcellation : numexemplars=" << numexemplars << " subjects=" << dim[4] << std::endl;
+    std::cout << ".... \t Input  dimensions=" << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << "," << dim[4] << std::endl;
+    std::cout << ".... \t Parc  dimensions=" << out_dim[0] << "," << out_dim[1] << "," << out_dim[2] << "," << out_dim[3] << "," << out_dim[4] << std::endl;
+    std::cout << "........................" << std::endl << std::endl;
+  }
+
+  int sum=0;
+  for (int ia=0;ia<=2;ia++)
+    sum+=abs(dim[ia]-out_dim[ia]);
+  if (sum>0)
+    {
+      std::cerr << "---- Bad FMRI Input to individualizedParcellationBatchWASM sum = " << sum << " > 0 " << std::endl;
+      return 0;
+    }
+
+  bisIndividualizedParcellation::bisParcellationAtlas atlas;
+  if (!atlas.initialize(parc_image.get(),numexemplars))
+    return 0;
+
+  std::unique_ptr<bisSimpleImage<short> > out_image(new bisSimpleImage<short>("out_parc"));
+  out_dim[3]=saveexemplars ? 5 : 1;
+  out_dim[4]=dim[4];
+  out_image->allocate(out_dim,out_spa);
+
+  // Subject i is component i of the input and of the output
+  BISLONG N=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+  int numsubjects=dim[4];
+  std::vector<const float*> fmri(numsubjects);
+  std::vector<short*> output(numsubjects);
+  std::vector<int> numframes(numsubjects,dim[3]),numoutputframes(numsubjects,out_dim[3]);
+  for (int i=0;i<numsubjects;i++)
+    {
+      fmri[i]=inp_image->getImageData()+N*dim[3]*i;
+      output[i]=out_image->getImageData()+N*out_dim[3]*i;
+    }
+
+  bisIndividualizedParcellation::runBatch(atlas,fmri,numframes,output,numoutputframes,usefloat,numthreads);
+
+  if (debug)
+    std::cout << "batch individualized Parcellation Done" << std::endl;
+
+  return out_image->releaseAndReturnRawArray();
+}
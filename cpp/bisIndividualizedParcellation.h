@@ -34,6 +34,73 @@
 
 
 namespace bisIndividualizedParcellation {
+
+  /** The parts of the individualized parcellation that depend only on the group parcellation (the in-mask voxel
+   * index maps, the voxels of each parcel and the MRF neighbor offsets). Compute this once and reuse it for all
+   * subjects that share the group parcellation. It is not changed by the run functions so it can be shared by threads.
+   */
+  class bisParcellationAtlas {
+
+  public:
+
+    bisParcellationAtlas();
+
+    /** Computes the context from a group parcellation
+     * @param groupparcellation the group parcellation (0=outside the mask, 1..numexemplars)
+     * @param numexemplars the number of parcels (must match the maximum label)
+     * @returns 1 if success, 0 if failed
+     */
+    int initialize(bisSimpleImage<short>* groupparcellation,int numexemplars=268);
+
+    /** image dimensions of the group parcellation */
+    int dim[5];
+
+    /** number of voxels in the image (dim[0]*dim[1]*dim[2]) */
+    int numvoxels;
+
+    /** number of parcels */
+    int numexemplars;
+
+    /** the image voxel of each in-mask voxel */
+    std::vector<int> ntoNvoxel;
+
+    /** the in-mask index of each image voxel (-1 if not in the mask) */
+    std::vector<int> Ntonvoxel;
+
+    /** the in-mask voxels of parcel p are parcelmembers[parcelstart[p]] to parcelmembers[parcelstart[p+1]-1] */
+    std::vector<int> parcelstart;
+
+    /** see parcelstart */
+    std::vector<int> parcelmembers;
+
+    /** the offsets of the 6 face neighbors of a voxel */
+    int incr[6];
+  };
+
+  /** Individualizes a group parcellation for one subject
+   * @param atlas the group parcellation context (see bisParcellationAtlas::initialize)
+   * @param FMRIImage the 4D fmri image of the subject (same voxel dimensions as the group parcellation)
+   * @param indiv the output image (allocated, 1 frame or 5 frames to also store the exemplars)
+   * @param usefloat if > 0 compute the final voxel/exemplar distances in single precision
+   * @param debug if > 0 print progress
+   * @returns 1 if success, 0 if failed
+   */
+  int runIndividualizedParcellation(bisParcellationAtlas* atlas,bisSimpleImage<float>* FMRIImage,bisSimpleImage<short>* indiv,
+                                    int usefloat=0,int debug=1);
+
+  /** Individualizes a group parcellation for many subjects, one subject per thread of bisThreadPool
+   * @param atlas the group parcellation context (see bisParcellationAtlas::initialize)
+   * @param FMRIImages the 4D fmri images of the subjects
+   * @param indiv the output images (allocated, one per subject, 1 frame or 5 frames to also store the exemplars)
+   * @param usefloat if > 0 compute the final voxel/exemplar distances in single precision
+   * @param numthreads maximum number of threads to use (if <=0 use the whole pool)
+   * @returns the number of subjects whose images do not match the atlas (skipped, their outputs are not changed), 0 if all ran
+   */
+  int runBatchIndividualizedParcellation(bisParcellationAtlas* atlas,
+                                         std::vector<bisSimpleImage<float>*>& FMRIImages,
+                                         std::vector<bisSimpleImage<short>*>& indiv,
+                                         int usefloat=0,int numthreads=0);
+
   int runIndividualizedParcellation(bisSimpleImage<float>* FMRIImage, bisSimpleImage<short>* groupparcelllation, bisSimpleImage<short>* indiv,
                                     int numexemplars=268);
 
@@ -58,6 +125,20 @@ extern "C" {
   // BIS: { 'individualizedParcellationWASM', 'bisImage', [ 'bisImage', 'bisImage', 'ParamObj', 'debug' ], {"checkorientation" : "all"} }
   BISEXPORT unsigned char* individualizedParcellationWASM(unsigned char* input, unsigned char* groupparcellation,const char* jsonstring,int debug);
 
+  /** Individualizes a group parcellation for many subjects (in parallel), the group parcellation is processed once.
+   * All subjects are passed in (and returned as) one image, so in WebAssembly (wasm32, a heap of at most 2-4GB) the float
+   * input, the output and a double copy of the in-mask timeseries for each running subject must fit in memory at once.
+   * Split large batches into several calls (or use runBatchIndividualizedParcellation natively).
+   * @param input serialized 5D input file as unsigned char array, the subjects are the components (dim[4]) each with dim[3] frames
+   * @param groupparcellation serialized input (group) parcellation as unsigned char array
+   * @param jsonstring the parameter string for the algorithm
+   * { "numberofexemplars" : 268, "usefloat" : false, "saveexemplars" : false, "numthreads" : 0 }
+   * @param debug if > 0 print debug messages
+   * @returns a pointer to a serialized image with one component (dim[4]) per subject
+   */
+  // BIS: { 'individualizedParcellationBatchWASM', 'bisImage', [ 'bisImage', 'bisImage', 'ParamObj', 'debug' ], {"checkorientation" : "all"} }
+  BISEXPORT unsigned char* individualizedParcellationBatchWASM(unsigned char* input, unsigned char* groupparcellation,const char* jsonstring,int debug);
+
 }
 
 
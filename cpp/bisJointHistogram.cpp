@@ -18,6 +18,7 @@
 
 #include "bisJointHistogram.h"
 #include "bisUtil.h"
+#include "bisSIMD.h"
 #include "math.h"
 #include <iostream>
 
@@ -322,6 +323,31 @@ int bisJointHistogram::weightedFillHistogram(short* arr1,short* arr2,short* weig
     this->zero();
 
   int slicesize=dim[0]*dim[1];
+
+#ifdef BIS_SIMD
+  // Compute the bins of a row at a time
+  if (this->intscale<=1)
+    {
+      std::vector<int> index(bounds[1]-bounds[0]+1);
+      int rowlength=index.size();
+      for (int k=bounds[4];k<=bounds[5];k++)
+        for (int j=bounds[2];j<=bounds[3];j++)
+          {
+            int offset=k*slicesize+j*dim[0]+bounds[0];
+            bisSIMD::computeBinIndices(&arr1[offset],&arr2[offset],rowlength,this->maxx,this->maxy,this->numbinsx,&index[0]);
+            for (int i=0;i<rowlength;i++)
+              {
+                if (index[i]>=0)
+                  {
+                    int w=factor*weightFun(offset+i,weightarr1,weightarr2);
+                    this->bins[index[i]]+=w;
+                    this->numsamples+=w;
+                  }
+              }
+          }
+      return 1;
+    }
+#endif
   
   // Treat as images with dimensions
 
@@ -0,0 +1,409 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#include "bisKNNGraph.h"
+#include "bisThreadPool.h"
+#include "bisSIMD.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+
+namespace bisKNNGraph {
+
+  // Points per task (rows) and per matrix product (columns) in the exact method
+  static const int BLOCK_ROWS=128;
+  static const int BLOCK_COLS=512;
+
+  // Extra candidates kept per point by the exact method before the (directly computed) distances are re-ranked.
+  // This is a heuristic margin for the rounding error of the GEMM distances, not a guarantee: with many near ties
+  // beyond the k+EXACT_MARGIN-th candidate a neighbor can still differ from the all pairs result (knn=0)
+  static const int EXACT_MARGIN=8;
+
+  // NN-descent parameters: groups smaller than this (or than 4*k) are done exactly, stop when fewer than
+  // DESCENT_DELTA*n*k neighbors changed in an iteration
+  static const int MIN_APPROXIMATE_POINTS=2048;
+  static const int DESCENT_MAXITER=12;
+  static const double DESCENT_DELTA=0.001;
+
+  typedef std::pair<float,int> bisKNNEntry;
+  typedef Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor> bisKNNBlock;
+
+  class bisKNNData {
+  public:
+    const float* data;
+    const long* rows;
+    int numdims;
+    int numneighbors;
+    int numthreads;
+    std::vector<float> mean;
+
+    const float* getPoint(int p) const { return this->data+this->rows[p]*this->numdims; }
+  };
+
+  double squaredDistance(const float* a,const float* b,int n)
+  {
+#ifdef BIS_SIMD
+    return bisSIMD::sumSquaredDifferences(a,b,n);
+#else
+    double sum=0.0;
+    for (int i=0;i<n;i++)
+      sum+=pow(a[i]-b[i],2.0f);
+    return sum;
+#endif
+  }
+
+  // ---------------------------------------------------------------------------------------------------
+  // Copies the (mean subtracted) points into a block and computes their squared norms. Removing the mean
+  // does not change the distances but avoids the cancellation in |a|^2+|b|^2-2a.b for data with a large offset
+  static void gatherBlock(const bisKNNData& kd,const int* points,int n,bisKNNBlock& block,std::vector<float>& norms)
+  {
+    block.resize(n,kd.numdims);
+    norms.resize(n);
+    for (int i=0;i<n;i++)
+      {
+        const float* src=kd.getPoint(points[i]);
+        float* dst=block.data()+long(i)*kd.numdims;
+        double sum=0.0;
+        for (int d=0;d<kd.numdims;d++)
+          {
+            float v=src[d]-kd.mean[d];
+            dst[d]=v;
+            sum+=double(v)*double(v);
+          }
+        norms[i]=float(sum);
+      }
+  }
+
+  // Recomputes the distances of the candidates directly, sorts them and stores the first numneighbors
+  static void storeNeighbors(const bisKNNData& kd,int p,std::vector<bisKNNEntry>& cand,
+                             std::vector<int>& neighbors,std::vector<float>& distances)
+  {
+    const float* a=kd.getPoint(p);
+    for (unsigned int i=0;i<cand.size();i++)
+      cand[i].first=float(squaredDistance(a,kd.getPoint(cand[i].second),kd.numdims));
+    std::sort(cand.begin(),cand.end());
+
+    long offset=long(p)*kd.numneighbors;
+    int n=std::min(int(cand.size()),kd.numneighbors);
+    for (int j=0;j<n;j++)
+      {
+        neighbors[offset+j]=cand[j].second;
+        distances[offset+j]=cand[j].first;
+      }
+  }
+
+  // ---------------------------------------------------------------------------------------------------
+  // Exact: blocks of BLOCK_ROWS points against all points of the group, BLOCK_COLS at a time
+  static void exactGroup(const bisKNNData& kd,const std::vector<int>& group,
+                         std::vector<int>& neighbors,std::vector<float>& distances)
+  {
+    int n=group.size();
+    int m=std::min(kd.numneighbors+EXACT_MARGIN,n-1);
+    if (m<1)
+      return;
+
+    long numblocks=(n+BLOCK_ROWS-1)/BLOCK_ROWS;
+    int poolthreads=bisThreadPool::getNumberOfThreads();
+    std::vector<bisKNNBlock> A(poolthreads),B(poolthreads);
+    std::vector<Eigen::MatrixXf> G(poolthreads);
+    std::vector<std::vector<float> > anorms(poolthreads),bnorms(poolthreads);
+    std::vector<std::vector<std::vector<bisKNNEntry> > > heaps(poolthreads);
+
+    bisThreadPool::parallelFor(0,numblocks,1,[&](BISLONG begin,BISLONG end,int thread) {
+        std::vector<std::vector<bisKNNEntry> >& heap=heaps[thread];
+        heap.resize(BLOCK_ROWS);
+
+        for (long blk=begin;blk<end;blk++)
+          {
+            int r0=blk*BLOCK_ROWS;
+            int nr=std::min(BLOCK_ROWS,n-r0);
+            gatherBlock(kd,&group[r0],nr,A[thread],anorms[thread]);
+            for (int i=0;i<nr;i++)
+              {
+                heap[i].clear();
+                heap[i].reserve(m+1);
+              }
+
+            for (int c0=0;c0<n;c0+=BLOCK_COLS)
+              {
+                int nc=std::min(BLOCK_COLS,n-c0);
+                gatherBlock(kd,&group[c0],nc,B[thread],bnorms[thread]);
+                G[thread].noalias()=A[thread]*B[thread].transpose();
+
+                const float* an=&anorms[thread][0];
+                const float* bn=&bnorms[thread][0];
+                for (int j=0;j<nc;j++)
+                  {
+                    const float* g=G[thread].data()+long(j)*nr;
+                    bisKNNEntry e(0.0f,group[c0+j]);
+                    for (int i=0;i<nr;i++)
+                      {
+                        if (c0+j==r0+i)
+                          continue;
+                        e.first=an[i]+bn[j]-2.0f*g[i];
+                        std::vector<bisKNNEntry>& h=heap[i];
+                        if (int(h.size())<m)
+                          {
+                            h.push_back(e);
+                            std::push_heap(h.begin(),h.end());
+                          }
+                        else if (e<h.front())
+                          {
+                            std::pop_heap(h.begin(),h.end());
+                            h.back()=e;
+                            std::push_heap(h.begin(),h.end());
+                          }
+                      }
+                  }
+              }
+
+            for (int i=0;i<nr;i++)
+              storeNeighbors(kd,group[r0+i],heap[i],neighbors,distances);
+          }
+      },kd.numthreads);
+  }
+
+  // ---------------------------------------------------------------------------------------------------
+  // NN-descent. Each point only updates its own list (reading a snapshot of the previous iteration), so the
+  // result does not depend on the number of threads.
+
+  // Inserts (d,q) into the sorted list of length k if it is closer than the last entry and not already there
+  static int insertNeighbor(int* nbr,float* dist,char* isnew,int k,int q,float d)
+  {
+    bisKNNEntry e(d,q);
+    if (!(e<bisKNNEntry(dist[k-1],nbr[k-1])))
+      return 0;
+    for (int j=0;j<k;j++)
+      if (nbr[j]==q)
+        return 0;
+
+    int j=k-1;
+    while (j>0 && e<bisKNNEntry(dist[j-1],nbr[j-1]))
+      {
+        nbr[j]=nbr[j-1];
+        dist[j]=dist[j-1];
+        isnew[j]=isnew[j-1];
+        --j;
+      }
+    nbr[j]=q;
+    dist[j]=d;
+    isnew[j]=1;
+    return 1;
+  }
+
+  static void approximateGroup(const bisKNNData& kd,const std::vector<int>& group,
+                               std::vector<int>& neighbors,std::vector<float>& distances,int debug)
+  {
+    int n=group.size();
+    int k=kd.numneighbors;
+    long nk=long(n)*k;
+    std::vector<int> nbr(nk),old_nbr(nk),rev(nk),revcount(n);
+    std::vector<float> dist(nk);
+    std::vector<char> isnew(nk),old_isnew(nk),revnew(nk);
+    int poolthreads=bisThreadPool::getNumberOfThreads();
+
+    // Random initial graph, seeded by point so that it does not depend on the threads
+    bisThreadPool::parallelFor(0,n,256,[&](BISLONG begin,BISLONG end,int) {
+        std::vector<bisKNNEntry> cand(k);
+        for (long p=begin;p<end;p++)
+          {
+            unsigned int seed=(unsigned int)(group[p])*2654435761u+12345u;
+            const float* a=kd.getPoint(group[p]);
+            int numfound=0;
+            while (numfound<k)
+              {
+                seed=seed*1664525u+1013904223u;
+                int q=(seed>>8) % n;
+                int found=(q==p);
+                for (int j=0;j<numfound && found==0;j++)
+                  if (cand[j].second==q)
+                    found=1;
+                if (!found)
+                  {
+                    cand[numfound]=bisKNNEntry(float(squaredDistance(a,kd.getPoint(group[q]),kd.numdims)),q);
+                    ++numfound;
+                  }
+              }
+            std::sort(cand.begin(),cand.end());
+            for (int j=0;j<k;j++)
+              {
+                nbr[p*k+j]=cand[j].second;
+                dist[p*k+j]=cand[j].first;
+                isnew[p*k+j]=1;
+              }
+          }
+      },kd.numthreads);
+
+    std::vector<std::vector<int> > stamp(poolthreads);
+    std::vector<long> updates(poolthreads);
+
+    for (int iter=0;iter<DESCENT_MAXITER;iter++)
+      {
+        old_nbr=nbr;
+        old_isnew=isnew;
+        std::fill(isnew.begin(),isnew.end(),0);
+
+        // Reverse neighbors (at most k per point)
+        std::fill(revcount.begin(),revcount.end(),0);
+        for (long i=0;i<nk;i++)
+          {
+            int q=old_nbr[i];
+            if (revcount[q]<k)
+              {
+                rev[long(q)*k+revcount[q]]=i/k;
+                revnew[long(q)*k+revcount[q]]=old_isnew[i];
+                ++revcount[q];
+              }
+          }
+
+        std::fill(updates.begin(),updates.end(),0);
+        bisThreadPool::parallelFor(0,n,256,[&](BISLONG begin,BISLONG end,int thread) {
+            std::vector<int>& st=stamp[thread];
+            if (st.size()==0)
+              st.resize(n,-1);
+
+            for (long p=begin;p<end;p++)
+              {
+                const float* a=kd.getPoint(group[p]);
+                int* p_nbr=&nbr[p*k];
+                float* p_dist=&dist[p*k];
+                char* p_new=&isnew[p*k];
+                long upd=0;
+
+                st[p]=p;
+                for (int j=0;j<k;j++)
+                  st[old_nbr[p*k+j]]=p;
+
+                auto check=[&](int q) {
+                  if (st[q]==p)
+                    return;
+                  st[q]=p;
+                  float d=float(squaredDistance(a,kd.getPoint(group[q]),kd.numdims));
+                  upd+=insertNeighbor(p_nbr,p_dist,p_new,k,q,d);
+                };
+
+                // Neighbors of neighbors, where at least one of the two links is new
+                for (int j=0;j<k;j++)
+                  {
+                    int u=old_nbr[p*k+j];
+                    char unew=old_isnew[p*k+j];
+                    for (int l=0;l<k;l++)
+                      if (unew || old_isnew[long(u)*k+l])
+                        check(old_nbr[long(u)*k+l]);
+                  }
+
+                // Reverse neighbors and their neighbors
+                for (int j=0;j<revcount[p];j++)
+                  {
+                    int u=rev[p*k+j];
+                    char unew=revnew[p*k+j];
+                    if (unew)
+                      check(u);
+                    for (int l=0;l<k;l++)
+                      if (unew || old_isnew[long(u)*k+l])
+                        check(old_nbr[long(u)*k+l]);
+                  }
+                updates[thread]+=upd;
+              }
+          },kd.numthreads);
+
+        long total=0;
+        for (int i=0;i<poolthreads;i++)
+          total+=updates[i];
+        if (debug)
+          std::cout << "++++ \t NN-descent group size=" << n << " iteration=" << iter+1 << " updates=" << total << std::endl;
+        if (total<=DESCENT_DELTA*nk)
+          break;
+      }
+
+    for (int p=0;p<n;p++)
+      {
+        long offset=long(group[p])*k;
+        for (int j=0;j<k;j++)
+          {
+            neighbors[offset+j]=group[nbr[long(p)*k+j]];
+            distances[offset+j]=dist[long(p)*k+j];
+          }
+      }
+  }
+
+  // ---------------------------------------------------------------------------------------------------
+  int computeNearestNeighbors(const float* data,int numdims,const long* rows,const short* labels,int numpoints,
+                              int numneighbors,int approximate,
+                              std::vector<int>& neighbors,std::vector<float>& distances,
+                              int numthreads,int debug)
+  {
+    if (numpoints<1 || numneighbors<1 || numdims<1)
+      {
+        std::cerr << "Bad k-NN graph parameters numpoints=" << numpoints << " numneighbors=" << numneighbors << " numdims=" << numdims << std::endl;
+        return 0;
+      }
+
+    bisKNNData kd;
+    kd.data=data;
+    kd.rows=rows;
+    kd.numdims=numdims;
+    kd.numneighbors=numneighbors;
+    kd.numthreads=numthreads;
+
+    std::vector<double> sum(numdims,0.0);
+    for (int p=0;p<numpoints;p++)
+      {
+        const float* a=kd.getPoint(p);
+        for (int d=0;d<numdims;d++)
+          sum[d]+=a[d];
+      }
+    kd.mean.resize(numdims);
+    for (int d=0;d<numdims;d++)
+      kd.mean[d]=float(sum[d]/numpoints);
+
+    neighbors.assign(long(numpoints)*numneighbors,-1);
+    distances.assign(long(numpoints)*numneighbors,0.0f);
+
+    // Group the points by label, in point order
+    std::vector<std::pair<short,int> > order(numpoints);
+    for (int p=0;p<numpoints;p++)
+      order[p]=std::pair<short,int>(labels[p],p);
+    std::sort(order.begin(),order.end());
+
+    int first=0;
+    while (first<numpoints)
+      {
+        int last=first;
+        while (last<numpoints && order[last].first==order[first].first)
+          ++last;
+
+        std::vector<int> group(last-first);
+        for (int i=first;i<last;i++)
+          group[i-first]=order[i].second;
+
+        int n=group.size();
+        int useapproximate=(approximate && n>=MIN_APPROXIMATE_POINTS && n>4*numneighbors);
+        if (debug)
+          std::cout << "++++ k-NN graph label=" << order[first].first << " points=" << n << " k=" << numneighbors
+                    << " method=" << (useapproximate ? "nn-descent" : "exact") << std::endl;
+        if (useapproximate)
+          approximateGroup(kd,group,neighbors,distances,debug);
+        else
+          exactGroup(kd,group,neighbors,distances);
+        first=last;
+      }
+
+    return 1;
+  }
+}
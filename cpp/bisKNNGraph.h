@@ -0,0 +1,66 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#ifndef _bis_KNNGraph_h
+#define _bis_KNNGraph_h
+
+#include <vector>
+
+/** @file bisKNNGraph.h
+
+    k-nearest neighbor graph of a set of points (e.g. the timeseries of the voxels in a mask) under squared
+    euclidean distance. Only points with the same label are neighbors.
+
+    The exact method computes the distances a block of points at a time as |a|^2+|b|^2-2 a.b using a matrix
+    product (GEMM) and keeps a bounded heap per point. The approximate method is NN-descent (Dong et al, WWW 2011),
+    starting from a random graph and repeatedly checking the neighbors of neighbors. Both run on bisThreadPool and
+    give the same result for any number of threads.
+
+    The returned distances are always recomputed directly from the data, so they match the brute force sums exactly.
+*/
+
+namespace bisKNNGraph {
+
+  /** Computes the squared distance between two points exactly as the brute force code does (accumulating in double)
+   * @param a the first point
+   * @param b the second point
+   * @param n the number of dimensions
+   * @returns sum_i (a[i]-b[i])^2
+   */
+  double squaredDistance(const float* a,const float* b,int n);
+
+  /** Computes the k nearest neighbors of each point among the points that have the same label
+   * @param data the data array, point p has coordinates data[rows[p]*numdims] to data[rows[p]*numdims+numdims-1]
+   * @param numdims the number of dimensions (e.g. frames)
+   * @param rows the row of data for each point
+   * @param labels the label of each point
+   * @param numpoints the number of points
+   * @param numneighbors the number of neighbors to find (k)
+   * @param approximate if 0 compute the exact graph, else use NN-descent
+   * @param neighbors on output numpoints*numneighbors point indices sorted by increasing distance (-1 if fewer points share the label)
+   * @param distances on output the matching squared distances
+   * @param numthreads maximum number of threads to use (if <=0 use the whole pool)
+   * @param debug if > 0 print progress
+   * @returns 1 if success, 0 if failed
+   */
+  int computeNearestNeighbors(const float* data,int numdims,const long* rows,const short* labels,int numpoints,
+                              int numneighbors,int approximate,
+                              std::vector<int>& neighbors,std::vector<float>& distances,
+                              int numthreads=0,int debug=0);
+}
+
+#endif
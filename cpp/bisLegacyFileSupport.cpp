@@ -150,12 +150,196 @@ namespace bisLegacyFileSupport {
    * @param debug if > 0 print debug messages
    * @returns 1 if success 0 if failed
    */
+  // ------------------------------------------------------------------------------------
+  // Streaming parser for .grd files
+  // Works directly on the input text (no splitting into lines/strings). Empty lines are skipped
+  // as in splitString so the line offsets match those used by the textParse methods.
+  // ------------------------------------------------------------------------------------
+  class bisLineCursor {
+
+  public:
+    bisLineCursor(const char* text) { this->current=text; this->skipEmptyLines(); }
+
+    /** returns 1 if there is a current line */
+    int valid() { return (*this->current!=0); }
+
+    /** returns a pointer to the beginning of the current line */
+    const char* line() { return this->current; }
+
+    /** returns 1 if the current line contains key */
+    int contains(const char* key) {
+      const char* end=this->lineEnd();
+      size_t len=strlen(key);
+      for (const char* p=this->current;p+len<=end;p++)
+        if (strncmp(p,key,len)==0)
+          return 1;
+      return 0;
+    }
+
+    /** advance by n lines */
+    void next(int n=1) {
+      for (int i=0;i<n && *this->current!=0;i++)
+        {
+          this->current=this->lineEnd();
+          if (*this->current=='\n')
+            this->current++;
+          this->skipEmptyLines();
+        }
+    }
+
+    /** move to the line following position p (p must be inside or at the end of a line) */
+    void moveToLineAfter(const char* p) {
+      while (*p!=0 && *p!='\n')
+        p++;
+      this->current=p;
+      if (*this->current=='\n')
+        this->current++;
+      this->skipEmptyLines();
+    }
+    
+  protected:
+    const char* current;
+
+    const char* lineEnd() {
+      const char* p=this->current;
+      while (*p!=0 && *p!='\n')
+        p++;
+      return p;
+    }
+    
+    void skipEmptyLines() {
+      while (*this->current=='\n')
+        this->current++;
+    }
+  };
+
+  /** parses count floats from p (advances p) returns number read */
+  static int parseFloats(const char*& p,float* values,int count)
+  {
+    for (int i=0;i<count;i++)
+      {
+        char* end;
+        values[i]=strtof(p,&end);
+        if (end==p)
+          return i;
+        p=end;
+      }
+    return count;
+  }
+
+  /** parses a grid from the current position (see bisGridTransformation::textParse for the format) */
+  static int streamParseGrid(bisLineCursor& cursor,bisGridTransformation* grid,int debug)
+  {
+    int read_interpmode=0;
+    if (!cursor.contains("#vtkpxBaseGridTransform File"))
+      {
+        if (!cursor.contains("#vtkpxBaseGridTransform2 File"))
+          return 0;
+        read_interpmode=1;
+      }
+
+    float ori[3],spa[3],fdim[3];
+    const char* p=0;
+    cursor.next(2); p=cursor.line(); parseFloats(p,ori,3);
+    cursor.next(2); p=cursor.line(); parseFloats(p,spa,3);
+    cursor.next(2); p=cursor.line(); parseFloats(p,fdim,3);
+
+    int interp_mode=4;
+    if (read_interpmode) {
+      cursor.next(2);
+      interp_mode=atoi(cursor.line());
+    }
+    int dim[3] = { int(fdim[0]), int(fdim[1]), int(fdim[2]) };
+
+    if (debug)
+      std::cout << "Initializing grid " << dim[0] << "*" << dim[1] << "*" << dim[2] << " (streaming parser)" << std::endl;
+
+    grid->initializeGrid(dim,spa,ori,(interp_mode==4));
+    float* data=grid->getData();
+    int np=grid->getNumberOfControlPoints();
+
+    // Displacements are lines of "index dx dy dz", read as one stream of numbers
+    cursor.next(2);
+    p=cursor.line();
+    float values[4];
+    for (int i=0;i<np;i++)
+      {
+        if (parseFloats(p,values,4)!=4)
+          {
+            std::cerr << "Failed to parse grid displacement " << i << " of " << np << std::endl;
+            return 0;
+          }
+        for (int ia=0;ia<=2;ia++)
+          data[i+ia*np]=values[ia+1];
+      }
+    grid->modified();
+    cursor.moveToLineAfter(p);
+    return 1;
+  }
+  
   int parseLegacyGridTransformationFile(const char* text,bisComboTransformation* output,int debug)
   {
-    const std::string d="\n";
-    std::vector<std::string> lines=splitString(text,d);
-    int offset=0;
-    return output->textParse(lines,offset,debug);
+    bisLineCursor cursor(text);
+    if (!cursor.valid())
+      return 0;
+
+    int isnewcombo=cursor.contains("#vtkpxNewComboTransform File");
+    // textSerialize writes #vtkMultiComboTransform so accept both spellings
+    int ismulticombo=cursor.contains("MultiComboTransform File");
+    int isgrid=cursor.contains("#vtkpxBaseGridTransform2 File");
+
+    if (isnewcombo==0 && ismulticombo==0 && isgrid==0)
+      {
+        if (debug)
+          std::cerr << "Bad header line in grid transformation file" << std::endl;
+        return 0;
+      }
+
+    int numgrids=1;
+    int nonlinearfirst=1;
+    if (isnewcombo)
+      {
+        cursor.next(2);
+        nonlinearfirst=atoi(cursor.line());
+      }
+    else if (ismulticombo)
+      {
+        cursor.next(2);
+        numgrids=atoi(cursor.line());
+        cursor.next(2);
+        nonlinearfirst=atoi(cursor.line());
+      }
+
+    if (nonlinearfirst==0)
+      {
+        std::cerr << "Bad Grid Transformation as nonlinearfirst=0 is not supported here" << std::endl;
+        return 0;
+      }
+
+    output->identity();
+    if (!isgrid)
+      {
+        cursor.next(2);
+        bisUtil::mat44 m;
+        for (int i=0;i<=3;i++)
+          {
+            const char* p=cursor.line();
+            parseFloats(p,m[i],4);
+            cursor.next(1);
+          }
+        output->setInitialTransformation(m);
+      }
+
+    if (debug)
+      std::cout << "numgrids=" << numgrids << " nonlinear=" << nonlinearfirst << std::endl;
+    
+    for (int i=0;i<numgrids;i++)
+      {
+        std::shared_ptr<bisGridTransformation> newgrid(new bisGridTransformation("combogrid"));
+        if (streamParseGrid(cursor,newgrid.get(),debug))
+          output->addTransformation(newgrid);
+      }
+    return 1;
   }
 
 
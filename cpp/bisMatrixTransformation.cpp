@@ -69,6 +69,32 @@ void bisMatrixTransformation::transformPoint(float X[3],float TX[3])
 }
 
 
+void bisMatrixTransformation::computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3])
+{
+  float y=j*spa[1];
+  float z=k*spa[2];
+
+  // Row constant part = M[.][1]*y+M[.][2]*z+M[.][3], minus the identity for the displacement in y,z
+  float base[3],slope[3];
+  for (int ia=0;ia<=2;ia++)
+    {
+      base[ia]=this->matrix[ia][1]*y+this->matrix[ia][2]*z+this->matrix[ia][3];
+      slope[ia]=this->matrix[ia][0];
+    }
+  base[1]-=y;
+  base[2]-=z;
+  slope[0]-=1.0f;
+
+  int offset=0;
+  for (int i=imin;i<=imax;i++)
+    {
+      float x=i*spa[0];
+      out[0][offset]=slope[0]*x+base[0];
+      out[1][offset]=slope[1]*x+base[1];
+      out[2][offset]=slope[2]*x+base[2];
+      ++offset;
+    }
+}
 
 void bisMatrixTransformation::getMatrix(bisUtil::mat44 out)
 {
@@ -149,7 +175,7 @@ void bisMatrixTransformation::serializeInPlace(unsigned char* output)
   //  std::cout.flush();
 }
 		
-long bisMatrixTransformation::getRawSize()
+BISLONG bisMatrixTransformation::getRawSize()
 {
   return 16+// Raw header 
     8+ // rows cols
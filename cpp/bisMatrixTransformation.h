@@ -52,6 +52,12 @@ class bisMatrixTransformation : public bisAbstractTransformation {
    * @param spa spacing of the underlying image used to convert mm to voxels. Origin is always 0,0,0 in bisWeb
    */
   virtual void transformPointToVoxel(float x[3],float y[3],float spa[3]);
+
+  /** computes the displacements for a row of voxels in closed form. Along a row only x changes
+   * so the contribution of y, z and the translation is computed once per row.
+   * See \link bisAbstractTransformation::computeDisplacementRow \endlink for parameters.
+   */
+  virtual void computeDisplacementRow(float spa[3],int j,int k,int imin,int imax,float* out[3]);
   
   /** Get the internal 4x4 matrix by storing in in m
    * @param m matirx to which the contents of the internal transformation are copied to 
@@ -97,7 +103,7 @@ class bisMatrixTransformation : public bisAbstractTransformation {
   virtual void serializeInPlace(unsigned char* output);
 
   /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize();
+  virtual BISLONG getRawSize();
 
 
   // No
@@ -17,20 +17,358 @@
 
 #include "bisMemoryManagement.h"
 #include "bisUtil.h"
-#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <vector>
 #include <iostream>
 #include <string>
 #include <string.h>
+#include <stdint.h>
 #include "bisObject.h"
 
 namespace bisMemoryManagement {
 
   int debug_memory=0;
   int large_memory=0;
-  std::map <BISLONG, BISLONG> memory_map;
-  std::map <BISLONG, std::string> memory_map_name;
-  std::map <BISLONG, bisObject*> memory_map_owner;
 
+  // ------------------------------------------------------------------------------------------
+  // Every block returned by allocate_memory is preceded by a small prefix that stores its size,
+  // a magic number (to catch pointers that were not allocated here or were already released)
+  // and a set of flags recording whether the block is in the debug registry (bit 0) and which
+  // pool size class it came from (bits 8-15, 0=not pooled). This lets release_memory update
+  // the byte counter and recycle the block in O(1) without any lookup.
+  // ------------------------------------------------------------------------------------------
+  const int PREFIX_SIZE=16;
+  const int MEMORY_MAGIC=0x62697331;
+  const int MEMORY_RELEASED=0x62697330;
+
+  // Production tracking -- relaxed atomic counters only
+  std::atomic<BISLONG> allocated_bytes(0);
+  std::atomic<BISLONG> allocated_pointers(0);
+  std::atomic<BISLONG> allocated_objects(0);
+  std::atomic<BISLONG> peak_allocated_bytes(0);
+
+  static void updatePeak(std::atomic<BISLONG>& peak,BISLONG value) {
+    BISLONG current=peak.load(std::memory_order_relaxed);
+    while (value>current && !peak.compare_exchange_weak(current,value,std::memory_order_relaxed)) { }
+  }
+
+  // ------------------------------------------------------------------------------------------
+  // Opt-in pooled allocator
+  //
+  // Blocks larger than POOL_MIN_SIZE are rounded up to a size class (four classes per power of
+  // two, i.e. at most 25% slack) and, when released, are kept in a small per-thread cache. Blocks
+  // that do not fit in the thread cache (and the contents of the caches of exiting threads) go
+  // to a shared pool guarded by a mutex, which is capped at pool_limit bytes. Blocks larger
+  // than POOL_MAX_SIZE are never pooled. release_pool advances pool_generation; every thread
+  // compares its cache against it on its next allocation/release and deletes stale blocks.
+  // ------------------------------------------------------------------------------------------
+  const int64_t POOL_MIN_SIZE=65536;
+  const int POOL_NUMCLASSES=4*14;
+  const int64_t POOL_MAX_SIZE=POOL_MIN_SIZE << (POOL_NUMCLASSES/4);
+  const int POOL_THREADCACHE_BLOCKS=2;
+
+  std::atomic<int> pool_memory(0);
+  std::atomic<unsigned int> pool_generation(0);
+#ifdef BISWASM
+  std::atomic<BISLONG> pool_limit(256*1024*1024);
+#else
+  std::atomic<BISLONG> pool_limit((BISLONG)2048*1024*1024);
+#endif
+
+  std::atomic<BISLONG> pool_cached_bytes(0);
+  std::atomic<BISLONG> peak_pool_cached_bytes(0);
+  std::atomic<BISLONG> peak_pool_allocated_bytes(0);
+  std::atomic<BISLONG> pool_allocated_bytes(0);
+  std::atomic<BISLONG> pool_hits(0);
+  std::atomic<BISLONG> pool_misses(0);
+
+  /** Returns the capacity of size class c */
+  static BISLONG poolClassSize(int c) {
+    int64_t base=POOL_MIN_SIZE << (c/4);
+    return base+(base/4)*(c%4);
+  }
+
+  /** Returns the smallest size class that can hold sz bytes or -1 if the block should not be pooled */
+  static int poolClass(BISLONG sz) {
+    if (sz<=POOL_MIN_SIZE || sz>POOL_MAX_SIZE)
+      return -1;
+    int e=0;
+    while ((POOL_MIN_SIZE << (e+1)) < sz)
+      e++;
+    for (int c=4*e+1;c<POOL_NUMCLASSES;c++) {
+      if (poolClassSize(c)>=sz)
+        return c;
+    }
+    return -1;
+  }
+
+  class bisMemoryPool {
+  public:
+    std::mutex lock;
+    std::vector<unsigned char*> blocks[POOL_NUMCLASSES];
+
+    ~bisMemoryPool() { this->clear(); }
+
+    /** Returns a block of class c or 0 if none is cached */
+    unsigned char* get(int c) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (this->blocks[c].size()==0)
+        return 0;
+      unsigned char* b=this->blocks[c].back();
+      this->blocks[c].pop_back();
+      return b;
+    }
+
+    /** Stores a block of class c, if the pool is full the block is deleted */
+    void put(int c,unsigned char* b) {
+      BISLONG sz=poolClassSize(c);
+      {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (pool_memory>0 && pool_cached_bytes.load(std::memory_order_relaxed)+sz<=pool_limit) {
+          this->blocks[c].push_back(b);
+          updatePeak(peak_pool_cached_bytes,pool_cached_bytes.fetch_add(sz,std::memory_order_relaxed)+sz);
+          return;
+        }
+      }
+      delete [] b;
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (int c=0;c<POOL_NUMCLASSES;c++) {
+        for (size_t i=0;i<this->blocks[c].size();i++)
+          delete [] this->blocks[c][i];
+        pool_cached_bytes.fetch_sub(poolClassSize(c)*(BISLONG)this->blocks[c].size(),std::memory_order_relaxed);
+        this->blocks[c].clear();
+      }
+    }
+  };
+
+  bisMemoryPool& shared_pool() {
+    static bisMemoryPool pool;
+    return pool;
+  }
+
+  /** Per-thread cache, flushed to the shared pool when the thread exits */
+  class bisMemoryThreadCache {
+  public:
+    unsigned char* blocks[POOL_NUMCLASSES][POOL_THREADCACHE_BLOCKS];
+    int count[POOL_NUMCLASSES];
+    unsigned int generation;
+
+    bisMemoryThreadCache() {
+      for (int c=0;c<POOL_NUMCLASSES;c++)
+        count[c]=0;
+      generation=pool_generation.load(std::memory_order_acquire);
+    }
+
+    ~bisMemoryThreadCache() {
+      this->synchronize();
+      this->flush();
+    }
+
+    /** Deletes the cached blocks if release_pool was called since they were cached */
+    void synchronize() {
+      unsigned int current=pool_generation.load(std::memory_order_acquire);
+      if (current==this->generation)
+        return;
+      for (int c=0;c<POOL_NUMCLASSES;c++) {
+        while (this->count[c]>0)
+          delete [] this->get(c);
+      }
+      this->generation=current;
+    }
+
+    unsigned char* get(int c) {
+      if (this->count[c]==0)
+        return 0;
+      this->count[c]-=1;
+      pool_cached_bytes.fetch_sub(poolClassSize(c),std::memory_order_relaxed);
+      return this->blocks[c][this->count[c]];
+    }
+
+    int put(int c,unsigned char* b) {
+      if (this->count[c]==POOL_THREADCACHE_BLOCKS)
+        return 0;
+      BISLONG sz=poolClassSize(c);
+      if (pool_cached_bytes.load(std::memory_order_relaxed)+sz>pool_limit)
+        return 0;
+      this->blocks[c][this->count[c]]=b;
+      this->count[c]+=1;
+      updatePeak(peak_pool_cached_bytes,pool_cached_bytes.fetch_add(sz,std::memory_order_relaxed)+sz);
+      return 1;
+    }
+
+    void flush() {
+      for (int c=0;c<POOL_NUMCLASSES;c++) {
+        while (this->count[c]>0)
+          shared_pool().put(c,this->get(c));
+      }
+    }
+  };
+
+  bisMemoryThreadCache& thread_cache() {
+    static thread_local bisMemoryThreadCache cache;
+    return cache;
+  }
+
+  /** Allocates a block (including the prefix) for sz bytes, returns the pool class used (or -1) in pclass */
+  static unsigned char* allocate_block(BISLONG sz,int& pclass) {
+
+    thread_cache().synchronize();
+    pclass=-1;
+    if (pool_memory>0)
+      pclass=poolClass(sz);
+
+    if (pclass<0)
+      return new unsigned char[sz+PREFIX_SIZE];
+
+    updatePeak(peak_pool_allocated_bytes,pool_allocated_bytes.fetch_add(poolClassSize(pclass),std::memory_order_relaxed)+poolClassSize(pclass));
+    unsigned char* b=thread_cache().get(pclass);
+    if (b==0) {
+      b=shared_pool().get(pclass);
+      if (b!=0)
+        pool_cached_bytes.fetch_sub(poolClassSize(pclass),std::memory_order_relaxed);
+    }
+
+    if (b!=0) {
+      pool_hits.fetch_add(1,std::memory_order_relaxed);
+      return b;
+    }
+
+    pool_misses.fetch_add(1,std::memory_order_relaxed);
+    return new unsigned char[poolClassSize(pclass)+PREFIX_SIZE];
+  }
+
+  /** Releases a block allocated by allocate_block */
+  static void release_block(unsigned char* base,int pclass) {
+
+    thread_cache().synchronize();
+    if (pclass<0) {
+      delete [] base;
+      return;
+    }
+
+    pool_allocated_bytes.fetch_sub(poolClassSize(pclass),std::memory_order_relaxed);
+    if (pool_memory>0) {
+      if (thread_cache().put(pclass,base))
+        return;
+      shared_pool().put(pclass,base);
+      return;
+    }
+    delete [] base;
+  }
+
+  /** Debug-only concurrent registry. A fixed set of shards, each an unordered_map guarded by its own
+   * mutex, so that multithreaded kernels allocating in debug mode only contend when they hash to the
+   * same shard. */
+  template<class V> class bisConcurrentRegistry {
+
+  public:
+
+    bisConcurrentRegistry() : count(0) { }
+
+    void insert(BISLONG key,const V& value) {
+      Shard& s=this->shards[this->getShard(key)];
+      std::lock_guard<std::mutex> lock(s.lock);
+      if (s.table.insert(std::make_pair(key,value)).second)
+        this->count.fetch_add(1,std::memory_order_relaxed);
+    }
+
+    int remove(BISLONG key,V& value) {
+      Shard& s=this->shards[this->getShard(key)];
+      std::lock_guard<std::mutex> lock(s.lock);
+      typename std::unordered_map<BISLONG,V>::iterator it=s.table.find(key);
+      if (it==s.table.end())
+        return 0;
+      value=it->second;
+      s.table.erase(it);
+      this->count.fetch_sub(1,std::memory_order_relaxed);
+      return 1;
+    }
+
+    int find(BISLONG key,V& value) {
+      Shard& s=this->shards[this->getShard(key)];
+      std::lock_guard<std::mutex> lock(s.lock);
+      typename std::unordered_map<BISLONG,V>::iterator it=s.table.find(key);
+      if (it==s.table.end())
+        return 0;
+      value=it->second;
+      return 1;
+    }
+
+    /** Copies the current contents (used for printing and cleanup) */
+    void snapshot(std::vector<std::pair<BISLONG,V> >& out) {
+      out.clear();
+      for (int i=0;i<NUMSHARDS;i++) {
+        std::lock_guard<std::mutex> lock(this->shards[i].lock);
+        out.insert(out.end(),this->shards[i].table.begin(),this->shards[i].table.end());
+      }
+    }
+
+    BISLONG size() { return this->count.load(std::memory_order_relaxed); }
+
+  protected:
+
+    enum { NUMSHARDS=32 };
+
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<BISLONG,V> table;
+    };
+
+    Shard shards[NUMSHARDS];
+    std::atomic<BISLONG> count;
+
+    int getShard(BISLONG key) {
+      // Drop the alignment bits before hashing
+      unsigned long long k=(unsigned long long)key >> 4;
+      k^=(k>>17);
+      k*=0x9E3779B97F4A7C15ULL;
+      return (int)((k>>32) % NUMSHARDS);
+    }
+  };
+
+  /** Entry in the debug registry. The owner is stored as a description as opposed to a pointer,
+   * so entries never dangle when the owner is deleted before the memory */
+  struct bisMemoryEntry {
+    BISLONG size;
+    std::string name;
+    std::string owner;
+  };
+
+  bisConcurrentRegistry<bisMemoryEntry>& memory_registry() {
+    static bisConcurrentRegistry<bisMemoryEntry> registry;
+    return registry;
+  }
+
+  bisConcurrentRegistry<bisObject*>& object_registry() {
+    static bisConcurrentRegistry<bisObject*> registry;
+    return registry;
+  }
+
+  static std::string describeOwner(bisObject* owner) {
+    if (owner==0)
+      return " [ no owner ]";
+    return " [ "+owner->getClassName()+", "+std::to_string((BISLONG)owner)+"]";
+  }
+
+  static void setPrefix(unsigned char* base,BISLONG sz,int magic,int flags) {
+    int64_t s=(int64_t)sz;
+    memcpy(base,&s,8);
+    memcpy(base+8,&magic,4);
+    memcpy(base+12,&flags,4);
+  }
+
+  static void getPrefix(unsigned char* base,BISLONG& sz,int& magic,int& flags) {
+    int64_t s=0;
+    memcpy(&s,base,8);
+    memcpy(&magic,base+8,4);
+    memcpy(&flags,base+12,4);
+    sz=(BISLONG)s;
+  }
 
   int debugMemory() {
     if (debug_memory>0)
@@ -56,24 +394,73 @@ namespace bisMemoryManagement {
     large_memory=m;
   }
 
+  int poolMemory() {
+    if (pool_memory>0)
+      return 1;
+    return 0;
+  }
+
+  void setPoolMemoryMode(int m,BISLONG limit) {
+    pool_memory=m;
+    if (limit>0)
+      pool_limit=limit;
+    if (pool_memory==0 || pool_cached_bytes.load(std::memory_order_relaxed)>pool_limit)
+      release_pool();
+  }
+
+  void release_pool() {
+    pool_generation.fetch_add(1,std::memory_order_acq_rel);
+    thread_cache().synchronize();
+    shared_pool().clear();
+  }
+
+  BISLONG getPoolCachedBytes() {
+    return pool_cached_bytes.load(std::memory_order_relaxed);
+  }
+
+  BISLONG getPeakAllocatedBytes() {
+    return peak_allocated_bytes.load(std::memory_order_relaxed);
+  }
+
+  void print_pool_statistics() {
+    std::cout << "M: peak allocated bytes=" << getPeakAllocatedBytes();
+    std::cout << ", pool mode=" << pool_memory.load() << " (limit=" << pool_limit.load() << ")";
+    std::cout << ", pooled bytes in use=" << pool_allocated_bytes.load(std::memory_order_relaxed);
+    std::cout << " (peak=" << peak_pool_allocated_bytes.load(std::memory_order_relaxed) << ")";
+    std::cout << ", cached bytes=" << pool_cached_bytes.load(std::memory_order_relaxed);
+    std::cout << " (peak=" << peak_pool_cached_bytes.load(std::memory_order_relaxed) << ")";
+    std::cout << ", hits=" << pool_hits.load(std::memory_order_relaxed) << ", misses=" << pool_misses.load(std::memory_order_relaxed) << std::endl;
+  }
+
+  BISLONG getAllocatedBytes() {
+    return allocated_bytes.load(std::memory_order_relaxed);
+  }
+
+  BISLONG getNumberOfAllocatedPointers() {
+    return allocated_pointers.load(std::memory_order_relaxed);
+  }
 
   unsigned char* allocate_memory(BISLONG sz,std::string name,std::string operation,bisObject* owner) {
 
-    unsigned char* out_pointer=new unsigned char[sz];
+    int pclass=-1;
+    unsigned char* base=allocate_block(sz,pclass);
+    unsigned char* out_pointer=base+PREFIX_SIZE;
 
-    BISLONG pt=(BISLONG)out_pointer;
-    memory_map[pt]=sz;
-    memory_map_name[pt]=name;
-    memory_map_owner[pt]=owner;
-    
-    if (debugMemory())
+    int tracked=debugMemory();
+    setPrefix(base,sz,MEMORY_MAGIC,tracked | ((pclass+1) << 8));
+    updatePeak(peak_allocated_bytes,allocated_bytes.fetch_add(sz,std::memory_order_relaxed)+sz);
+    allocated_pointers.fetch_add(1,std::memory_order_relaxed);
+
+    if (tracked)
       {
+        bisMemoryEntry entry;
+        entry.size=sz;
+        entry.name=name;
+        entry.owner=describeOwner(owner);
+        memory_registry().insert((BISLONG)out_pointer,entry);
+
 	std::cout << "*****\t (MEMORY ALLOC) " << name << " (" << operation << ") allocating =["
-		  << sz << "],  (loc=" << (BISLONG)out_pointer << ") ";
-	if (owner!=0)
-	  std::cout << " [ " << owner->getClassName()  << ", " << BISLONG(owner) << "]" << std::endl ;
-	else
-	  std::cout << " [ no owner ]" << std::endl;
+		  << sz << "],  (loc=" << (BISLONG)out_pointer << ") " << entry.owner << std::endl;
       }
 
     return out_pointer;
@@ -81,138 +468,135 @@ namespace bisMemoryManagement {
 
   void release_memory(unsigned char* pointer,std::string operation) {
 
-    BISLONG sz2=-1;
-    BISLONG pt=(BISLONG)pointer;
-    std::string name="unknown";
-    bisObject* owner=0;
-    if(memory_map.find(pt) == memory_map.end()) {
-      std::cerr << "*****\t (MEMORY ERR) Memory was not allocated here ... "  << BISLONG(pointer) << std::endl;
-    } else {
-      sz2=memory_map[pt];
-      owner=memory_map_owner[(BISLONG)pointer];
-      name=memory_map_name[pt];
+    if (pointer==0)
+      return;
+
+    unsigned char* base=pointer-PREFIX_SIZE;
+    BISLONG sz=-1;
+    int magic=0,flags=0;
+    getPrefix(base,sz,magic,flags);
+
+    if (magic!=MEMORY_MAGIC) {
+      std::cerr << "*****\t (MEMORY ERR) Memory was not allocated here or was already released ... "  << BISLONG(pointer) << std::endl;
+      return;
     }
-    
-    // Erase
-    memory_map.erase(pt);
-    memory_map_name.erase(pt);
-    memory_map_owner.erase(pt);
+
+    setPrefix(base,sz,MEMORY_RELEASED,0);
+    allocated_bytes.fetch_sub(sz,std::memory_order_relaxed);
+    allocated_pointers.fetch_sub(1,std::memory_order_relaxed);
+
+    bisMemoryEntry entry;
+    entry.size=sz;
+    entry.name="unknown";
+    entry.owner=" [ no owner ]";
+    if (flags & 1)
+      memory_registry().remove((BISLONG)pointer,entry);
     
     if (debugMemory())
       {
-	std::cout << "*****\t (MEMORY DEL) " << name << " (" << operation << ") deleting size=["
-		  << sz2 << "],  (loc=" << (BISLONG)pointer << ") ";
-      	if (owner!=0)
-	  std::cout << " [ " << owner->getClassName() << ", " << BISLONG(owner) << "]" << std::endl ;
-	else
-	  std::cout << " [ no owner ]" << std::endl;
+	std::cout << "*****\t (MEMORY DEL) " << entry.name << " (" << operation << ") deleting size=["
+		  << sz << "],  (loc=" << (BISLONG)pointer << ") " << entry.owner << std::endl;
       }
-    delete [] pointer;
+    release_block(base,((flags >> 8) & 0xFF)-1);
   }
 
   void not_releasing_memory(unsigned char* pointer,std::string operation,int used_to_own) {
 
-    BISLONG sz2=-1;
-    BISLONG pt=(BISLONG)pointer;
-    std::string name="unknown";
-    bisObject* owner=0;
-    
-    if(memory_map.find(pt) != memory_map.end()) {
-      sz2=memory_map[pt];
-      owner=memory_map_owner[(BISLONG)pointer];
-      name=memory_map_name[pt];
-    }
+    if (!debugMemory())
+      return;
 
-    
-    if (debugMemory())
-      {
-	std::cout << "-----\t (MEMORY ___) " << name << " (" << operation << ") ";
-	
-	if (used_to_own)
-	  std::cout << "(releasing)";
-	else
-	  std::cout << "(ignoring)";
+    bisMemoryEntry entry;
+    entry.size=-1;
+    entry.name="unknown";
+    entry.owner=" [ no owner ]";
+    memory_registry().find((BISLONG)pointer,entry);
+
+    std::cout << "-----\t (MEMORY ___) " << entry.name << " (" << operation << ") ";
 	
-	std::cout << "; size=" << sz2 << " (loc=" << (BISLONG)pointer << ") ";
+    if (used_to_own)
+      std::cout << "(releasing)";
+    else
+      std::cout << "(ignoring)";
 	
-	if (owner!=0)
-	  std::cout << " [ "  << owner->getClassName() << ", " << BISLONG(owner) << "]" << std::endl ;
-	else
-	  std::cout << " [ no owner ]" << std::endl;
-      }
-
-   
+    std::cout << "; size=" << entry.size << " (loc=" << (BISLONG)pointer << ") " << entry.owner << std::endl;
   }
 
-  
+  void register_object(bisObject* obj) {
 
-  void release_links(bisObject* obj) {
+    allocated_objects.fetch_add(1,std::memory_order_relaxed);
+    if (debugMemory())
+      object_registry().insert((BISLONG)obj,obj);
+  }
 
-    std::map<BISLONG, bisObject*>::iterator it;
-    
-    for ( it = memory_map_owner.begin(); it != memory_map_owner.end(); it++ ) {
+  void release_object(bisObject* obj) {
 
-      if (it->second==obj)
-	it->second=0;
+    allocated_objects.fetch_sub(1,std::memory_order_relaxed);
+    // Objects registered while in debug mode must be removed even if debug mode has since been turned off
+    if (object_registry().size()>0) {
+      bisObject* tmp=0;
+      object_registry().remove((BISLONG)obj,tmp);
     }
   }
 
+  void print_objects() {
 
-    
+    std::vector<std::pair<BISLONG,bisObject*> > objects;
+    object_registry().snapshot(objects);
+    for (size_t i=0;i<objects.size();i++)
+      {
+        bisObject* obj=objects[i].second;
+        std::cout << "O " << objects[i].first
+                  << " : "
+                  << obj->getName()
+                  << " (" << obj->getClassName() << ") " << std::endl;
+      }
+    std::cout << "O: total objects=" << allocated_objects.load(std::memory_order_relaxed) << " (tracked=" << objects.size() << ")" << std::endl;
+    std::cout << "+++++++++++++++++++++++++++++++" << std::endl  << std::endl;
+  }
   
   void print_map() {
-    std::map<BISLONG, BISLONG>::iterator it;
 
     std::cout << std::endl;
     std::cout << "+++++++++++++++++++++++++++++++" << std::endl;
     std::cout << "+ Current Pointer Memory state " << std::endl;
     std::cout << "+++++++++++++++++++++++++++++++" << std::endl;
 
-    if (memory_map.size()==0)
+    std::vector<std::pair<BISLONG,bisMemoryEntry> > entries;
+    memory_registry().snapshot(entries);
+    
+    if (getNumberOfAllocatedPointers()==0)
       {
 	std::cout << "P: No raw data" << std::endl;
       }
     else
       {
-        for ( it = memory_map.begin(); it != memory_map.end(); it++ )
+        for (size_t i=0;i<entries.size();i++)
 	  {
-	    std::cout << "P " << it->first  // string (key)
-		      << " : " << memory_map_name[it->first] << " (" 
-		      << it->second << ")";
-	    
-	    bisObject* owner=memory_map_owner[it->first];
-	    if (owner!=0)
-	      std::cout << " [ " <<  owner->getClassName()  << ", " << BISLONG(owner) << "]" << std::endl ;
-	    else
-	      std::cout << " [ no owner ]" << std::endl;
-	    
+	    std::cout << "P " << entries[i].first
+		      << " : " << entries[i].second.name << " (" 
+		      << entries[i].second.size << ")" << entries[i].second.owner << std::endl;
 	  }
+        std::cout << "P: total pointers=" << getNumberOfAllocatedPointers() << ", bytes=" << getAllocatedBytes();
+        std::cout << " (tracked=" << entries.size() << ")" << std::endl;
       }
-    
+    print_pool_statistics();
 
     bisObject::print_memory_map();
   }
 
   void delete_all() {
-    std::map<BISLONG, BISLONG>::iterator it;
 
-    if (memory_map.size()==0)
+    if (memory_registry().size()==0)
       {
+        if (getNumberOfAllocatedPointers()>0)
+          std::cerr << "*****\t (MEMORY ERR) delete_all only releases memory allocated in debug memory mode" << std::endl;
         return;
       }
 
-    for (int pass=0;pass<=1;pass++) {
-      
-      for ( it = memory_map.begin(); it != memory_map.end(); it++ )
-        {
-          unsigned char* pointer=(unsigned char*)it->first;
-          delete [] pointer;
-        }
-
-      memory_map.clear();
-      memory_map_name.clear();
-      memory_map_owner.clear();
-    }
+    std::vector<std::pair<BISLONG,bisMemoryEntry> > entries;
+    memory_registry().snapshot(entries);
+    for (size_t i=0;i<entries.size();i++)
+      release_memory((unsigned char*)entries[i].first,"delete_all");
     return;
   }
 
@@ -222,4 +606,3 @@ namespace bisMemoryManagement {
     memcpy(output,input,length);
   }
 }
-
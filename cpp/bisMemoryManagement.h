@@ -71,15 +71,54 @@ namespace bisMemoryManagement {
   */
   void setLargeMemoryMode(int m);
 
+  /** Return 1 if the pooled allocator is enabled  */
+  int poolMemory();
+
+  /** Enables/disables the pooled allocator. When enabled, released blocks larger than 64KB are kept
+   * in size-class free lists (a small per-thread cache backed by a shared pool) and reused by subsequent
+   * allocations of a similar size. Disabling the pool releases all cached blocks.
+   * @param m if > 0 enable the pool
+   * @param limit if > 0 sets the maximum number of bytes kept in the pool
+   */
+  void setPoolMemoryMode(int m,BISLONG limit=0);
+
+  /** Deletes all blocks cached by the pool. The shared pool and the calling thread's cache are emptied
+   * immediately, the caches of other threads are emptied on their next allocation/release (or when they exit) */
+  void release_pool();
+
+  /** Returns the number of bytes currently kept by the pool (shared pool and thread caches) */
+  BISLONG getPoolCachedBytes();
+
+  /** Returns the largest number of bytes that were allocated at any one time (high-water mark) */
+  BISLONG getPeakAllocatedBytes();
+
+  /** Prints the high-water marks and the pool statistics (hits, misses, cached bytes) */
+  void print_pool_statistics();
+
+
+  /** Returns the number of bytes currently allocated via allocate_memory (always tracked) */
+  BISLONG getAllocatedBytes();
 
-  /** Called bis bisObject::~bisObject to eliminate links
+  /** Returns the number of pointers currently allocated via allocate_memory (always tracked) */
+  BISLONG getNumberOfAllocatedPointers();
+
+  /** Called by bisObject::bisObject to register the object. In debug mode the object is
+   * also added to the registry printed by print_map, otherwise only a counter is updated.
    * @param obj calling object
    */
-  void release_links(bisObject* obj);
-  
+  void register_object(bisObject* obj);
+
+  /** Called by bisObject::~bisObject to remove the object from the registry
+   * @param obj calling object
+   */
+  void release_object(bisObject* obj);
+
+  /** Prints the objects registered in debug mode (see bisObject::print_memory_map) */
+  void print_objects();
   
   /**
-   * Allocate memory of size sz with name=name, 
+   * Allocate memory of size sz with name=name. Outside of debug mode only atomic counters are updated,
+   * in debug mode the pointer is also stored (with its name and owner) in a thread-safe registry.
    * @param sz size in bytes
    * @param name pointer name
    * @param operation description of the operation
@@ -108,7 +147,7 @@ namespace bisMemoryManagement {
   void print_map();
 
   /** 
-   * Delete all allocated pointers and BisObjects
+   * Delete all allocated pointers that were allocated in debug mode (and hence are in the registry)
    */
   void delete_all();
 
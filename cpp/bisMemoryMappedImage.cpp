@@ -0,0 +1,237 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+#include "bisMemoryMappedImage.h"
+#include "bisDataTypes.h"
+#include <cstring>
+#include <cmath>
+
+#if !defined(BISWASM) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define BIS_HAS_MMAP 1
+#endif
+
+namespace bisMemoryMappedImageUtil {
+
+  /** Bytes in front of the voxel data needed by the serialized image (16 + dimensions,spacing + 64-bit size) */
+  const int PREAMBLE_SIZE=64;
+
+  /** Copies a value of type T from an unaligned location in the header */
+  template<class T> T getHeaderValue(unsigned char* header,int offset) {
+    T v;
+    memcpy(&v,header+offset,sizeof(T));
+    return v;
+  }
+
+  int parseNIFTIHeader(unsigned char* header,BISLONG filesize,int dim[5],float spa[5],int& datatype,BISLONG& voxoffset,BISLONG& datasize) {
+
+    if (filesize<348)
+      {
+        std::cerr << "NIFTI header: file too small to be a NIFTI image" << std::endl;
+        return 0;
+      }
+
+    if (header[0]==0x1f && header[1]==0x8b)
+      {
+        std::cerr << "NIFTI header: compressed (.nii.gz) files are not supported" << std::endl;
+        return 0;
+      }
+
+    int sizeof_hdr=getHeaderValue<int>(header,0);
+    double pixdim[8];
+    BISLONG ndim[8];
+    int version=0;
+
+    if (sizeof_hdr==348 && memcmp(header+344,"n+1",4)==0)
+      {
+        version=1;
+        for (int ia=0;ia<=7;ia++) {
+          ndim[ia]=getHeaderValue<short>(header,40+2*ia);
+          pixdim[ia]=getHeaderValue<float>(header,76+4*ia);
+        }
+        datatype=getHeaderValue<short>(header,70);
+        voxoffset=(BISLONG)getHeaderValue<float>(header,108);
+      }
+    else if (sizeof_hdr==540 && filesize>=540 && memcmp(header+4,"n+2",4)==0)
+      {
+        version=2;
+        for (int ia=0;ia<=7;ia++) {
+          ndim[ia]=(BISLONG)getHeaderValue<int64_t>(header,16+8*ia);
+          pixdim[ia]=getHeaderValue<double>(header,104+8*ia);
+        }
+        datatype=getHeaderValue<short>(header,12);
+        voxoffset=(BISLONG)getHeaderValue<int64_t>(header,168);
+      }
+    else
+      {
+        std::cerr << "NIFTI header: not a single file NIFTI image in native byte order (sizeof_hdr=" << sizeof_hdr << ")" << std::endl;
+        return 0;
+      }
+
+    int typesize=0;
+    switch (datatype)
+      {
+        bisvtkTemplateMacro( typesize=sizeof(BIS_TT) );
+      }
+    if (typesize==0)
+      {
+        std::cerr << "NIFTI header: unsupported NIFTI data type " << datatype << std::endl;
+        return 0;
+      }
+
+    // Dimensions beyond dim[0] are 1, spacing rounded as in bisweb_image.js
+    BISLONG length=1;
+    for (int ia=0;ia<=4;ia++)
+      {
+        BISLONG d=1;
+        if (ia+1<=ndim[0] && ndim[ia+1]>1)
+          d=ndim[ia+1];
+        if (d>2147483647)
+          {
+            std::cerr << "NIFTI header: dimension " << ia << " too large " << d << std::endl;
+            return 0;
+          }
+        dim[ia]=(int)d;
+        length*=d;
+        spa[ia]=float(pixdim[ia+1]);
+        if (spa[ia]<=0.0f)
+          spa[ia]=1.0f;
+        if (ia<=2)
+          spa[ia]=float(floor(spa[ia]*1000.0+0.5)*0.001);
+      }
+
+    BISLONG minoffset=(version==1) ? 352 : 544;
+    if (voxoffset<minoffset || voxoffset%16!=0)
+      {
+        std::cerr << "NIFTI header: bad voxel offset " << voxoffset << std::endl;
+        return 0;
+      }
+
+    datasize=length*typesize;
+    if (voxoffset+datasize>filesize)
+      {
+        std::cerr << "NIFTI header: file is truncated (" << filesize << " < " << voxoffset+datasize << ")" << std::endl;
+        return 0;
+      }
+    return 1;
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+bisMemoryMappedImage::bisMemoryMappedImage(std::string n) : bisObject(n) {
+
+  this->class_name="bisMemoryMappedImage";
+  this->mapping=0;
+  this->mapping_size=0;
+  this->raw_array=0;
+  this->data_type=-1;
+}
+
+bisMemoryMappedImage::~bisMemoryMappedImage() {
+
+  this->unmap();
+}
+
+void bisMemoryMappedImage::unmap() {
+
+#ifdef BIS_HAS_MMAP
+  if (this->mapping!=0)
+    munmap(this->mapping,(size_t)this->mapping_size);
+#endif
+  this->mapping=0;
+  this->mapping_size=0;
+  this->raw_array=0;
+  this->data_type=-1;
+}
+
+// ---------------------------------------------------------------------------------------------------
+int bisMemoryMappedImage::mapNIFTIFile(std::string filename,int debug) {
+
+  this->unmap();
+
+#ifndef BIS_HAS_MMAP
+  std::cerr << "Memory mapped images are not supported on this platform (" << filename << ")" << std::endl;
+  return 0;
+#else
+  int fd=open(filename.c_str(),O_RDONLY);
+  if (fd<0)
+    {
+      std::cerr << "Memory mapped image: failed to open " << filename << std::endl;
+      return 0;
+    }
+
+  struct stat st;
+  if (fstat(fd,&st)!=0 || st.st_size<=0)
+    {
+      std::cerr << "Memory mapped image: failed to stat " << filename << std::endl;
+      close(fd);
+      return 0;
+    }
+
+  // MAP_PRIVATE -- writes (the header below and any in place processing) are copy-on-write and never reach the file
+  BISLONG filesize=(BISLONG)st.st_size;
+  void* ptr=mmap(0,(size_t)filesize,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (ptr==MAP_FAILED)
+    {
+      std::cerr << "Memory mapped image: mmap failed for " << filename << std::endl;
+      return 0;
+    }
+
+  unsigned char* header=(unsigned char*)ptr;
+  int dim[5]; float spa[5];
+  int datatype=0;
+  BISLONG voxoffset=0,datasize=0;
+  if (!bisMemoryMappedImageUtil::parseNIFTIHeader(header,filesize,dim,spa,datatype,voxoffset,datasize))
+    {
+      std::cerr << "Memory mapped image: failed to parse " << filename << std::endl;
+      munmap(ptr,(size_t)filesize);
+      return 0;
+    }
+
+  // Serialized image header immediately before the voxel data (always the 64-bit size header)
+  this->raw_array=header+voxoffset-bisMemoryMappedImageUtil::PREAMBLE_SIZE;
+  int* begin_int=(int*)this->raw_array;
+  begin_int[0]=bisDataTypes::s_image;
+  begin_int[1]=datatype;
+  begin_int[2]=bisMemoryMappedImageUtil::PREAMBLE_SIZE-16;
+  int* int_head=(int*)(this->raw_array+16);
+  float* float_head=(float*)(this->raw_array+36);
+  for (int ia=0;ia<=4;ia++)
+    {
+      int_head[ia]=dim[ia];
+      float_head[ia]=spa[ia];
+    }
+  bisSimpleDataUtil::setSerializedDataSize(this->raw_array,datasize,1);
+
+  this->mapping=header;
+  this->mapping_size=filesize;
+  this->data_type=datatype;
+
+  if (debug)
+    {
+      std::cout << "..... Mapped " << filename << " dim=" << dim[0] << "," << dim[1] << "," << dim[2] << "," << dim[3] << "," << dim[4];
+      std::cout << " spa=" << spa[0] << "," << spa[1] << "," << spa[2] << " type=" << datatype << " voxoffset=" << voxoffset;
+      std::cout << " size=" << datasize << std::endl;
+    }
+  return 1;
+#endif
+}
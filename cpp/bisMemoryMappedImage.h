@@ -0,0 +1,111 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+
+#ifndef _bis_MemoryMappedImage_h
+#define _bis_MemoryMappedImage_h
+
+#include "bisSimpleDataStructures.h"
+
+namespace bisMemoryMappedImageUtil {
+
+  /** Parses the relevant fields of an uncompressed single-file NIFTI-1 or NIFTI-2 header (native byte order)
+   * @param header the first bytes of the file (at least 540 bytes or the whole file if smaller)
+   * @param filesize the size of the file in bytes
+   * @param dim on output the image dimensions (5d)
+   * @param spa on output the image spacing (5d)
+   * @param datatype on output the data type (see \link bisDataTypes \endlink)
+   * @param voxoffset on output the offset of the voxel data in bytes
+   * @param datasize on output the size of the voxel data in bytes
+   * @returns 1 if success 0 if failed
+   */
+  int parseNIFTIHeader(unsigned char* header,BISLONG filesize,int dim[5],float spa[5],int& datatype,BISLONG& voxoffset,BISLONG& datasize);
+}
+
+/**
+ * Memory-maps an uncompressed single-file NIFTI image (.nii, NIFTI-1 or NIFTI-2) for native (non-WASM) builds.
+ * The file is mapped copy-on-write and the bisweb serialization header (16 bytes + 48 bytes of dimensions,spacing
+ * and the 64-bit data size) is written into the mapped page just before the voxel offset. The result is a valid
+ * serialized image whose voxel data is the file itself, so images can be linked (see \link bisSimpleData::linkIntoPointer \endlink)
+ * without reading the file. Only the page holding the header is copied; the data pages are shared with the page cache.
+ * Changes to the voxel data are private to this process and are never written back to the file.
+ * The mapping (and hence any image linked to it) is valid only while this object exists.
+ */
+class bisMemoryMappedImage : public bisObject {
+
+public:
+
+  /** Constructor
+   * @param name used to set class name
+   */
+  bisMemoryMappedImage(std::string name="mmapimage");
+
+  /** Destructor, unmaps the file */
+  virtual ~bisMemoryMappedImage();
+
+  /** Maps a .nii file
+   * @param filename the name of the file to map (must be uncompressed, native byte order)
+   * @param debug if > 0 print debug messages
+   * @returns 1 if success, 0 if failed (or if memory mapping is not supported on this platform)
+   */
+  int mapNIFTIFile(std::string filename,int debug=0);
+
+  /** Unmaps the file. Images linked to the mapping must not be used after this */
+  void unmap();
+
+  /** @returns 1 if a file is currently mapped */
+  int isMapped() { return (this->raw_array!=0); }
+
+  /** @returns the data type of the mapped image (see \link bisDataTypes \endlink) or -1 if nothing is mapped */
+  int getDataType() { return this->data_type; }
+
+  /** @returns the serialized image inside the mapping (or 0). This is not owned by the caller and must not be released */
+  unsigned char* getRawArray() { return this->raw_array; }
+
+  /** Creates a n_e_w image that points into the mapping. The image does not own its pointer (owns_pointer=0).
+   * If T does not match the data type of the file, linkIntoPointer casts the data into a n_e_w (owned) array.
+   * @param name the name of the image
+   * @returns the image (caller owns the image object, not the data) or 0 if nothing is mapped
+   */
+  template<class T> bisSimpleImage<T>* linkImage(std::string name="mmapped") {
+    if (this->raw_array==0)
+      return 0;
+    bisSimpleImage<T>* img=new bisSimpleImage<T>(name);
+    if (!img->linkIntoPointer(this->raw_array,0))
+      {
+        delete img;
+        return 0;
+      }
+    return img;
+  }
+
+protected:
+
+  /** The start of the mapping */
+  unsigned char* mapping;
+
+  /** The size of the mapping in bytes */
+  BISLONG mapping_size;
+
+  /** Start of the serialized image inside the mapping */
+  unsigned char* raw_array;
+
+  /** The data type of the image */
+  int data_type;
+};
+
+#endif
@@ -18,11 +18,6 @@
 #include "bisObject.h"
 #include "bisMemoryManagement.h"
 #include <iostream>
-#include <list>
-
-namespace bisObjectMemory {
-  std::list<bisObject*> memory_list;
-}
 
 
 bisObject::bisObject(std::string n)
@@ -35,8 +30,6 @@ bisObject::bisObject(std::string n)
 bisObject::~bisObject()
 {
   this->release_object_memory();
-  bisMemoryManagement::release_links(this);
-
 }
 
 
@@ -47,7 +40,7 @@ std::string bisObject::getName() {
 
 void bisObject::register_object_memory()
 {
-  bisObjectMemory::memory_list.push_back(this);
+  bisMemoryManagement::register_object(this);
     
   if (bisMemoryManagement::debugMemory())
     std::cout << "ooooo (OBJECT MEMORY ALLOC) " << this->getName() << " (loc=" << BISLONG(this) << ")" << std::endl;
@@ -55,7 +48,7 @@ void bisObject::register_object_memory()
 
 void bisObject::release_object_memory()
 {
-  bisObjectMemory::memory_list.remove(this);
+  bisMemoryManagement::release_object(this);
 
   if (bisMemoryManagement::debugMemory())
     {
@@ -67,15 +60,5 @@ void bisObject::release_object_memory()
 
 void bisObject::print_memory_map()
 {
-  std::list<bisObject*>::iterator it;
-
-  for ( it = bisObjectMemory::memory_list.begin(); it != bisObjectMemory::memory_list.end(); it++ )
-    {
-      bisObject* obj=*it;
-      std::cout << "O " << (BISLONG)obj  // string (key)
-		<< " : "
-		<< obj->getName()   // string's value
-		<< " (" << obj->getClassName() << ") " << std::endl;
-    }
-  std::cout << "+++++++++++++++++++++++++++++++" << std::endl  << std::endl;
+  bisMemoryManagement::print_objects();
 }
@@ -0,0 +1,209 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+#include "bisSIMD.h"
+
+#ifdef BIS_SIMD
+
+namespace bisSIMD {
+
+  double sumSquaredDifferences(const float* a,const float* b,int n)
+  {
+    float4 acc=splat(0.0f);
+    int i=0;
+    for (;i+4<=n;i+=4)
+      {
+        float4 d=sub(load(a+i),load(b+i));
+        acc=add(acc,mul(d,d));
+      }
+    double sum=hsum(acc);
+    for (;i<n;i++)
+      sum+=(a[i]-b[i])*(a[i]-b[i]);
+    return sum;
+  }
+
+  double dotProduct(const float* a,const float* b,int n)
+  {
+    float4 acc=splat(0.0f);
+    int i=0;
+    for (;i+4<=n;i+=4)
+      acc=add(acc,mul(load(a+i),load(b+i)));
+    double sum=hsum(acc);
+    for (;i<n;i++)
+      sum+=a[i]*b[i];
+    return sum;
+  }
+
+  double weightedDotProduct(const float* a,const float* b,const float* w,int n)
+  {
+    float4 acc=splat(0.0f);
+    int i=0;
+    for (;i+4<=n;i+=4)
+      acc=add(acc,mul(mul(load(a+i),load(b+i)),load(w+i)));
+    double sum=hsum(acc);
+    for (;i<n;i++)
+      sum+=a[i]*b[i]*w[i];
+    return sum;
+  }
+
+  void computeBinIndices(const short* a,const short* b,int n,float maxx,float maxy,int numbinsx,int* index)
+  {
+    float4 zero=splat(0.0f),mx=splat(maxx),my=splat(maxy),nbx=splat(float(numbinsx)),minus=splat(-1.0f);
+    float fa[4],fb[4];
+    int i=0;
+    for (;i+4<=n;i+=4)
+      {
+        for (int l=0;l<4;l++)
+          {
+            fa[l]=a[i+l];
+            fb[l]=b[i+l];
+          }
+        float4 va=load(fa),vb=load(fb);
+        float4 bin=add(va,mul(vb,nbx));
+        storeInt(index+i,select(inside(va,zero,mx),select(inside(vb,zero,my),bin,minus),minus));
+      }
+    for (;i<n;i++)
+      {
+        if (a[i]<0 || a[i]>maxx || b[i]<0 || b[i]>maxy)
+          index[i]=-1;
+        else
+          index[i]=a[i]+b[i]*numbinsx;
+      }
+  }
+
+  // ---------------------------------------------------------------------------------------------------
+  // Convolution
+  // Tap offsets (in units of the axis stride) and weights for every position along the axis. The
+  // boundary handling is the same as in bisImageAlgorithms::oneDConvolution
+  // ---------------------------------------------------------------------------------------------------
+  static void computeTaps(int n,const std::vector<float>& kernel,int vtkboundary,
+                          std::vector<int>& numtaps,std::vector<int>& tapoffset,std::vector<float>& tapweight)
+  {
+    int radius=int((kernel.size()-1)/2);
+    int width=2*radius+1;
+    numtaps.resize(n);
+    tapoffset.resize(n*width);
+    tapweight.resize(n*width);
+
+    for (int ia=0;ia<n;ia++)
+      {
+        int nt=0;
+        double sumw=0.0;
+        int interior=(ia>=radius && ia<n-radius);
+        for (int tau=-radius;tau<=radius;tau++)
+          {
+            int coord=tau+ia;
+            int fixedtau=tau;
+            if (coord<0 || coord>n-1)
+              {
+                if (vtkboundary)
+                  continue;
+                fixedtau= (coord<0) ? -ia : n-1-ia;
+              }
+            tapoffset[ia*width+nt]=fixedtau;
+            tapweight[ia*width+nt]=kernel[tau+radius];
+            sumw+=kernel[tau+radius];
+            ++nt;
+          }
+        if (vtkboundary && !interior && sumw>0.0)
+          {
+            for (int t=0;t<nt;t++)
+              tapweight[ia*width+t]=float(tapweight[ia*width+t]/sumw);
+          }
+        numtaps[ia]=nt;
+      }
+  }
+
+  void convolve(const float* in,float* out,int dim[5],const std::vector<float>& kernel,int axis,int vtkboundary)
+  {
+    int radius=int((kernel.size()-1)/2);
+    int width=2*radius+1;
+    BISLONG slicesize=BISLONG(dim[0])*BISLONG(dim[1]);
+    BISLONG volsize=slicesize*BISLONG(dim[2]);
+    int numcompframes=dim[3]*dim[4];
+    int n=dim[axis];
+
+    std::vector<int> numtaps,tapoffset;
+    std::vector<float> tapweight;
+    computeTaps(n,kernel,vtkboundary,numtaps,tapoffset,tapweight);
+
+    if (axis==0)
+      {
+        // Lines are contiguous, vectorize over four consecutive outputs in the interior
+        BISLONG numlines=BISLONG(dim[1])*BISLONG(dim[2])*numcompframes;
+        for (BISLONG line=0;line<numlines;line++)
+          {
+            const float* inl=in+line*n;
+            float* outl=out+line*n;
+            int ia=0;
+            while (ia<n)
+              {
+                if (ia>=radius && ia+3<n-radius)
+                  {
+                    float4 acc=splat(0.0f);
+                    for (int tau=-radius;tau<=radius;tau++)
+                      acc=add(acc,mul(splat(kernel[tau+radius]),load(inl+ia+tau)));
+                    store(outl+ia,acc);
+                    ia+=4;
+                  }
+                else
+                  {
+                    float sum=0.0f;
+                    for (int t=0;t<numtaps[ia];t++)
+                      sum+=tapweight[ia*width+t]*inl[ia+tapoffset[ia*width+t]];
+                    outl[ia]=sum;
+                    ++ia;
+                  }
+              }
+          }
+        return;
+      }
+
+    // Axis 1 or 2: neighboring lines are contiguous in x (and y for axis 2), vectorize across lines
+    BISLONG stride=(axis==1) ? dim[0] : slicesize;
+    int numouter= (axis==1) ? dim[2] : 1;
+    BISLONG outerstride= (axis==1) ? slicesize : 0;
+    int inner= (axis==1) ? dim[0] : int(slicesize);
+
+    for (int compframe=0;compframe<numcompframes;compframe++)
+      for (int outer=0;outer<numouter;outer++)
+        for (int ia=0;ia<n;ia++)
+          {
+            BISLONG base=compframe*volsize+outer*outerstride+ia*stride;
+            const int* offs=&tapoffset[ia*width];
+            const float* wgts=&tapweight[ia*width];
+            int nt=numtaps[ia];
+            int x=0;
+            for (;x+4<=inner;x+=4)
+              {
+                float4 acc=splat(0.0f);
+                for (int t=0;t<nt;t++)
+                  acc=add(acc,mul(splat(wgts[t]),load(in+base+x+offs[t]*stride)));
+                store(out+base+x,acc);
+              }
+            for (;x<inner;x++)
+              {
+                float sum=0.0f;
+                for (int t=0;t<nt;t++)
+                  sum+=wgts[t]*in[base+x+offs[t]*stride];
+                out[base+x]=sum;
+              }
+          }
+  }
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+#ifndef _bis_SIMD_h
+#define _bis_SIMD_h
+
+#include "bisMemoryManagement.h"
+#include <vector>
+
+/** @file bisSIMD.h
+
+    Four-wide float vector helpers for the hot loops (separable convolution, trilinear interpolation,
+    joint histogram fill, correlation and distance matrix inner products).
+
+    BIS_SIMD is defined for native builds that define BIS_USE_SSE (SSE2). Otherwise (including the WebAssembly
+    library) nothing is defined here and the callers use their original scalar loops. The vector code accumulates
+    in float, so results may differ from the scalar code in the last bits.
+*/
+
+#if defined(BIS_USE_SSE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define BIS_SIMD 1
+#endif
+
+#ifdef BIS_SIMD
+
+namespace bisSIMD {
+
+  typedef __m128 float4;
+  inline float4 load(const float* p) { return _mm_loadu_ps(p); }
+  inline void store(float* p,float4 a) { _mm_storeu_ps(p,a); }
+  inline float4 splat(float a) { return _mm_set1_ps(a); }
+  inline float4 make(float a,float b,float c,float d) { return _mm_setr_ps(a,b,c,d); }
+  inline float4 add(float4 a,float4 b) { return _mm_add_ps(a,b); }
+  inline float4 sub(float4 a,float4 b) { return _mm_sub_ps(a,b); }
+  inline float4 mul(float4 a,float4 b) { return _mm_mul_ps(a,b); }
+  inline float4 inside(float4 a,float4 lo,float4 hi) { return _mm_and_ps(_mm_cmpge_ps(a,lo),_mm_cmple_ps(a,hi)); }
+  inline float4 select(float4 mask,float4 a,float4 b) { return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b)); }
+  inline void storeInt(int* p,float4 a) { _mm_storeu_si128((__m128i*)p,_mm_cvttps_epi32(a)); }
+
+  /** @returns the sum of the four lanes */
+  inline float hsum(float4 a) {
+    float v[4]; store(v,a);
+    return (v[0]+v[1])+(v[2]+v[3]);
+  }
+
+  /** Values of type T are converted to float without loss (used to decide whether the float kernels apply) */
+  template<class T> struct isExactInFloat { enum { value = (sizeof(T)<=2) }; };
+  template<> struct isExactInFloat<float> { enum { value = 1 }; };
+
+  /** Trilinear interpolation from the eight corner values
+   * @param data the image data
+   * @param B the corner offsets along each axis (B[1] and B[2] already multiplied by the row/slice size)
+   * @param W the weights of the two corners along each axis
+   * @returns the interpolated value
+   */
+  template<class T> inline float trilinear(T* data,int B[3][2],double W[3][2]) {
+    int i00=B[2][0]+B[1][0],i01=B[2][0]+B[1][1],i10=B[2][1]+B[1][0],i11=B[2][1]+B[1][1];
+    float4 v0=make((float)data[i00+B[0][0]],(float)data[i01+B[0][0]],(float)data[i10+B[0][0]],(float)data[i11+B[0][0]]);
+    float4 v1=make((float)data[i00+B[0][1]],(float)data[i01+B[0][1]],(float)data[i10+B[0][1]],(float)data[i11+B[0][1]]);
+    float4 wyz=mul(make(float(W[2][0]),float(W[2][0]),float(W[2][1]),float(W[2][1])),
+                   make(float(W[1][0]),float(W[1][1]),float(W[1][0]),float(W[1][1])));
+    return hsum(mul(add(mul(v0,splat(float(W[0][0]))),mul(v1,splat(float(W[0][1])))),wyz));
+  }
+
+  /** @returns sum_i (a[i]-b[i])^2 */
+  double sumSquaredDifferences(const float* a,const float* b,int n);
+
+  /** @returns sum_i a[i]*b[i] */
+  double dotProduct(const float* a,const float* b,int n);
+
+  /** @returns sum_i a[i]*b[i]*w[i] */
+  double weightedDotProduct(const float* a,const float* b,const float* w,int n);
+
+  /** Computes joint histogram bin indices a[i]+b[i]*numbinsx, or -1 if a[i] is not in [0,maxx] or b[i] not in [0,maxy]
+   * @param a values of image 1
+   * @param b values of image 2
+   * @param n number of values
+   * @param maxx the maximum bin for a
+   * @param maxy the maximum bin for b
+   * @param numbinsx the number of bins for a
+   * @param index the output indices (size n)
+   */
+  void computeBinIndices(const short* a,const short* b,int n,float maxx,float maxy,int numbinsx,int* index);
+
+  /** One dimensional convolution of a float image along an axis, same boundary handling as bisImageAlgorithms::oneDConvolution
+   * @param in the input image data
+   * @param out the output image data (must not be the same as in)
+   * @param dim the image dimensions
+   * @param kernel the convolution kernel (size 2*radius+1)
+   * @param axis the axis (0,1,2)
+   * @param vtkboundary if 0 repeat the edge values, else renormalize the kernel at the edges
+   */
+  void convolve(const float* in,float* out,int dim[5],const std::vector<float>& kernel,int axis,int vtkboundary);
+
+  /** Generic version for non float images, returns 0 (not done, use the scalar code) */
+  template<class IT,class OT> inline int convolveIfFloat(IT* ,OT* ,int [5],const std::vector<float>& ,int ,int ) { return 0; }
+
+  /** float images use the vector convolution, returns 1 */
+  inline int convolveIfFloat(float* in,float* out,int dim[5],const std::vector<float>& kernel,int axis,int vtkboundary) {
+    convolve(in,out,dim,kernel,axis,vtkboundary);
+    return 1;
+  }
+}
+
+#endif
+
+#endif
@@ -44,6 +44,12 @@
   unsigned char* header[header_size]; //  defined separately for vector,matrix and image
   unsigned char* data[data_length];   //  raw data of type defined by data_type
 </PRE>
+
+ * Data larger than 2GB (or all data when bisMemoryManagement::largeMemory() is set) uses the 64-bit
+ * version of the header. Here data_length is set to bisDataTypes::s_datasize64 and the actual size
+ * is stored as an int64 in the last 8 bytes of the header (which is therefore 8 bytes longer).
+ * The legacy large data format (data_length=-sizeof(T), size computed from the dimensions) is still
+ * read.
 */
 
 
@@ -106,7 +112,7 @@ public:
   /** Get the length of the data array in elements (not bytes) 
    * @returns length of data array in elements
    */
-  long getLength() { return this->data_length; }
+  BISLONG getLength() { return this->data_length; }
 
   /** Get the data array
    * @returns a pointer to the data array
@@ -130,7 +136,10 @@ public:
   /** Returns the raw size in bytes
    * @returns the size of the raw_array in bytes 
    */
-  long getRawSize() { return this->header_size+this->data_size+16; }
+  BISLONG getRawSize() { return this->header_size+this->data_size+16; }
+
+  /** Returns 1 if this object uses the 64-bit header (see above) */
+  int hasLargeHeader() { return this->large_header; }
 
   /** Get Range
    * @param range the function stores in this the minimum and the maximum value in the data array 
@@ -143,7 +152,8 @@ protected:
   // Global Flags
   // size -> in bytes, length in type<T>
   int owns_pointer,  data_type, header_size;
-  long data_length,data_size;
+  BISLONG data_length,data_size;
+  int large_header;
   int used_to_own_pointer;
   std::string raw_array_name;
 #endif
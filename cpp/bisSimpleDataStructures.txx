@@ -24,8 +24,66 @@
 namespace bisSimpleDataUtil {
 
 #ifndef BISWASM  
-  const long MAX_SIZE=2147483647;
+  const BISLONG MAX_SIZE=2147483647;
 #endif
+
+  /** Returns 1 if data of this size should be serialized using the 64-bit header */
+  inline int useLargeHeader(BISLONG data_size) {
+#ifndef BISWASM
+    if (data_size>=MAX_SIZE || bisMemoryManagement::largeMemory())
+      return 1;
+#endif
+    return 0;
+  }
+
+  /** Stores the data size in a serialized pointer. If large_header=1 the header
+   * (begin_int[2] bytes) must include the 8 byte trailer for the 64-bit size */
+  inline void setSerializedDataSize(unsigned char* pointer,BISLONG data_size,int large_header) {
+
+    int* begin_int=(int*)pointer;
+    if (large_header) {
+      int64_t sz=(int64_t)data_size;
+      begin_int[3]=bisDataTypes::s_datasize64;
+      bisMemoryManagement::copy_memory(pointer+16+begin_int[2]-8,(unsigned char*)&sz,8);
+    } else {
+      begin_int[3]=(int)data_size;
+    }
+  }
+
+  /** Returns the data size of a serialized pointer, handling the 64-bit and the legacy large headers
+   * @param pointer the serialized data
+   * @param large_header set to 1 if the pointer uses the 64-bit header
+   * @returns the size in bytes or -1 if failed */
+  inline BISLONG getSerializedDataSize(unsigned char* pointer,int& large_header) {
+
+    int* begin_int=(int*)pointer;
+    large_header=0;
+    
+    if (begin_int[3]>=0)
+      return begin_int[3];
+
+    if (begin_int[3]==bisDataTypes::s_datasize64) {
+      int64_t sz=0;
+      if (begin_int[2]<8)
+        return -1;
+      bisMemoryManagement::copy_memory((unsigned char*)&sz,pointer+16+begin_int[2]-8,8);
+      large_header=1;
+      return (BISLONG)sz;
+    }
+
+    // Legacy large header -sizeof(T), compute size from the dimensions
+    if (begin_int[0]==bisDataTypes::s_image ||
+        begin_int[0]==bisDataTypes::s_matrix) {
+      BISLONG len=1;
+      int maxdim=4;
+      if (begin_int[0]==bisDataTypes::s_matrix)
+        maxdim=1;
+      for (int i=0;i<=maxdim;i++)
+        len*=begin_int[4+i];
+      return len*abs(begin_int[3]);
+    }
+    return -1;
+  }
   
   template<class OT,class IT> unsigned char* internal_cast_raw_data(unsigned char* in_pointer,BISLONG& data_size,
 								    std::string name,bisObject* owner,OT* ,IT* ) {
@@ -36,8 +94,11 @@ namespace bisSimpleDataUtil {
     
     int* begin_int=(int*)in_pointer;
     int header_size=begin_int[2];
+    int large_header=0;
     if (data_size<1)
-      data_size=begin_int[3];
+      data_size=getSerializedDataSize(in_pointer,large_header);
+    else
+      large_header=(begin_int[3]==bisDataTypes::s_datasize64);
 
     BISLONG numelements=data_size/sizeof(IT);
     BISLONG output_data_size= numelements*sizeof(OT);
@@ -54,13 +115,14 @@ namespace bisSimpleDataUtil {
     bisMemoryManagement::copy_memory(out_pointer,in_pointer,16+header_size);
     begin_int=(int*)out_pointer;
     begin_int[1]=ot_type;
-    begin_int[3]=output_data_size;
-#ifndef BISWASM
-    if (output_data_size>=MAX_SIZE || bisMemoryManagement::largeMemory())
+    if (large_header)
+      setSerializedDataSize(out_pointer,output_data_size,1);
+    else if (useLargeHeader(output_data_size))
       begin_int[3]=(int)(-1*sizeof(OT));
-#endif
+    else
+      begin_int[3]=(int)output_data_size;
     
-    for (int i=0;i<numelements;i++)
+    for (BISLONG i=0;i<numelements;i++)
       odata[i]=(OT)idata[i];
 
     data_size=output_data_size;
@@ -116,6 +178,7 @@ template<class T> bisSimpleData<T>::bisSimpleData(std::string n) : bisDataObject
   this->data_length=0;
   this->data_size=0;
   this->header_size=0;
+  this->large_header=0;
   this->owns_pointer=0;
   this->used_to_own_pointer=0;
   T tmp=0;
@@ -139,7 +202,7 @@ template<class T> bisSimpleData<T>::~bisSimpleData() {
 
   
 template<class T> void bisSimpleData<T>::fill(T val) {
-  for (int ia=0;ia<this->data_length;ia++)
+  for (BISLONG ia=0;ia<this->data_length;ia++)
     this->data[ia]=val;
 }
 
@@ -156,6 +219,9 @@ template< class T> void bisSimpleData<T>::allocate_data() {
   // On to output stuff
   // ------------------
   this->data_size=this->data_length*sizeof(T);
+  this->large_header=bisSimpleDataUtil::useLargeHeader(this->data_size);
+  if (this->large_header)
+    this->header_size+=8;
   this->raw_array=bisMemoryManagement::allocate_memory(16+this->data_size+this->header_size,
 						       this->raw_array_name,"allocate_data",this);
   
@@ -170,11 +236,7 @@ template< class T> void bisSimpleData<T>::allocate_data() {
   begin_int[0]=this->magic_type;
   begin_int[1]=this->data_type;
   begin_int[2]=this->header_size;
-  begin_int[3]=this->data_size;
-#ifndef BISWASM
-  if (this->data_size>=bisSimpleDataUtil::MAX_SIZE || bisMemoryManagement::largeMemory())
-    begin_int[3]=(int)(-1*sizeof(T));
-#endif
+  bisSimpleDataUtil::setSerializedDataSize(this->raw_array,this->data_size,this->large_header);
 }
 
 template<class T> int bisSimpleData<T>::deSerialize(unsigned char* pointer)
@@ -186,29 +248,12 @@ template<class T> int bisSimpleData<T>::linkIntoPointer(unsigned char* pointer,i
 
   int* begin_int=(int*)pointer;
   int incoming_magic_type=begin_int[0];
-  BISLONG dt_size=begin_int[3];
+  int large_header=0;
+  BISLONG dt_size=bisSimpleDataUtil::getSerializedDataSize(pointer,large_header);
 
   if (dt_size<0) {
-    std::cout << "____ C++ large image: original length=" << dt_size << ", B=" << begin_int[3] << std::endl;
-    if (this->magic_type==bisDataTypes::s_image ||
-        this->magic_type==bisDataTypes::s_matrix) {
-      BISLONG len=1;
-      int maxdim=4;
-      if (this->magic_type==bisDataTypes::s_matrix)
-        maxdim=1;
-      for (int i=0;i<=maxdim;i++) {
-        // std::cout << "Dim " << i << "=" << begin_int[4+i] << std::endl;
-        len*=begin_int[4+i];
-      }
-      std::cout << "____      Len " << len << std::endl;
-      dt_size=len*abs(begin_int[3]);
-      std::cout << "____                 final byte length=" << dt_size << " vs " << dt_size/len << " bytes=" << abs(begin_int[3]) << std::endl;
-    }
-    
-    if (dt_size<0) {
-      std::cerr << "Bad data set " << dt_size  << std::endl;
-      return 0;
-    }
+    std::cerr << "Bad data set " << dt_size  << " (B=" << begin_int[3] << ")" << std::endl;
+    return 0;
   }
 
   if (bisMemoryManagement::debugMemory() )
@@ -265,6 +310,7 @@ template<class T> int bisSimpleData<T>::linkIntoPointer(unsigned char* pointer,i
   begin_int=(int*)output_pointer;
   this->data_type=begin_int[1];
   this->header_size=begin_int[2];
+  this->large_header=large_header;
   this->data_size=dt_size;
   this->data_length=this->data_size/sizeof(T);
 
@@ -285,11 +331,9 @@ template<class T> void bisSimpleData<T>::serializeInPlace(unsigned char* output)
   begin_int[0]=this->magic_type;
   begin_int[1]=this->data_type;
   begin_int[2]=this->header_size;
-  begin_int[3]=this->data_size;
-#ifndef BISWASM
-  if (this->data_size >= bisSimpleDataUtil::MAX_SIZE || bisMemoryManagement::largeMemory())
+  begin_int[3]=(int)this->data_size;
+  if (!this->large_header && bisSimpleDataUtil::useLargeHeader(this->data_size))
     begin_int[3]=(int)(-1*sizeof(T));
-#endif
   
   unsigned char* begin_ptr=(unsigned char*)(&begin_int[0]);
   
@@ -297,6 +341,8 @@ template<class T> void bisSimpleData<T>::serializeInPlace(unsigned char* output)
   bisMemoryManagement::copy_memory(output,begin_ptr,4*4);
   bisMemoryManagement::copy_memory(output+16,this->header,this->header_size);
   bisMemoryManagement::copy_memory(output+16+this->header_size,(unsigned char*)this->data,this->data_size);
+  if (this->large_header)
+    bisSimpleDataUtil::setSerializedDataSize(output,this->data_size,1);
   
 
 
@@ -313,7 +359,7 @@ template<class T> void bisSimpleData<T>::getRange(double range[2])
     {
       range[0]=this->data[0];
       range[1]=this->data[0];
-      for (int i=1;i<this->data_length;i++)
+      for (BISLONG i=1;i<this->data_length;i++)
 	{
 	  if (range[1]<data[i])
 	    range[1]=data[i];
@@ -376,7 +422,7 @@ template<class T> int bisSimpleMatrix<T>::allocate(int numrows,int numcols)
 {
   this->numrows=numrows;
   this->numcols=numcols;
-  this->data_length=this->numrows*this->numcols;
+  this->data_length=BISLONG(this->numrows)*BISLONG(this->numcols);
   this->header_size=8;
   this->allocate_data();
   int* int_head=(int*)(this->header);
@@ -396,7 +442,7 @@ template<class T> int bisSimpleMatrix<T>::eye(int rows) {
   this->allocate(rows,rows);
   this->fill((T)0);
   for (int i=0;i<this->numrows;i++)
-    this->data[i*this->numrows+i]=(T)1;
+    this->data[BISLONG(i)*BISLONG(this->numrows)+i]=(T)1;
   
   return 1;
 }
@@ -534,8 +580,8 @@ template<class T> bisSimpleImage<T>* bisSimpleImage<T>::copyImage(std::string na
   // Copy intensities from input to output
   T *outP=output_image->getData();
   T *inpP=this->getData();
-  int nvox=output_image->getLength();
-  for (int i=0;i<nvox;i++)
+  BISLONG nvox=output_image->getLength();
+  for (BISLONG i=0;i<nvox;i++)
     outP[i]=inpP[i];
   
   return output_image;
@@ -547,7 +593,7 @@ template<class T> T* bisSimpleImage<T>::getPointerAtStartOfFrame(int frame) {
     
   int actualframe=bisUtil::irange(frame,0,this->dimensions[3]*this->dimensions[4]-1);
   T* inp=this->getData();
-  int offset=this->dimensions[0]*this->dimensions[1]*this->dimensions[2]*actualframe;
+  BISLONG offset=BISLONG(this->dimensions[0])*BISLONG(this->dimensions[1])*BISLONG(this->dimensions[2])*BISLONG(actualframe);
   return &inp[offset];
 }
 
@@ -0,0 +1,241 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#include "bisSparseMatrix.h"
+#include <vector>
+
+bisSparseMatrix::bisSparseMatrix(std::string n) : bisDataObject(n) {
+  this->magic_type=bisDataTypes::s_sparsematrix;
+  this->class_name="bisSparseMatrix";
+  this->raw_array=0;
+  this->owns_pointer=0;
+  this->large_header=0;
+  this->numrows=0;
+  this->numcols=0;
+  this->numnonzero=0;
+  this->numcomponents=0;
+  this->rowpointers=0;
+  this->columnindices=0;
+  this->values=0;
+}
+
+bisSparseMatrix::~bisSparseMatrix() {
+  this->cleanup();
+}
+
+void bisSparseMatrix::cleanup() {
+  if (this->owns_pointer)
+    bisMemoryManagement::release_memory(this->raw_array,"bisSparseMatrix::cleanup");
+  else if (this->raw_array!=0)
+    bisMemoryManagement::not_releasing_memory(this->raw_array,"bisSparseMatrix::cleanup");
+  this->raw_array=0;
+  this->owns_pointer=0;
+}
+
+BISLONG bisSparseMatrix::getDataSize() {
+  return 4*(BISLONG(this->numrows)+1)+4*BISLONG(this->numnonzero)*(1+BISLONG(this->numcomponents));
+}
+
+BISLONG bisSparseMatrix::getRawSize() {
+  return 16+16+8*this->large_header+this->getDataSize();
+}
+
+// -------------------------------------------------------------------
+int bisSparseMatrix::allocate(int nrows,int ncols,const int* rowcounts,int ncomponents) {
+
+  BISLONG total=0;
+  for (int i=0;i<nrows;i++)
+    total+=rowcounts[i];
+  if (total>2147483647 || nrows<0 || ncols<0 || ncomponents<1) {
+    std::cerr << "Can not allocate sparse matrix rows=" << nrows << " cols=" << ncols << " entries=" << total << " components=" << ncomponents << std::endl;
+    return 0;
+  }
+
+  this->cleanup();
+  this->numrows=nrows;
+  this->numcols=ncols;
+  this->numnonzero=int(total);
+  this->numcomponents=ncomponents;
+
+  BISLONG datasize=this->getDataSize();
+  this->large_header=bisSimpleDataUtil::useLargeHeader(datasize);
+  BISLONG rawsize=this->getRawSize();
+  this->raw_array=bisMemoryManagement::allocate_memory(rawsize,this->name,"allocate",this);
+  this->owns_pointer=1;
+
+  int* begin_int=(int*)this->raw_array;
+  begin_int[0]=this->magic_type;
+  begin_int[1]=bisDataTypes::b_float32;
+  begin_int[2]=16+8*this->large_header;
+  bisSimpleDataUtil::setSerializedDataSize(this->raw_array,datasize,this->large_header);
+  begin_int[4]=this->numrows;
+  begin_int[5]=this->numcols;
+  begin_int[6]=this->numnonzero;
+  begin_int[7]=this->numcomponents;
+
+  unsigned char* data=this->raw_array+16+begin_int[2];
+  this->rowpointers=(int*)data;
+  this->columnindices=this->rowpointers+this->numrows+1;
+  this->values=(float*)(this->columnindices+this->numnonzero);
+
+  this->rowpointers[0]=0;
+  for (int i=0;i<nrows;i++)
+    this->rowpointers[i+1]=this->rowpointers[i]+rowcounts[i];
+  for (int i=0;i<this->numnonzero;i++)
+    this->columnindices[i]=0;
+  BISLONG nv=BISLONG(this->numnonzero)*this->numcomponents;
+  for (BISLONG i=0;i<nv;i++)
+    this->values[i]=0.0f;
+  return 1;
+}
+
+// -------------------------------------------------------------------
+int bisSparseMatrix::linkIntoPointer(unsigned char* pointer,int copy_pointer) {
+
+  int* begin_int=(int*)pointer;
+  int large=0;
+  BISLONG datasize=bisSimpleDataUtil::getSerializedDataSize(pointer,large);
+  if (begin_int[0]!=this->magic_type || begin_int[1]!=bisDataTypes::b_float32 || begin_int[2]<16 || datasize<4)
+    {
+      std::cerr << "Bad Magic Type or bad header. Can not deserialize pointer as bisSparseMatrix (" << begin_int[0] << "," << begin_int[1] << "," << begin_int[2] << ")" << std::endl;
+      return 0;
+    }
+
+  this->cleanup();
+  unsigned char* output_pointer=pointer;
+  if (copy_pointer)
+    {
+      BISLONG sz=16+begin_int[2]+datasize;
+      output_pointer=bisMemoryManagement::allocate_memory(sz,this->name,"copying",this);
+      bisMemoryManagement::copy_memory(output_pointer,pointer,sz);
+      this->owns_pointer=1;
+    }
+
+  begin_int=(int*)output_pointer;
+  this->raw_array=output_pointer;
+  this->large_header=large;
+  this->numrows=begin_int[4];
+  this->numcols=begin_int[5];
+  this->numnonzero=begin_int[6];
+  this->numcomponents=begin_int[7];
+
+  if (this->getDataSize()!=datasize)
+    {
+      std::cerr << "Bad sparse matrix data size " << datasize << " expected " << this->getDataSize() << std::endl;
+      this->cleanup();
+      return 0;
+    }
+
+  unsigned char* data=output_pointer+16+begin_int[2];
+  this->rowpointers=(int*)data;
+  this->columnindices=this->rowpointers+this->numrows+1;
+  this->values=(float*)(this->columnindices+this->numnonzero);
+  return 1;
+}
+
+int bisSparseMatrix::deSerialize(unsigned char* pointer) {
+  return this->linkIntoPointer(pointer,1);
+}
+
+void bisSparseMatrix::serializeInPlace(unsigned char* output) {
+  if (this->raw_array==0)
+    {
+      int zero[4]= { 0,0,0,0 };
+      this->allocate(0,0,zero,1);
+    }
+  bisMemoryManagement::copy_memory(output,this->raw_array,this->getRawSize());
+}
+
+// -------------------------------------------------------------------
+int bisSparseMatrix::importCOO(bisSimpleMatrix<double>* coo,int nrows,int indexoffset,int* slots) {
+
+  int nt=coo->getNumRows();
+  int nc=coo->getNumCols();
+  if (nc<3)
+    {
+      std::cerr << "Bad COO matrix " << nt << "*" << nc << std::endl;
+      return 0;
+    }
+  double* dat=coo->getData();
+
+  std::vector<int> counts(nrows,0);
+  std::vector<char> hasdiagonal(nrows,0);
+  for (int i=0;i<nt;i++)
+    {
+      int row=int(dat[BISLONG(i)*nc])-indexoffset;
+      int col=int(dat[BISLONG(i)*nc+1])-indexoffset;
+      if (row<0 || row>=nrows || col<0 || col>=nrows)
+        {
+          std::cerr << "Bad COO entry " << i << " (" << row << "," << col << ") numrows=" << nrows << std::endl;
+          return 0;
+        }
+      counts[row]++;
+      if (row==col)
+        hasdiagonal[row]=1;
+    }
+
+  if (!this->allocate(nrows,nrows,&counts[0],nc-2))
+    return 0;
+
+  // next free slot in each row, the first slot is kept for the diagonal
+  std::vector<int> next(nrows);
+  for (int r=0;r<nrows;r++)
+    next[r]=this->rowpointers[r]+hasdiagonal[r];
+
+  for (int i=0;i<nt;i++)
+    {
+      double* v=&dat[BISLONG(i)*nc];
+      int row=int(v[0])-indexoffset;
+      int col=int(v[1])-indexoffset;
+      int slot;
+      if (row==col && hasdiagonal[row]==1)
+        {
+          slot=this->rowpointers[row];
+          hasdiagonal[row]=2;
+        }
+      else
+        {
+          slot=next[row];
+          ++next[row];
+        }
+      this->columnindices[slot]=col;
+      if (slots)
+        slots[i]=slot;
+      for (int c=0;c<this->numcomponents;c++)
+        this->values[BISLONG(c)*this->numnonzero+slot]=float(v[c+2]);
+    }
+  return 1;
+}
+
+int bisSparseMatrix::exportCOO(bisSimpleMatrix<double>* coo,int indexoffset) {
+
+  int nc=2+this->numcomponents;
+  coo->zero(this->numnonzero,nc);
+  double* dat=coo->getData();
+  for (int r=0;r<this->numrows;r++)
+    {
+      for (int e=this->rowpointers[r];e<this->rowpointers[r+1];e++)
+        {
+          double* v=&dat[BISLONG(e)*nc];
+          v[0]=r+indexoffset;
+          v[1]=this->columnindices[e]+indexoffset;
+          for (int c=0;c<this->numcomponents;c++)
+            v[c+2]=this->values[BISLONG(c)*this->numnonzero+e];
+        }
+    }
+  return 1;
+}
@@ -0,0 +1,155 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+#ifndef _bis_SparseMatrix_h
+#define _bis_SparseMatrix_h
+
+#include "bisDataObject.h"
+#include "bisSimpleDataStructures.h"
+
+/** @file bisSparseMatrix.h
+
+    A sparse matrix in compressed sparse row (CSR) format with int32 indices and float values, used for the image
+    distance matrices. Each entry can have more than one value (component), e.g. the intensity distance and the
+    spatial distance. Within a row the diagonal entry (if present) comes first, then the other entries.
+
+    Serialized (in a single block so that it can be used in place, see linkIntoPointer) as:
+<PRE>
+    int magic_type;   // bisDataTypes::s_sparsematrix
+    int data_type;    // bisDataTypes::b_float32
+    int header_size;  // 16 (24 if the 64-bit size is used, see bisSimpleDataStructures.h)
+    int data_size;    // in bytes
+    int header[4];    // numrows,numcols,numnonzero,numcomponents
+    int rowpointers[numrows+1];
+    int columnindices[numnonzero];
+    float values[numcomponents*numnonzero]; // component 0 for all entries, then component 1 ...
+</PRE>
+*/
+
+class bisSparseMatrix : public bisDataObject {
+
+ public:
+
+  /** Constructor
+   * @param n used to set class name
+   */
+  bisSparseMatrix(std::string n="sparsematrix");
+
+  /** Destructor */
+  virtual ~bisSparseMatrix();
+
+  /** Allocates the matrix given the number of entries in each row. The row pointers are set, the column indices
+   * and the values are set to zero.
+   * @param numrows number of rows
+   * @param numcols number of columns
+   * @param rowcounts the number of entries in each row (numrows values)
+   * @param numcomponents number of values per entry
+   * @returns 1 if success, 0 if failed (e.g. more than 2^31-1 entries)
+   */
+  int allocate(int numrows,int numcols,const int* rowcounts,int numcomponents=1);
+
+  /** Populate this class from a serialized pointer
+   * @param pointer the raw data pointer
+   * @param copy_pointer if > 0 then a copy is made as opposed to simply a pointer to the original data
+   * @returns 1 if success, 0 if failed
+   */
+  int linkIntoPointer(unsigned char* pointer,int copy_pointer=0);
+
+  /** deSerialize (makes a copy, see linkIntoPointer)
+   * @param pointer the serialized data
+   * @returns 1 if success, 0 if failed
+   */
+  virtual int deSerialize(unsigned char* pointer);
+
+  /** serialize this object to a preallocated pointer
+   * @param output pointer to store data in
+   */
+  virtual void serializeInPlace(unsigned char* output);
+
+  /** returns size needed to serialize this object in bytes */
+  virtual BISLONG getRawSize();
+
+  /** Releases and returns the raw array (to return to JS/Python) */
+  unsigned char* releaseAndReturnRawArray() { this->owns_pointer=0; return this->raw_array; }
+
+  /** @returns the number of rows */
+  int getNumRows() { return this->numrows; }
+
+  /** @returns the number of columns */
+  int getNumCols() { return this->numcols; }
+
+  /** @returns the number of stored entries */
+  int getNumNonZero() { return this->numnonzero; }
+
+  /** @returns the number of values per entry */
+  int getNumComponents() { return this->numcomponents; }
+
+  /** @returns the row pointers (numrows+1), the entries of row r are rowpointers[r] to rowpointers[r+1]-1 */
+  int* getRowPointers() { return this->rowpointers; }
+
+  /** @returns the column index of each entry */
+  int* getColumnIndices() { return this->columnindices; }
+
+  /** @returns the values of component c for all entries */
+  float* getValues(int c=0) { return this->values+BISLONG(c)*BISLONG(this->numnonzero); }
+
+  /** Creates the matrix from a matrix of triples (row,column,value0,value1,...), one entry per row, as returned by
+   * the COO versions of the distance matrix code. The input order is kept within a row except that the diagonal
+   * is moved to the front.
+   * @param coo the input matrix (columns 0,1 are the indices, the rest are the values)
+   * @param numrows the number of rows (and columns) of the output
+   * @param indexoffset subtract this from the indices (1 for the 1-offset indices of the index map)
+   * @param slots if not 0 (an array of size coo->getNumRows()) set to the entry each input row is stored in
+   * @returns 1 if success, 0 if failed
+   */
+  int importCOO(bisSimpleMatrix<double>* coo,int numrows,int indexoffset=1,int* slots=0);
+
+  /** Stores the matrix as triples (row,column,value0,value1,...) (the inverse of importCOO)
+   * @param coo the output matrix
+   * @param indexoffset add this to the indices
+   * @returns 1 if success
+   */
+  int exportCOO(bisSimpleMatrix<double>* coo,int indexoffset=1);
+
+ protected:
+
+#ifndef DOXYGEN_SKIP
+  unsigned char* raw_array;
+  int owns_pointer;
+  int large_header;
+  int numrows,numcols,numnonzero,numcomponents;
+  int* rowpointers;
+  int* columnindices;
+  float* values;
+#endif
+
+  /** Releases the raw array if owned */
+  void cleanup();
+
+  /** @returns the size of the data part in bytes */
+  BISLONG getDataSize();
+
+ private:
+
+  /** Copy constructor disabled to maintain shared/unique ptr safety */
+  bisSparseMatrix(const bisSparseMatrix&);
+
+  /** Assignment disabled to maintain shared/unique ptr safety */
+  void operator=(const bisSparseMatrix&);
+};
+
+#endif
@@ -65,7 +65,7 @@ void bisSurface::copy(bisSurface* other) {
 
 
 // -------------------------------------------------------------------
-long bisSurface::getRawSize()
+BISLONG bisSurface::getRawSize()
 {
   // Header
   // 16 bytes big header
@@ -52,7 +52,7 @@ class bisSurface : public bisDataObject {
   virtual void serializeInPlace(unsigned char* output);
 
   /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize();
+  virtual BISLONG getRawSize();
 
   /** Get the Points
    * @returns a shared pointer to Points
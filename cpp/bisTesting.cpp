@@ -26,12 +26,25 @@
 #include "bisComboTransformation.h"
 #include "bisLinearTransformation.h"
 #include "bisLegacyFileSupport.h"
+#include "bisMemoryMappedImage.h"
+#include "bisImageAlgorithms.h"
+#include "bisfMRIAlgorithms.h"
+#include "bisImageDistanceMatrix.h"
+#include "bisSparseMatrix.h"
+#include "bisImageTransformationJacobian.h"
 #include <iostream>
 #include <memory>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
 #include <math.h>
 #include <Eigen/Dense>
+#if !defined(BISWASM) || defined(__EMSCRIPTEN_PTHREADS__)
+#include <thread>
+#include <future>
+#endif
 
 // Yale was founded in 1701
 // If Web Assembly return 1701 , else 1700 (C)
@@ -387,6 +400,1061 @@ int test_bendingEnergy(unsigned char* ptr,int )
   return numfailed;
 }
 
+int test_bakedComboTransformation(unsigned char* ptr,int debug)
+{
+  std::unique_ptr<bisComboTransformation> chained(new bisComboTransformation("chained"));
+  std::unique_ptr<bisComboTransformation> baked(new bisComboTransformation("baked"));
+  if (!chained->deSerialize(ptr) || !baked->deSerialize(ptr))
+    return 1;
+
+  chained->addTransformation(chained->getGridTransformation(0));
+  baked->addTransformation(baked->getGridTransformation(0));
+
+  // Bake on a 2mm lattice covering the grid
+  int griddim[3]; float gridspa[3],gridori[3];
+  chained->getGridTransformation(0)->getGridDimensions(griddim);
+  chained->getGridTransformation(0)->getGridSpacing(gridspa);
+  chained->getGridTransformation(0)->getGridOrigin(gridori);
+  int dim[3]; float spa[3]={ 2.0,2.0,2.0 };
+  for (int ia=0;ia<=2;ia++)
+    dim[ia]=int((gridori[ia]+(griddim[ia]-1)*gridspa[ia])/spa[ia])+1;
+
+  if (!baked->bakeGridTransformations(dim,spa,1) || !baked->hasValidBakedField())
+    return 1;
+
+  // At the lattice nodes the baked field is exact, in between it is trilinear
+  double maxnode=0.0,maxmid=0.0;
+  float x[3],y1[3],y2[3];
+  for (int k=0;k<dim[2]-1;k+=5)
+    for (int j=0;j<dim[1]-1;j+=5)
+      for (int i=0;i<dim[0]-1;i+=5)
+	{
+	  for (int pass=0;pass<=1;pass++)
+	    {
+	      x[0]=(i+0.5*pass)*spa[0];
+	      x[1]=(j+0.5*pass)*spa[1];
+	      x[2]=(k+0.5*pass)*spa[2];
+	      chained->transformPoint(x,y1);
+	      baked->transformPoint(x,y2);
+	      double d=0.0;
+	      for (int ia=0;ia<=2;ia++)
+		d+=pow(y1[ia]-y2[ia],2.0);
+	      d=sqrt(d);
+	      if (pass==0 && d>maxnode)
+		maxnode=d;
+	      else if (pass==1 && d>maxmid)
+		maxmid=d;
+	    }
+	}
+
+  int numfailed=0;
+  if (maxnode>0.001)
+    ++numfailed;
+  if (maxmid>0.05)
+    ++numfailed;
+
+  // Modifying a grid invalidates the baked field
+  std::shared_ptr<bisGridTransformation> grid=baked->getGridTransformation(0);
+  std::vector<float> params(grid->getNumberOfDOF());
+  grid->getParameterVector(params);
+  params[0]+=1.0f;
+  grid->setParameterVector(params);
+  if (baked->hasValidBakedField())
+    ++numfailed;
+
+  // So does a raw write through a pointer obtained before baking, once modified() is called.
+  // The re-baked field must follow the new displacements
+  std::shared_ptr<bisGridTransformation> cgrid=chained->getGridTransformation(0);
+  float* rawdata=grid->getData();
+  float* craw=cgrid->getData();
+  if (!baked->bakeGridTransformations(dim,spa,1) || !baked->hasValidBakedField())
+    return numfailed+1;
+  int np=grid->getNumberOfDOF();
+  for (int i=0;i<np;i++)
+    {
+      rawdata[i]=rawdata[i]*1.5f+0.5f;
+      craw[i]=rawdata[i];
+    }
+  grid->modified();
+  cgrid->modified();
+  if (baked->hasValidBakedField())
+    ++numfailed;
+
+  double maxrebaked=0.0;
+  if (!baked->bakeGridTransformations(dim,spa,1) || !baked->hasValidBakedField())
+    {
+      ++numfailed;
+    }
+  else
+    {
+      for (int k=0;k<dim[2];k+=5)
+	for (int j=0;j<dim[1];j+=5)
+	  for (int i=0;i<dim[0];i+=5)
+	    {
+	      x[0]=i*spa[0];  x[1]=j*spa[1];  x[2]=k*spa[2];
+	      chained->transformPoint(x,y1);
+	      baked->transformPoint(x,y2);
+	      double d=0.0;
+	      for (int ia=0;ia<=2;ia++)
+		d+=pow(y1[ia]-y2[ia],2.0);
+	      maxrebaked=std::max(maxrebaked,sqrt(d));
+	    }
+      if (maxrebaked>0.001)
+	++numfailed;
+    }
+
+  if (debug)
+    std::cout << "Baked vs chained: max error at nodes=" << maxnode << ", midpoints=" << maxmid << ", after raw write and re-bake=" << maxrebaked << ", numfailed=" << numfailed << std::endl;
+
+  return numfailed;
+}
+
+// Compares the displacements of two grids, returns the max abs difference (or 1e6 if the sizes differ)
+static double test_maxGridDifference(bisGridTransformation* a,bisGridTransformation* b)
+{
+  if (a->getNumberOfDOF()!=b->getNumberOfDOF())
+    return 1e6;
+  std::vector<float> pa(a->getNumberOfDOF()),pb(b->getNumberOfDOF());
+  a->getParameterVector(pa);
+  b->getParameterVector(pb);
+  double maxd=0.0;
+  for (unsigned int i=0;i<pa.size();i++)
+    maxd=std::max(maxd,double(fabs(pa[i]-pb[i])));
+  return maxd;
+}
+
+int test_compressedGridSerialization(int debug)
+{
+  int numfailed=0;
+  int dim[3]={ 10,9,8 };
+  float spa[3]={ 5.0,5.0,5.0 },ori[3]={ -2.0,-3.0,-4.0 };
+
+  // Mostly zero grid (small compressed size)
+  std::unique_ptr<bisGridTransformation> grid(new bisGridTransformation("grid"));
+  grid->initializeGrid(dim,spa,ori,1);
+  std::vector<float> params(grid->getNumberOfDOF(),0.0f);
+  for (unsigned int i=0;i<params.size();i+=37)
+    params[i]=0.25f*float(i%11)+0.5f;
+  grid->setParameterVector(params);
+
+  for (int mode=1;mode<=2;mode++)
+    {
+      grid->setSerializationMode(mode);
+      unsigned char* ptr=grid->serialize();
+      std::unique_ptr<bisGridTransformation> out(new bisGridTransformation("out"));
+      double d=1e6;
+      if (out->deSerialize(ptr))
+        d=test_maxGridDifference(grid.get(),out.get());
+      bisMemoryManagement::release_memory(ptr);
+      if (d>0.01)
+        ++numfailed;
+      if (debug)
+        std::cout << "Compressed grid mode=" << mode << " round trip max diff=" << d << std::endl;
+    }
+
+  // The counter tracks every path that changes (or hands out) the displacements
+  unsigned long count=grid->getModificationCount();
+  float* data=grid->getData();
+  unsigned long count_getdata=grid->getModificationCount();
+  grid->modified();
+  unsigned long count_modified=grid->getModificationCount();
+  unsigned char* ptr=grid->serialize();
+  grid->deSerialize(ptr);
+  bisMemoryManagement::release_memory(ptr);
+  unsigned long count_deserialize=grid->getModificationCount();
+  if (!(count<count_getdata && count_getdata<count_modified && count_modified<count_deserialize))
+    ++numfailed;
+
+  // A write through getData() after getRawSize (stale cached size) must not overrun the buffer
+  grid->setSerializationMode(2);
+  data=grid->getData();
+  BISLONG rawsize=grid->getRawSize();
+  for (int i=0;i<int(grid->getNumberOfDOF());i++)
+    data[i]=1.0f+0.001f*float(i);
+  const int guard=64;
+  std::vector<unsigned char> buffer(rawsize+guard,0xAB);
+  grid->serializeInPlace(&buffer[0]);
+  int overrun=0;
+  for (int i=0;i<guard;i++)
+    overrun+=(buffer[rawsize+i]!=0xAB);
+  std::unique_ptr<bisGridTransformation> stale(new bisGridTransformation("stale"));
+  int stale_ok=stale->deSerialize(&buffer[0]);
+  if (overrun>0 || stale_ok)
+    ++numfailed;
+
+  // After modified() the size is recomputed and the grid round trips
+  grid->modified();
+  ptr=grid->serialize();
+  std::unique_ptr<bisGridTransformation> fresh(new bisGridTransformation("fresh"));
+  double dfresh=1e6;
+  if (fresh->deSerialize(ptr))
+    dfresh=test_maxGridDifference(grid.get(),fresh.get());
+  bisMemoryManagement::release_memory(ptr);
+  if (dfresh>0.01)
+    ++numfailed;
+
+  // A grid read by the streaming .grd parser serializes (compressed) to the values it parsed
+  std::unique_ptr<bisComboTransformation> combo(new bisComboTransformation("combo"));
+  std::shared_ptr<bisGridTransformation> cgrid(new bisGridTransformation("cgrid"));
+  cgrid->initializeGrid(dim,spa,ori,1);
+  cgrid->setParameterVector(params);
+  combo->addTransformation(cgrid);
+  std::string text=combo->textSerialize();
+  std::unique_ptr<bisComboTransformation> parsed(new bisComboTransformation("parsed"));
+  double dparsed=1e6;
+  if (bisLegacyFileSupport::parseLegacyGridTransformationFile(text.c_str(),parsed.get(),0))
+    {
+      std::shared_ptr<bisGridTransformation> pgrid=parsed->getGridTransformation(0);
+      pgrid->setSerializationMode(1);
+      ptr=pgrid->serialize();
+      std::unique_ptr<bisGridTransformation> pout(new bisGridTransformation("pout"));
+      if (pout->deSerialize(ptr))
+        dparsed=test_maxGridDifference(cgrid.get(),pout.get());
+      bisMemoryManagement::release_memory(ptr);
+    }
+  if (dparsed>0.001)
+    ++numfailed;
+
+  if (debug)
+    std::cout << "Modification counts=" << count << "," << count_getdata << "," << count_modified << "," << count_deserialize
+              << " stale write: overrun bytes=" << overrun << " deserialized=" << stale_ok << ", after modified() diff=" << dfresh
+              << ", parsed .grd diff=" << dparsed << " numfailed=" << numfailed << std::endl;
+  return numfailed;
+}
+
+// Max difference between the displacement field computed by computeDisplacementField (with numthreads)
+// plus the row kernel over a partial row, and the displacement y-x given by transformPoint
+static double test_maxDisplacementFieldError(bisAbstractTransformation* xform,int dim[3],float spa[3],int numthreads)
+{
+  std::unique_ptr<bisSimpleImage<float> > field(xform->computeDisplacementField(dim,spa,numthreads));
+  float* data=field->getData();
+  BISLONG slicesize=BISLONG(dim[0])*BISLONG(dim[1]);
+  BISLONG volsize=slicesize*dim[2];
+
+  int imin=1,imax=dim[0]-2;
+  std::vector<float> row(3*dim[0],0.0f);
+  float* out[3] = { &row[0],&row[dim[0]],&row[2*dim[0]] };
+
+  double maxd=0.0;
+  float X[3],Y[3];
+  for (int k=0;k<dim[2];k++)
+    for (int j=0;j<dim[1];j++)
+      {
+        xform->computeDisplacementRow(spa,j,k,imin,imax,out);
+        BISLONG index=k*slicesize+BISLONG(j)*dim[0];
+        for (int i=0;i<dim[0];i++)
+          {
+            X[0]=i*spa[0]; X[1]=j*spa[1]; X[2]=k*spa[2];
+            xform->transformPoint(X,Y);
+            for (int ia=0;ia<=2;ia++)
+              {
+                double u=Y[ia]-X[ia];
+                maxd=std::max(maxd,double(fabs(data[index+ia*volsize]-u)));
+                if (i>=imin && i<=imax)
+                  maxd=std::max(maxd,double(fabs(out[ia][i-imin]-u)));
+              }
+            ++index;
+          }
+      }
+  return maxd;
+}
+
+int test_displacementFieldKernels(int debug)
+{
+  int numfailed=0;
+
+  // Smooth non-trivial displacements on a 3D and a single slice (2D) b-spline grid
+  float gspa[3]={ 10.0,12.0,9.0 },gori[3]={ -6.0,-4.0,-5.0 };
+  int gdim3[3]={ 8,7,6 },gdim2[3]={ 8,7,1 };
+  std::shared_ptr<bisGridTransformation> grids[2];
+  int* gdims[2]={ gdim3,gdim2 };
+  for (int g=0;g<=1;g++)
+    {
+      grids[g]=std::shared_ptr<bisGridTransformation>(new bisGridTransformation("grid"));
+      grids[g]->initializeGrid(gdims[g],gspa,gori,1);
+      std::vector<float> params(grids[g]->getNumberOfDOF());
+      for (unsigned int i=0;i<params.size();i++)
+        params[i]=3.0f*float(sin(0.37*i+g));
+      grids[g]->setParameterVector(params);
+    }
+
+  bisUtil::mat44 m;
+  float ang=0.1f;
+  for (int i=0;i<=3;i++)
+    for (int j=0;j<=3;j++)
+      m[i][j]=float(i==j);
+  m[0][0]=cos(ang); m[0][1]=-sin(ang); m[1][0]=sin(ang); m[1][1]=cos(ang);
+  m[0][3]=2.0f; m[1][3]=-3.0f; m[2][3]=1.5f;
+  std::unique_ptr<bisMatrixTransformation> matrix(new bisMatrixTransformation("matrix"));
+  matrix->setMatrix(m);
+
+  std::unique_ptr<bisComboTransformation> combo(new bisComboTransformation("combo"));
+  combo->setInitialTransformation(m);
+  combo->addTransformation(grids[0]);
+  std::shared_ptr<bisGridTransformation> second(new bisGridTransformation("second"));
+  second->initializeGrid(gdim3,gspa,gori,1);
+  std::vector<float> params(second->getNumberOfDOF());
+  for (unsigned int i=0;i<params.size();i++)
+    params[i]=2.0f*float(cos(0.21*i));
+  second->setParameterVector(params);
+  combo->addTransformation(second);
+
+  // The fields extend past the grids so the clamped boundary weights are exercised too
+  int dim3[3]={ 27,23,17 },dim2[3]={ 27,23,1 };
+  float spa[3]={ 3.0,3.5,3.5 };
+
+  const char* names[4]={ "grid3d","grid2d","combo","matrix" };
+  bisAbstractTransformation* xforms[4]={ grids[0].get(),grids[1].get(),combo.get(),matrix.get() };
+  int* dims[4]={ dim3,dim2,dim3,dim3 };
+
+  for (int t=0;t<=3;t++)
+    for (int numthreads=1;numthreads<=4;numthreads+=3)
+      {
+        double d=test_maxDisplacementFieldError(xforms[t],dims[t],spa,numthreads);
+        if (d>0.001)
+          ++numfailed;
+        if (debug)
+          std::cout << "Displacement field " << names[t] << " numthreads=" << numthreads << " max diff vs transformPoint=" << d << std::endl;
+      }
+
+  if (debug)
+    std::cout << "Displacement field kernels numfailed=" << numfailed << std::endl;
+  return numfailed;
+}
+
+// Per-voxel Jacobian from a full displacement field (the implementation before the slab kernel),
+// used as the reference in test_jacobianImage
+static bisSimpleImage<float>* test_referenceJacobian(bisAbstractTransformation* xform,int dim[3],float spa[3],int nonlinearonly)
+{
+  std::unique_ptr<bisSimpleImage<float> > field(xform->computeDisplacementField(dim,spa,1));
+  float* idata=field->getData();
+  int o_dim[5] = { dim[0],dim[1],dim[2],1,1 };
+  float o_spa[5] = { spa[0],spa[1],spa[2],1.0,1.0 };
+  bisSimpleImage<float>* out=new bisSimpleImage<float>("refjacobian");
+  out->allocate(o_dim,o_spa);
+  out->fill(0.0);
+  float* odata=out->getData();
+
+  BISLONG offsets[4]= { 1,dim[0],BISLONG(dim[0])*dim[1],BISLONG(dim[0])*dim[1]*dim[2] };
+  double sum=0.0;
+  int num=0;
+  for (int ka=1;ka<dim[2]-1;ka++)
+    for (int ja=1;ja<dim[1]-1;ja++)
+      for (int ia=1;ia<dim[0]-1;ia++)
+        {
+          BISLONG index=ka*offsets[2]+ja*offsets[1]+ia;
+          double m[3][3];
+          for (int comp=0;comp<=2;comp++)
+            {
+              float* c=&idata[index+comp*offsets[3]];
+              for (int axis=0;axis<=2;axis++)
+                m[comp][axis]=0.5*(c[offsets[axis]]-c[-offsets[axis]])/spa[axis];
+            }
+          // Determinant of I + the symmetric part of the displacement gradient
+          double r11=1.0+m[0][0],r22=1.0+m[1][1],r33=1.0+m[2][2];
+          double r12=0.5*(m[1][0]+m[0][1]),r13=0.5*(m[2][0]+m[0][2]),r23=0.5*(m[1][2]+m[2][1]);
+          double d=r11*(r22*r33-r23*r23)-r12*(r12*r33-r23*r13)+r13*(r12*r23-r22*r13);
+          odata[index]=float(d)-1.0f;
+          sum+=float(d);
+          num+=1;
+        }
+
+  float mean=0.0;
+  if (nonlinearonly && num>0)
+    mean=sum/float(num);
+  for (int ka=1;ka<dim[2]-1;ka++)
+    for (int ja=1;ja<dim[1]-1;ja++)
+      for (int ia=1;ia<dim[0]-1;ia++)
+        {
+          BISLONG index=ka*offsets[2]+ja*offsets[1]+ia;
+          odata[index]=100.0f*(odata[index]-mean);
+        }
+  return out;
+}
+
+int test_jacobianImage(int debug)
+{
+  int numfailed=0;
+
+  std::shared_ptr<bisGridTransformation> grid(new bisGridTransformation("grid"));
+  int gdim[3]={ 8,7,6 };
+  float gspa[3]={ 10.0,11.0,12.0 },gori[3]={ -5.0,-7.0,-3.0 };
+  grid->initializeGrid(gdim,gspa,gori,1);
+  std::vector<float> params(grid->getNumberOfDOF());
+  for (unsigned int i=0;i<params.size();i++)
+    params[i]=1.5f*float(sin(0.53*i));
+  grid->setParameterVector(params);
+
+  bisUtil::mat44 m;
+  for (int i=0;i<=3;i++)
+    for (int j=0;j<=3;j++)
+      m[i][j]=float(i==j)+float(i<3)*0.02f*float((i+2*j)%5);
+  std::unique_ptr<bisComboTransformation> combo(new bisComboTransformation("combo"));
+  combo->setInitialTransformation(m);
+  combo->addTransformation(grid);
+
+  // 13 slices -> 11 interior slices, uneven slabs for 3 and 4 threads; 4 slices -> fewer interior slices than threads
+  int dims[2][3]={ { 31,27,13 },{ 19,17,4 } };
+  float spa[3]={ 1.5,1.6,1.7 };
+  bisAbstractTransformation* xforms[2]={ grid.get(),combo.get() };
+  const char* names[2]={ "grid","combo" };
+  int threads[3]={ 1,3,4 };
+
+  for (int t=0;t<=1;t++)
+    {
+      unsigned char* xform_ptr=xforms[t]->serialize();
+      for (int d=0;d<=1;d++)
+        {
+          int odim[5]={ dims[d][0],dims[d][1],dims[d][2],1,1 };
+          float ospa[5]={ spa[0],spa[1],spa[2],1.0,1.0 };
+          std::unique_ptr<bisSimpleImage<short> > input(new bisSimpleImage<short>("input"));
+          input->allocate(odim,ospa);
+          unsigned char* input_ptr=input->serialize();
+
+          for (int nonlinearonly=0;nonlinearonly<=1;nonlinearonly++)
+            {
+              // For a combo nonlinearonly drops the linear part instead of removing the mean
+              std::unique_ptr<bisSimpleImage<float> > gold;
+              if (t==1 && nonlinearonly)
+                {
+                  bisUtil::mat44 identity;
+                  for (int i=0;i<=3;i++)
+                    for (int j=0;j<=3;j++)
+                      identity[i][j]=float(i==j);
+                  combo->setInitialTransformation(identity);
+                  gold.reset(test_referenceJacobian(combo.get(),dims[d],spa,0));
+                  combo->setInitialTransformation(m);
+                }
+              else
+                {
+                  gold.reset(test_referenceJacobian(xforms[t],dims[d],spa,nonlinearonly));
+                }
+
+              for (int th=0;th<=2;th++)
+                {
+                  std::stringstream json;
+                  json << "{ \"nonlinearonly\" : " << (nonlinearonly ? "true" : "false") << ", \"numthreads\" : " << threads[th] << " }";
+                  unsigned char* out_ptr=computeJacobianImageWASM(input_ptr,xform_ptr,json.str().c_str(),0);
+                  std::unique_ptr<bisSimpleImage<float> > output(new bisSimpleImage<float>("output"));
+                  double maxd=1e6;
+                  if (out_ptr!=0 && output->linkIntoPointer(out_ptr,1) && output->getLength()==gold->getLength())
+                    {
+                      maxd=0.0;
+                      float* g=gold->getData();
+                      float* o=output->getData();
+                      for (BISLONG i=0;i<gold->getLength();i++)
+                        maxd=std::max(maxd,double(fabs(g[i]-o[i])));
+                    }
+                  bisMemoryManagement::release_memory(out_ptr);
+                  if (maxd>0.01)
+                    ++numfailed;
+                  if (debug)
+                    std::cout << "Jacobian " << names[t] << " dim=" << dims[d][0] << "," << dims[d][1] << "," << dims[d][2]
+                              << " nonlinearonly=" << nonlinearonly << " numthreads=" << threads[th] << " max diff vs per-voxel=" << maxd << std::endl;
+                }
+            }
+          bisMemoryManagement::release_memory(input_ptr);
+        }
+      bisMemoryManagement::release_memory(xform_ptr);
+    }
+
+  if (debug)
+    std::cout << "Jacobian image numfailed=" << numfailed << std::endl;
+  return numfailed;
+}
+
+int test_poolMemory(int debug)
+{
+  int oldmode=bisMemoryManagement::poolMemory();
+  bisMemoryManagement::setPoolMemoryMode(1);
+  bisMemoryManagement::release_pool();
+
+  int numfailed=0;
+  const BISLONG sz=1024*1024;
+
+  // A released block is reused by the next allocation of a similar size
+  unsigned char* a=bisMemoryManagement::allocate_memory(sz,"pool_a","test");
+  bisMemoryManagement::release_memory(a,"test");
+  BISLONG cached=bisMemoryManagement::getPoolCachedBytes();
+  unsigned char* b=bisMemoryManagement::allocate_memory(sz-1000,"pool_b","test");
+  if (a!=b || cached<sz)
+    ++numfailed;
+  bisMemoryManagement::release_memory(b,"test");
+  bisMemoryManagement::release_pool();
+  if (bisMemoryManagement::getPoolCachedBytes()!=0)
+    ++numfailed;
+  if (debug)
+    std::cout << "Pool reuse=" << (a==b) << " cached=" << cached << ", after release=" << bisMemoryManagement::getPoolCachedBytes() << std::endl;
+
+#if !defined(BISWASM) || defined(__EMSCRIPTEN_PTHREADS__)
+  // The cache of another thread is emptied on its next allocation after release_pool
+  std::promise<void> filled,released,synchronized;
+  std::future<void> filled_f=filled.get_future(),released_f=released.get_future(),synchronized_f=synchronized.get_future();
+  std::thread worker([&]() {
+      bisMemoryManagement::release_memory(bisMemoryManagement::allocate_memory(sz,"pool_w","test"),"test");
+      filled.set_value();
+      released_f.wait();
+      bisMemoryManagement::release_memory(bisMemoryManagement::allocate_memory(16,"pool_s","test"),"test");
+      synchronized.set_value();
+    });
+
+  filled_f.wait();
+  BISLONG before=bisMemoryManagement::getPoolCachedBytes();
+  bisMemoryManagement::release_pool();
+  BISLONG stale=bisMemoryManagement::getPoolCachedBytes();
+  released.set_value();
+  synchronized_f.wait();
+  BISLONG after=bisMemoryManagement::getPoolCachedBytes();
+  worker.join();
+  if (before<sz || stale<sz || after!=0)
+    ++numfailed;
+  if (debug)
+    std::cout << "Thread cache: cached=" << before << ", after release_pool=" << stale << ", after next allocation=" << after << std::endl;
+#endif
+
+  bisMemoryManagement::setPoolMemoryMode(oldmode);
+  return numfailed;
+}
+
+int test_largeHeader(int debug)
+{
+  int numfailed=0;
+#ifndef BISWASM
+  // An image header (40 bytes) plus the 8 byte trailer, no data is allocated
+  unsigned char header[16+48];
+  memset(header,0,16+48);
+  int* begin_int=(int*)header;
+  begin_int[0]=bisDataTypes::s_image;
+  begin_int[1]=bisDataTypes::b_float32;
+  begin_int[2]=48;
+
+  BISLONG sizes[3] = { (BISLONG(1) << 31)+4, (BISLONG(1) << 33)+12, (BISLONG(3) << 40) };
+  for (int i=0;i<=2;i++)
+    {
+      int large_header=0;
+      bisSimpleDataUtil::setSerializedDataSize(header,sizes[i],1);
+      BISLONG out=bisSimpleDataUtil::getSerializedDataSize(header,large_header);
+      if (out!=sizes[i] || large_header!=1 || begin_int[3]!=bisDataTypes::s_datasize64)
+        ++numfailed;
+      if (debug)
+        std::cout << "64-bit header size=" << sizes[i] << " -> " << out << " large=" << large_header << std::endl;
+    }
+
+  // Legacy header, size computed from the dimensions (2^32 floats)
+  begin_int[2]=40;
+  begin_int[3]=-4;
+  int dims[5] = { 2048,2048,1024,1,1 };
+  for (int i=0;i<=4;i++)
+    begin_int[4+i]=dims[i];
+  int large_header=0;
+  BISLONG out=bisSimpleDataUtil::getSerializedDataSize(header,large_header);
+  if (out!=BISLONG(2048)*2048*1024*4 || large_header!=0)
+    ++numfailed;
+  if (debug)
+    std::cout << "Legacy header size=" << out << std::endl;
+
+  // A small image serialized in large memory mode uses the 64-bit header and round-trips
+  int oldmode=bisMemoryManagement::largeMemory();
+  bisMemoryManagement::setLargeMemoryMode(1);
+  int dim[5] = { 5,4,3,2,1 };
+  float spa[5] = { 1.0,1.5,2.0,1.0,1.0 };
+  std::unique_ptr<bisSimpleImage<short> > img(new bisSimpleImage<short>("large_header_img"));
+  img->allocate(dim,spa);
+  short* idata=img->getImageData();
+  for (int i=0;i<img->getLength();i++)
+    idata[i]=(short)(i*7-100);
+
+  std::unique_ptr<bisSimpleImage<short> > img2(new bisSimpleImage<short>("large_header_img2"));
+  if (!img->hasLargeHeader() || !img2->linkIntoPointer(img->getRawArray(),1) || img2->getLength()!=img->getLength())
+    {
+      ++numfailed;
+    }
+  else
+    {
+      short* odata=img2->getImageData();
+      int bad=0;
+      for (int i=0;i<img->getLength();i++)
+        if (odata[i]!=idata[i])
+          bad=1;
+      numfailed+=bad;
+    }
+  bisMemoryManagement::setLargeMemoryMode(oldmode);
+#endif
+  if (debug)
+    std::cout << "Large header numfailed=" << numfailed << std::endl;
+  return numfailed;
+}
+
+int test_memoryMappedImage(const char* filename,unsigned char* gold_ptr,int debug)
+{
+  std::unique_ptr<bisMemoryMappedImage> mapped(new bisMemoryMappedImage("mapped"));
+  if (!mapped->mapNIFTIFile(filename,debug))
+    {
+      std::cerr << "Failed to map " << filename << std::endl;
+      return 1;
+    }
+
+  unsigned char* mapped_ptr=mapped->getRawArray();
+  int* mapped_header=(int*)mapped_ptr;
+  int* gold_header=(int*)gold_ptr;
+
+  int numfailed=0;
+  if (mapped_header[0]!=bisDataTypes::s_image || mapped_header[1]!=gold_header[1])
+    ++numfailed;
+
+  // Dimensions and spacing (5 ints and 5 floats after the 16 byte header)
+  int* mapped_dim=(int*)(mapped_ptr+16);
+  int* gold_dim=(int*)(gold_ptr+16);
+  float* mapped_spa=(float*)(mapped_ptr+36);
+  float* gold_spa=(float*)(gold_ptr+36);
+  for (int ia=0;ia<=4;ia++)
+    {
+      if (mapped_dim[ia]!=gold_dim[ia])
+        ++numfailed;
+      if (ia<=2 && fabs(mapped_spa[ia]-gold_spa[ia])>0.0001)
+        ++numfailed;
+    }
+
+  // The voxel data must be bitwise identical
+  int large_header=0;
+  BISLONG mapped_size=bisSimpleDataUtil::getSerializedDataSize(mapped_ptr,large_header);
+  BISLONG gold_size=bisSimpleDataUtil::getSerializedDataSize(gold_ptr,large_header);
+  if (mapped_size!=gold_size || mapped_size<1)
+    ++numfailed;
+  else if (memcmp(mapped_ptr+16+mapped_header[2],gold_ptr+16+gold_header[2],mapped_size)!=0)
+    ++numfailed;
+
+  if (debug)
+    {
+      std::cout << "Mapped " << filename << " dim=" << mapped_dim[0] << "," << mapped_dim[1] << "," << mapped_dim[2] << "," << mapped_dim[3];
+      std::cout << " type=" << mapped_header[1] << " size=" << mapped_size << " (gold=" << gold_size << ") numfailed=" << numfailed << std::endl;
+    }
+  return numfailed;
+}
+
+static double test_maxImageDifference(bisSimpleImage<float>* a,bisSimpleImage<float>* b)
+{
+  if (a->getLength()!=b->getLength())
+    return 1e+9;
+  float* adata=a->getData();
+  float* bdata=b->getData();
+  double maxdiff=0.0;
+  for (BISLONG i=0;i<a->getLength();i++)
+    {
+      double d=fabs(adata[i]-bdata[i]);
+      if (d>maxdiff)
+        maxdiff=d;
+    }
+  return maxdiff;
+}
+
+int test_imageStreams(int debug)
+{
+  // Odd sizes so that chunks of 3 frames and of 100/1000 voxels do not divide the image
+  int dim[5]={ 13,11,9,7,1 };
+  float spa[5]={ 1.5,2.0,2.5,1.0,1.0 };
+  std::unique_ptr<bisSimpleImage<float> > input(new bisSimpleImage<float>("input"));
+  input->allocate(dim,spa);
+  float* idata=input->getData();
+  for (BISLONG i=0;i<input->getLength();i++)
+    idata[i]=float((i*37)%251)+10.0f*sin(0.01f*float(i));
+
+  int numfailed=0;
+  int chunks[3]={ 1,3,dim[3] };
+
+  // Smoothing
+  float sigmas[3]={ 2.0,1.5,1.0 },outsigmas[3];
+  std::unique_ptr<bisSimpleImage<float> > smooth_gold(new bisSimpleImage<float>("smooth_gold"));
+  smooth_gold->copyStructure(input.get());
+  bisImageAlgorithms::gaussianSmoothImage(input.get(),smooth_gold.get(),sigmas,outsigmas,1,1.5,0);
+
+  for (int c=0;c<=2;c++)
+    {
+      std::unique_ptr<bisSimpleImage<float> > output(new bisSimpleImage<float>("smooth"));
+      output->copyStructure(input.get());
+      bisMemoryImageStream<float> instream(input.get()),outstream(output.get());
+      int ok=bisImageAlgorithms::gaussianSmoothImage(&instream,&outstream,sigmas,outsigmas,1,1.5,0,chunks[c]);
+      double diff=test_maxImageDifference(output.get(),smooth_gold.get());
+      if (!ok || diff>1e-4)
+        ++numfailed;
+      if (debug)
+        std::cout << "Stream smooth framesperchunk=" << chunks[c] << " ok=" << ok << " maxdiff=" << diff << std::endl;
+    }
+
+  // Reslicing to a different grid with a linear transformation
+  std::unique_ptr<bisLinearTransformation> xform(new bisLinearTransformation("xform"));
+  std::vector<float> p={ 1.5,-2.0,1.0,4.0,3.0,-2.0,1.0,1.0,1.0,0.0,0.0,0.0 };
+  xform->setParameterVector(p,1);
+  int odim[5]={ 10,12,8,dim[3],1 };
+  float ospa[5]={ 1.7,1.3,2.2,1.0,1.0 };
+  for (int interp=0;interp<=3;interp+=3)
+    {
+      std::unique_ptr<bisSimpleImage<float> > reslice_gold(new bisSimpleImage<float>("reslice_gold"));
+      reslice_gold->allocate(odim,ospa);
+      bisImageAlgorithms::resliceImage(input.get(),reslice_gold.get(),xform.get(),interp,0.0);
+      for (int c=0;c<=2;c++)
+        {
+          std::unique_ptr<bisSimpleImage<float> > output(new bisSimpleImage<float>("reslice"));
+          output->allocate(odim,ospa);
+          bisMemoryImageStream<float> instream(input.get()),outstream(output.get());
+          int ok=bisImageAlgorithms::resliceImage(&instream,&outstream,xform.get(),interp,0.0,chunks[c]);
+          double diff=test_maxImageDifference(output.get(),reslice_gold.get());
+          if (!ok || diff>1e-4)
+            ++numfailed;
+          if (debug)
+            std::cout << "Stream reslice interp=" << interp << " framesperchunk=" << chunks[c] << " ok=" << ok << " maxdiff=" << diff << std::endl;
+        }
+    }
+
+  // GLM with 1 drift + 2 task regressors
+  std::unique_ptr<bisSimpleMatrix<float> > regressors(new bisSimpleMatrix<float>("regressors"));
+  regressors->allocate(dim[3],3);
+  float* rdata=regressors->getData();
+  for (int t=0;t<dim[3];t++)
+    {
+      rdata[t*3]=1.0;
+      rdata[t*3+1]=sin(0.9f*float(t));
+      rdata[t*3+2]=float(t%3)-1.0f;
+    }
+  std::unique_ptr<bisSimpleImage<float> > glm_gold(bisfMRIAlgorithms::computeGLM(input.get(),0,regressors.get(),2));
+  BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
+  BISLONG voxelchunks[3]={ 100,1000,volsize };
+  int gdim[5]={ dim[0],dim[1],dim[2],2,1 };
+  for (int c=0;c<=2;c++)
+    {
+      std::unique_ptr<bisSimpleImage<float> > output(new bisSimpleImage<float>("glm"));
+      output->allocate(gdim,spa);
+      bisMemoryImageStream<float> instream(input.get()),outstream(output.get());
+      int ok=bisfMRIAlgorithms::computeGLM(&instream,0,regressors.get(),2,&outstream,voxelchunks[c]);
+      double diff=test_maxImageDifference(output.get(),glm_gold.get());
+      if (!ok || diff>1e-3)
+        ++numfailed;
+      if (debug)
+        std::cout << "Stream GLM voxelsperchunk=" << voxelchunks[c] << " ok=" << ok << " maxdiff=" << diff << std::endl;
+    }
+
+  return numfailed;
+}
+
+// Compares two CSR matrices row by row (entries sorted by column as the producers may order rows differently)
+static int test_compareSparseMatrices(bisSparseMatrix* a,bisSparseMatrix* b,double& maxdiff)
+{
+  maxdiff=0.0;
+  if (a->getNumRows()!=b->getNumRows() || a->getNumNonZero()!=b->getNumNonZero() || a->getNumComponents()!=b->getNumComponents())
+    return 1;
+
+  int* arows=a->getRowPointers();
+  int* brows=b->getRowPointers();
+  int nc=a->getNumComponents();
+  int nerr=0;
+  for (int r=0;r<a->getNumRows();r++)
+    {
+      if (arows[r]!=brows[r] || arows[r+1]!=brows[r+1])
+        return 1;
+      std::vector<std::pair<int,int> > aent,bent;
+      for (int e=arows[r];e<arows[r+1];e++)
+        {
+          aent.push_back(std::pair<int,int>(a->getColumnIndices()[e],e));
+          bent.push_back(std::pair<int,int>(b->getColumnIndices()[e],e));
+        }
+      std::sort(aent.begin(),aent.end());
+      std::sort(bent.begin(),bent.end());
+      for (size_t i=0;i<aent.size();i++)
+        {
+          if (aent[i].first!=bent[i].first)
+            ++nerr;
+          for (int c=0;c<nc;c++)
+            {
+              double d=fabs(a->getValues(c)[aent[i].second]-b->getValues(c)[bent[i].second]);
+              if (d>maxdiff)
+                maxdiff=d;
+            }
+        }
+    }
+  return nerr;
+}
+
+// Runs a distance matrix function with csr=false and csr=true and compares the outputs
+static int test_distanceMatrixCSR(unsigned char* image_ptr,unsigned char* objectmap_ptr,std::string jsonstring,int indexoffset,int debug)
+{
+  std::string csrstring=jsonstring.substr(0,jsonstring.size()-1)+", \"csr\" : true }";
+  unsigned char* coo_ptr=0;
+  unsigned char* csr_ptr=0;
+  if (objectmap_ptr)
+    {
+      coo_ptr=computeImageDistanceMatrixWASM(image_ptr,objectmap_ptr,jsonstring.c_str(),0);
+      csr_ptr=computeImageDistanceMatrixWASM(image_ptr,objectmap_ptr,csrstring.c_str(),0);
+    }
+  else
+    {
+      coo_ptr=computeTemporalImageDistanceMatrixWASM(image_ptr,jsonstring.c_str(),0);
+      csr_ptr=computeTemporalImageDistanceMatrixWASM(image_ptr,csrstring.c_str(),0);
+    }
+
+  if (coo_ptr==0 || csr_ptr==0)
+    {
+      std::cerr << "Failed to compute distance matrix " << jsonstring << std::endl;
+      return 1;
+    }
+
+  std::unique_ptr<bisSimpleMatrix<double> > coo(new bisSimpleMatrix<double>("coo"));
+  std::unique_ptr<bisSparseMatrix> csr(new bisSparseMatrix("csr"));
+  std::unique_ptr<bisSparseMatrix> imported(new bisSparseMatrix("imported"));
+  int numfailed=0;
+  if (!coo->deSerialize(coo_ptr) || !csr->deSerialize(csr_ptr))
+    numfailed=1;
+  bisMemoryManagement::release_memory(coo_ptr);
+  bisMemoryManagement::release_memory(csr_ptr);
+  if (numfailed)
+    return 1;
+
+  if (!imported->importCOO(coo.get(),csr->getNumRows(),indexoffset))
+    return 1;
+
+  double maxdiff=0.0;
+  int nerr=test_compareSparseMatrices(imported.get(),csr.get(),maxdiff);
+  if (nerr>0 || maxdiff>1e-4)
+    numfailed=1;
+  if (debug)
+    std::cout << "CSR vs COO " << jsonstring << " rows=" << csr->getNumRows() << " entries=" << csr->getNumNonZero()
+              << " (coo=" << coo->getNumRows() << ") bad columns=" << nerr << " maxdiff=" << maxdiff << std::endl;
+  return numfailed;
+}
+
+int test_sparseMatrix(int debug)
+{
+  int numfailed=0;
+
+  // Small hand made matrix with 2 components (1-offset indices as in the index map), diagonal not first in row 2
+  double entries[9][4]={ { 1,1,0.0,0.0 }, { 1,2,1.5,2.0 }, { 1,3,2.5,4.0 },
+                         { 2,1,1.5,2.0 }, { 2,2,0.0,0.0 }, { 2,4,0.5,1.0 },
+                         { 3,1,2.5,4.0 },
+                         { 4,2,0.5,1.0 }, { 4,4,0.0,0.0 } };
+  std::unique_ptr<bisSimpleMatrix<double> > coo(new bisSimpleMatrix<double>("coo"));
+  coo->zero(9,4);
+  for (int i=0;i<9;i++)
+    for (int j=0;j<4;j++)
+      coo->getData()[i*4+j]=entries[i][j];
+
+  std::unique_ptr<bisSparseMatrix> matrix(new bisSparseMatrix("matrix"));
+  if (!matrix->importCOO(coo.get(),4,1))
+    return 1;
+
+  int gold_rows[5]={ 0,3,6,7,9 };
+  int gold_cols[9]={ 0,1,2, 1,0,3, 0, 3,1 };
+  for (int i=0;i<=4;i++)
+    if (matrix->getRowPointers()[i]!=gold_rows[i])
+      ++numfailed;
+  for (int i=0;i<9;i++)
+    if (matrix->getColumnIndices()[i]!=gold_cols[i])
+      ++numfailed;
+  if (matrix->getNumComponents()!=2 || fabs(matrix->getValues(1)[5]-1.0)>1e-6)
+    ++numfailed;
+  if (debug)
+    std::cout << "Import COO numfailed=" << numfailed << std::endl;
+
+  // Export and import again must give the same bytes
+  std::unique_ptr<bisSimpleMatrix<double> > exported(new bisSimpleMatrix<double>("exported"));
+  std::unique_ptr<bisSparseMatrix> reimported(new bisSparseMatrix("reimported"));
+  matrix->exportCOO(exported.get(),1);
+  if (!reimported->importCOO(exported.get(),4,1) || reimported->getRawSize()!=matrix->getRawSize())
+    ++numfailed;
+  else
+    {
+      std::unique_ptr<unsigned char[]> a(new unsigned char[matrix->getRawSize()]);
+      std::unique_ptr<unsigned char[]> b(new unsigned char[matrix->getRawSize()]);
+      matrix->serializeInPlace(a.get());
+      reimported->serializeInPlace(b.get());
+      if (memcmp(a.get(),b.get(),matrix->getRawSize())!=0)
+        ++numfailed;
+    }
+
+  // Serialize, deSerialize (copy) and linkIntoPointer (in place)
+  BISLONG rawsize=matrix->getRawSize();
+  std::unique_ptr<unsigned char[]> buffer(new unsigned char[rawsize]);
+  matrix->serializeInPlace(buffer.get());
+  std::unique_ptr<bisSparseMatrix> copied(new bisSparseMatrix("copied"));
+  std::unique_ptr<bisSparseMatrix> linked(new bisSparseMatrix("linked"));
+  double maxdiff=0.0;
+  if (!copied->deSerialize(buffer.get()) || test_compareSparseMatrices(copied.get(),matrix.get(),maxdiff)>0 || maxdiff>0.0)
+    ++numfailed;
+  if (!linked->linkIntoPointer(buffer.get()) || (unsigned char*)linked->getRowPointers()!=buffer.get()+32 ||
+      test_compareSparseMatrices(linked.get(),matrix.get(),maxdiff)>0 || maxdiff>0.0)
+    ++numfailed;
+
+  // A dense matrix must be rejected
+  std::unique_ptr<bisSparseMatrix> bad(new bisSparseMatrix("bad"));
+  if (bad->deSerialize(coo->getRawArray()))
+    ++numfailed;
+  if (debug)
+    std::cout << "Serialization numfailed=" << numfailed << std::endl;
+
+  // Distance matrices computed directly as CSR vs converted from COO
+  int dim[5]={ 9,8,7,6,1 };
+  float spa[5]={ 2.0,2.0,2.0,1.0,1.0 };
+  std::unique_ptr<bisSimpleImage<float> > image(new bisSimpleImage<float>("image"));
+  image->allocate(dim,spa);
+  for (BISLONG i=0;i<image->getLength();i++)
+    image->getData()[i]=float((i*7919)%1013)*0.1f;
+  int odim[5]={ 9,8,7,1,1 };
+  std::unique_ptr<bisSimpleImage<short> > objectmap(new bisSimpleImage<short>("objectmap"));
+  objectmap->allocate(odim,spa);
+  for (BISLONG i=0;i<objectmap->getLength();i++)
+    objectmap->getData()[i]= (i%5==0) ? 0 : 1;
+
+  numfailed+=test_distanceMatrixCSR(image->getRawArray(),objectmap->getRawArray(),"{ \"useradius\" : true, \"radius\" : 4.0, \"numthreads\" : 2 }",1,debug);
+  numfailed+=test_distanceMatrixCSR(image->getRawArray(),objectmap->getRawArray(),"{ \"useradius\" : false, \"sparsity\" : 0.1, \"knn\" : 0, \"numthreads\" : 2 }",1,debug);
+  numfailed+=test_distanceMatrixCSR(image->getRawArray(),objectmap->getRawArray(),"{ \"useradius\" : false, \"sparsity\" : 0.1, \"knn\" : 1, \"numthreads\" : 2 }",1,debug);
+
+  // Temporal matrices (frames x frames), of a time series and of the patch offsets of a 3D image
+  int tdim[5]={ 5,4,3,40,1 };
+  std::unique_ptr<bisSimpleImage<float> > timeseries(new bisSimpleImage<float>("timeseries"));
+  timeseries->allocate(tdim,spa);
+  for (BISLONG i=0;i<timeseries->getLength();i++)
+    timeseries->getData()[i]=float((i*7919)%1013)*0.1f;
+  std::unique_ptr<bisSimpleImage<float> > image3d(new bisSimpleImage<float>("image3d"));
+  image3d->allocate(odim,spa);
+  for (BISLONG i=0;i<image3d->getLength();i++)
+    image3d->getData()[i]=float((i*7919)%1013)*0.1f;
+
+  numfailed+=test_distanceMatrixCSR(timeseries->getRawArray(),0,"{ \"sparsity\" : 0.2, \"numthreads\" : 2 }",0,debug);
+  numfailed+=test_distanceMatrixCSR(image3d->getRawArray(),0,"{ \"sparsity\" : 0.2, \"numthreads\" : 2, \"patchradius\" : 1 }",0,debug);
+
+  return numfailed;
+}
+
+// Imports a serialized temporal COO distance matrix (0-offset indices) into a CSR matrix and releases it
+static int test_importTemporalMatrix(unsigned char* ptr,bisSparseMatrix* output)
+{
+  if (ptr==0)
+    return 0;
+  std::unique_ptr<bisSimpleMatrix<double> > coo(new bisSimpleMatrix<double>("coo"));
+  int ok=coo->deSerialize(ptr);
+  bisMemoryManagement::release_memory(ptr);
+  if (!ok || coo->getNumRows()<1)
+    return 0;
+
+  int numrows=0;
+  for (int i=0;i<coo->getNumRows();i++)
+    numrows=std::max(numrows,int(coo->getData()[i*3])+1);
+  return output->importCOO(coo.get(),numrows,0);
+}
+
+// Compares the temporal distance matrices of two images (or parameter sets), returns 1 if they differ
+static int test_compareTemporalMatrices(unsigned char* image1_ptr,std::string json1,unsigned char* image2_ptr,std::string json2,
+                                        std::string name,int debug)
+{
+  std::unique_ptr<bisSparseMatrix> m1(new bisSparseMatrix("m1"));
+  std::unique_ptr<bisSparseMatrix> m2(new bisSparseMatrix("m2"));
+  if (!test_importTemporalMatrix(computeTemporalImageDistanceMatrixWASM(image1_ptr,json1.c_str(),0),m1.get()) ||
+      !test_importTemporalMatrix(computeTemporalImageDistanceMatrixWASM(image2_ptr,json2.c_str(),0),m2.get()))
+    {
+      std::cerr << "Failed to compute temporal distance matrix " << name << std::endl;
+      return 1;
+    }
+
+  double maxdiff=0.0;
+  int nerr=0;
+  if (m1->getNumRows()!=m2->getNumRows() || m1->getNumNonZero()!=m2->getNumNonZero())
+    nerr=1;
+  else
+    nerr=test_compareSparseMatrices(m1.get(),m2.get(),maxdiff);
+  int failed=(nerr>0 || maxdiff>1e-4);
+  if (debug || failed)
+    std::cout << name << " rows=" << m1->getNumRows() << "," << m2->getNumRows() << " entries=" << m1->getNumNonZero() << ","
+              << m2->getNumNonZero() << " bad columns=" << nerr << " maxdiff=" << maxdiff << std::endl;
+  return failed;
+}
+
+int test_patchDistanceMatrix(int debug)
+{
+  int numfailed=0;
+  int dim[5]={ 9,8,7,1,1 };
+  float spa[5]={ 2.0,2.0,2.0,1.0,1.0 };
+  std::unique_ptr<bisSimpleImage<float> > image(new bisSimpleImage<float>("image3d"));
+  image->allocate(dim,spa);
+  for (BISLONG i=0;i<image->getLength();i++)
+    image->getData()[i]=float((i*7919)%1013)*0.1f;
+
+  // patchradius=2 (125 frames) against the temporal matrix of the stored reformatted image
+  for (int increment=1;increment<=2;increment++)
+    {
+      std::stringstream reformat;
+      reformat << "{ \"radius\" : 2, \"increment\" : " << increment << ", \"numthreads\" : 2 }";
+      unsigned char* reformatted=createPatchReformatedImage(image->getRawArray(),reformat.str().c_str(),0);
+      if (reformatted==0)
+        {
+          std::cerr << "Failed to create patch reformatted image " << reformat.str() << std::endl;
+          numfailed++;
+          continue;
+        }
+      std::stringstream patch;
+      patch << "{ \"sparsity\" : 0.2, \"numthreads\" : 2, \"patchradius\" : 2, \"increment\" : " << increment << " }";
+      numfailed+=test_compareTemporalMatrices(image->getRawArray(),patch.str(),
+                                              reformatted,"{ \"sparsity\" : 0.2, \"numthreads\" : 2 }",
+                                              "patch view vs reformatted image "+reformat.str(),debug);
+      bisMemoryManagement::release_memory(reformatted);
+    }
+
+  // Long series: with one thread the frame sums are done in several chunks, with 4 threads in one
+  int tdim[5]={ 2,2,2,3000,1 };
+  std::unique_ptr<bisSimpleImage<float> > timeseries(new bisSimpleImage<float>("timeseries"));
+  timeseries->allocate(tdim,spa);
+  for (BISLONG i=0;i<timeseries->getLength();i++)
+    timeseries->getData()[i]=float((i*7919)%1013)*0.1f;
+  numfailed+=test_compareTemporalMatrices(timeseries->getRawArray(),"{ \"sparsity\" : 0.01, \"numthreads\" : 1 }",
+                                          timeseries->getRawArray(),"{ \"sparsity\" : 0.01, \"numthreads\" : 4 }",
+                                          "3000 frames 1 vs 4 threads",debug);
+  return numfailed;
+}
+
+// Exact median (same index as estimateMedianDistance) of dist+lambda*euclid
+template<class V> static float test_exactMedian(const V* dist,const V* euclid,double lambda,BISLONG n)
+{
+  std::vector<float> values(n);
+  for (BISLONG i=0;i<n;i++)
+    values[i]=dist[i]+lambda*euclid[i];
+  std::nth_element(values.begin(),values.begin()+n/2,values.end());
+  return values[n/2];
+}
+
+int test_medianSampling(int debug)
+{
+  int numfailed=0;
+
+  // Rows of length 4 whose first entry is much smaller than the rest (e.g. the diagonal): every 4th entry
+  // would only see the first entries, the exact median is in the upper band [1,2)
+  BISLONG n=BISLONG(3)*1048576+17;
+  std::vector<float> dist(n),euclid(n);
+  std::vector<double> ddist(n),deuclid(n);
+  for (BISLONG i=0;i<n;i++)
+    {
+      dist[i]=float((i%4==0) ? 0.0 : 1.0)+float((i*7919)%100003)/100003.0f;
+      euclid[i]=float((i*104729)%1009)/1009.0f;
+      ddist[i]=dist[i];
+      deuclid[i]=euclid[i];
+    }
+
+  for (int pass=0;pass<=1;pass++)
+    {
+      double lambda=0.5*pass;
+      float exact=test_exactMedian(&dist[0],&euclid[0],lambda,n);
+      float sampled=bisImageDistanceMatrix::estimateMedianDistance(&dist[0],&euclid[0],lambda,n,1048576);
+      float dsampled=bisImageDistanceMatrix::estimateMedianDistance(&ddist[0],&deuclid[0],lambda,n,1048576);
+      float small=bisImageDistanceMatrix::estimateMedianDistance(&dist[0],&euclid[0],lambda,BISLONG(100001),1048576);
+      float smallexact=test_exactMedian(&dist[0],&euclid[0],lambda,BISLONG(100001));
+
+      int ok=(fabs(sampled-exact)<0.01 && fabs(dsampled-exact)<0.01 && small==smallexact);
+      if (debug || !ok)
+        std::cout << "..... median lambda=" << lambda << " exact=" << exact << " sampled=" << sampled << " (double=" << dsampled
+                  << ") n=" << n << ", exact=" << smallexact << " vs " << small << " n=100001 ok=" << ok << std::endl;
+      if (!ok)
+        numfailed++;
+    }
+
+  return numfailed;
+}
+
 int test_PTZConversions(int debug)
 {
   // As computed in vtkpxMath
@@ -96,6 +96,100 @@ extern "C" {
   // BIS: { 'test_bendingEnergy', 'Int', [ 'bisComboTransformation','debug'] } 
   BISEXPORT int test_bendingEnergy(unsigned char* ptr,int debug);
 
+  /** Tests that a combo transformation with a baked grid field (bakeGridTransformations)
+   * maps points like the full grid chain. The grid of the input is added a second time to form a chain.
+   * Also checks that setParameterVector and a raw write through getData() (plus modified()) invalidate the bake.
+   * @param ptr serialized Combo Transformation with 1 grid
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_bakedComboTransformation', 'Int', [ 'bisComboTransformation','debug'] } 
+  BISEXPORT int test_bakedComboTransformation(unsigned char* ptr,int debug);
+
+  /** Tests the compressed grid serialization (modes 1 and 2), that the modification count tracks getData, deSerialize
+   * and the .grd parser and that a write through getData() after getRawSize does not overrun the serialization buffer
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_compressedGridSerialization', 'Int', [ 'debug'] } 
+  BISEXPORT int test_compressedGridSerialization(int debug);
+
+  /** Tests the computeDisplacementRow kernels and the threaded computeDisplacementField (1 and 4 threads)
+   * against transformPoint for 3D and single slice b-spline grids, a combo and a matrix transformation
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_displacementFieldKernels', 'Int', [ 'debug'] } 
+  BISEXPORT int test_displacementFieldKernels(int debug);
+
+  /** Tests computeJacobianImageWASM (slab kernel with a rolling window of displacement slices) against a per-voxel
+   * Jacobian computed from the full displacement field, for a grid and a combo, with and without nonlinearonly,
+   * with 1, 3 and 4 threads, including uneven slabs and fewer interior slices than threads
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_jacobianImage', 'Int', [ 'debug'] } 
+  BISEXPORT int test_jacobianImage(int debug);
+
+  /** Tests the pooled allocator (block reuse and release_pool, including the caches of other threads)
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_poolMemory', 'Int', [ 'debug'] } 
+  BISEXPORT int test_poolMemory(int debug);
+
+  /** Tests the 64-bit serialization header: data sizes over 2^31 bytes round-trip through the header,
+   * the legacy -sizeof(T) header and an image serialized in large memory mode (native only, 0 in WASM)
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_largeHeader', 'Int', [ 'debug'] } 
+  BISEXPORT int test_largeHeader(int debug);
+
+  /** Tests bisMemoryMappedImage: maps an uncompressed .nii file (NIFTI-1 or NIFTI-2) and compares it
+   * with the same file read by the normal loader (native only, memory mapping is not available in WASM)
+   * @param filename the .nii file to map
+   * @param gold_ptr the serialized image loaded from the same file
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_memoryMappedImage', 'Int', [ 'String', 'bisImage', 'debug'] } 
+  BISEXPORT int test_memoryMappedImage(const char* filename,unsigned char* gold_ptr,int debug);
+
+  /** Tests the streaming versions of gaussianSmoothImage, resliceImage and computeGLM (via bisMemoryImageStream)
+   * against the in-memory versions, using chunk sizes that do and do not divide the number of frames/voxels
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_imageStreams', 'Int', [ 'debug'] } 
+  BISEXPORT int test_imageStreams(int debug);
+
+  /** Tests bisSparseMatrix: serialization (deSerialize, linkIntoPointer), COO import/export round trip and that
+   * the csr=true outputs of computeImageDistanceMatrixWASM (radius, all pairs, k-NN) and
+   * computeTemporalImageDistanceMatrixWASM match their COO outputs
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_sparseMatrix', 'Int', [ 'debug'] } 
+  BISEXPORT int test_sparseMatrix(int debug);
+
+  /** Tests the patch view temporal distance matrix (patchradius=2, increment 1 and 2) against the temporal matrix of
+   * the output of createPatchReformatedImage and that a long series (frame sums done in chunks) does not depend on
+   * the number of threads
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_patchDistanceMatrix', 'Int', [ 'debug'] } 
+  BISEXPORT int test_patchDistanceMatrix(int debug);
+
+  /** Tests bisImageDistanceMatrix::estimateMedianDistance (the median used to scale the eigenvector affinity weights)
+   * against the exact median on an array of more than 2^20 entries (sampled) and on a smaller one (exact)
+   * @param debug if > 0 print debug messages
+   * @returns num failed tests
+   */
+  // BIS: { 'test_medianSampling', 'Int', [ 'debug'] } 
+  BISEXPORT int test_medianSampling(int debug);
+
   /** Tests PTZ Conversions i.e. p->t, t->p p->z, z->p
    * @param debug if > 0 print debug messages
    * @returns num failed tests
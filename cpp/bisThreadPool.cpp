@@ -0,0 +1,313 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+#include "bisThreadPool.h"
+#include <iostream>
+#include <vector>
+#include <memory>
+
+#if defined(BISWASM) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define BIS_THREADPOOL_SERIAL 1
+#endif
+
+#ifndef BIS_THREADPOOL_SERIAL
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+namespace bisThreadPool {
+
+  const int MAX_THREADS=256;
+
+#ifdef BIS_THREADPOOL_SERIAL
+
+  int setNumberOfThreads(int ) { return 1; }
+
+  int getNumberOfThreads() { return 1; }
+
+  void parallelFor(BISLONG begin,BISLONG end,BISLONG ,const bisRangeFunction& fn,int )
+  {
+    if (end>begin)
+      fn(begin,end,0);
+  }
+
+#else
+
+  // ------------------------------------------------------------------------------------------
+  // Each thread owns a range of chunk indices [next,end). The owner takes chunks from the front,
+  // thieves take the back half.
+  // ------------------------------------------------------------------------------------------
+  class bisChunkRange {
+  public:
+    std::mutex lock;
+    BISLONG next;
+    BISLONG end;
+
+    /** Takes the next chunk, returns -1 if empty */
+    BISLONG pop() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (this->next>=this->end)
+        return -1;
+      return this->next++;
+    }
+
+    /** Takes the back half of the remaining chunks into [b,e), returns 0 if empty */
+    int steal(BISLONG& b,BISLONG& e) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      BISLONG remaining=this->end-this->next;
+      if (remaining<1)
+        return 0;
+      BISLONG mid=this->next+remaining/2;
+      b=mid;
+      e=this->end;
+      this->end=mid;
+      return 1;
+    }
+
+    void set(BISLONG b,BISLONG e) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->next=b;
+      this->end=e;
+    }
+  };
+
+  class bisPool {
+  public:
+    std::vector<std::thread> workers;
+    std::unique_ptr<bisChunkRange[]> ranges;
+    int numthreads;
+
+    // Dispatch state (guarded by mutex)
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    long generation;
+    int active;
+    int stopping;
+
+    // The current job
+    const bisRangeFunction* fn;
+    BISLONG begin,end,grain,numchunks;
+    int jobthreads;
+
+    bisPool(int n);
+    ~bisPool();
+    void workerLoop(int thread);
+    void runChunks(int thread);
+    void run(BISLONG b,BISLONG e,BISLONG g,const bisRangeFunction& f,int nt);
+  };
+
+  // Index of the pool thread running the current code, -1 outside the pool
+  static thread_local int current_thread=-1;
+
+  // Serializes parallelFor calls from different external threads and changes to the pool size
+  static std::mutex pool_mutex;
+  static bisPool* global_pool=0;
+
+  // The size of the pool (0 = not set yet), readable without the lock (e.g. from inside a parallelFor body)
+  static std::atomic<int> pool_size(0);
+
+  bisPool::bisPool(int n) {
+    this->numthreads=n;
+    this->ranges.reset(new bisChunkRange[n]);
+    this->generation=0;
+    this->active=0;
+    this->stopping=0;
+    this->fn=0;
+    this->begin=this->end=this->grain=this->numchunks=0;
+    this->jobthreads=0;
+    for (int i=1;i<n;i++)
+      this->workers.push_back(std::thread(&bisPool::workerLoop,this,i));
+  }
+
+  bisPool::~bisPool() {
+    {
+      std::lock_guard<std::mutex> guard(this->mutex);
+      this->stopping=1;
+    }
+    this->wake.notify_all();
+    for (size_t i=0;i<this->workers.size();i++)
+      this->workers[i].join();
+  }
+
+  void bisPool::workerLoop(int thread) {
+
+    current_thread=thread;
+    long seen=0;
+    while (1)
+      {
+        {
+          std::unique_lock<std::mutex> guard(this->mutex);
+          this->wake.wait(guard,[&] { return this->stopping || this->generation!=seen; });
+          if (this->stopping)
+            return;
+          seen=this->generation;
+          if (thread>=this->jobthreads)
+            continue;
+        }
+
+        this->runChunks(thread);
+
+        {
+          std::lock_guard<std::mutex> guard(this->mutex);
+          --this->active;
+          if (this->active==0)
+            this->done.notify_all();
+        }
+      }
+  }
+
+  void bisPool::runChunks(int thread) {
+
+    bisChunkRange& own=this->ranges[thread];
+    while (1)
+      {
+        BISLONG chunk=own.pop();
+        if (chunk<0)
+          {
+            // Steal the back half of another thread's chunks, starting with the next thread
+            BISLONG b=0,e=0;
+            int found=0;
+            for (int i=1;i<this->jobthreads && found==0;i++)
+              found=this->ranges[(thread+i)%this->jobthreads].steal(b,e);
+            if (!found)
+              return;
+            own.set(b+1,e);
+            chunk=b;
+          }
+
+        BISLONG cb=this->begin+chunk*this->grain;
+        BISLONG ce=cb+this->grain;
+        if (ce>this->end)
+          ce=this->end;
+        (*this->fn)(cb,ce,thread);
+      }
+  }
+
+  void bisPool::run(BISLONG b,BISLONG e,BISLONG g,const bisRangeFunction& f,int nt) {
+
+    this->fn=&f;
+    this->begin=b;
+    this->end=e;
+    this->grain=g;
+    this->numchunks=(e-b+g-1)/g;
+    this->jobthreads=nt;
+
+    // Initial static partition of the chunks (keeps locality when the work is even)
+    for (int i=0;i<nt;i++)
+      this->ranges[i].set((this->numchunks*i)/nt,(this->numchunks*(i+1))/nt);
+
+    {
+      std::lock_guard<std::mutex> guard(this->mutex);
+      this->active=nt-1;
+      ++this->generation;
+    }
+    this->wake.notify_all();
+
+    current_thread=0;
+    this->runChunks(0);
+    current_thread=-1;
+
+    std::unique_lock<std::mutex> guard(this->mutex);
+    this->done.wait(guard,[&] { return this->active==0; });
+    this->fn=0;
+  }
+
+  static int defaultNumberOfThreads() {
+    int n=(int)std::thread::hardware_concurrency();
+    if (n<1)
+      n=1;
+    if (n>MAX_THREADS)
+      n=MAX_THREADS;
+    return n;
+  }
+
+  int setNumberOfThreads(int n) {
+
+    if (n>MAX_THREADS)
+      n=MAX_THREADS;
+    if (n<1)
+      n=defaultNumberOfThreads();
+
+    std::lock_guard<std::mutex> guard(pool_mutex);
+    pool_size=n;
+    if (global_pool!=0 && global_pool->numthreads!=n)
+      {
+        delete global_pool;
+        global_pool=0;
+      }
+    return n;
+  }
+
+  int getNumberOfThreads() {
+
+    int n=pool_size;
+    if (n<1)
+      n=defaultNumberOfThreads();
+    return n;
+  }
+
+  void parallelFor(BISLONG begin,BISLONG end,BISLONG grain,const bisRangeFunction& fn,int maxthreads)
+  {
+    if (end<=begin)
+      return;
+
+    // Nested call from inside a parallelFor body, run on this thread
+    if (current_thread>=0)
+      {
+        fn(begin,end,current_thread);
+        return;
+      }
+
+    std::lock_guard<std::mutex> guard(pool_mutex);
+    if (global_pool==0)
+      {
+        if (pool_size<1)
+          pool_size=defaultNumberOfThreads();
+        global_pool=new bisPool(pool_size);
+      }
+
+    int nt=global_pool->numthreads;
+    if (maxthreads>0 && maxthreads<nt)
+      nt=maxthreads;
+
+    if (grain<1)
+      {
+        grain=(end-begin)/(16*nt);
+        if (grain<1)
+          grain=1;
+      }
+
+    BISLONG numchunks=(end-begin+grain-1)/grain;
+    if (numchunks<nt)
+      nt=(int)numchunks;
+
+    if (nt<2)
+      {
+        current_thread=0;
+        fn(begin,end,0);
+        current_thread=-1;
+        return;
+      }
+
+    global_pool->run(begin,end,grain,fn,nt);
+  }
+
+#endif
+}
@@ -0,0 +1,64 @@
+/*  LICENSE
+ 
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+ 
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+ 
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+ 
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+ 
+ ENDLICENSE */
+
+
+#ifndef _bis_ThreadPool_h
+#define _bis_ThreadPool_h
+
+#include "bisMemoryManagement.h"
+#include <functional>
+
+/** @file bisThreadPool.h
+
+    A persistent, lazily created pool of worker threads with work stealing. The range of a parallelFor is
+    split into chunks of grain elements, each thread starts on a contiguous share of the chunks and once it runs out
+    steals half of the remaining chunks of another thread. Kernels with uneven work per element (e.g. masked voxels)
+    are load balanced and no threads are created per call.
+
+    The calling thread takes part in the work as thread 0. Nested calls (from inside a parallelFor body) run serially
+    on the calling thread. In WebAssembly builds without pthreads everything runs serially.
+*/
+
+namespace bisThreadPool {
+
+  /** The body of a parallelFor
+   * @param begin the first element of the chunk
+   * @param end one past the last element of the chunk
+   * @param thread the index of the thread running the chunk (0 to getNumberOfThreads()-1), use this to index per-thread storage
+   */
+  typedef std::function<void(BISLONG begin,BISLONG end,int thread)> bisRangeFunction;
+
+  /** Sets the number of threads in the pool (the pool is recreated on next use)
+   * @param n the number of threads (if <=0 use the number of processors)
+   * @returns the actual number of threads
+   */
+  int setNumberOfThreads(int n);
+
+  /** @returns the number of threads in the pool (including the calling thread) */
+  int getNumberOfThreads();
+
+  /** Runs fn over [begin,end) in chunks of grain elements using the pool
+   * @param begin the first element
+   * @param end one past the last element
+   * @param grain the chunk size (if < 1 a chunk size giving about 16 chunks per thread is used)
+   * @param fn the body, called as fn(chunkbegin,chunkend,thread)
+   * @param maxthreads if > 0 use at most this many threads
+   */
+  void parallelFor(BISLONG begin,BISLONG end,BISLONG grain,const bisRangeFunction& fn,int maxthreads=0);
+}
+
+#endif
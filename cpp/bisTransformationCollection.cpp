@@ -49,7 +49,7 @@ std::shared_ptr<bisAbstractTransformation> bisTransformationCollection::getTrans
 }
 
 // -------------------------------------------------------------------
-long bisTransformationCollection::getRawSize()
+BISLONG bisTransformationCollection::getRawSize()
 {
   // Header
   // 16 bytes big header
@@ -106,7 +106,9 @@ int bisTransformationCollection::deSerialize(unsigned char* pointer)
       std::stringstream name;
       name << "transformation_" << (ia+1);
       std::shared_ptr<bisAbstractTransformation> tmp_g(bisDataObjectFactory::deserializeTransformation(pointer+offset,name.str()));
-      offset+=tmp_g->getRawSize();
+      // Use the stored sizes as grids may have been serialized in a compressed mode
+      int* component_header=(int*)(pointer+offset);
+      offset+=16+component_header[2]+component_header[3];
       this->addTransformation(tmp_g);
     }
 
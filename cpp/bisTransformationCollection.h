@@ -76,7 +76,7 @@ class bisTransformationCollection : public bisAbstractTransformation {
   virtual void serializeInPlace(unsigned char* output);
 
   /** returns size needed to serialize this object in bytes */
-  virtual long getRawSize();
+  virtual BISLONG getRawSize();
 
   // No
   virtual  int isLinear() { return 0;}
@@ -20,6 +20,7 @@
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cmath>
 #include <unsupported/Eigen/SpecialFunctions>
 
@@ -353,6 +354,74 @@ namespace bisUtil {
       for (int ib=0;ib<=3;ib++) 
         m[ia][ib]=value;
   }
+
+  // -------------------------------------------------------------------------
+  // Half precision conversion
+  // -------------------------------------------------------------------------
+  unsigned short floatToHalf(float v) {
+    unsigned int f;
+    memcpy(&f,&v,4);
+
+    unsigned int sign=(f>>16) & 0x8000;
+    unsigned int absf=f & 0x7FFFFFFF;
+    
+    // NaN stays NaN, Inf and overflow become Inf
+    if (absf > 0x7F800000)
+      return (unsigned short)(sign | 0x7E00);
+    if (absf >= 0x477FF000) 
+      return (unsigned short)(sign | 0x7C00);
+
+    // Subnormal half (or zero)
+    if (absf < 0x38800000) {
+      if (absf < 0x33000000)
+        return (unsigned short)sign;
+      unsigned int mant=(absf & 0x007FFFFF) | 0x00800000;
+      int shift=113-(int)(absf>>23)+13;
+      unsigned int h=mant >> shift;
+      unsigned int rem=mant & ((1u<<shift)-1);
+      unsigned int halfway=1u<<(shift-1);
+      if (rem>halfway || (rem==halfway && (h & 1)))
+        h++;
+      return (unsigned short)(sign | h);
+    }
+
+    // Normal: rebias exponent and round mantissa to nearest even
+    unsigned int h=((absf - 0x38000000) >> 13);
+    unsigned int rem=absf & 0x1FFF;
+    if (rem>0x1000 || (rem==0x1000 && (h & 1)))
+      h++;
+    return (unsigned short)(sign | h);
+  }
+
+  float halfToFloat(unsigned short h) {
+    unsigned int sign=((unsigned int)(h & 0x8000))<<16;
+    unsigned int exponent=(h>>10) & 0x1F;
+    unsigned int mant=h & 0x3FF;
+    unsigned int f;
+    
+    if (exponent==0) {
+      if (mant==0) {
+        f=sign;
+      } else {
+        // Subnormal half -> normal float
+        exponent=127-15+1;
+        while ((mant & 0x400)==0) {
+          mant<<=1;
+          exponent--;
+        }
+        mant&=0x3FF;
+        f=sign | (exponent<<23) | (mant<<13);
+      }
+    } else if (exponent==0x1F) {
+      f=sign | 0x7F800000 | (mant<<13);
+    } else {
+      f=sign | ((exponent+127-15)<<23) | (mant<<13);
+    }
+    
+    float v;
+    memcpy(&v,&f,4);
+    return v;
+  }
   
 
 }
@@ -176,6 +176,19 @@ namespace bisUtil {
    * @returns z-score */
   double PvalueToZscore(double p);
 
+  /** Convert a float to IEEE 754 half precision (float16) with round to nearest even.
+   * Values too large become infinity, values too small become (signed) zero.
+   * @param v the input value
+   * @returns the 16-bit representation
+   */
+  unsigned short floatToHalf(float v);
+
+  /** Convert an IEEE 754 half precision (float16) value to float
+   * @param h the 16-bit representation
+   * @returns the value as float
+   */
+  float halfToFloat(unsigned short h);
+
   /** Convert rho to z (i.e. correlation to z-score)
    * @param rho - correlation coefficient
    * @returns the z-score
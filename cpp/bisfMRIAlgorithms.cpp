@@ -18,19 +18,16 @@
 
 #include "bisfMRIAlgorithms.h"
 #include "bisEigenUtil.h"
+#include "bisSIMD.h"
 #include <Eigen/Dense>
 #include <vector>
 
 namespace bisfMRIAlgorithms {
 
-  bisSimpleImage<float>* computeGLM(bisSimpleImage<float>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks)
+  // Checks the regressor matrix and the mask for the GLM. Returns the mask data (0 if no valid mask) in maskdata.
+  static int checkGLMInputs(int dim[5],bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int& num_tasks,unsigned char*& maskdata)
   {
-    int dim[5]; input->getDimensions(dim);
-
-    
     int nc=dim[3]*dim[4];
-    int nt=dim[0]*dim[1]*dim[2];
-
     if (num_tasks<0 || num_tasks>nc)
       num_tasks=nc;
 
@@ -39,12 +36,10 @@ namespace bisfMRIAlgorithms {
     if (numrows!=nc || numcols<num_tasks)
       {
         std::cerr << "Bad Regressor Matrix " << numrows << "*" << numcols << " Need " << nc << "rows and at least " << num_tasks << " columns" << std::endl;
-        return NULL;
+        return 0;
       }
 
-
-    int usemask=0;
-    unsigned char* maskdata=0;
+    maskdata=0;
     if (mask!=0)
       {
         int m_dim[3]; mask->getImageDimensions(m_dim);
@@ -53,53 +48,120 @@ namespace bisfMRIAlgorithms {
           sum+=abs(m_dim[ia]-dim[ia]);
 
         if (sum>0)
+          std::cerr << "Bad Mask for compute GLM ... ignoring " << std::endl;
+        else
+          maskdata=mask->getImageData();
+      }
+    return 1;
+  }
+
+  // Fits the GLM for numvoxels voxels. inputdata[voxel+frame*stride] and outdata[voxel+task*stride],
+  // stride is the volume size for whole images and the block size for voxel blocks
+  template<class T> static void computeGLMBlock(T* inputdata,unsigned char* maskdata,BISLONG numvoxels,BISLONG stride,
+                                                Eigen::MatrixXf& LSQ,int nc,int num_tasks,float* outdata)
+  {
+    int numcols=LSQ.rows();
+    int task_offset=numcols-num_tasks;
+    Eigen::VectorXf b=Eigen::VectorXf::Zero(numcols);
+    Eigen::VectorXf x=Eigen::VectorXf::Zero(nc);
+
+    for (BISLONG voxel=0;voxel<numvoxels;voxel++)
+      {
+        int compute=1;
+        if (maskdata!=0)
+          compute=(double(maskdata[voxel])>0);
+
+        if (compute)
           {
-            std::cerr << "Bad Mask for compute GLM ... ignoring " << std::endl;
+            for (int frame=0;frame<nc;frame++)
+              x[frame]=(float)inputdata[voxel+frame*stride];
+    	    bisEigenUtil::inPlaceMultiplyMV(LSQ,x,b);
+            for (int task=0;task<num_tasks;task++)
+              outdata[task*stride+voxel]=b[task+task_offset];
           }
         else
           {
-            usemask=1;
-            maskdata=mask->getImageData();
+            for (int task=0;task<num_tasks;task++)
+              outdata[task*stride+voxel]=0.0f;
           }
       }
+  }
+
+  template<class T> bisSimpleImage<float>* computeGLM(bisSimpleImage<T>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks)
+  {
+    int dim[5]; input->getDimensions(dim);
+    unsigned char* maskdata=0;
+    if (!checkGLMInputs(dim,mask,regressorMatrix,num_tasks,maskdata))
+      return NULL;
+
+    int nc=dim[3]*dim[4];
+    BISLONG volsize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
 
     bisSimpleImage<float>* output=new bisSimpleImage<float>("beta_image");
     int outdim[5] = { dim[0],dim[1],dim[2],num_tasks,1};
     float spa[5]; input->getSpacing(spa);
     output->allocate(outdim,spa);
-    output->fill(0.0f);
     
-    float* outdata=output->getImageData();
     Eigen::MatrixXf A=bisEigenUtil::mapToEigenMatrix(regressorMatrix);
     Eigen::MatrixXf LSQ=bisEigenUtil::createLSQMatrix(A);
-    Eigen::VectorXf b=Eigen::VectorXf::Zero(numcols);
-    Eigen::MatrixXf inputdata=bisEigenUtil::mapImageToEigenMatrix(input);
-    
-    int task_offset=numcols-num_tasks;
-    int volsize=nt;
-    for (int voxel=0;voxel<nt;voxel++)
-      {
-        int compute=0;
-        if (usemask)
-          {
-            if (double(maskdata[voxel])>0)
-              compute=1;
-          }
-        else
-          compute=1;
+    computeGLMBlock(input->getImageData(),maskdata,volsize,volsize,LSQ,nc,num_tasks,output->getImageData());
+    return output;
+  }
 
-        if (compute)
-          {
-            Eigen::VectorXf x=inputdata.col(voxel);
-    	    bisEigenUtil::inPlaceMultiplyMV(LSQ,x,b);
-            for (int task=0;task<num_tasks;task++)
-              outdata[task*volsize+voxel]=b[task+task_offset];
-          }
+  int computeGLM(bisAbstractImageStream<float>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks,
+                 bisAbstractImageStream<float>* output,BISLONG voxelsperchunk)
+  {
+    int dim[5]; input->getDimensions(dim);
+    unsigned char* maskdata=0;
+    if (!checkGLMInputs(dim,mask,regressorMatrix,num_tasks,maskdata))
+      return 0;
+
+    int odim[5]; output->getDimensions(odim);
+    if (odim[0]!=dim[0] || odim[1]!=dim[1] || odim[2]!=dim[2] || output->getNumberOfFrames()!=num_tasks)
+      {
+        std::cerr << "Bad output stream for GLM, need " << dim[0] << "*" << dim[1] << "*" << dim[2] << "*" << num_tasks << std::endl;
+        return 0;
       }
 
-    return output;
+    int nc=dim[3]*dim[4];
+    BISLONG volsize=input->getVolumeSize();
+    if (voxelsperchunk<1 || voxelsperchunk>volsize)
+      voxelsperchunk=volsize;
+
+    Eigen::MatrixXf A=bisEigenUtil::mapToEigenMatrix(regressorMatrix);
+    Eigen::MatrixXf LSQ=bisEigenUtil::createLSQMatrix(A);
+
+    // Block buffers, all frames of voxelsperchunk voxels in and all betas out
+    std::vector<float> inblock(voxelsperchunk*nc);
+    std::vector<float> outblock(voxelsperchunk*num_tasks);
+    for (BISLONG begin=0;begin<volsize;begin+=voxelsperchunk)
+      {
+        BISLONG number=voxelsperchunk;
+        if (begin+number>volsize)
+          number=volsize-begin;
+
+        if (!input->readVoxelBlock(begin,number,&inblock[0]))
+          return 0;
+        unsigned char* blockmask=0;
+        if (maskdata!=0)
+          blockmask=maskdata+begin;
+        computeGLMBlock(&inblock[0],blockmask,number,number,LSQ,nc,num_tasks,&outblock[0]);
+        if (!output->writeVoxelBlock(begin,number,&outblock[0]))
+          return 0;
+      }
+    return 1;
   }
 
+  // Explicit instantiations for all image types (see bisvtkTemplateMacro)
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<double>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<float>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<int>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<unsigned int>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<short>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<unsigned short>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<char>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template bisSimpleImage<float>* computeGLM(bisSimpleImage<unsigned char>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+
   // ---------------------------------------------------------------------------------------
   // Legendre Polynomial
   // ---------------------------------------------------------------------------------------
@@ -421,7 +483,7 @@ namespace bisfMRIAlgorithms {
 
     Eigen::MatrixXf input=  Eigen::MatrixXf::Zero(dim[3],1);
     Eigen::MatrixXf output=  Eigen::MatrixXf::Zero(dim[3],1);
-    int numvoxels=dim[0]*dim[1]*dim[2];
+    BISLONG numvoxels=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     float* indata=input_image->getImageData();
     float* outdata=output_image->getImageData();
 
@@ -429,7 +491,7 @@ namespace bisfMRIAlgorithms {
     
     std::cout << "Dim=" << dim[0] << "," << dim[1] << "," << dim[2] << ", frames=" << dim[3] << " nv=" << numvoxels << std::endl;
     
-    for (int i=0;i<numvoxels;i++)
+    for (BISLONG i=0;i<numvoxels;i++)
       {
         double mean=0.0;
         int d=debug;
@@ -643,10 +705,14 @@ namespace bisfMRIAlgorithms {
       {
         for (int outcol=outrow;outcol<sz[1];outcol++)
           {
+#ifdef BIS_SIMD
+            double sum=bisSIMD::weightedDotProduct(norm.col(outrow).data(),norm.col(outcol).data(),weights.data(),sz[0]);
+#else
             double sum=0.0;
             for (int row=0;row<sz[0];row++) {
               sum=sum+norm(row,outrow)*norm(row,outcol)*weights(row);
             }
+#endif
 
 	    
             if (toz)
@@ -756,7 +822,7 @@ namespace bisfMRIAlgorithms {
     // --------------------------
     float* imagedata=input->getImageData();
     Eigen::VectorXf img_matrix=Eigen::VectorXf::Zero(sz[0]);
-    int numvoxels=dim[0]*dim[1]*dim[2];
+    BISLONG numvoxels=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int numframes=sz[0];
 
     
@@ -768,7 +834,7 @@ namespace bisfMRIAlgorithms {
 
     
     
-    for (int voxel=0;voxel<numvoxels;voxel++) {
+    for (BISLONG voxel=0;voxel<numvoxels;voxel++) {
       double sum=0.0;
       double sum2=0.0;
       
@@ -815,9 +881,11 @@ namespace bisfMRIAlgorithms {
    */
   int normalizeTimeSeriesImage(bisSimpleImage<float>* input,bisSimpleImage<float>* output)
   {
-    output->copyStructure(input);
+    // Each voxel's time series is read completely before it is overwritten, so output may be the input (in place)
+    if (output!=input)
+      output->copyStructure(input);
     int dim[5]; input->getDimensions(dim);
-    int volumesize=dim[0]*dim[1]*dim[2];
+    BISLONG volumesize=BISLONG(dim[0])*BISLONG(dim[1])*BISLONG(dim[2]);
     int numframes=dim[3]*dim[4];
 
     float* idata=input->getImageData();
@@ -825,14 +893,14 @@ namespace bisfMRIAlgorithms {
 
     double scale=1.0/double(numframes);
     
-    for (int voxel=0;voxel<volumesize;voxel++) {
+    for (BISLONG voxel=0;voxel<volumesize;voxel++) {
       
       double sum=0.0;
       double sum2=0.0;
 	
       for (int frame=0;frame<numframes;frame++)
         {
-          int index=voxel+frame*volumesize;
+          BISLONG index=voxel+frame*volumesize;
           float v=idata[index];
           sum=sum+v;
           sum2=sum2+v*v;
@@ -844,7 +912,7 @@ namespace bisfMRIAlgorithms {
         scale=1.0/sigma;
       for (int frame=0;frame<numframes;frame++)
         {
-          int index=voxel+frame*volumesize;
+          BISLONG index=voxel+frame*volumesize;
           float v=idata[index];
           odata[index]=(v-mean)*scale;
         }
@@ -21,6 +21,7 @@
 
 #include "bisDataTypes.h"
 #include "bisSimpleDataStructures.h"
+#include "bisImageStream.h"
 #include "bisEigenUtil.h"
 #include "bisUtil.h"
 #include "math.h"
@@ -32,14 +33,29 @@
  */
 namespace bisfMRIAlgorithms {
 
-  /** compute GLM inhomogeneity
+  /** compute GLM inhomogeneity. The input time series is read in its native type (instantiated for all
+   * types in bisDataTypes), each voxel's time series is converted to float as it is fitted.
    * @param input the input image time series
    * @param mask the input mask (compute only where this > 0)
    * @param regressorMatrix  the regressor Matrix (this is post HRF Convolution etc.)
    * @param num_tasks Number of Tasks (last N columns of regressor matrix, first columns are drift, nuisance terms);
    * @returns the 4D beta map image
    */
-  bisSimpleImage<float>* computeGLM(bisSimpleImage<float>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+  template<class T> bisSimpleImage<float>* computeGLM(bisSimpleImage<T>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks);
+
+  /** compute GLM on an image stream. Blocks of voxelsperchunk voxels (with all frames) are read, fitted and
+   * written so memory use is bounded by the chunk size (see \link bisAbstractImageStream \endlink).
+   * The input stream casts to float as it reads (e.g. bisNIFTIFileImageStream<float> for any file type).
+   * @param input the input image time series stream
+   * @param mask the input mask (compute only where this > 0)
+   * @param regressorMatrix  the regressor Matrix (this is post HRF Convolution etc.)
+   * @param num_tasks Number of Tasks (last N columns of regressor matrix, first columns are drift, nuisance terms);
+   * @param output the beta map stream (x,y,z,num_tasks)
+   * @param voxelsperchunk number of voxels to process at a time
+   * @returns 1 if success 0 if failed
+   */
+  int computeGLM(bisAbstractImageStream<float>* input,bisSimpleImage<unsigned char>* mask,bisSimpleMatrix<float>* regressorMatrix,int num_tasks,
+                 bisAbstractImageStream<float>* output,BISLONG voxelsperchunk=65536);
 
   /** Computes legendre polynomial of order in range 0 to 6.
    * @param t the input value
@@ -166,7 +182,7 @@ namespace bisfMRIAlgorithms {
   /** This function normalizes a time series image to have unit magnitude and zero mean for each voxel
    * @alias BisfMRIMatrixConnectivity.normalizeTimeSeriesImage
    * @param {Image} input - the input timeseries  image
-   * @param {Image} output - the normalized timeseries  image
+   * @param {Image} output - the normalized timeseries  image (may be the input image for in place operation)
    */
   int normalizeTimeSeriesImage(bisSimpleImage<float>* input,bisSimpleImage<float>* output);
 
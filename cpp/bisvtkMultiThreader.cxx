@@ -13,6 +13,7 @@
 
 =========================================================================*/
 #include "bisvtkMultiThreader.h"
+#include "bisThreadPool.h"
 
 namespace bisvtkMultiThreader {
 
@@ -313,10 +314,15 @@ void vtkMultiThreader::SingleMethodExecute()
 
 #ifndef VTK_USE_WIN32_THREADS
 #ifndef VTK_USE_PTHREADS
-  // There is no multi threading, so there is only one thread.
-  this->ThreadInfoArray[0].UserData        = this->SingleData;
-  this->ThreadInfoArray[0].NumberOfThreads = this->NumberOfThreads;
-  this->SingleMethod( (void *)(&this->ThreadInfoArray[0]) );
+  // There is no multi threading (e.g. WebAssembly), so run the pieces
+  // for each thread id sequentially in this thread. Running only thread 0
+  // would leave the work partitioned to the other thread ids undone.
+  for (int thread_loop = 0; thread_loop < this->NumberOfThreads; thread_loop++ )
+  {
+    this->ThreadInfoArray[thread_loop].UserData        = this->SingleData;
+    this->ThreadInfoArray[thread_loop].NumberOfThreads = this->NumberOfThreads;
+    this->SingleMethod( (void *)(&this->ThreadInfoArray[thread_loop]) );
+  }
 #endif
 #endif
 }
@@ -646,31 +652,29 @@ void runMultiThreader(vtkThreadFunctionType func, void *ds,std::string msg,int N
 #ifdef BISWASM
     NumberOfThreads=2;
 #endif
-                        
-    if (NumberOfThreads>1)
-      {
-#ifndef _WIN32
-        if (debug)
-          std::cout << "++++ \n++++ About to launch " << NumberOfThreads << " threads. " << msg << std::endl << "++++" << std::endl;
-#endif
-        vtkMultiThreader* threader=new vtkMultiThreader();
-        threader->SetSingleMethod(func,ds);
-        threader->SetNumberOfThreads(NumberOfThreads);
-        threader->SingleMethodExecute();
-        //delete threader;
-      }
-    else
-      {
+
+    if (NumberOfThreads<1)
+      NumberOfThreads=1;
+
 #ifndef _WIN32
-        if (debug)
-          std::cout << "++++ \n++++ Running in Single Threaded Mode." << msg << std::endl << "++++" << std::endl;
-#endif
-        vtkMultiThreader::ThreadInfo data;
-        data.UserData=(void*)ds;
-        data.ThreadID=0;
-        data.NumberOfThreads=1;
-        func(&data);
-      }
+    if (debug)
+      std::cout << "++++ \n++++ About to run " << NumberOfThreads << " pieces on " << bisThreadPool::getNumberOfThreads() << " pool threads. " << msg << std::endl << "++++" << std::endl;
+#endif
+
+    // Each ThreadID runs once as a task of the persistent pool (bisThreadPool), no threads are created per call.
+    // Pieces run concurrently when there are enough pool threads, otherwise some run one after the other.
+    bisThreadPool::parallelFor(0,NumberOfThreads,1,[&](BISLONG begin,BISLONG end,int) {
+        for (BISLONG piece=begin;piece<end;piece++)
+          {
+            vtkMultiThreader::ThreadInfo data;
+            data.UserData=(void*)ds;
+            data.ThreadID=(int)piece;
+            data.NumberOfThreads=NumberOfThreads;
+            data.ActiveFlag=nullptr;
+            data.ActiveFlagLock=nullptr;
+            func(&data);
+          }
+      },NumberOfThreads);
   }
 }
 
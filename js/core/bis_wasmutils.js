@@ -219,6 +219,13 @@ var get_collection_magic_code=function(Module) { return Module._getCollectionMag
  */
 var get_surface_magic_code=function(Module) { return Module._getSurfaceMagicCode(); };
 
+/**
+ * @alias bisWasmUtils.get_sparsematrix_magic_code
+ * @param {EmscriptenModule} Module - the emscripten Module object
+ * @returns {number} the Bis WebAssembly Magic Code for a CSR sparse matrix
+ */
+var get_sparsematrix_magic_code=function(Module) { return Module._getSparseMatrixMagicCode(); };
+
 
 // ------------------------------------------------------------
 //  Heavy Code
@@ -460,7 +467,14 @@ var unpackStructure=function(Module,
 
     out_obj.magic_type=magic_type;
     const headersize=intheader[2];
-    const data_size=intheader[3];
+    let data_size=intheader[3];
+
+    // 64-bit data size stored (little endian) in the last 8 bytes of the object header
+    if (data_size===-64) {
+        let sz64 = get_array_view(Module,Uint32Array,in_dataptr+8+headersize,2);
+        data_size=sz64[0]+sz64[1]*4294967296;
+    }
+    out_obj.headersize=headersize;
     
     if (magic_type==matr_magic_code) {
         let dim = get_array_view(Module,Int32Array,in_dataptr+16,2);
@@ -598,6 +612,7 @@ let outputobject = {
     get_combo_magic_code :      get_combo_magic_code ,
     get_collection_magic_code : get_collection_magic_code,
     get_surface_magic_code :      get_surface_magic_code ,
+    get_sparsematrix_magic_code : get_sparsematrix_magic_code,
     createPointer: createPointer,
     packStructure : packStructure,
     packStructureInPlace : packStructureInPlace,
@@ -179,6 +179,11 @@ var deserializeAndDeleteObject=function(Module,ptr,datatype,first_input=0) {
     first_input=first_input || 0;
     
     if (datatype==='Matrix' || datatype==='Vector') {
+        // The CSR output of the distance matrix functions (csr=true) is only supported from Python/native code
+        if (wasmutil.get_array_view(Module,Int32Array,ptr,1)[0]===wasmutil.get_sparsematrix_magic_code(Module)) {
+            wasmutil.release_memory(Module,ptr);
+            throw new Error('CSR sparse matrices (csr=true) can not be returned to JS, use csr=false');
+        }
         let output=new BisWebMatrix();
         output.deserializeWasmAndDelete(Module,ptr);
         return output;
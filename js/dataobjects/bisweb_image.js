@@ -270,7 +270,7 @@ class BisWebImage extends BisWebDataObject {
             return 0;
         }
 
-        let dataptr=wasmobj.dataptr+56;
+        let dataptr=wasmobj.dataptr+16+wasmobj.headersize;
         this.initialize();
 
         let nifti_info=internal.header.getniftitype(wasmobj.datatype);
@@ -55,7 +55,8 @@ class timeseriesNormalizeImage extends BaseModule {
         return new Promise( (resolve, reject) => {
             console.log('inp=',input.getDescription());
             biswrap.initialize().then(() => {
-                this.outputs['output'] = biswrap.timeSeriesNormalizeImageWASM(input, super.parseBoolean(vals.debug));
+                // The input is serialized to a temporary WASM copy, so it is safe to normalize that copy in place
+                this.outputs['output'] = biswrap.timeSeriesNormalizeImageWASM(input, { 'inplace' : true }, super.parseBoolean(vals.debug));
                 resolve();
             }).catch( (e) => {
                 reject(e.stack);
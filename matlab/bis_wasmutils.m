@@ -501,7 +501,11 @@ function moduleOutput = bis_wasmutils()
     typename=get_matlab_type(top_header(2));
     headersize=top_header(3);
     data_bytelength=top_header(4);
-    if (data_bytelength<0)
+    if (data_bytelength==-64)
+      % 64-bit data size stored in the last 8 bytes of the object header
+      reshape(ptr,16+headersize+offset,1);
+      data_bytelength=double(typecast(ptr.Value(9+headersize+offset:16+headersize+offset),'int64'));
+    elseif (data_bytelength<0)
       disp('==== MATLAB large image deserialize');
       % Xenios to add
       reshape(ptr,36+offset,1);
@@ -527,14 +531,14 @@ function moduleOutput = bis_wasmutils()
     switch(top_header(1))
       case get_matrix_magic_code()
 	dimensions=typecast(rawdata(17+offset:24+offset,:),code_int32);
-	data=typecast(rawdata(25+offset:total_length+offset,1:1),typename);
+	data=typecast(rawdata(17+headersize+offset:total_length+offset,1:1),typename);
 	out=transpose(reshape(data,dimensions(2),dimensions(1)));
       case get_vector_magic_code()
-	out=typecast(rawdata(17+offset:total_length+offset,1:1),typename);
+	out=typecast(rawdata(17+headersize+offset:total_length+offset,1:1),typename);
       case get_image_magic_code()
 	      
 	dimensions=typecast(rawdata(17+offset:36+offset,:),code_int32);
-    	tmp=typecast(rawdata(57+offset:total_length+offset,1:1),typename);
+    	tmp=typecast(rawdata(17+headersize+offset:total_length+offset,1:1),typename);
 	img=reshape(tmp,dimensions(1),dimensions(2),dimensions(3),dimensions(4),dimensions(5));
 	sp=typecast(rawdata(37+offset:56+offset,:),code_float);
         
@@ -184,6 +184,16 @@ describe('Testing eigen numerical library and matlab parsing\n', function() {
         assert.equal(numfailed,0);
     });
 
+    it('wasm pool memory',function() {
+        let numfailed=libbiswasm.test_poolMemory(1);
+        assert.equal(numfailed,0);
+    });
+
+    it('wasm image streams vs in memory',function() {
+        let numfailed=libbiswasm.test_imageStreams(1);
+        assert.equal(numfailed,0);
+    });
+
 
     it('wasm eigen util operations',function() {
 
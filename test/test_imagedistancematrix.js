@@ -146,6 +146,25 @@ describe('Testing imageDistanceMatrix stuff\n', function() {
         });
     });
 
+    it ('test distmatrix3 knn',function() {
+        return new Promise( (resolve) => {
+            let ok=true;
+            [ 0,1,2 ].forEach( (knn) => {
+                let out3=libbiswasm.computeImageDistanceMatrixWASM(img,obj,{ "useradius" : false,
+                                                                             "sparsity" : 0.1,
+                                                                             "knn" : knn,
+                                                                             "numthreads" : 1
+                                                                           },0);
+                let result=out3.compareWithOther(gold[2]);
+                console.log('.... knn=',knn,result);
+                if (!result.testresult)
+                    ok=false;
+            });
+            assert.equal(true,ok);
+            resolve();
+        });
+    });
+
     it ('test load and save',function() {
         return new Promise( (resolve) => {
             gold[1].save(tmpFname1).then( () => {
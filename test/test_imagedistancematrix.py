@@ -153,6 +153,59 @@ class TestImageDistanceMatrix(unittest.TestCase):
         
         self.assertEqual(testpass,True);
 
+    def test_csrmatrix(self):
+
+        print('----------------------------------------------------------')
+        print('__ CSR sparse matrix serialization and COO equivalence');
+        numfailed=libbis.test_sparseMatrix(1);
+        self.assertEqual(numfailed,0);
+
+    def test_patchdistancematrix(self):
+
+        print('----------------------------------------------------------')
+        print('__ patch view (patchradius=2) vs patch reformatted image temporal distance matrix');
+        numfailed=libbis.test_patchDistanceMatrix(1);
+        self.assertEqual(numfailed,0);
+
+    def test_mediansampling(self):
+
+        print('----------------------------------------------------------')
+        print('__ sampled median of more than 2^20 entries vs exact median');
+        numfailed=libbis.test_medianSampling(1);
+        self.assertEqual(numfailed,0);
+
+    def test_csreigenvectors(self):
+
+        # The CSR output is passed to the eigenvector code as is and must give the same result as the COO output
+        dat=np.zeros([8,8,6,5],dtype=np.float32);
+        flat=dat.reshape(-1);
+        for i in range(0,flat.size):
+            flat[i]=((i*7919)%1013)*0.1;
+        timeseries=bisImage().create(dat,[2.0,2.0,2.0,1.0,1.0],affine);
+        mask=bisImage().create(np.ones([8,8,6],dtype=np.int16),[2.0,2.0,2.0],affine);
+        imap=libbis.computeImageIndexMapWASM(mask,0);
+
+        outputs=[];
+        for csr in [ False, True ]:
+            matrix=libbis.computeImageDistanceMatrixWASM(timeseries,mask,{ "useradius" : True,
+                                                                          "radius" : 4.0,
+                                                                          "numthreads" : 2,
+                                                                          "csr" : csr },0);
+            if csr:
+                self.assertEqual(type(matrix),bisSparseMatrix);
+            else:
+                self.assertEqual(type(matrix),np.ndarray);
+            eigen=libbis.computeSparseImageEigenvectorsWASM(matrix,imap,{ "maxeigen" : 3,
+                                                                         "singleprecision" : True,
+                                                                         "numthreads" : 2 },0);
+            outputs.append(np.abs(eigen.get_data()));
+
+        result=np.max(np.abs(outputs[0]-outputs[1]));
+        print('----------------------------------------------------------')
+        print('__ CSR vs COO eigenvectors maxdiff=',result);
+        print('----------------------------------------------------------')
+        self.assertLess(result,1e-3*np.max(outputs[0]));
+
     def test_loadsparse(self):
 
         fname=(my_path+'/../test/testdata/distancematrix/sample.binmatr');
@@ -0,0 +1,127 @@
+/*  LICENSE
+
+ _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+
+ BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+
+ - you may not use this software except in compliance with the License.
+ - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+
+ __Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.__
+
+ ENDLICENSE */
+
+/* jshint node:true */
+/*global describe, it,before */
+"use strict";
+
+require('../config/bisweb_pathconfig.js');
+
+const assert = require("assert");
+const BisWebImage=require('bisweb_image');
+const libbiswasm=require('libbiswasm_wrapper');
+
+// Odd dimensions so that flip has a middle voxel that maps onto itself
+let createTestImage=function(type,dims,numframes=1) {
+    let img=new BisWebImage();
+    img.createImage({ dimensions: dims, type : type, numframes : numframes });
+    let imgdata=img.getImageData();
+    for (let i=0;i<imgdata.length;i++)
+        imgdata[i]=((i*37)%251)-20;
+    return img;
+};
+
+// Runs fn with and without inplace and checks that the outputs are identical and the input is unchanged
+let compareInPlace=function(name,img,fn,params) {
+
+    let orig=img.getImageData().slice(0);
+    let copy_params=Object.assign({},params,{ inplace : false });
+    let inplace_params=Object.assign({},params,{ inplace : true });
+
+    let out_copy=fn(img,copy_params,0);
+    let out_inplace=fn(img,inplace_params,0);
+
+    let cdata=out_copy.getImageData(),idata=out_inplace.getImageData();
+    assert.equal(cdata.length,idata.length);
+    assert.equal(out_copy.getDataType(),out_inplace.getDataType());
+
+    let maxdiff=0.0;
+    for (let i=0;i<cdata.length;i++)
+        maxdiff=Math.max(maxdiff,Math.abs(cdata[i]-idata[i]));
+
+    let indata=img.getImageData(),inputchanged=0;
+    for (let i=0;i<indata.length;i++) {
+        if (indata[i]!==orig[i])
+            inputchanged++;
+    }
+    console.log('+++++ '+name+' in place vs copy max diff=',maxdiff,' type=',out_inplace.getDataType(),' input changed=',inputchanged);
+    assert.equal(maxdiff,0.0);
+    assert.equal(inputchanged,0);
+    return out_inplace;
+};
+
+
+describe('Testing in place image filters',function() {
+
+    this.timeout(50000);
+
+    before(function(done) {
+        libbiswasm.initialize().then( () => { done(); });
+    });
+
+    it ('normalize', () => {
+        let img=createTestImage('short',[ 9,7,5 ]);
+        compareInPlace('normalize',img,libbiswasm.normalizeImageWASM,
+                       { perlow : 0.05, perhigh : 0.95, outmaxvalue : 1024 });
+    });
+
+    it ('threshold', () => {
+        let img=createTestImage('short',[ 9,7,5 ]);
+        compareInPlace('threshold',img,libbiswasm.thresholdImageWASM,
+                       { low : 50.0, high : 150.0, replacein : true, replaceout : true, invalue : 1.0, outvalue : 0.0, datatype : -1 });
+    });
+
+    it ('shiftScale', () => {
+        let img=createTestImage('float',[ 9,7,5 ]);
+        compareInPlace('shiftScale',img,libbiswasm.shiftScaleImageWASM,
+                       { shift : 2.5, scale : 3.0, datatype : -1 });
+    });
+
+    it ('flip (odd dimensions)', () => {
+        let dims=[ 9,7,5 ];
+        let img=createTestImage('short',dims);
+        [ [1,0,0], [0,1,0], [0,0,1], [1,1,1] ].forEach( (f) => {
+            let out=compareInPlace('flip '+f.join(','),img,libbiswasm.flipImageWASM,
+                                   { flipi : f[0], flipj : f[1], flipk : f[2] });
+            // Check against the direct index computation
+            let idata=img.getImageData(),odata=out.getImageData(),bad=0;
+            for (let k=0;k<dims[2];k++) {
+                for (let j=0;j<dims[1];j++) {
+                    for (let i=0;i<dims[0];i++) {
+                        let si= f[0] ? dims[0]-1-i : i;
+                        let sj= f[1] ? dims[1]-1-j : j;
+                        let sk= f[2] ? dims[2]-1-k : k;
+                        if (odata[i+j*dims[0]+k*dims[0]*dims[1]]!==idata[si+sj*dims[0]+sk*dims[0]*dims[1]])
+                            bad++;
+                    }
+                }
+            }
+            assert.equal(bad,0);
+        });
+    });
+
+    it ('blank', () => {
+        let img=createTestImage('short',[ 9,7,5 ]);
+        compareInPlace('blank',img,libbiswasm.blankImageWASM,
+                       { i0 : 2, i1 : 6, j0 : 1, j1 : 5, k0 : 1, k1 : 3, outside : -3 });
+    });
+
+    it ('timeSeriesNormalize', () => {
+        let img=createTestImage('float',[ 5,5,3 ],7);
+        compareInPlace('timeSeriesNormalize',img,libbiswasm.timeSeriesNormalizeImageWASM,{});
+    });
+});
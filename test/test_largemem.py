@@ -104,6 +104,29 @@ class TestLargeMem(unittest.TestCase):
         testpass=smooth();
         self.assertEqual(testpass,True);
 
+    def test_smooth_pool(self):
+        print('')
+        print('________________________________________________________________');
+        print('')
+        print('Using pooled memory');
+        wasmutil.set_force_large_memory(0);
+        wasmutil.set_pool_memory(True);
+        testpass=smooth() and smooth();
+        wasmutil.release_pool_memory();
+        numfailed=libbiswasm.test_poolMemory(1);
+        wasmutil.set_pool_memory(False);
+        self.assertEqual(testpass,True);
+        self.assertEqual(numfailed,0);
+
+    def test_large_header(self):
+        print('')
+        print('________________________________________________________________');
+        print('')
+        print('Testing 64-bit serialization header');
+        numfailed=libbiswasm.test_largeHeader(1);
+        wasmutil.set_force_large_memory(0);
+        self.assertEqual(numfailed,0);
+
 
 if __name__ == '__main__':
     TestLargeMem().main()        
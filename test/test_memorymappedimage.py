@@ -0,0 +1,68 @@
+# LICENSE
+#
+# _This file is Copyright 2018 by the Image Processing and Analysis Group (BioImage Suite Team). Dept. of Radiology & Biomedical Imaging, Yale School of Medicine._
+#
+# BioImage Suite Web is licensed under the Apache License, Version 2.0 (the "License");
+#
+# - you may not use this software except in compliance with the License.
+# - You may obtain a copy of the License at [http://www.apache.org/licenses/LICENSE-2.0](http://www.apache.org/licenses/LICENSE-2.0)
+#
+# __Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.__
+#
+# ENDLICENSE
+
+import os
+import sys
+import tempfile
+import numpy as np
+import nibabel as nib
+import unittest
+
+my_path=os.path.dirname(os.path.realpath(__file__));
+sys.path.insert(0,os.path.abspath(my_path+'/../'));
+
+import biswebpython.core.bis_objects as bis
+import biswebpython.core.bis_baseutils as bis_baseutils;
+libbiswasm=bis_baseutils.getDynamicLibraryWrapper();
+
+# ----------------------------------------------------------------------------------------------
+# Memory mapping needs uncompressed .nii files, so the test data is written out as NIFTI-1 / NIFTI-2
+def write_uncompressed(inname,outname,nifti2,dtype):
+    tmp=nib.load(my_path+'/../test/testdata/'+inname);
+    data=np.asanyarray(tmp.dataobj).astype(dtype);
+    if nifti2:
+        out=nib.Nifti2Image(data,tmp.affine);
+    else:
+        out=nib.Nifti1Image(data,tmp.affine);
+    out.header.set_zooms(tmp.header.get_zooms());
+    nib.save(out,outname);
+
+def map_and_compare(inname,nifti2,dtype):
+    tmpdir=tempfile.mkdtemp();
+    fname=os.path.join(tmpdir,'mapped.nii');
+    write_uncompressed(inname,fname,nifti2,dtype);
+    gold=bis.bisImage().load(fname);
+    numfailed=libbiswasm.test_memoryMappedImage(fname,gold,1);
+    os.remove(fname);
+    os.rmdir(tmpdir);
+    return numfailed;
+
+class TestMemoryMappedImage(unittest.TestCase):
+
+    def test_nifti1(self):
+        print('')
+        print('___ Memory mapping NIFTI-1 (3D short)');
+        self.assertEqual(map_and_compare('MNI_2mm_orig.nii.gz',False,np.int16),0);
+
+    def test_nifti2(self):
+        print('')
+        print('___ Memory mapping NIFTI-2 (4D float)');
+        self.assertEqual(map_and_compare('indiv/prep.nii.gz',True,np.float32),0);
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -204,6 +204,59 @@ describe('Testing New Style Bspline Grid Code\n', function() {
         assert.equal(true,(error0<0.1 && error1<0.1 && error2  < 0.1 && error4<0.00001));
     });
 
+    it('test compressed combo transformation serialization',function() {
+
+        const dim=images[2].getDimensions();
+        const spa=images[2].getSpacing();
+        const obj = { "dimensions" : [ dim[0],dim[1],dim[2] ],
+                      "spacing" : [ spa[0],spa[1],spa[2] ]
+                    };
+        let orig=libbiswasm.computeDisplacementFieldWASM(bsplinecombo_inp,obj,0);
+        
+        let errors=[];
+        [ false, true ].forEach( (half) => {
+            let compressed=libbiswasm.compressComboTransformationWASM(bsplinecombo_inp,{ "float16" : half },0);
+            let combo=libbiswasm.decompressComboTransformationWASM(compressed,0);
+            let out=libbiswasm.computeDisplacementFieldWASM(combo,obj,0);
+            let error=bisimagesmoothreslice.computeImageSSD(orig,out);
+            console.log('+++++ Compressed (float16=',half,') size=',compressed.getDimensions(),' displacement field error=',error.toFixed(6));
+            errors.push(error);
+        });
+        assert.equal(true,(errors[0]<0.00001 && errors[1]<0.01));
+    });
+
+    it('test inverse displacement field',function() {
+
+        const dim=images[2].getDimensions();
+        const spa=images[2].getSpacing();
+        const obj = { "dimensions" : [ dim[0],dim[1],dim[2] ],
+                      "spacing" : [ spa[0],spa[1],spa[2] ]
+                    };
+        let forward=libbiswasm.computeDisplacementFieldWASM(bsplinecombo_inp,obj,0);
+
+        let errors=[];
+        [ 1, 20 ].forEach( (iterations) => {
+            let inverse=libbiswasm.computeInverseDisplacementFieldWASM(bsplinecombo_inp,{
+                "dimensions" : obj.dimensions,
+                "spacing" : obj.spacing,
+                "iterations" : iterations,
+                "tolerance" : 0.001 },1);
+            let error=bisimagesmoothreslice.computeDisplacementFieldRoundTripError(forward,inverse);
+            let wasm_error=libbiswasm.computeDisplacementFieldRoundTripErrorWASM(forward,inverse,0);
+            console.log('+++++ Inverse displacement field (iterations=',iterations,') round trip error=',error.toFixed(4),' wasm=',wasm_error.toFixed(4));
+            assert.equal(true,Math.abs(error-wasm_error)<0.001);
+            errors.push(error);
+        });
+        // The converged inverse is limited only by trilinear interpolation of the 6mm fields (~0.05mm)
+        assert.equal(true,(errors[1]<0.1 && errors[1]<errors[0]));
+
+        // Fields on different lattices are rejected
+        let smaller=libbiswasm.computeDisplacementFieldWASM(bsplinecombo_inp,{
+            "dimensions" : [ dim[0]-1,dim[1],dim[2] ],
+            "spacing" : obj.spacing },0);
+        assert.equal(0,libbiswasm.computeDisplacementFieldRoundTripErrorWASM(forward,smaller,0));
+    });
+
     it('test wasm bending energy',function() {
 
         let debug=1;
@@ -213,6 +266,42 @@ describe('Testing New Style Bspline Grid Code\n', function() {
 
     });
 
+    it('test wasm baked vs chained combo transformation',function() {
+
+        let debug=1;
+        let numfailed=libbiswasm.test_bakedComboTransformation(bsplinecombo_inp,debug);
+        console.log('\n Back to JS. numfailed=',numfailed);
+        assert.equal(0,numfailed);
+
+    });
+
+    it('test wasm compressed grid serialization',function() {
+
+        let debug=1;
+        let numfailed=libbiswasm.test_compressedGridSerialization(debug);
+        console.log('\n Back to JS. numfailed=',numfailed);
+        assert.equal(0,numfailed);
+
+    });
+
+    it('test wasm displacement field kernels vs transformPoint',function() {
+
+        let debug=1;
+        let numfailed=libbiswasm.test_displacementFieldKernels(debug);
+        console.log('\n Back to JS. numfailed=',numfailed);
+        assert.equal(0,numfailed);
+
+    });
+
+    it('test wasm jacobian image vs per-voxel jacobian',function() {
+
+        let debug=1;
+        let numfailed=libbiswasm.test_jacobianImage(debug);
+        console.log('\n Back to JS. numfailed=',numfailed);
+        assert.equal(0,numfailed);
+
+    });
+
 
     it('fit displacement field with bspline and compare',function() {
         console.log('\n\n\n\n');